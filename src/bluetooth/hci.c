@@ -0,0 +1,518 @@
+/*
+    Raw HCI ingest: LE Advertising Report events from a socket or a capture file
+*/
+
+#include "hci.h"
+#include "device.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/socket.h>
+
+struct hci_stats hci_stats;
+
+#define HCI_COMMAND_PKT 0x01
+#define HCI_EVENT_PKT 0x04
+
+#define EVT_CMD_COMPLETE 0x0E
+#define EVT_LE_META_EVENT 0x3E
+#define EVT_LE_ADVERTISING_REPORT 0x02
+#define EVT_LE_EXTENDED_ADVERTISING_REPORT 0x0D
+
+#define OPCODE_LE_SET_SCAN_PARAMETERS 0x200B
+#define OPCODE_LE_SET_SCAN_ENABLE 0x200C
+
+// Not using libbluetooth, these match <bluetooth/hci.h>
+#ifndef AF_BLUETOOTH
+#define AF_BLUETOOTH 31
+#endif
+#define BTPROTO_HCI 1
+#define SOL_HCI 0
+#define HCI_FILTER 2
+#define HCI_CHANNEL_RAW 0
+
+struct sockaddr_hci
+{
+    sa_family_t hci_family;
+    unsigned short hci_dev;
+    unsigned short hci_channel;
+};
+
+struct hci_filter
+{
+    uint32_t type_mask;
+    uint32_t event_mask[2];
+    uint16_t opcode;
+};
+
+static uint16_t read_le16(const uint8_t* p) { return (uint16_t)(p[0] | (p[1] << 8)); }
+static uint32_t read_le32(const uint8_t* p) { return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24); }
+static uint32_t read_be32(const uint8_t* p) { return (uint32_t)p[3] | ((uint32_t)p[2] << 8) | ((uint32_t)p[1] << 16) | ((uint32_t)p[0] << 24); }
+
+/*
+    Decode the advertising data structures (length, type, value...) into the advert
+*/
+static void parse_advertising_data(const uint8_t* data, int length, struct hci_advert* advert)
+{
+    bool complete_name = FALSE;
+
+    for (int i = 0; i < length; )
+    {
+        int field_length = data[i];
+        if (field_length == 0) break;                       // early termination
+        if (i + 1 + field_length > length) break;           // truncated
+
+        uint8_t type = data[i + 1];
+        const uint8_t* value = data + i + 2;
+        int value_length = field_length - 1;
+
+        switch (type)
+        {
+            case 0x02:      // incomplete list of 16 bit UUIDs
+            case 0x03:      // complete list of 16 bit UUIDs
+                for (int j = 0; j + 2 <= value_length && advert->uuids_length < HCI_MAX_UUIDS; j += 2)
+                {
+                    g_snprintf(advert->uuids[advert->uuids_length++], 37, "0000%04x-0000-1000-8000-00805f9b34fb", read_le16(value + j));
+                }
+                break;
+            case 0x04:      // incomplete list of 32 bit UUIDs
+            case 0x05:      // complete list of 32 bit UUIDs
+                for (int j = 0; j + 4 <= value_length && advert->uuids_length < HCI_MAX_UUIDS; j += 4)
+                {
+                    g_snprintf(advert->uuids[advert->uuids_length++], 37, "%08x-0000-1000-8000-00805f9b34fb", read_le32(value + j));
+                }
+                break;
+            case 0x06:      // incomplete list of 128 bit UUIDs
+            case 0x07:      // complete list of 128 bit UUIDs
+                for (int j = 0; j + 16 <= value_length && advert->uuids_length < HCI_MAX_UUIDS; j += 16)
+                {
+                    const uint8_t* u = value + j;   // little endian
+                    g_snprintf(advert->uuids[advert->uuids_length++], 37,
+                        "%02x%02x%02x%02x-%02x%02x-%02x%02x-%02x%02x-%02x%02x%02x%02x%02x%02x",
+                        u[15], u[14], u[13], u[12], u[11], u[10], u[9], u[8], u[7], u[6], u[5], u[4], u[3], u[2], u[1], u[0]);
+                }
+                break;
+            case 0x08:      // shortened local name
+            case 0x09:      // complete local name
+                if (type == 0x09 || !complete_name)
+                {
+                    int n = value_length < (int)sizeof(advert->name) - 1 ? value_length : (int)sizeof(advert->name) - 1;
+                    memcpy(advert->name, value, n);
+                    advert->name[n] = '\0';
+                    complete_name = (type == 0x09);
+                }
+                break;
+            case 0x0A:      // tx power level
+                if (value_length >= 1)
+                {
+                    advert->tx_power = (int8_t)value[0];
+                    advert->has_tx_power = TRUE;
+                }
+                break;
+            case 0x19:      // appearance
+                if (value_length >= 2)
+                {
+                    advert->appearance = read_le16(value);
+                    advert->has_appearance = TRUE;
+                }
+                break;
+            case 0xFF:      // manufacturer specific data
+                if (value_length >= 2 && advert->manufacturers_length < HCI_MAX_MANUFACTURERS)
+                {
+                    struct hci_manufacturer_data* m = &advert->manufacturers[advert->manufacturers_length++];
+                    m->manufacturer = read_le16(value);
+                    m->data = value + 2;
+                    m->length = value_length - 2;
+                }
+                break;
+            default:
+                break;
+        }
+
+        i += 1 + field_length;
+    }
+}
+
+/*
+    Fill in the address fields from the 6 little endian address bytes
+*/
+static void set_address(struct hci_advert* advert, uint8_t address_type, const uint8_t* address)
+{
+    g_snprintf(advert->mac, sizeof(advert->mac), "%02x:%02x:%02x:%02x:%02x:%02x",
+        address[5], address[4], address[3], address[2], address[1], address[0]);
+    // 0 = public, 1 = random, 2 and 3 are resolved private addresses
+    advert->address_type = (address_type == 0 || address_type == 2) ? PUBLIC_ADDRESS_TYPE : RANDOM_ADDRESS_TYPE;
+}
+
+/*
+    LE Advertising Report: num reports then for each
+    event type, address type, address[6], data length, data, rssi
+*/
+static int parse_legacy_reports(const uint8_t* p, int length, hci_advert_handler handler, void* context)
+{
+    if (length < 1) return 0;
+    int count = p[0];
+    int offset = 1;
+    int parsed = 0;
+
+    for (int r = 0; r < count; r++)
+    {
+        if (offset + 9 > length) { hci_stats.malformed++; break; }
+        int data_length = p[offset + 8];
+        if (offset + 9 + data_length + 1 > length) { hci_stats.malformed++; break; }
+
+        struct hci_advert advert;
+        memset(&advert, 0, sizeof(advert));
+        set_address(&advert, p[offset + 1], p + offset + 2);
+        parse_advertising_data(p + offset + 9, data_length, &advert);
+        advert.rssi = (int8_t)p[offset + 9 + data_length];
+        advert.has_rssi = advert.rssi != 127;
+
+        handler(&advert, context);
+        parsed++;
+        offset += 9 + data_length + 1;
+    }
+    return parsed;
+}
+
+/*
+    LE Extended Advertising Report: num reports then for each
+    event type[2], address type, address[6], primary phy, secondary phy, sid, tx power, rssi,
+    periodic interval[2], direct address type, direct address[6], data length, data
+*/
+static int parse_extended_reports(const uint8_t* p, int length, hci_advert_handler handler, void* context)
+{
+    if (length < 1) return 0;
+    int count = p[0];
+    int offset = 1;
+    int parsed = 0;
+
+    for (int r = 0; r < count; r++)
+    {
+        if (offset + 24 > length) { hci_stats.malformed++; break; }
+        const uint8_t* report = p + offset;
+        int data_length = report[23];
+        if (offset + 24 + data_length > length) { hci_stats.malformed++; break; }
+
+        struct hci_advert advert;
+        memset(&advert, 0, sizeof(advert));
+        set_address(&advert, report[2], report + 3);
+        parse_advertising_data(report + 24, data_length, &advert);
+        if ((int8_t)report[12] != 127)
+        {
+            advert.tx_power = (int8_t)report[12];
+            advert.has_tx_power = TRUE;
+        }
+        advert.rssi = (int8_t)report[13];
+        advert.has_rssi = advert.rssi != 127;
+
+        handler(&advert, context);
+        parsed++;
+        offset += 24 + data_length;
+    }
+    return parsed;
+}
+
+/*
+    Parse one HCI event (event code, length, parameters)
+*/
+int hci_parse_event(const uint8_t* event, int length, hci_advert_handler handler, void* context)
+{
+    if (length < 2) return 0;
+    hci_stats.events++;
+
+    if (event[0] != EVT_LE_META_EVENT) return 0;
+    int parameter_length = event[1];
+    if (parameter_length + 2 > length || parameter_length < 1) { hci_stats.malformed++; return 0; }
+
+    const uint8_t* p = event + 2;
+    int n = 0;
+    switch (p[0])
+    {
+        case EVT_LE_ADVERTISING_REPORT:
+            n = parse_legacy_reports(p + 1, parameter_length - 1, handler, context);
+            break;
+        case EVT_LE_EXTENDED_ADVERTISING_REPORT:
+            n = parse_extended_reports(p + 1, parameter_length - 1, handler, context);
+            break;
+        default:
+            break;
+    }
+    hci_stats.reports += n;
+    return n;
+}
+
+/*
+    LIVE SOCKET
+*/
+
+struct hci_source
+{
+    int fd;
+    hci_advert_handler handler;
+    void* context;
+};
+
+static bool send_command(int fd, uint16_t opcode, const uint8_t* parameters, int length)
+{
+    uint8_t packet[4 + 32];
+    packet[0] = HCI_COMMAND_PKT;
+    packet[1] = opcode & 0xff;
+    packet[2] = opcode >> 8;
+    packet[3] = length;
+    memcpy(packet + 4, parameters, length);
+    return write(fd, packet, 4 + length) == 4 + length;
+}
+
+static gboolean hci_socket_readable(GIOChannel* channel, GIOCondition condition, gpointer data)
+{
+    (void)channel;
+    struct hci_source* source = (struct hci_source*)data;
+
+    if (condition & (G_IO_ERR | G_IO_HUP))
+    {
+        g_warning("HCI socket closed");
+        close(source->fd);
+        g_free(source);
+        return FALSE;
+    }
+
+    uint8_t buffer[1024];
+    int n = read(source->fd, buffer, sizeof(buffer));
+    if (n <= 0)
+    {
+        if (n < 0 && errno != EAGAIN && errno != EINTR) g_warning("HCI read failed %i", errno);
+        return TRUE;
+    }
+
+    if (buffer[0] == HCI_EVENT_PKT)
+    {
+        hci_parse_event(buffer + 1, n - 1, source->handler, source->context);
+    }
+    return TRUE;
+}
+
+/*
+    Open an HCI device, start passive LE scanning and deliver reports on the main loop
+*/
+bool hci_start_live(int device, hci_advert_handler handler, void* context)
+{
+    int fd = socket(AF_BLUETOOTH, SOCK_RAW | SOCK_CLOEXEC, BTPROTO_HCI);
+    if (fd < 0)
+    {
+        g_warning("Could not open HCI socket, error %i", errno);
+        return FALSE;
+    }
+
+    struct sockaddr_hci address;
+    memset(&address, 0, sizeof(address));
+    address.hci_family = AF_BLUETOOTH;
+    address.hci_dev = device;
+    address.hci_channel = HCI_CHANNEL_RAW;
+    if (bind(fd, (struct sockaddr*)&address, sizeof(address)) < 0)
+    {
+        g_warning("Could not bind HCI socket to hci%i, error %i", device, errno);
+        close(fd);
+        return FALSE;
+    }
+
+    // Only events, and only LE meta and command complete
+    struct hci_filter filter;
+    memset(&filter, 0, sizeof(filter));
+    filter.type_mask = 1 << HCI_EVENT_PKT;
+    filter.event_mask[EVT_LE_META_EVENT >> 5] |= 1u << (EVT_LE_META_EVENT & 31);
+    filter.event_mask[EVT_CMD_COMPLETE >> 5] |= 1u << (EVT_CMD_COMPLETE & 31);
+    if (setsockopt(fd, SOL_HCI, HCI_FILTER, &filter, sizeof(filter)) < 0)
+    {
+        g_warning("Could not set HCI filter, error %i", errno);
+    }
+
+    // Passive scan, 10ms interval and window, public own address, accept all
+    uint8_t disable[] = { 0x00, 0x00 };
+    uint8_t parameters[] = { 0x00, 0x10, 0x00, 0x10, 0x00, 0x00, 0x00 };
+    uint8_t enable[] = { 0x01, 0x00 };  // enable, do not filter duplicates (need every RSSI)
+    if (!send_command(fd, OPCODE_LE_SET_SCAN_ENABLE, disable, sizeof(disable)) ||
+        !send_command(fd, OPCODE_LE_SET_SCAN_PARAMETERS, parameters, sizeof(parameters)) ||
+        !send_command(fd, OPCODE_LE_SET_SCAN_ENABLE, enable, sizeof(enable)))
+    {
+        g_warning("Could not start LE scan on hci%i, error %i", device, errno);
+    }
+
+    struct hci_source* source = g_malloc(sizeof(struct hci_source));
+    source->fd = fd;
+    source->handler = handler;
+    source->context = context;
+
+    GIOChannel* channel = g_io_channel_unix_new(fd);
+    g_io_add_watch(channel, G_IO_IN | G_IO_ERR | G_IO_HUP, hci_socket_readable, source);
+    g_io_channel_unref(channel);
+
+    g_info("HCI ingest from hci%i", device);
+    return TRUE;
+}
+
+/*
+    FILE REPLAY
+*/
+
+enum capture_format { capture_btsnoop_hci, capture_btsnoop_h4, capture_pcap_h4, capture_pcap_h4_phdr };
+
+struct hci_replay
+{
+    gchar* contents;
+    gsize length;
+    gsize offset;
+    enum capture_format format;
+    bool big_endian;                // pcap only, btsnoop is always big endian
+    hci_advert_handler handler;
+    void* context;
+    gint64 started;
+    long records;
+    long reports_at_start;
+};
+
+// Records per main loop idle call, keeps the loop responsive during a replay
+#define REPLAY_BATCH 2000
+
+/*
+    Deliver one captured packet, returns false at the end of the file
+*/
+static bool replay_one(struct hci_replay* replay)
+{
+    const uint8_t* p = (const uint8_t*)replay->contents + replay->offset;
+    gsize remaining = replay->length - replay->offset;
+
+    uint32_t included;
+    uint32_t flags = 0;
+    int header;
+    if (replay->format == capture_btsnoop_hci || replay->format == capture_btsnoop_h4)
+    {
+        // original length, included length, flags, drops, timestamp[8]
+        header = 24;
+        if (remaining < (gsize)header) return FALSE;
+        included = read_be32(p + 4);
+        flags = read_be32(p + 8);
+    }
+    else
+    {
+        // seconds, micro or nano seconds, included length, original length
+        header = 16;
+        if (remaining < (gsize)header) return FALSE;
+        included = replay->big_endian ? read_be32(p + 8) : read_le32(p + 8);
+    }
+    // Not header + included, a corrupt length near 4G would wrap that and pass
+    if (included > remaining - header || included > G_MAXINT) return FALSE;
+
+    const uint8_t* packet = p + header;
+    int length = included;
+    replay->offset += (gsize)header + included;
+    replay->records++;
+
+    switch (replay->format)
+    {
+        case capture_btsnoop_hci:
+            // bit 1 set = command or event, bit 0 set = received: both set is an event
+            if ((flags & 3) == 3) hci_parse_event(packet, length, replay->handler, replay->context);
+            break;
+        case capture_pcap_h4_phdr:
+            // 4 byte direction header then H4
+            if (length < 4) break;
+            packet += 4;
+            length -= 4;
+            // fall through
+        case capture_btsnoop_h4:
+        case capture_pcap_h4:
+            if (length > 1 && packet[0] == HCI_EVENT_PKT) hci_parse_event(packet + 1, length - 1, replay->handler, replay->context);
+            break;
+    }
+    return TRUE;
+}
+
+static gboolean replay_batch(gpointer data)
+{
+    struct hci_replay* replay = (struct hci_replay*)data;
+
+    for (int i = 0; i < REPLAY_BATCH; i++)
+    {
+        if (!replay_one(replay))
+        {
+            double seconds = (g_get_monotonic_time() - replay->started) / 1000000.0;
+            long reports = hci_stats.reports - replay->reports_at_start;
+            g_info("HCI replay done: %li records, %li adverts in %.3fs = %.0f adverts/s, %li malformed",
+                replay->records, reports, seconds, seconds > 0 ? reports / seconds : 0.0, hci_stats.malformed);
+            g_free(replay->contents);
+            g_free(replay);
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
+
+/*
+    Replay a btsnoop or pcap capture on the main loop as fast as it will go
+*/
+bool hci_start_replay(const char* path, hci_advert_handler handler, void* context)
+{
+    gchar* contents;
+    gsize length;
+    GError* error = NULL;
+    if (!g_file_get_contents(path, &contents, &length, &error))
+    {
+        g_warning("Could not read HCI capture %s: %s", path, error->message);
+        g_error_free(error);
+        return FALSE;
+    }
+
+    struct hci_replay* replay = g_malloc0(sizeof(struct hci_replay));
+    replay->contents = contents;
+    replay->length = length;
+    replay->handler = handler;
+    replay->context = context;
+
+    const uint8_t* p = (const uint8_t*)contents;
+    if (length >= 16 && memcmp(p, "btsnoop\0", 8) == 0)
+    {
+        uint32_t datalink = read_be32(p + 12);
+        if (datalink == 1001) replay->format = capture_btsnoop_hci;
+        else if (datalink == 1002) replay->format = capture_btsnoop_h4;
+        else
+        {
+            g_warning("Unsupported btsnoop datalink %u in %s", datalink, path);
+            g_free(contents);
+            g_free(replay);
+            return FALSE;
+        }
+        replay->offset = 16;
+    }
+    else if (length >= 24 && (read_le32(p) == 0xa1b2c3d4 || read_le32(p) == 0xa1b23c4d ||
+                              read_be32(p) == 0xa1b2c3d4 || read_be32(p) == 0xa1b23c4d))
+    {
+        replay->big_endian = (read_be32(p) == 0xa1b2c3d4 || read_be32(p) == 0xa1b23c4d);
+        uint32_t linktype = replay->big_endian ? read_be32(p + 20) : read_le32(p + 20);
+        if (linktype == 187) replay->format = capture_pcap_h4;
+        else if (linktype == 201) replay->format = capture_pcap_h4_phdr;
+        else
+        {
+            g_warning("Unsupported pcap link type %u in %s", linktype, path);
+            g_free(contents);
+            g_free(replay);
+            return FALSE;
+        }
+        replay->offset = 24;
+    }
+    else
+    {
+        g_warning("%s is not a btsnoop or pcap capture", path);
+        g_free(contents);
+        g_free(replay);
+        return FALSE;
+    }
+
+    g_info("HCI replay of %s (%lu bytes)", path, (unsigned long)length);
+    replay->started = g_get_monotonic_time();
+    replay->reports_at_start = hci_stats.reports;
+    g_idle_add(replay_batch, replay);
+    return TRUE;
+}
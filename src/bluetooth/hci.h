@@ -0,0 +1,80 @@
+#ifndef HCI_H
+#define HCI_H
+/*
+    Raw HCI ingest: LE Advertising Report events (legacy and extended) parsed straight
+    from an HCI socket or replayed from a btsnoop / pcap capture file, bypassing BlueZ
+
+    Each advertising report is decoded into a struct hci_advert and passed to a handler
+    which feeds it into the same device update path as the BlueZ properties.
+*/
+
+#include <glib.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+// Most UUIDs collected from one advert
+#define HCI_MAX_UUIDS 16
+// Most manufacturer data records collected from one advert
+#define HCI_MAX_MANUFACTURERS 4
+
+struct hci_manufacturer_data
+{
+    uint16_t manufacturer;
+    const uint8_t* data;        // after the company id, points into the event
+    int length;
+};
+
+/*
+    One decoded advertising report
+*/
+struct hci_advert
+{
+    char mac[18];               // AA:BB:CC:DD:EE:FF
+    int8_t address_type;        // PUBLIC_ADDRESS_TYPE or RANDOM_ADDRESS_TYPE
+    int8_t rssi;
+    bool has_rssi;
+    int8_t tx_power;
+    bool has_tx_power;
+    char name[32];              // complete or shortened local name, empty if none
+    uint16_t appearance;
+    bool has_appearance;
+    int uuids_length;
+    char uuids[HCI_MAX_UUIDS][37];
+    int manufacturers_length;
+    struct hci_manufacturer_data manufacturers[HCI_MAX_MANUFACTURERS];
+};
+
+typedef void (*hci_advert_handler)(const struct hci_advert* advert, void* context);
+
+/*
+    Parse one HCI event (event code, length, parameters), calls handler for each
+    advertising report in it, returns the number of reports
+*/
+int hci_parse_event(const uint8_t* event, int length, hci_advert_handler handler, void* context);
+
+/*
+    Open an HCI device, start passive LE scanning and deliver reports on the main loop
+    Returns false if the socket could not be opened
+*/
+bool hci_start_live(int device, hci_advert_handler handler, void* context);
+
+/*
+    Replay a btsnoop (HCI or H4) or pcap (H4, H4 with header) capture on the main loop
+    as fast as it will go, logging the replay rate at the end
+    Returns false if the file could not be read or is not a recognized format
+*/
+bool hci_start_replay(const char* path, hci_advert_handler handler, void* context);
+
+/*
+    Counters for logging
+*/
+struct hci_stats
+{
+    long events;                // HCI events seen
+    long reports;               // advertising reports decoded
+    long malformed;             // events or reports that did not parse
+};
+
+extern struct hci_stats hci_stats;
+
+#endif
@@ -0,0 +1,347 @@
+/*
+    Compile JSONL recordings files into the binary form the scanner maps (see core/compiledrecordings.h)
+
+    compilerecordings <output.recordings> <file.jsonl or directory> ...
+
+    Files are read in the order given, the .jsonl files in a directory in name order. Put the
+    output in /var/sniffer/recordings (and move the JSONL files it was made from out of there)
+    and the scanner picks it up on its next pass.
+*/
+
+#include "compiledrecordings.h"
+#include "utility.h"
+#include "cJSON.h"
+
+#include <glib.h>
+#include <errno.h>
+#include <math.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/*
+    Everything read so far, in the order it will be written
+*/
+struct compiler
+{
+    GString* strings;                   // string table
+    uint32_t* names;                    // string offset of each column
+    int column_count;
+    struct compiled_patch* patches;
+    int patch_count;
+    uint32_t* rows;                     // patch index of each row
+    float* matrix;                      // row_count x column_count, grows as columns are added
+    int row_count;
+    int row_capacity;
+    int column_capacity;
+    int errors;
+};
+
+/*
+    Offset of a string in the string table, added if not there already
+*/
+static uint32_t intern(struct compiler* c, const char* value)
+{
+    const char* strings = c->strings->str;
+    for (gsize offset = 0; offset < c->strings->len; offset += strlen(strings + offset) + 1)
+    {
+        if (strcmp(strings + offset, value) == 0) return offset;
+    }
+    uint32_t offset = c->strings->len;
+    g_string_append_len(c->strings, value, strlen(value) + 1);
+    return offset;
+}
+
+/*
+    Column for an access point name, added if not seen before
+*/
+static int get_or_add_column(struct compiler* c, const char* name)
+{
+    uint32_t offset = intern(c, name);
+    for (int i = 0; i < c->column_count; i++)
+    {
+        if (c->names[i] == offset) return i;
+    }
+
+    if (c->column_count == c->column_capacity)
+    {
+        // Widen every row written so far, the new columns were not recorded
+        int capacity = c->column_capacity == 0 ? 8 : c->column_capacity * 2;
+        float* matrix = g_new(float, (size_t)c->row_capacity * capacity);
+        for (int r = 0; r < c->row_count; r++)
+        {
+            for (int i = 0; i < capacity; i++)
+            {
+                matrix[(size_t)r * capacity + i] = i < c->column_count ? c->matrix[(size_t)r * c->column_capacity + i] : NAN;
+            }
+        }
+        g_free(c->matrix);
+        c->matrix = matrix;
+        c->names = g_renew(uint32_t, c->names, capacity);
+        c->column_capacity = capacity;
+    }
+
+    c->names[c->column_count] = offset;
+    return c->column_count++;
+}
+
+/*
+    Index of a patch, added if not seen before
+*/
+static int get_or_add_patch(struct compiler* c, const char* name, const char* room, const char* group, const char* tags)
+{
+    struct compiled_patch patch = { intern(c, name), intern(c, room), intern(c, group), intern(c, tags) };
+    for (int i = 0; i < c->patch_count; i++)
+    {
+        if (memcmp(&c->patches[i], &patch, sizeof(patch)) == 0) return i;
+    }
+    c->patches = g_renew(struct compiled_patch, c->patches, c->patch_count + 1);
+    c->patches[c->patch_count] = patch;
+    return c->patch_count++;
+}
+
+/*
+    New row for a patch with nothing recorded yet
+*/
+static float* add_row(struct compiler* c, int patch)
+{
+    if (c->row_count == c->row_capacity)
+    {
+        c->row_capacity = c->row_capacity == 0 ? 64 : c->row_capacity * 2;
+        c->rows = g_renew(uint32_t, c->rows, c->row_capacity);
+        c->matrix = g_renew(float, c->matrix, (size_t)c->row_capacity * c->column_capacity);
+    }
+    c->rows[c->row_count] = patch;
+    float* row = c->matrix + (size_t)c->row_count * c->column_capacity;
+    for (int i = 0; i < c->column_capacity; i++) row[i] = NAN;
+    c->row_count++;
+    return row;
+}
+
+/*
+    One line of a JSONL file, same rules as the scanner: one heading per file then distances,
+    returns what was wrong with the line or NULL
+*/
+static const char* compile_line(struct compiler* c, const char* line, int* current_patch)
+{
+    cJSON* json = cJSON_Parse(line);
+    if (json == NULL) return "not JSON";
+
+    cJSON* patch_name = cJSON_GetObjectItemCaseSensitive(json, "patch");
+    cJSON* room_name = cJSON_GetObjectItemCaseSensitive(json, "room");
+    cJSON* group_name = cJSON_GetObjectItemCaseSensitive(json, "group");
+    cJSON* tags = cJSON_GetObjectItemCaseSensitive(json, "tags");
+    cJSON* distances = cJSON_GetObjectItemCaseSensitive(json, "distances");
+
+    bool has_meta = cJSON_IsString(patch_name) && cJSON_IsString(room_name) && cJSON_IsString(group_name) && cJSON_IsString(tags);
+    bool has_distances = cJSON_IsObject(distances);
+    const char* problem = has_meta || has_distances ? NULL : "missing metadata or distances";
+
+    if (has_meta && *current_patch < 0)
+    {
+        *current_patch = get_or_add_patch(c, patch_name->valuestring, room_name->valuestring, group_name->valuestring, tags->valuestring);
+    }
+
+    if (has_distances && *current_patch < 0)
+    {
+        problem = "missing metadata heading before distances";
+    }
+    else if (has_distances)
+    {
+        // Columns first, adding one can move the rows
+        cJSON* distance;
+        int count = 0;
+        cJSON_ArrayForEach(distance, distances)
+        {
+            if (cJSON_IsNumber(distance)) get_or_add_column(c, distance->string);
+        }
+
+        // The scanner keeps a recording with no distances (all at infinity) so this does too
+        float* row = add_row(c, *current_patch);
+        cJSON_ArrayForEach(distance, distances)
+        {
+            if (!cJSON_IsNumber(distance)) continue;
+            row[get_or_add_column(c, distance->string)] = distance->valuedouble;
+            count++;
+        }
+        if (count < 1) problem = "no distances";
+    }
+
+    cJSON_Delete(json);
+    return problem;
+}
+
+static void compile_file(struct compiler* c, const char* path)
+{
+    FILE* f = fopen(path, "r");
+    if (f == NULL)
+    {
+        g_printerr("Could not open %s: %s\n", path, strerror(errno));
+        c->errors++;
+        return;
+    }
+
+    int current_patch = -1;
+    int line_count = 0;
+    char* line = NULL;
+    size_t capacity = 0;
+    while (getline(&line, &capacity, f) >= 0)
+    {
+        line_count++;
+        if (string_starts_with(line, "#")) continue;
+        trim(line);
+        if (strlen(line) == 0) continue;
+
+        const char* problem = compile_line(c, line, &current_patch);
+        if (problem != NULL)
+        {
+            g_printerr("%s: '%s' in %s (%i)\n", problem, line, path, line_count);
+            c->errors++;
+        }
+    }
+    free(line);
+    fclose(f);
+}
+
+static int compare_names(const void* a, const void* b)
+{
+    return strcmp(*(char* const*)a, *(char* const*)b);
+}
+
+static void compile_directory(struct compiler* c, const char* directory)
+{
+    GDir* dir = g_dir_open(directory, 0, NULL);
+    if (dir == NULL)
+    {
+        g_printerr("Could not read %s\n", directory);
+        c->errors++;
+        return;
+    }
+
+    GPtrArray* names = g_ptr_array_new_with_free_func(g_free);
+    const gchar* filename;
+    while ((filename = g_dir_read_name(dir)))
+    {
+        if (string_ends_with(filename, ".jsonl")) g_ptr_array_add(names, g_build_filename(directory, filename, NULL));
+    }
+    g_dir_close(dir);
+
+    qsort(names->pdata, names->len, sizeof(gpointer), compare_names);
+    for (guint i = 0; i < names->len; i++) compile_file(c, g_ptr_array_index(names, i));
+    g_ptr_array_free(names, TRUE);
+}
+
+static uint64_t align(uint64_t offset)
+{
+    return (offset + COMPILED_RECORDINGS_ALIGN - 1) & ~(uint64_t)(COMPILED_RECORDINGS_ALIGN - 1);
+}
+
+static bool write_section(FILE* f, uint64_t offset, const void* data, size_t size)
+{
+    static const char padding[COMPILED_RECORDINGS_ALIGN];
+    long at = ftell(f);
+    if (at < 0 || (uint64_t)at > offset) return FALSE;
+    if (fwrite(padding, 1, offset - at, f) != offset - at) return FALSE;
+    return size == 0 || fwrite(data, 1, size, f) == size;
+}
+
+/*
+    Write to a temporary file alongside and rename it over the output so a scanner with the
+    old file mapped keeps a complete copy
+*/
+static bool write_compiled(struct compiler* c, const char* output)
+{
+    struct compiled_recordings_header header;
+    memset(&header, 0, sizeof(header));
+    header.magic = COMPILED_RECORDINGS_MAGIC;
+    header.version = COMPILED_RECORDINGS_VERSION;
+    header.column_count = c->column_count;
+    header.patch_count = c->patch_count;
+    header.row_count = c->row_count;
+    header.strings_size = c->strings->len;
+
+    header.names_offset = align(sizeof(header));
+    header.patches_offset = align(header.names_offset + (uint64_t)c->column_count * sizeof(uint32_t));
+    header.rows_offset = align(header.patches_offset + (uint64_t)c->patch_count * sizeof(struct compiled_patch));
+    header.matrix_offset = align(header.rows_offset + (uint64_t)c->row_count * sizeof(uint32_t));
+    header.strings_offset = align(header.matrix_offset + (uint64_t)c->row_count * c->column_count * sizeof(float));
+    header.file_size = header.strings_offset + header.strings_size;
+
+    // Rows are kept column_capacity wide while compiling, the file has them column_count wide
+    float* matrix = g_new(float, (size_t)c->row_count * c->column_count + 1);
+    for (int r = 0; r < c->row_count; r++)
+    {
+        memcpy(matrix + (size_t)r * c->column_count, c->matrix + (size_t)r * c->column_capacity, c->column_count * sizeof(float));
+    }
+
+    char* temporary = g_strdup_printf("%s.tmp", output);
+    FILE* f = fopen(temporary, "wb");
+    bool ok = f != NULL;
+    if (ok)
+    {
+        ok = write_section(f, 0, &header, sizeof(header)) &&
+            write_section(f, header.names_offset, c->names, (size_t)c->column_count * sizeof(uint32_t)) &&
+            write_section(f, header.patches_offset, c->patches, (size_t)c->patch_count * sizeof(struct compiled_patch)) &&
+            write_section(f, header.rows_offset, c->rows, (size_t)c->row_count * sizeof(uint32_t)) &&
+            write_section(f, header.matrix_offset, matrix, (size_t)c->row_count * c->column_count * sizeof(float)) &&
+            write_section(f, header.strings_offset, c->strings->str, c->strings->len);
+        ok = (fflush(f) == 0) && ok;
+        ok = (fsync(fileno(f)) == 0) && ok;
+        ok = (fclose(f) == 0) && ok;
+    }
+    if (ok) ok = rename(temporary, output) == 0;
+    if (!ok)
+    {
+        g_printerr("Could not write %s: %s\n", output, strerror(errno));
+        unlink(temporary);
+    }
+
+    g_free(temporary);
+    g_free(matrix);
+    return ok;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 3 || !string_ends_with(argv[1], COMPILED_RECORDINGS_EXTENSION))
+    {
+        g_printerr("Compile recordings for the scanner to map instead of parsing\n");
+        g_printerr("   compilerecordings <output%s> <file.jsonl or directory> ...\n", COMPILED_RECORDINGS_EXTENSION);
+        return 1;
+    }
+
+    struct compiler c;
+    memset(&c, 0, sizeof(c));
+    c.strings = g_string_new(NULL);
+
+    for (int i = 2; i < argc; i++)
+    {
+        if (g_file_test(argv[i], G_FILE_TEST_IS_DIR)) compile_directory(&c, argv[i]);
+        else compile_file(&c, argv[i]);
+    }
+
+    if (c.row_count == 0)
+    {
+        g_printerr("No recordings found, nothing written\n");
+        return 1;
+    }
+
+    if (!write_compiled(&c, argv[1])) return 1;
+
+    // Read it back the way the scanner will
+    struct compiled_recordings compiled;
+    if (!compiled_recordings_open(&compiled, argv[1])) return 1;
+    g_print("%s: %u recordings of %u patches over %u access points, %zu bytes%s\n", argv[1],
+        compiled.header->row_count, compiled.header->patch_count, compiled.header->column_count, compiled.size,
+        c.errors > 0 ? ", see problems above" : "");
+    compiled_recordings_close(&compiled);
+
+    g_string_free(c.strings, TRUE);
+    g_free(c.names);
+    g_free(c.patches);
+    g_free(c.rows);
+    g_free(c.matrix);
+    return 0;
+}
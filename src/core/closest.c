@@ -20,6 +20,7 @@
 #include "knn.h"
 #include "overlaps.h"
 #include "aggregate.h"
+#include <pthread.h>
 
 /*
     Get the closest recent observation for a device
@@ -30,18 +31,20 @@ struct ClosestTo *get_closest_64(struct OverallState* state, int64_t device_64)
 {
     struct ClosestTo *best = NULL;
 
-    // Working backwards in time through the array
-    for (struct ClosestHead* head = state->closestHead; head != NULL; head = head->next)
+    // There is only ever one head per mac
+    struct ClosestHead* head = mac_map_get(&state->closest_index, device_64);
+    if (head != NULL)
     {
-        if (head->mac64 != device_64) continue;
-
-        for (struct ClosestTo* test = head->closest; test != NULL; test = test->next)
+        // Start from the latest observation and look for a closer one that is recent enough
+        best = closest_latest(head);
+        for (int i = 0; i < closest_count(head); i++)
         {
+            struct ClosestTo* test = &head->closest[i];
             g_assert(test->access_point != NULL);
 
-            if (best == NULL)
+            if (test == best)
             {
-                best = test;
+                continue;
             }
             else if (best->access_point->id == test->access_point->id)
             {
@@ -86,67 +89,63 @@ struct ClosestTo *get_closest_64(struct OverallState* state, int64_t device_64)
 /*
 *  Prune based on time, removing old data, not strictly necessary but keeps memory requirement lower
 *  and saves unnecessary CPU cycles
+*  The chain is least recently updated at the tail, so pop from there until what is left is both
+*  recent enough and no more than CLOSEST_N heads, each head removed is O(1)
 */
-void prune(struct OverallState* state, time_t latest)
+void prune_closest(struct OverallState* state, time_t now)
 {
-    struct ClosestHead* cut_off_after = NULL;
-    struct ClosestHead* pc = NULL;
-    int debug_cutoff_index = 0;
-    int c = 0;
-    for (struct ClosestHead* t = state->closestHead; t != NULL && t->next != NULL; t = t->next)
+    struct ClosestHead* t;
+    while ((t = state->closestTail) != NULL)
     {
-        if (t->closest != NULL)  // First item isn't initialized yet
-        {
-            c++;
-            int age = difftime(latest, t->closest->latest); // latest is a substitute for now, close enough
-            if (age > MAX_AGE)
-            {
-                cut_off_after = pc;  // not t, the one before
-                //g_debug("Prune head array (too old) starting at %i. %s", debug_cutoff_index, t->name);
-                break;
-            }
-            if (c > CLOSEST_N)
-            {
-                cut_off_after = pc;  // not t, the one before
-                //g_debug("Prune head array (too many) starting at %i. %s", debug_cutoff_index, t->name);
-                break;
-            }
-          
-            debug_cutoff_index++;
-            pc = t;
-        }
+        int age = difftime(now, closest_latest(t)->latest);
+        if (age <= MAX_AGE && state->closest_index.count <= CLOSEST_N) break;
+
+        // unlink from the tail
+        state->closestTail = t->prev;
+        if (t->prev != NULL) t->prev->next = NULL;
+        else state->closestHead = NULL;
+
+        // observations and room history go back to their pools
+        node_pool_free(&state->closest_pools[closest_size_class(t->closest_capacity)], t->closest);
+        node_pool_free_chain(&state->room_pool, t->recent_rooms);
+        g_free(t->pairs);
+        identity_graph_remove(&state->identities, t->mac64);
+        mac_map_remove(&state->closest_index, t->mac64);
+        node_pool_free(&state->head_pool, t);
+        state->closest_pruned++;
     }
+}
 
-    if (cut_off_after != NULL)
+/*
+   Make room for an observation from a new access point, keeping the array in access point id order
+*/
+static struct ClosestTo* insert_observation(struct OverallState* state, struct ClosestHead* head, struct AccessPoint* access_point)
+{
+    int n = closest_count(head);
+    int index = __builtin_popcount(head->ap_mask & ((1u << access_point->id) - 1));
+
+    if (n == head->closest_capacity)
     {
-        // dispose of head chain
-        struct ClosestHead* unlink_head = NULL;
-        while ((unlink_head = cut_off_after->next) != NULL)
+        // Move up to the next size class
+        int size_class = closest_size_class(n + 1);
+        struct ClosestTo* grown = node_pool_alloc(&state->closest_pools[size_class]);
+        if (head->closest != NULL)
         {
-            // dispose of side chain
-            struct ClosestTo* unlink = NULL;
-            while ((unlink = unlink_head->closest) != NULL)
-            {
-                unlink_head->closest = unlink->next;
-                g_free(unlink);
-            }
-
-            // dispose of side chain
-            struct RecentRoom* rr = NULL;
-            while ((rr = unlink_head->recent_rooms) != NULL)
-            {
-                unlink_head->recent_rooms = rr->next;
-                g_free(rr);
-            }
-
-            cut_off_after->next = unlink_head->next;
-            g_free(unlink_head);
+            memcpy(grown, head->closest, n * sizeof(struct ClosestTo));
+            node_pool_free(&state->closest_pools[closest_size_class(head->closest_capacity)], head->closest);
         }
+        head->closest = grown;
+        head->closest_capacity = 1 << size_class;
     }
+
+    memmove(&head->closest[index + 1], &head->closest[index], (n - index) * sizeof(struct ClosestTo));
+    head->ap_mask |= 1u << access_point->id;
+    head->closest[index].access_point = access_point;
+    return &head->closest[index];
 }
 
 /*
-   Add a closest observation (get a lock before you call this)
+   Add a closest observation (main loop only)
 */
 void add_closest(struct OverallState* state, int64_t device_64, struct AccessPoint* access_point, 
     time_t earliest, time_t latest, float distance, 
@@ -158,41 +157,52 @@ void add_closest(struct OverallState* state, int64_t device_64, struct AccessPoi
 {
     g_assert(access_point != NULL);
 
+    // Observations are indexed by access point id
+    if (access_point->id >= N_ACCESS_POINTS)
+    {
+        static bool warned = false;
+        if (!warned) g_warning("Ignoring %s and any other access point beyond %i", access_point->client_id, N_ACCESS_POINTS);
+        warned = true;
+        return;
+    }
+
     // Find the matching mac address in the ClosestTo head list
 
-    struct ClosestHead* previousHead = NULL;
-    int c = 0;
-    for(struct ClosestHead* h = state->closestHead; h != NULL; h=h->next)
+    struct ClosestHead* h = mac_map_get(&state->closest_index, device_64);
+    if (h != NULL)
     {
-        if (h->mac64 == device_64) 
+        // If it was superseeded, it isn't now
+        if (h->supersededby != 0)
         {
-            // If it was superseeded, it isn't now
-            if (h->supersededby != 0)
-            {
-                char mac[18];
-                mac_64_to_string(mac, sizeof(mac), h->mac64);
+            char mac[18];
+            mac_64_to_string(mac, sizeof(mac), h->mac64);
 
-                char othermac[18];
-                mac_64_to_string(othermac, sizeof(mac), h->supersededby);
+            char othermac[18];
+            mac_64_to_string(othermac, sizeof(mac), h->supersededby);
 
-                g_warning("%s %s was marked superseded by %s but it's no longer", mac, h->name, othermac);
-                h->supersededby = 0;
-            }
+            g_warning("%s %s was marked superseded by %s but it's no longer", mac, h->name, othermac);
+            h->supersededby = 0;
 
-            // Move it to the head of the chain so that they sort in time order always
-            if (previousHead != NULL)
-            {
-                // unlink from chain
-                previousHead->next = h->next;
-                // and put it on the front
-                h->next = state->closestHead;
-                state->closestHead = h;
-            }
-            // else, already at head of chain
-            break; 
+            // Rotated macs are never reused so if it was linked behind a later mac, that was wrong
+            if (!h->identity_tip) identity_graph_remove(&state->identities, h->mac64);
+            h->link_passes = 0;
         }
-        previousHead = h;
-        if (c++ > 2*CLOSEST_N) g_error("Stuck scanning head");
+
+        // Move it to the head of the chain so that they sort in time order always
+        // (so heads updated since the last supersession pass are always ahead of the rest)
+        if (h->prev != NULL)
+        {
+            // unlink from chain
+            h->prev->next = h->next;
+            if (h->next != NULL) h->next->prev = h->prev;
+            else state->closestTail = h->prev;
+            // and put it on the front
+            h->prev = NULL;
+            h->next = state->closestHead;
+            state->closestHead->prev = h;
+            state->closestHead = h;
+        }
+        // else, already at head of chain
     }
 
     // We moved it to the head so it should be here
@@ -202,10 +212,14 @@ void add_closest(struct OverallState* state, int64_t device_64, struct AccessPoi
     {
         g_trace("Add new head for %s", name);
 
-        head = malloc(sizeof(struct ClosestHead));
+        head = node_pool_alloc(&state->head_pool);
         // Add it to the front of the list
         head->next = state->closestHead;
+        head->prev = NULL;
+        if (state->closestHead != NULL) state->closestHead->prev = head;
+        else state->closestTail = head;
         state->closestHead = head;
+        mac_map_put(&state->closest_index, device_64, head);
         // Initialize it
         head->category = category;
         head->known_interval = known_interval;
@@ -216,12 +230,21 @@ void add_closest(struct OverallState* state, int64_t device_64, struct AccessPoi
         g_utf8_strncpy(head->name, name, NAME_LENGTH);
         head->name_type = name_type;
         head->closest = NULL;
+        head->ap_mask = 0;
+        head->closest_capacity = 0;
+        head->latest_ap = -1;
         head->supersededby = 0;
         head->recent_rooms = NULL;
-
-        prune(state, latest);
+        head->pairs = NULL;
+        head->pair_count = 0;
+        head->identity_tip = true;
+        head->link_candidate = 0;
+        head->link_passes = 0;
     }
 
+    // Needs its supersession pairs finding again
+    head->dirty = true;
+
     // Update the type, latest wins
     if (category != CATEGORY_UNKNOWN) head->category = category;
 
@@ -239,48 +262,21 @@ void add_closest(struct OverallState* state, int64_t device_64, struct AccessPoi
         head->name_type = name_type;
     }
 
-    // Now scan along
-
-    // Remove same access point if present
-    struct ClosestTo* previous = NULL;
-    c = 0;
-    for (struct ClosestTo* close = head->closest; close != NULL; close=close->next)
-    {
-        if (close->access_point == access_point)
-        {
-            // unlink from chain
-            if (previous != NULL)
-            {
-                previous->next = close->next;
-                // and put it on the front
-                close->next = head->closest;
-                head->closest = close;
-                g_trace("  Bump entry for %s on %s", name, access_point->short_client_id);
-            }
-            else
-            {
-                g_trace("  Head entry for %s on %s", name, access_point->short_client_id);
-            }
-            break;
-        }
-        previous = close;
-        if (c++ > N_ACCESS_POINTS) g_error("  Stuck scanning chain %s on %s", name, access_point->short_client_id);
-    }
-
-    struct ClosestTo* closest = head->closest;
+    // Find the observation for this access point, O(1) by id
+    struct ClosestTo* closest = closest_for(head, access_point->id);
 
-    // If it's not at the head now, allocate a new one at the head
-    if (closest == NULL || closest->access_point != access_point)
+    if (closest == NULL)
     {
         // no such access point observation found, allocate a new one for head
-        closest = malloc(sizeof(struct ClosestTo));
-        closest->next = head->closest;
+        closest = insert_observation(state, head, access_point);
         closest->count = 0;
         // Only set earliest on creation, it's per-access point so that's OK
         closest->earliest = earliest;
-        head->closest = closest;
         g_trace("  Add entry for %s on %s", name, access_point->short_client_id);
-        closest->access_point = access_point;
+    }
+    else
+    {
+        g_trace("  Bump entry for %s on %s", name, access_point->short_client_id);
     }
 
     // Update it
@@ -288,30 +284,24 @@ void add_closest(struct OverallState* state, int64_t device_64, struct AccessPoi
     closest->distance = distance;
     closest->latest = latest;
 
-    // closest is now 'top left' - the first in a chain on the first head
+    // closest is now the latest observation on the first head
+    head->latest_ap = access_point->id;
 }
 
 /*
-   Calculates room scores using access point distances
+   Finds the most likely patches and their normalized probabilities using access point distances
+   Only reads state the analysis pass does not change so it can run on any analysis thread
 */
-int calculate_location(struct OverallState* state, 
+static int find_location(struct OverallState* state, struct AccessPoint* access_points,
     float accessdistances[N_ACCESS_POINTS],
     float accesstimes[N_ACCESS_POINTS], 
     double average_gap,
     struct top_k* best_three, int best_three_len,
-    bool is_training_beacon, bool debug)
+    bool debug)
 {
-    (void)accesstimes;
-
-    for (struct patch* patch = state->patches; patch != NULL; patch = patch->next)
-    {
-        patch->knn_score = 0.0;
-    }
-
-    struct AccessPoint* access_points = state->access_points;
-
     // try confirmed
-    int k_found = k_nearest(state->recordings, accessdistances, accesstimes, average_gap, access_points, best_three, best_three_len, TRUE, debug);
+    int k_found = k_nearest(state->recordings, &state->recording_store.matrix, &state->recording_store.index,
+        accessdistances, accesstimes, average_gap, access_points, best_three, best_three_len, TRUE, debug);
 
     // if (k_found < 3)
     // {
@@ -339,16 +329,6 @@ int calculate_location(struct OverallState* state,
                 // e.g. 0.426, 0.346, 0.289 => 0.080, 0.057 => * 5 => .4, .275 => 0.9 and ...
             best_three[bi].normalized_probability = pallocation;
             allocation = allocation - pallocation;
-
-            if (pallocation > 0.0001)
-            {
-                best_three[bi].patch->knn_score += pallocation;
-                if (best_three[bi].patch->knn_score > 1.0)
-                {
-                    g_warning("%s knn_score %.2f should be < 1.0", best_three[bi].patch->name, best_three[bi].patch->knn_score);
-                }
-            }
-
         }
 
         return k_found;
@@ -389,10 +369,200 @@ int calculate_location(struct OverallState* state,
     return 0;
 }
 
+/*
+   Adds the probabilities from find_location to the patch scores
+*/
+static void score_patches(struct OverallState* state, struct top_k* best_three, int k_found)
+{
+    for (struct patch* patch = state->patches; patch != NULL; patch = patch->next)
+    {
+        patch->knn_score = 0.0;
+    }
+
+    for (int bi = 0; bi < k_found; bi++)
+    {
+        double pallocation = best_three[bi].normalized_probability;
+        if (pallocation > 0.0001)
+        {
+            best_three[bi].patch->knn_score += pallocation;
+            if (best_three[bi].patch->knn_score > 1.0)
+            {
+                g_warning("%s knn_score %.2f should be < 1.0", best_three[bi].patch->name, best_three[bi].patch->knn_score);
+            }
+        }
+    }
+}
+
+/*
+   Calculates room scores using access point distances
+*/
+int calculate_location(struct OverallState* state, 
+    float accessdistances[N_ACCESS_POINTS],
+    float accesstimes[N_ACCESS_POINTS], 
+    double average_gap,
+    struct top_k* best_three, int best_three_len,
+    bool is_training_beacon, bool debug)
+{
+    (void)is_training_beacon;
+    int k_found = find_location(state, state->access_points, accessdistances, accesstimes, average_gap, best_three, best_three_len, debug);
+    score_patches(state, best_three, k_found);
+    return k_found;
+}
+
+/*
+   How long does this device typically go between transmits
+*/
+static double average_gap_for(struct ClosestHead* ahead)
+{
+    // Calculate frequency with which this device normally transmits
+
+    int sum_readings = 0;
+    int sum_duration = 0;
+    double average_gap = 60;
+
+    if (ahead -> known_interval > 0 && ahead->known_interval < 2000)
+    {
+        average_gap = ahead->known_interval;
+    }
+    else
+    {
+        for (int i = 0; i < closest_count(ahead); i++)
+        {
+            struct ClosestTo* other = &ahead->closest[i];
+            int dt = difftime(other->latest, other->earliest); 
+            int dc = other->count;
+
+            // Correct very small values
+            if (dt / dc < 30) {dt = 30 * dc;}
+            // Sometimes get a large value for seen ... long gap ... seen again
+            if (dt / dc > 300) {dt = 300*dc;}
+
+            sum_duration += dt;
+            sum_readings += dc;
+        }
+        average_gap = sum_duration / sum_readings;
+
+        // Milwaukee beacons need to last longer
+        if (ahead->category == CATEGORY_BEACON && average_gap < 45) average_gap = 45.0;
+    }
+    return average_gap;
+}
+
+/*
+   Is an observation recent enough to use when locating a head
+*/
+static bool worth_including(struct ClosestTo* other, struct ClosestTo* latest_observation, double average_gap)
+{
+    int time_diff = difftime(latest_observation->latest, other->latest);
+    // Should always be +ve as we are scanning back in time
+
+    return
+        // must use at least one no matter how old
+        other == latest_observation ||
+        // only interested in where it has been recently, but if average_gap is stupidly small bump it to 25s
+        (time_diff < 5 * average_gap);
+}
+
+// Inputs and result of locating one head in the snapshot
+struct head_location
+{
+    double average_gap;
+    float access_distances[N_ACCESS_POINTS];       // latest observation distance
+    float access_times[N_ACCESS_POINTS];           // latest observation time
+    double time_score;
+    int k_found;
+    struct top_k best_few[7];
+};
+
+// Batch of heads an analysis thread takes at a time
+#define LOCATION_BATCH 8
+
+/*
+    Shared by the analysis threads while locating the heads in the snapshot
+*/
+struct location_job
+{
+    struct OverallState* state;
+    struct closest_snapshot* snapshot;
+    struct head_location* locations;
+    time_t now;
+    int next;                           // next head to take
+};
+
+/*
+    Locate one head, reads only the snapshot and state that does not change during the pass
+*/
+static void locate_head(struct OverallState* state, struct closest_snapshot* snapshot, struct ClosestHead* ahead,
+    time_t now, struct head_location* location)
+{
+    struct AccessPoint* access_points = closest_snapshot_access_points(snapshot);
+
+    // Set all distances to zero
+    for (struct AccessPoint* ap = access_points; ap != NULL; ap = ap->next)
+    {
+        location->access_distances[ap->id] = EFFECTIVE_INFINITE;  // effective infinite
+        location->access_times[ap->id] = 0.0;
+    }
+
+    double average_gap = average_gap_for(ahead);
+    location->average_gap = average_gap;
+
+    struct ClosestTo* latest_observation = closest_latest(ahead);
+    int delta_time = difftime(now, latest_observation->latest);
+
+    for (int i = 0; i < closest_count(ahead); i++)
+    {
+        struct ClosestTo* other = &ahead->closest[i];
+        if (!worth_including(other, latest_observation, average_gap)) continue;
+
+        // add this one to the ones to calculate location on
+
+        int index = other->access_point->id;
+        location->access_distances[index] = other->distance; // was why? round(other->distance * 10.0) / 10.0;
+        int abs_diff = difftime(now, other->latest);
+        location->access_times[index] = abs_diff;
+    }
+
+    // Same calculation in knn.c
+    double p_gone_away = delta_time < 4 * average_gap ? 0.0 : atan(10*delta_time/average_gap)/3.14159*2;
+    location->time_score = 1.0 - p_gone_away;
+
+    location->k_found = 0;
+    if (location->time_score > 0.01)
+    {
+        bool debug = ahead->category == CATEGORY_PHONE;
+        location->k_found = find_location(state, access_points,
+            location->access_distances, location->access_times,
+            average_gap,
+            location->best_few, 7,
+            debug);
+    }
+}
+
+/*
+    Analysis thread: take batches of heads until there are none left
+*/
+static void locate_heads_worker(void* context, int worker)
+{
+    (void)worker;
+    struct location_job* job = context;
+    int count = job->snapshot->count;
+    for (;;)
+    {
+        int i = __atomic_fetch_add(&job->next, LOCATION_BATCH, __ATOMIC_RELAXED);
+        if (i >= count) break;
+        int end = i + LOCATION_BATCH < count ? i + LOCATION_BATCH : count;
+        for (; i < end; i++)
+        {
+            locate_head(job->state, job->snapshot, &job->snapshot->heads[i], job->now, &job->locations[i]);
+        }
+    }
+}
+
 
 void debug_print_heading(struct ClosestHead* ahead, time_t now, float average_gap)
 {
-    struct ClosestTo* latest_observation = ahead->closest;
+    struct ClosestTo* latest_observation = closest_latest(ahead);
 
     char mac[18];
     mac_64_to_string(mac, sizeof(mac), ahead->mac64);
@@ -409,10 +579,10 @@ void debug_print_heading(struct ClosestHead* ahead, time_t now, float average_ga
         snprintf(prob_s, sizeof(prob_s), "p(%.3f) x %s", ahead->superseded_probability, sup_mac);
     }
 
-    time_t earliest = ahead->closest->earliest;
-    for (struct ClosestTo* other = ahead->closest; other != NULL; other = other->next)
+    time_t earliest = latest_observation->earliest;
+    for (int i = 0; i < closest_count(ahead); i++)
     {
-        if (other->earliest < earliest) earliest = other->earliest;
+        if (ahead->closest[i].earliest < earliest) earliest = ahead->closest[i].earliest;
     }
 
     const char* room_name = (ahead->recent_rooms == NULL) ? "" : ahead->recent_rooms->name;
@@ -435,17 +605,19 @@ void debug_print_heading(struct ClosestHead* ahead, time_t now, float average_ga
 // ? static time_t last_run;
 
 /*
-    Find counts by patch, room and group
+    Find counts by patch, room and group from the snapshot: supersession, then locate every head
+    and add it to its patches' totals
+    Runs on the analysis thread while the main loop carries on ingesting, so apart from the
+    snapshot it only touches what the main loop leaves alone until the pass is finished: the
+    patches, the recordings and the beacons' rooms
 */
-bool print_counts_by_closest(struct OverallState* state)
+void analyze_closest(struct OverallState* state, struct closest_snapshot* snapshot)
 {
-    time_t last_run = state->last_summary;
-    time(&state->last_summary);
+    closest_snapshot_fill_features(snapshot);
 
     //g_debug("pack_closest_columns()");
-    pack_closest_columns(state);
+    pack_closest_columns(state, snapshot);
 
-    struct AccessPoint* access_points_list = state->access_points;
     struct Beacon* beacon_list = state->beacons;
     struct patch* patch_list = state->patches;
 
@@ -465,80 +637,12 @@ bool print_counts_by_closest(struct OverallState* state)
         current->other_total = 0.0;
     }
 
-    // TODO: Make this lazy, less often?
-    //if (state->recordings == NULL)
-    free_list(&state->recordings);
-    int count_recordings = 0;
-    int count_recordings_and_beacons = 0;
-    g_trace("Re-read observations files");
-    bool ok = read_observations ("/var/sniffer/recordings", state, TRUE);
-    if (!ok) g_warning("Failed to read recordings files back");
-    for (struct recording* r = state->recordings; r != NULL; r=r->next)
-    {
-        count_recordings++;
-    }
-
-    // and then layer the found beacons on top
-    ok = read_observations ("/var/sniffer/beacons", state, FALSE);
-    if (!ok) g_warning("Failed to read beacon files back");
-    for (struct recording* r = state->recordings; r != NULL; r=r->next)
-    {
-        count_recordings_and_beacons++;
-    }
+    int count_recordings = state->recording_store.confirmed_count;
+    int count_recordings_and_beacons = state->recording_store.total_count;
 
     g_info(" ");
     g_info("COUNTS (recordings: %i, beacons: %i)", count_recordings, count_recordings_and_beacons);
     
-    if (count_recordings == 0)
-    {
-        for (struct AccessPoint* ap = state->access_points; ap != NULL; ap=ap->next)
-        {
-            // Create patches: close to ap, between ap1 and ap2, ...?
-        }
-
-        //g_warning("No patches found, please deploy patches files");
-
-        char* local_id = state->local->client_id; // Used as group_id
-
-        struct patch* current_patch = get_or_create_patch("Close", "4m", local_id, "group=inside", &state->patches, &state->groups, TRUE);
-        struct recording* ralloc = malloc(sizeof(struct recording));
-        ralloc->confirmed = TRUE;
-        ralloc->patch = current_patch;
-        ralloc->next = state->recordings;
-        state->recordings = ralloc;
-        ralloc->access_point_distances[0] = 2.0;
-
-        //--------- 3.5m
-
-        current_patch = get_or_create_patch("Near", "7m", local_id, "group=inside", &state->patches, &state->groups, TRUE);
-        ralloc = malloc(sizeof(struct recording));
-        ralloc->confirmed = TRUE;
-        ralloc->patch = current_patch;
-        ralloc->next = state->recordings;
-        state->recordings = ralloc;
-        ralloc->access_point_distances[0] = 5.0;
-
-        //--------- 7m
-
-        current_patch = get_or_create_patch("Far", "9m", local_id, "group=outside", &state->patches, &state->groups, TRUE);
-        ralloc = malloc(sizeof(struct recording));
-        ralloc->confirmed = TRUE;
-        ralloc->patch = current_patch;
-        ralloc->next = state->recordings;
-        state->recordings = ralloc;
-        ralloc->access_point_distances[0] = 9.0;
-
-        //--------- 10.5m
-
-        current_patch = get_or_create_patch("Distant", "Far", local_id, "group=outside", &state->patches, &state->groups, TRUE);
-        ralloc = malloc(sizeof(struct recording));
-        ralloc->confirmed = TRUE;
-        ralloc->patch = current_patch;
-        ralloc->next = state->recordings;
-        state->recordings = ralloc;
-        ralloc->access_point_distances[0] = 12.0;
-    }
-    
     time_t now = time(0);
 
     // // Unmark every entry in the closest array
@@ -555,56 +659,30 @@ bool print_counts_by_closest(struct OverallState* state)
     // TODO: Make logging configurable, turn off over time?
     int log_n = 15;
 
-    for (struct ClosestHead* ahead = state->closestHead; ahead != NULL; ahead = ahead->next)
+    // Locate every head on the analysis threads, then go through them in order to log and total them
+    struct location_job job;
+    job.state = state;
+    job.snapshot = snapshot;
+    job.locations = g_new(struct head_location, snapshot->count > 0 ? snapshot->count : 1);
+    job.now = now;
+    job.next = 0;
+    work_pool_run(&state->analysis_pool, locate_heads_worker, &job);
+
+    for (struct ClosestHead* ahead = closest_snapshot_first(snapshot); ahead != NULL; ahead = ahead->next)
     {
-        // parallel array of distances and times
-        float access_distances[N_ACCESS_POINTS];       // latest observation distance
-        float access_times[N_ACCESS_POINTS];           // latest observation time
+        struct head_location* location = &job.locations[ahead - snapshot->heads];
 
-        // Set all distances to zero
-        for (struct AccessPoint* ap = access_points_list; ap != NULL; ap = ap->next)
-        {
-            access_distances[ap->id] = EFFECTIVE_INFINITE;  // effective infinite
-            access_times[ap->id] = 0.0;
-        }
+        // parallel array of distances and times
+        float* access_distances = location->access_distances;
 
         count_examined++;
 
         count_not_marked++;
 
-        // Calculate frequency with which this device normally transmits
-
-        int sum_readings = 0;
-        int sum_duration = 0;
         // How long does this device typically go between transmits
-        double average_gap = 60;
-
-        if (ahead -> known_interval > 0 && ahead->known_interval < 2000)
-        {
-            average_gap = ahead->known_interval;
-        }
-        else
-        {
-            for (struct ClosestTo* other = ahead->closest; other != NULL; other = other->next)
-            {
-                int dt = difftime(other->latest, other->earliest); 
-                int dc = other->count;
-
-                // Correct very small values
-                if (dt / dc < 30) {dt = 30 * dc;}
-                // Sometimes get a large value for seen ... long gap ... seen again
-                if (dt / dc > 300) {dt = 300*dc;}
-
-                sum_duration += dt;
-                sum_readings += dc;
-            }
-            average_gap = sum_duration / sum_readings;
-
-            // Milwaukee beacons need to last longer
-            if (ahead->category == CATEGORY_BEACON && average_gap < 45) average_gap = 45.0;
-        }
+        double average_gap = location->average_gap;
 
-        struct ClosestTo* latest_observation = ahead->closest;
+        struct ClosestTo* latest_observation = closest_latest(ahead);
 
         int delta_time = difftime(now, latest_observation->latest);
 
@@ -660,30 +738,17 @@ bool print_counts_by_closest(struct OverallState* state)
         //     debug_print_heading(ahead, now, average_gap);
         // }
 
-        int count_same_mac = 0;
-
         // BY DEFINITION WE ONLY CARE ABOUT SUPERSEDED ON THE FIRST INSTANCE OF A MAC ADDRESS
         // ALL EARLIER POSSIBLE SUPERSEEDED VALUES ARE IRRELEVANT IF ONE CAME IN LATER ON A
         // DIFFERENT ACCESS POINT Right?
 
         // Examine all observations of this same mac address
-        for (struct ClosestTo* other = ahead->closest; other != NULL; other = other->next)
+        for (int i = 0; i < closest_count(ahead); i++)
         {
+            struct ClosestTo* other = &ahead->closest[i];
             count += other->count;
 
-            int time_diff = difftime(latest_observation->latest, other->latest);
-            int abs_diff = difftime(now, other->latest);
-            // Should always be +ve as we are scanning back in time
-
-            count_same_mac++;
-
-            bool worth_including = 
-                // must use at least one no matter how old
-                count_same_mac < 2 ||
-                // only interested in where it has been recently, but if average_gap is stupidly small bump it to 25s
-                (time_diff < 5 * average_gap);
-
-            if (!worth_including) continue;
+            if (!worth_including(other, latest_observation, average_gap)) continue;
 
             //Verbose logging
             if (logging && detailedLogging)
@@ -701,71 +766,36 @@ bool print_counts_by_closest(struct OverallState* state)
                 other->distance, 
                 now - other->earliest,
                 now - other->latest,
-                other->count, worth_including ? "" : " (ignore)");
+                other->count, "");
             }
-
-            // add this one to the ones to calculate location on
-
-            int index = other->access_point->id;
-            access_distances[index] = other->distance; // was why? round(other->distance * 10.0) / 10.0;
-            access_times[index] = abs_diff;
         }
 
         //struct AccessPoint *ap = test->access_point;
 
-        // Same calculation in knn.c
-        double p_gone_away = delta_time < 4 * average_gap ? 0.0 : atan(10*delta_time/average_gap)/3.14159*2;
-        double time_score = 1.0 - p_gone_away;
+        double time_score = location->time_score;
 
         if (time_score > 0.01)
         {
-            bool debug = ahead->category == CATEGORY_PHONE;
-
-            struct top_k best_few[7];
-            int k_found = calculate_location(state, 
-                access_distances, access_times,
-                average_gap,
-                best_few, 7,
-                ahead->is_training_beacon, debug);
+            // Located on an analysis thread, add it to the patch scores
+            struct top_k* best_few = location->best_few;
+            int k_found = location->k_found;
+            score_patches(state, best_few, k_found);
 
 
             // MOVING ROOM?
 
             struct patch* best_patch = best_few[0].patch;
             bool moving = false;
+            char moved_from[NAME_LENGTH];
+            moved_from[0] = '\0';
 
             if (best_patch != NULL && 
                 (ahead->recent_rooms == NULL || strcmp(ahead->recent_rooms->name, best_patch->room) != 0))
             {
-                struct RecentRoom* recent = malloc(sizeof(struct RecentRoom));
-                g_utf8_strncpy(recent->name, best_patch->room, NAME_LENGTH);
-                recent->next = ahead->recent_rooms;
-                ahead->recent_rooms = recent;
-
+                if (ahead->recent_rooms != NULL) g_utf8_strncpy(moved_from, ahead->recent_rooms->name, NAME_LENGTH);
+                // Added to the live head's recent rooms when the snapshot is published
+                closest_snapshot_move(snapshot, ahead, best_patch->room);
                 moving = true;
-                // prune
-
-                int keep = 10;
-
-                struct RecentRoom* last_room = ahead->recent_rooms;
-                while ((last_room != NULL) && (keep-- > 0))
-                {
-                    last_room = last_room->next;
-                }
-
-                // unlink after here
-                if (last_room != NULL)
-                {
-                    // dispose of tail
-                    struct RecentRoom* rr = NULL;
-                    while ((rr = last_room->next) != NULL)
-                    {
-                        g_debug("Pruning %s", rr->name);
-                        last_room->next = rr->next;
-                        rr->next = NULL;
-                        g_free(rr);
-                    }
-                }
             }
 
             if (logging || moving) 
@@ -776,9 +806,9 @@ bool print_counts_by_closest(struct OverallState* state)
                     debug_print_heading(ahead, now, average_gap);
                 }
 
-                if (moving && ahead->recent_rooms->next != NULL)
+                if (moving && moved_from[0] != '\0')
                 {
-                    g_debug("Moved %s to %s from %s", ahead->name, best_patch->room, ahead->recent_rooms->next->name);
+                    g_debug("Moved %s to %s from %s", ahead->name, best_patch->room, moved_from);
                 }
 
                 // Log the details explaining why it moved
@@ -802,9 +832,9 @@ bool print_counts_by_closest(struct OverallState* state)
 
                 cJSON *jdistances = cJSON_AddObjectToObject(jobject, "distances");
     
-                for (struct ClosestTo* other = ahead->closest; other != NULL; other = other->next)
+                for (int i = 0; i < closest_count(ahead); i++)
                 {
-                    struct AccessPoint* ap = other->access_point;
+                    struct AccessPoint* ap = ahead->closest[i].access_point;
                     int access_id = ap->id;
                     // Includes only those that are within sensible time interval (worth_including above)
                     if (access_distances[access_id] < EFFECTIVE_INFINITE)
@@ -891,6 +921,73 @@ bool print_counts_by_closest(struct OverallState* state)
 
     }
 
+    g_free(job.locations);
+}
+
+/*
+    Analysis thread for one pass, hands the snapshot back to the main loop through the analysis queue
+*/
+static void* analysis_thread(void* parameters)
+{
+    struct OverallState* state = parameters;
+    struct closest_snapshot* snapshot = &state->closest_snapshot;
+    analyze_closest(state, snapshot);
+
+    // One pass at a time so there is always room
+    if (!mpsc_queue_push(&state->analysis_queue, &snapshot))
+    {
+        g_warning("Analysis queue is full, pass is lost");
+    }
+    ingest_wake(state);
+    return NULL;
+}
+
+/*
+    Start a pass to find counts by patch, room and group, main loop only
+    Takes the snapshot and starts the analysis thread on it, returns false if the last pass is still running
+*/
+bool start_counts_by_closest(struct OverallState* state)
+{
+    if (state->analysis_running) return false;
+
+    time(&state->last_summary);
+
+    // Recordings stay in memory, only files changed since the last pass are read again
+    // (and the standard patches are used if there are no recordings yet)
+    if (recording_store_refresh(&state->recording_store, state))
+    {
+        g_debug("Recordings changed, %li files read so far", state->recording_store.files_read);
+    }
+
+    // Analysis works on a copy of the chain, results go back to the live heads when it is done
+    closest_snapshot_take(&state->closest_snapshot, state);
+
+    state->analysis_running = true;
+    state->analysis_joinable = pthread_create(&state->analysis_thread, NULL, analysis_thread, state) == 0;
+    if (!state->analysis_joinable)
+    {
+        g_warning("Could not start the analysis thread, analysing on the main loop");
+        analysis_thread(state);
+    }
+    return true;
+}
+
+/*
+    Finish the pass once the analysis queue has handed the snapshot back, main loop only
+    Returns true if the counts changed
+*/
+bool finish_counts_by_closest(struct OverallState* state)
+{
+    if (state->analysis_joinable) pthread_join(state->analysis_thread, NULL);
+    state->analysis_running = false;
+    state->analysis_joinable = false;
+
+    // Superseded marks and room moves back onto the live chain
+    closest_snapshot_publish(&state->closest_snapshot, state);
+
+    struct patch* patch_list = state->patches;
+    time_t now = time(0);
+
     char *json_complete = NULL;
     cJSON *jobject = cJSON_CreateObject();
 
@@ -900,11 +997,12 @@ bool print_counts_by_closest(struct OverallState* state)
 
     // Summarize by room
 
-    struct summary* summary = NULL;
-    summarize_by_room(patch_list, &summary);
+    struct summaries* summary = &state->room_summary;
+    summarize_by_room(patch_list, &state->place_ids, summary);
 
-    for (struct summary* s=summary; s!=NULL; s=s->next)
+    for (struct summary* s = summary->items; s < summary->items + summary->count; s++)
     {
+        if (!s->present) continue;
         // This makes reception hard: if (any_present(s))
         {
             cJSON* item = cJSON_CreateObject();
@@ -914,15 +1012,15 @@ bool print_counts_by_closest(struct OverallState* state)
             cJSON_AddItemToArray(jrooms, item);
         }
     }
-    free_summary(&summary);
 
     // Summarize by group
-    summary = NULL;
-    summarize_by_group(patch_list, &summary);
+    summary = &state->group_summary;
+    summarize_by_group(patch_list, &state->place_ids, summary);
 
     g_info("              phones     covid percent   watches   tablets wearables computers   beacons     other");
-    for (struct summary* s=summary; s!=NULL; s=s->next)
+    for (struct summary* s = summary->items; s < summary->items + summary->count; s++)
     {
+        if (!s->present) continue;
         cJSON* item = cJSON_CreateObject();
         cJSON_AddStringToObject(item, "name", s->category);
         //cJSON_AddStringToObject(item, "tag", s->extra);
@@ -940,7 +1038,6 @@ bool print_counts_by_closest(struct OverallState* state)
             s->other_total
             );
     }
-    free_summary(&summary);
 
     if (state->beacons != NULL)
     {
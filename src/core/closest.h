@@ -19,7 +19,16 @@ void add_closest(struct OverallState* state, int64_t device_64, struct AccessPoi
 
 struct ClosestTo *get_closest_64(struct OverallState* state, int64_t mac64);
 
-// Compute counts by patch, room and group, returns true if they changed
-bool print_counts_by_closest(struct OverallState* state);
+// Drop heads older than MAX_AGE or beyond CLOSEST_N from the tail of the chain
+void prune_closest(struct OverallState* state, time_t now);
+
+// Start computing counts by patch, room and group on the analysis thread, false if still running
+bool start_counts_by_closest(struct OverallState* state);
+
+// Counts from the snapshot, the analysis thread's half of the pass
+void analyze_closest(struct OverallState* state, struct closest_snapshot* snapshot);
+
+// Publish the pass the analysis queue handed back, returns true if the counts changed
+bool finish_counts_by_closest(struct OverallState* state);
 
 #endif
\ No newline at end of file
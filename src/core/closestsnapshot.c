@@ -0,0 +1,263 @@
+/*
+    Snapshot of the closest chain for the analysis pass
+*/
+
+#include "closestsnapshot.h"
+#include "state.h"
+#include "macmap.h"
+#include "nodepool.h"
+#include "knn.h"
+#include "overlaps.h"
+#include "identity.h"
+
+#include <glib.h>
+#include <string.h>
+
+/*
+    Initialize an empty snapshot
+*/
+void closest_snapshot_init(struct closest_snapshot* snapshot)
+{
+    snapshot->heads = NULL;
+    snapshot->observations = NULL;
+    snapshot->access_points = NULL;
+    snapshot->rooms = NULL;
+    snapshot->moved = NULL;
+    snapshot->recomputed = NULL;
+    snapshot->link = NULL;
+    snapshot->identities = NULL;
+    snapshot->features = NULL;
+    mac_map_init(&snapshot->index, 64);
+    snapshot->count = 0;
+    snapshot->observation_count = 0;
+    snapshot->head_capacity = 0;
+    snapshot->observation_capacity = 0;
+    snapshot->access_point_count = 0;
+    snapshot->access_point_capacity = 0;
+    snapshot->taken = 0;
+    snapshot->snapshots = 0;
+    snapshot->published = 0;
+    snapshot->vanished = 0;
+    snapshot->changed = 0;
+}
+
+/*
+    Copy the live closest chain, main loop only
+*/
+void closest_snapshot_take(struct closest_snapshot* snapshot, struct OverallState* state)
+{
+    int count = 0;
+    int observation_count = 0;
+    for (struct ClosestHead* h = state->closestHead; h != NULL; h = h->next)
+    {
+        count++;
+        observation_count += closest_count(h);
+    }
+
+    int access_point_count = 0;
+    for (struct AccessPoint* ap = state->access_points; ap != NULL; ap = ap->next) access_point_count++;
+    if (access_point_count > snapshot->access_point_capacity)
+    {
+        snapshot->access_point_capacity = access_point_count + 4;
+        snapshot->access_points = g_renew(struct AccessPoint, snapshot->access_points, snapshot->access_point_capacity);
+    }
+
+    // Access points are added by the main loop and their sensors change, the copies keep what the analysis reads
+    struct AccessPoint* by_id[N_ACCESS_POINTS] = { NULL };
+    int a = 0;
+    for (struct AccessPoint* ap = state->access_points; ap != NULL; ap = ap->next, a++)
+    {
+        struct AccessPoint* copy = &snapshot->access_points[a];
+        *copy = *ap;
+        copy->sensors = NULL;
+        copy->next = a < access_point_count - 1 ? &snapshot->access_points[a + 1] : NULL;
+        if (ap->id >= 0 && ap->id < N_ACCESS_POINTS) by_id[ap->id] = copy;
+    }
+    snapshot->access_point_count = access_point_count;
+
+    if (count > snapshot->head_capacity)
+    {
+        snapshot->head_capacity = count + count / 2;
+        snapshot->heads = g_renew(struct ClosestHead, snapshot->heads, snapshot->head_capacity);
+        snapshot->rooms = g_renew(struct RecentRoom, snapshot->rooms, snapshot->head_capacity);
+        snapshot->moved = g_renew(bool, snapshot->moved, snapshot->head_capacity);
+        snapshot->recomputed = g_renew(bool, snapshot->recomputed, snapshot->head_capacity);
+        snapshot->link = g_renew(bool, snapshot->link, snapshot->head_capacity);
+        snapshot->identities = g_renew(int64_t, snapshot->identities, snapshot->head_capacity);
+        snapshot->features = g_renew(struct closest_features, snapshot->features, snapshot->head_capacity);
+    }
+    if (observation_count > snapshot->observation_capacity)
+    {
+        snapshot->observation_capacity = observation_count + observation_count / 2;
+        snapshot->observations = g_renew(struct ClosestTo, snapshot->observations, snapshot->observation_capacity);
+    }
+
+    // Copies move when the buffer grows so the index is rebuilt each time
+    mac_map_free(&snapshot->index);
+    mac_map_init(&snapshot->index, 2 * count);
+    time(&snapshot->taken);
+
+    struct ClosestTo* observations = snapshot->observations;
+    int i = 0;
+    for (struct ClosestHead* h = state->closestHead; h != NULL; h = h->next, i++)
+    {
+        struct ClosestHead* copy = &snapshot->heads[i];
+        *copy = *h;
+
+        int n = closest_count(h);
+        memcpy(observations, h->closest, n * sizeof(struct ClosestTo));
+        for (int k = 0; k < n; k++) observations[k].access_point = by_id[observations[k].access_point->id];
+        copy->closest = observations;
+        observations += n;
+
+        // Only the current room is of interest to the analysis
+        copy->recent_rooms = NULL;
+        if (h->recent_rooms != NULL)
+        {
+            snapshot->rooms[i] = *h->recent_rooms;
+            snapshot->rooms[i].next = NULL;
+            copy->recent_rooms = &snapshot->rooms[i];
+        }
+        snapshot->moved[i] = false;
+
+        // Pairs found on an earlier pass are stale if the head has changed since, the rest are
+        // copied as a prune during the pass frees the live ones
+        snapshot->recomputed[i] = false;
+        snapshot->link[i] = false;
+        if (h->dirty || h->pair_count == 0)
+        {
+            copy->pairs = NULL;
+            copy->pair_count = 0;
+        }
+        else
+        {
+            copy->pairs = g_new(struct supersession_pair, h->pair_count);
+            memcpy(copy->pairs, h->pairs, h->pair_count * sizeof(struct supersession_pair));
+        }
+        h->dirty = false;
+
+        snapshot->identities[i] = identity_graph_find(&state->identities, h->mac64);
+        mac_map_put(&snapshot->index, copy->mac64, copy);
+
+        copy->prev = i > 0 ? &snapshot->heads[i - 1] : NULL;
+        copy->next = i < count - 1 ? &snapshot->heads[i + 1] : NULL;
+    }
+
+    snapshot->count = count;
+    snapshot->observation_count = observation_count;
+    snapshot->snapshots++;
+}
+
+/*
+    Fill the comparison vectors of every copy, on the analysis thread
+*/
+void closest_snapshot_fill_features(struct closest_snapshot* snapshot)
+{
+    for (int i = 0; i < snapshot->count; i++)
+    {
+        closest_features_fill(&snapshot->features[i], &snapshot->heads[i], snapshot->taken);
+    }
+}
+
+/*
+    Record that the analysis moved a head in the snapshot to a new room
+*/
+void closest_snapshot_move(struct closest_snapshot* snapshot, struct ClosestHead* head, const char* room)
+{
+    int i = head - snapshot->heads;
+    g_assert(i >= 0 && i < snapshot->count);
+
+    g_utf8_strncpy(snapshot->rooms[i].name, room, NAME_LENGTH);
+    snapshot->rooms[i].started = snapshot->taken;
+    snapshot->rooms[i].next = NULL;
+    head->recent_rooms = &snapshot->rooms[i];
+    snapshot->moved[i] = true;
+}
+
+/*
+    Add a room to the front of a live head's recent rooms, keeping the last few
+*/
+static void push_recent_room(struct OverallState* state, struct ClosestHead* head, struct RecentRoom* room)
+{
+    struct RecentRoom* recent = node_pool_alloc(&state->room_pool);
+    *recent = *room;
+    recent->next = head->recent_rooms;
+    head->recent_rooms = recent;
+
+    int keep = 10;
+
+    struct RecentRoom* last_room = head->recent_rooms;
+    while ((last_room != NULL) && (keep-- > 0))
+    {
+        last_room = last_room->next;
+    }
+
+    // unlink after here
+    if (last_room != NULL)
+    {
+        // dispose of tail
+        node_pool_free_chain(&state->room_pool, last_room->next);
+        last_room->next = NULL;
+    }
+}
+
+/*
+    Apply the analysis results on the copies back to the live heads, main loop only
+*/
+void closest_snapshot_publish(struct closest_snapshot* snapshot, struct OverallState* state)
+{
+    for (int i = 0; i < snapshot->count; i++)
+    {
+        struct ClosestHead* copy = &snapshot->heads[i];
+        struct ClosestHead* live = mac_map_get(&state->closest_index, copy->mac64);
+        if (live == NULL)
+        {
+            g_free(copy->pairs);
+            snapshot->vanished++;
+            continue;
+        }
+
+        // Dirty again if ingest updated it while the pass ran
+        bool changed = live->dirty;
+
+        if (snapshot->recomputed[i])
+        {
+            g_free(live->pairs);
+            live->pairs = copy->pairs;
+            live->pair_count = copy->pair_count;
+        }
+        else
+        {
+            g_free(copy->pairs);
+            if (copy->dirty) live->dirty = true;
+        }
+        copy->pairs = NULL;
+        live->identity_tip = copy->identity_tip;
+
+        if (changed)
+        {
+            // add_closest has cleared what this pass found superseding it
+            snapshot->changed++;
+        }
+        else
+        {
+            live->debug_supersededby_prior = copy->debug_supersededby_prior;
+            live->supersededby = copy->supersededby;
+            live->superseded_probability = copy->superseded_probability;
+            live->link_candidate = copy->link_candidate;
+            live->link_passes = copy->link_passes;
+
+            // Only while both are still there, a pruned mac is never linked again
+            if (snapshot->link[i] && mac_map_get(&state->closest_index, copy->supersededby) != NULL)
+            {
+                identity_graph_link(&state->identities, copy->supersededby, copy->mac64);
+            }
+        }
+
+        if (snapshot->moved[i])
+        {
+            push_recent_room(state, live, &snapshot->rooms[i]);
+        }
+        snapshot->published++;
+    }
+}
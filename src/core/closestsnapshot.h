@@ -0,0 +1,110 @@
+#ifndef CLOSESTSNAPSHOT_H
+#define CLOSESTSNAPSHOT_H
+/*
+    Snapshot of the closest chain for the analysis pass
+
+    The live chain keeps changing as observations arrive: heads move to the front, observation
+    arrays grow into larger size classes, heads get pruned. The analysis pass (supersession and
+    location) instead works on a copy taken on the main loop at the start of the pass: the heads
+    in chain order, linked through next and prev as usual, with all of their observations back to
+    back in one array and the access points they refer to. The pass then runs on its own thread
+    while the main loop carries on ingesting, and the copy stays consistent however long it takes.
+
+    Each copy also gets the vectors compare_features works on, filled by the analysis thread.
+
+    The copy is read only apart from the analysis results on each head (superseded by, the
+    room it moved to, the supersession pairs found again for heads that were dirty and whether
+    to link it to the head superseding it). Those are applied to the live heads by mac address on
+    the main loop when the pass is done, heads pruned in the meantime are skipped. A head updated
+    while the pass ran is dirty again: it gets the pairs and room but keeps its own superseded by,
+    which add_closest has just cleared. Buffers are kept and reused from pass to pass.
+
+    Copies of clean heads get a copy of the live head's supersession pairs (the live ones may be
+    freed by a prune during the pass), dirty heads start with none. Taking a snapshot clears the
+    dirty flag on the live heads so that it marks heads updated after the snapshot.
+*/
+
+#include "aggregate.h"
+#include "macmap.h"
+#include <time.h>
+
+struct OverallState;
+struct closest_features;
+
+struct closest_snapshot
+{
+    struct ClosestHead* heads;          // copies in chain order, most recent first
+    struct ClosestTo* observations;     // observations of every head back to back
+    struct AccessPoint* access_points;  // copies of the access points, linked in list order, no sensors
+    struct RecentRoom* rooms;           // current room of each head, at most one per head
+    bool* moved;                        // analysis moved the head to the room in rooms
+    struct closest_features* features; // comparison vectors of each head, times relative to taken
+    bool* recomputed;                   // analysis found the head's supersession pairs again
+    bool* link;                         // analysis wants the head linked to the head superseding it
+    int64_t* identities;                // identity of each head when the snapshot was taken
+    struct mac_map index;               // mac64 -> copy in heads
+    int count;
+    int observation_count;
+    int head_capacity;
+    int observation_capacity;
+    int access_point_count;
+    int access_point_capacity;
+    time_t taken;
+
+    // Statistics
+    long snapshots;                     // passes taken
+    long published;                     // head results applied to the live chain
+    long vanished;                      // heads pruned before their results were applied
+    long changed;                       // heads updated while the pass ran
+};
+
+/*
+    Initialize an empty snapshot
+*/
+void closest_snapshot_init(struct closest_snapshot* snapshot);
+
+/*
+    Copy the live closest chain, main loop only
+*/
+void closest_snapshot_take(struct closest_snapshot* snapshot, struct OverallState* state);
+
+/*
+    Fill the comparison vectors of every copy, on the analysis thread
+*/
+void closest_snapshot_fill_features(struct closest_snapshot* snapshot);
+
+/*
+    Apply the analysis results on the copies back to the live heads, main loop only
+*/
+void closest_snapshot_publish(struct closest_snapshot* snapshot, struct OverallState* state);
+
+/*
+    Copy of the head for a mac address, NULL if it was not in the chain
+*/
+static inline struct ClosestHead* closest_snapshot_find(struct closest_snapshot* snapshot, int64_t mac64)
+{
+    return mac_map_get(&snapshot->index, mac64);
+}
+
+/*
+    First head in the snapshot, NULL if empty
+*/
+static inline struct ClosestHead* closest_snapshot_first(struct closest_snapshot* snapshot)
+{
+    return snapshot->count > 0 ? snapshot->heads : NULL;
+}
+
+/*
+    Access point list the copies refer to, NULL if there are none
+*/
+static inline struct AccessPoint* closest_snapshot_access_points(struct closest_snapshot* snapshot)
+{
+    return snapshot->access_point_count > 0 ? snapshot->access_points : NULL;
+}
+
+/*
+    Record that the analysis moved a head in the snapshot to a new room
+*/
+void closest_snapshot_move(struct closest_snapshot* snapshot, struct ClosestHead* head, const char* room);
+
+#endif
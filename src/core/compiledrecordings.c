@@ -0,0 +1,121 @@
+/*
+    Compiled recordings
+*/
+
+#include "compiledrecordings.h"
+
+#include <glib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/*
+    Does a section of count items of size bytes at offset lie inside the file
+*/
+static bool section_fits(const struct compiled_recordings* compiled, uint64_t offset, uint64_t count, uint64_t size)
+{
+    if (offset % COMPILED_RECORDINGS_ALIGN != 0) return false;
+    if (offset < sizeof(struct compiled_recordings_header) || offset > compiled->size) return false;
+    return count <= (compiled->size - offset) / size;
+}
+
+/*
+    Check the header and every index in the file so nothing later needs to
+*/
+static const char* validate(struct compiled_recordings* compiled)
+{
+    if (compiled->size < sizeof(struct compiled_recordings_header)) return "too short";
+
+    const struct compiled_recordings_header* header = compiled->map;
+    if (header->magic != COMPILED_RECORDINGS_MAGIC) return "not a compiled recordings file";
+    if (header->version != COMPILED_RECORDINGS_VERSION) return "unsupported version";
+    if (header->file_size != compiled->size) return "truncated";
+
+    if (!section_fits(compiled, header->names_offset, header->column_count, sizeof(uint32_t))) return "bad access point names";
+    if (!section_fits(compiled, header->patches_offset, header->patch_count, sizeof(struct compiled_patch))) return "bad patches";
+    if (!section_fits(compiled, header->rows_offset, header->row_count, sizeof(uint32_t))) return "bad recordings";
+    if (!section_fits(compiled, header->matrix_offset, (uint64_t)header->row_count * header->column_count, sizeof(float))) return "bad matrix";
+    if (!section_fits(compiled, header->strings_offset, header->strings_size, 1)) return "bad strings";
+
+    compiled->header = header;
+    compiled->names = (const uint32_t*)((const char*)compiled->map + header->names_offset);
+    compiled->patches = (const struct compiled_patch*)((const char*)compiled->map + header->patches_offset);
+    compiled->rows = (const uint32_t*)((const char*)compiled->map + header->rows_offset);
+    compiled->matrix = (const float*)((const char*)compiled->map + header->matrix_offset);
+    compiled->strings = (const char*)compiled->map + header->strings_offset;
+
+    // The last string is terminated so every offset inside the table is too
+    uint32_t strings_size = header->strings_size;
+    if (strings_size == 0 || compiled->strings[strings_size - 1] != '\0') return "bad strings";
+
+    for (uint32_t i = 0; i < header->column_count; i++)
+    {
+        if (compiled->names[i] >= strings_size) return "bad access point name";
+    }
+    for (uint32_t i = 0; i < header->patch_count; i++)
+    {
+        const struct compiled_patch* p = &compiled->patches[i];
+        if (p->name >= strings_size || p->room >= strings_size || p->group >= strings_size || p->tags >= strings_size)
+            return "bad patch";
+    }
+    for (uint32_t i = 0; i < header->row_count; i++)
+    {
+        if (compiled->rows[i] >= header->patch_count) return "bad patch index";
+    }
+    return NULL;
+}
+
+/*
+    Map a compiled recordings file and check it is complete and consistent, false (with a warning) if not
+*/
+bool compiled_recordings_open(struct compiled_recordings* compiled, const char* path)
+{
+    memset(compiled, 0, sizeof(struct compiled_recordings));
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        g_warning("Could not open compiled recordings '%s': %s", path, strerror(errno));
+        return FALSE;
+    }
+
+    struct stat info;
+    if (fstat(fd, &info) != 0 || info.st_size == 0)
+    {
+        g_warning("Could not read compiled recordings '%s'", path);
+        close(fd);
+        return FALSE;
+    }
+
+    void* map = mmap(NULL, info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);  // the mapping keeps the file open
+    if (map == MAP_FAILED)
+    {
+        g_warning("Could not map compiled recordings '%s': %s", path, strerror(errno));
+        return FALSE;
+    }
+
+    compiled->map = map;
+    compiled->size = info.st_size;
+
+    const char* problem = validate(compiled);
+    if (problem != NULL)
+    {
+        g_warning("Could not use compiled recordings '%s': %s", path, problem);
+        compiled_recordings_close(compiled);
+        return FALSE;
+    }
+    return TRUE;
+}
+
+/*
+    Unmap the file
+*/
+void compiled_recordings_close(struct compiled_recordings* compiled)
+{
+    if (compiled->map != NULL) munmap(compiled->map, compiled->size);
+    memset(compiled, 0, sizeof(struct compiled_recordings));
+}
@@ -0,0 +1,95 @@
+#ifndef COMPILEDRECORDINGS_H
+#define COMPILEDRECORDINGS_H
+/*
+    Compiled recordings
+
+    A binary form of the JSONL recordings files made offline by the compilerecordings tool and
+    memory mapped by the daemon, so a site with thousands of training points loads without
+    parsing any JSON and the pages are shared with anything else that maps the same file.
+
+    Access point ids are handed out at runtime in the order access points are seen, so the file
+    keeps access points by name: each column of the matrix has the name used in the JSONL files
+    (long, short or alternate name) and is matched to an access point when the recording store
+    expands the rows into recordings. Columns for access points not seen yet are skipped until they are.
+
+    Layout, native byte order, every section 16 byte aligned:
+
+        header
+        access point names    uint32_t string offset per column
+        patches               struct compiled_patch per patch
+        recordings            uint32_t patch index per row
+        matrix                float[rows][columns], NaN where the access point was not recorded
+        strings               NUL terminated, offsets are from the start of this section
+
+    Rows are in the order they appeared in the source files. The file is only ever replaced
+    (written alongside and renamed over) never rewritten in place, a mapping of the old one
+    stays valid until it is closed.
+*/
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define COMPILED_RECORDINGS_MAGIC 0x43525350        // "PSRC"
+#define COMPILED_RECORDINGS_VERSION 1
+#define COMPILED_RECORDINGS_EXTENSION ".recordings"
+#define COMPILED_RECORDINGS_ALIGN 16
+
+struct compiled_recordings_header
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t column_count;              // access point names
+    uint32_t patch_count;
+    uint32_t row_count;                 // recordings
+    uint32_t strings_size;
+    uint64_t names_offset;
+    uint64_t patches_offset;
+    uint64_t rows_offset;
+    uint64_t matrix_offset;
+    uint64_t strings_offset;
+    uint64_t file_size;
+};
+
+struct compiled_patch
+{
+    uint32_t name;                      // string offsets
+    uint32_t room;
+    uint32_t group;
+    uint32_t tags;
+};
+
+/*
+    A mapped compiled recordings file
+*/
+struct compiled_recordings
+{
+    void* map;
+    size_t size;
+    const struct compiled_recordings_header* header;
+    const uint32_t* names;
+    const struct compiled_patch* patches;
+    const uint32_t* rows;
+    const float* matrix;
+    const char* strings;
+};
+
+/*
+    Map a compiled recordings file and check it is complete and consistent, false (with a warning) if not
+*/
+bool compiled_recordings_open(struct compiled_recordings* compiled, const char* path);
+
+/*
+    Unmap the file
+*/
+void compiled_recordings_close(struct compiled_recordings* compiled);
+
+/*
+    String from the string table
+*/
+static inline const char* compiled_recordings_string(const struct compiled_recordings* compiled, uint32_t offset)
+{
+    return compiled->strings + offset;
+}
+
+#endif
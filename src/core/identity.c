@@ -0,0 +1,218 @@
+/*
+    Identity graph: mac addresses known to belong to the same device
+*/
+
+#include "identity.h"
+
+#include <glib.h>
+
+/*
+    Node for a mac, added as its own identity if it isn't there yet
+*/
+static int node_for(struct identity_graph* graph, int64_t mac64)
+{
+    intptr_t found = (intptr_t)mac_map_get(&graph->index, mac64);
+    if (found != 0) return found - 1;
+
+    if (graph->count == graph->capacity)
+    {
+        graph->capacity = graph->capacity == 0 ? 64 : graph->capacity * 2;
+        graph->nodes = g_renew(struct identity_node, graph->nodes, graph->capacity);
+    }
+    int i = graph->count++;
+    graph->nodes[i].mac64 = mac64;
+    graph->nodes[i].parent = i;
+    graph->nodes[i].size = 1;
+    graph->nodes[i].id = mac64;
+    mac_map_put(&graph->index, mac64, (void*)(intptr_t)(i + 1));
+    graph->identities++;
+    return i;
+}
+
+static int root_of(struct identity_graph* graph, int i)
+{
+    struct identity_node* nodes = graph->nodes;
+    while (nodes[i].parent != i)
+    {
+        // Path halving: point every other node on the way at its grandparent
+        nodes[i].parent = nodes[nodes[i].parent].parent;
+        i = nodes[i].parent;
+    }
+    return i;
+}
+
+static bool join(struct identity_graph* graph, int64_t a, int64_t b)
+{
+    int ra = root_of(graph, node_for(graph, a));
+    int rb = root_of(graph, node_for(graph, b));
+    if (ra == rb) return false;
+
+    // Union by size keeps the trees shallow
+    struct identity_node* nodes = graph->nodes;
+    if (nodes[ra].size < nodes[rb].size)
+    {
+        int t = ra; ra = rb; rb = t;
+    }
+    nodes[rb].parent = ra;
+    nodes[ra].size += nodes[rb].size;
+    graph->identities--;
+    return true;
+}
+
+static void append_link(struct identity_link** links, int* count, int* capacity, int64_t a, int64_t b)
+{
+    if (*count == *capacity)
+    {
+        *capacity = *capacity == 0 ? 64 : *capacity * 2;
+        *links = g_renew(struct identity_link, *links, *capacity);
+    }
+    (*links)[*count].a = a;
+    (*links)[*count].b = b;
+    (*count)++;
+}
+
+/*
+    Rebuild the sets from the links that are left after removals
+*/
+static void rebuild(struct identity_graph* graph)
+{
+    mac_map_free(&graph->index);
+    mac_map_init(&graph->index, graph->link_count + 16);
+    graph->count = 0;
+    graph->identities = 0;
+
+    // Links that joined nothing new (left over from bridging a removed mac) are dropped
+    int kept = 0;
+    for (int k = 0; k < graph->link_count; k++)
+    {
+        if (join(graph, graph->links[k].a, graph->links[k].b)) graph->links[kept++] = graph->links[k];
+    }
+    graph->link_count = kept;
+
+    // Identities that lost a mac get their id back, unless the id itself was removed since
+    for (int k = 0; k < graph->kept_count; k++)
+    {
+        intptr_t found = (intptr_t)mac_map_get(&graph->index, graph->kept[k].a);
+        if (found == 0 || mac_map_get(&graph->index, graph->kept[k].b) == NULL) continue;
+        graph->nodes[root_of(graph, found - 1)].id = graph->kept[k].b;
+    }
+    graph->kept_count = 0;
+
+    graph->stale = false;
+    graph->rebuilds++;
+}
+
+/*
+    Initialize an empty graph
+*/
+void identity_graph_init(struct identity_graph* graph)
+{
+    graph->nodes = NULL;
+    graph->count = 0;
+    graph->capacity = 0;
+    mac_map_init(&graph->index, 64);
+    graph->links = NULL;
+    graph->link_count = 0;
+    graph->link_capacity = 0;
+    graph->kept = NULL;
+    graph->kept_count = 0;
+    graph->kept_capacity = 0;
+    graph->stale = false;
+    graph->identities = 0;
+    graph->linked = 0;
+    graph->removed = 0;
+    graph->rebuilds = 0;
+}
+
+/*
+    Free the storage used by a graph
+*/
+void identity_graph_free(struct identity_graph* graph)
+{
+    g_free(graph->nodes);
+    g_free(graph->links);
+    g_free(graph->kept);
+    mac_map_free(&graph->index);
+    graph->nodes = NULL;
+    graph->links = NULL;
+    graph->kept = NULL;
+    graph->count = 0;
+    graph->capacity = 0;
+    graph->link_count = 0;
+    graph->link_capacity = 0;
+    graph->kept_count = 0;
+    graph->kept_capacity = 0;
+}
+
+/*
+    Record that two macs are the same device, returns false if they already were
+*/
+bool identity_graph_link(struct identity_graph* graph, int64_t a, int64_t b)
+{
+    if (graph->stale) rebuild(graph);
+    if (!join(graph, a, b)) return false;
+
+    append_link(&graph->links, &graph->link_count, &graph->link_capacity, a, b);
+    graph->linked++;
+    return true;
+}
+
+/*
+    Take a mac out of the graph, whatever else it was linked to stays one identity with the same id
+*/
+void identity_graph_remove(struct identity_graph* graph, int64_t mac64)
+{
+    intptr_t found = (intptr_t)mac_map_get(&graph->index, mac64);
+    if (found == 0) return;
+
+    // The trees are still whole until the rebuild, removed macs are only out of the index
+    int64_t id = graph->nodes[root_of(graph, found - 1)].id;
+
+    // Every link to the mac is dropped and its other ends are linked to the first one instead,
+    // so a mac in the middle of a chain doesn't split it. There is at most one of these for each
+    // link dropped so they fit in the space left behind
+    bool bridged = false;
+    int64_t first = 0;
+    int kept = 0;
+    for (int k = 0; k < graph->link_count; k++)
+    {
+        struct identity_link link = graph->links[k];
+        if (link.a != mac64 && link.b != mac64)
+        {
+            graph->links[kept++] = link;
+            continue;
+        }
+        int64_t other = link.a == mac64 ? link.b : link.a;
+        if (!bridged)
+        {
+            first = other;
+            bridged = true;
+            continue;
+        }
+        graph->links[kept].a = first;
+        graph->links[kept].b = other;
+        kept++;
+    }
+    graph->link_count = kept;
+
+    if (bridged && id != mac64)
+    {
+        append_link(&graph->kept, &graph->kept_count, &graph->kept_capacity, first, id);
+    }
+
+    mac_map_remove(&graph->index, mac64);
+    graph->stale = true;
+    graph->removed++;
+}
+
+/*
+    Representative mac for the identity of a mac, the mac itself if it was never linked
+*/
+int64_t identity_graph_find(struct identity_graph* graph, int64_t mac64)
+{
+    if (graph->stale) rebuild(graph);
+
+    intptr_t found = (intptr_t)mac_map_get(&graph->index, mac64);
+    if (found == 0) return mac64;
+    return graph->nodes[root_of(graph, found - 1)].id;
+}
@@ -0,0 +1,87 @@
+#ifndef IDENTITY_H
+#define IDENTITY_H
+/*
+    Identity graph: mac addresses known to belong to the same device
+
+    Phones and watches rotate their random mac address every few minutes, so one device
+    leaves a trail of heads in the closest chain. Once the supersession pass has paired the
+    same two heads for long enough they are linked here for good, and every later pass only
+    has to compare the latest head of each identity (its tip) with the others.
+
+    Union-find with union by size and path halving over the linked macs only, a mac that was
+    never linked is an identity on its own. Links are kept as a list of pairs so that macs can
+    be taken out again (pruned, or seen again after being linked which means the link was
+    wrong): removing marks the graph stale and the sets are rebuilt from the remaining links
+    before the next find. A mac taken out of the middle of a rotation chain would split it in
+    two, so its neighbours are linked to each other in its place, and the identity keeps its id
+    through the rebuild unless the id was the mac removed. Main loop only.
+*/
+
+#include "macmap.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+struct identity_node
+{
+    int64_t mac64;
+    int parent;         // index of parent node, itself for a root
+    int size;           // number of macs under a root
+    int64_t id;         // identity of the set, on a root
+};
+
+struct identity_link
+{
+    int64_t a;
+    int64_t b;
+};
+
+struct identity_graph
+{
+    struct identity_node* nodes;
+    int count;
+    int capacity;
+    struct mac_map index;           // mac64 -> node index + 1
+
+    struct identity_link* links;    // every link made, minus those to removed macs
+    int link_count;
+    int link_capacity;
+
+    struct identity_link* kept;     // a = a mac still linked, b = the id its identity keeps
+    int kept_count;
+    int kept_capacity;
+
+    bool stale;                     // a mac was removed, rebuild before the next find
+    int identities;                 // roots, macs that were never linked are not counted
+
+    // Statistics
+    long linked;
+    long removed;
+    long rebuilds;
+};
+
+/*
+    Initialize an empty graph
+*/
+void identity_graph_init(struct identity_graph* graph);
+
+/*
+    Free the storage used by a graph
+*/
+void identity_graph_free(struct identity_graph* graph);
+
+/*
+    Record that two macs are the same device, returns false if they already were
+*/
+bool identity_graph_link(struct identity_graph* graph, int64_t a, int64_t b);
+
+/*
+    Take a mac out of the graph, whatever else it was linked to stays one identity with the same id
+*/
+void identity_graph_remove(struct identity_graph* graph, int64_t mac64);
+
+/*
+    Representative mac for the identity of a mac, the mac itself if it was never linked
+*/
+int64_t identity_graph_find(struct identity_graph* graph, int64_t mac64);
+
+#endif
@@ -3,6 +3,8 @@
 */
 #include "state.h"
 #include "knn.h"
+#include "recordingmatrix.h"
+#include "recordingindex.h"
 #include "accesspoints.h"
 #include "cJSON.h"
 #include "utility.h"
@@ -22,6 +24,17 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 
+// Heads are compared four access points at a time where the compiler targets SSE2 or NEON
+#if N_ACCESS_POINTS % 4 != 0
+#error N_ACCESS_POINTS must be a multiple of 4
+#endif
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
 #define PI 3.141592653
 
 // UTILITY METHODS
@@ -57,9 +70,10 @@ char* recording_to_json (float access_point_distances[N_ACCESS_POINTS], struct A
 }
 
 /*
-    Convert JSON lines value back to a recording value
+    Convert JSON lines value back to a recording value, added to the front of recordings
 */
-bool json_to_recording(char* buffer, struct OverallState* state, struct patch** current_patch, bool confirmed)
+bool json_to_recording(char* buffer, struct OverallState* state, struct patch** current_patch, bool confirmed,
+    struct recording** recordings)
 {
     if (strlen(buffer) == 0) return TRUE;
 
@@ -114,7 +128,7 @@ bool json_to_recording(char* buffer, struct OverallState* state, struct patch**
         else
         {
             //g_info("Heading: Patch '%s' Group name '%s', tags '%s'", patch_name->valuestring, group_name->valuestring, tags->valuestring);
-            *current_patch = get_or_create_patch(patch_name->valuestring, room_name->valuestring, group_name->valuestring, tags->valuestring, &state->patches, &state->groups, confirmed);
+            *current_patch = get_or_create_patch(patch_name->valuestring, room_name->valuestring, group_name->valuestring, tags->valuestring, &state->patches, &state->groups, &state->place_ids, confirmed);
         }
     }
 
@@ -134,8 +148,8 @@ bool json_to_recording(char* buffer, struct OverallState* state, struct patch**
         struct recording* ralloc = malloc(sizeof(struct recording));
         ralloc->confirmed = confirmed;
         ralloc->patch = *current_patch;
-        ralloc->next = state->recordings;
-        state->recordings = ralloc;
+        ralloc->next = *recordings;
+        *recordings = ralloc;
 
         for (struct AccessPoint* ap = state->access_points; ap != NULL; ap = ap->next)
         {
@@ -155,7 +169,7 @@ bool json_to_recording(char* buffer, struct OverallState* state, struct patch**
             }
             else if (cJSON_IsNumber(dist_alternate))
             {
-                ralloc->access_point_distances[ap->id] = dist_short->valuedouble;
+                ralloc->access_point_distances[ap->id] = dist_alternate->valuedouble;
                 count++;
             }
             else
@@ -453,7 +467,74 @@ void get_probability (struct recording* recording,
     top_k_list
 
 */
+/*
+   Insert a scored recording into the top TOP_K_N if it's a better match
+*/
+static void insert_top_k(struct top_k result[TOP_K_N], int* k, struct patch* patch, float probability_pos, float probability_neg)
+{
+    float probability_combined = probability_pos * (1.0 - probability_neg);
+
+    // Most recordings are no better than the worst already kept
+    if (*k == TOP_K_N && !(result[TOP_K_N - 1].probability_combined < probability_combined)) return;
+
+    struct top_k current;
+    current.patch = patch;
+    current.probability_is = probability_pos;
+    current.probability_isnt = probability_neg;
+    current.probability_combined = probability_combined;
+    current.used = FALSE;
+
+    // Find insertion point
+    for (int i = 0; i < TOP_K_N; i++)
+    {
+        if (i == *k)
+        {
+            // Off the end, but still < k, so add the item here
+            (*k)++;
+            result[i] = current;
+            break;
+        }
+        else if (result[i].probability_combined < current.probability_combined)
+        {
+            // Insert at this position, pick up current and move it down
+            struct top_k temp = result[i];
+            result[i] = current;
+            current = temp;
+        }
+        else
+        {
+            // keep going
+        }
+    }
+}
+
+/*
+   Score rows first to first + count of a matrix, both whole lanes, into the top TOP_K_N
+*/
+static void score_rows(const struct recording_matrix* matrix, const struct recording_query* query, int first, int count,
+    bool confirmed, struct top_k result[TOP_K_N], int* k)
+{
+    float probability_pos[RECORDING_MATRIX_BLOCK];
+    float probability_neg[RECORDING_MATRIX_BLOCK];
+    for (int block = first; block < first + count; block += RECORDING_MATRIX_BLOCK)
+    {
+        int block_count = MIN(RECORDING_MATRIX_BLOCK, first + count - block);
+        recording_matrix_score(matrix, query, block, block_count, probability_pos, probability_neg);
+
+        int rows = MIN(block_count, matrix->rows - block);
+        for (int i = 0; i < rows; i++)
+        {
+            struct recording* recording = matrix->row_recordings[block + i];
+            if (recording == NULL) continue;
+            if (confirmed && !recording->confirmed) continue;
+            insert_top_k(result, k, recording->patch, probability_pos[i], probability_neg[i]);
+        }
+    }
+}
+
 int k_nearest(struct recording* recordings,
+            const struct recording_matrix* matrix,
+            struct recording_index* index,
             float accessdistances[N_ACCESS_POINTS],
             float accesstimes[N_ACCESS_POINTS],
             double average_gap, 
@@ -465,52 +546,58 @@ int k_nearest(struct recording* recordings,
 
     struct top_k result[TOP_K_N];
     int k = 0;
-    int test_count = 0;
-    for (struct recording* recording = recordings; recording != NULL; recording = recording->next)
+
+    int buckets[RECORDING_INDEX_BUCKETS];
+    int bucket_count = 0;
+    bool bulk = true;
+    if (index != NULL && recording_index_usable(index, recordings, access_points))
     {
-        if (confirmed && !recording->confirmed) continue;
-        test_count++;
+        bucket_count = recording_index_buckets(index, accessdistances, buckets);
+    }
 
-        debug = debug && string_starts_with(recording->patch->name, "East");
+    if (bucket_count > 0)
+    {
+        // Only the recordings closest to the access points the device is closest to
+        struct recording_query query;
+        recording_matrix_query(&index->matrix, accessdistances, &query);
+        for (int b = 0; b < bucket_count; b++)
+        {
+            score_rows(&index->matrix, &query, index->first[buckets[b]], index->count[buckets[b]], confirmed, result, &k);
+        }
+    }
+    else if (matrix != NULL && recording_matrix_usable(matrix, recordings, access_points))
+    {
+        // Score a block of recordings at a time from the matrix, in list order as below
+        struct recording_query query;
+        recording_matrix_query(matrix, accessdistances, &query);
+        score_rows(matrix, &query, 0, matrix->stride, confirmed, result, &k);
+    }
+    else
+    {
+        bulk = false;
+        for (struct recording* recording = recordings; recording != NULL; recording = recording->next)
+        {
+            if (confirmed && !recording->confirmed) continue;
 
-        float probability_pos = 0.0;
-        float probability_neg = 1.0;
+            debug = debug && string_starts_with(recording->patch->name, "East");
 
-        // Insert recording into the list if it's a better match
-        get_probability(recording, accessdistances, accesstimes, average_gap,
-            &probability_pos, &probability_neg, access_points, debug);
+            float probability_pos = 0.0;
+            float probability_neg = 1.0;
 
-        struct top_k current;
-        current.patch = recording->patch;
-        current.probability_is = probability_pos;
-        current.probability_isnt = probability_neg;
-        current.probability_combined = probability_pos * (1.0 - probability_neg);
-        current.used = FALSE;
-        //current.patch = recording;
+            get_probability(recording, accessdistances, accesstimes, average_gap,
+                &probability_pos, &probability_neg, access_points, debug);
 
-        //if (debug) g_debug("Patch %s Distance %.2f", current.patch_name, distance);
+            insert_top_k(result, &k, recording->patch, probability_pos, probability_neg);
+        }
+    }
 
-        // Find insertion point
-        for (int i = 0; i < TOP_K_N; i++)
+    // Scoring in bulk has no per access point trace, log what it found instead
+    if (debug && bulk)
+    {
+        for (int i = 0; i < k; i++)
         {
-            if (i == k)
-            {
-                // Off the end, but still < k, so add the item here
-                k++;
-                result[i] = current;
-                break;
-            }
-            else if (result[i].probability_combined < current.probability_combined)
-            {
-                // Insert at this position, pick up current and move it down
-                struct top_k temp = result[i];
-                result[i] = current;
-                current = temp;
-            }
-            else
-            {
-                // keep going
-            }
+            if (!string_starts_with(result[i].patch->name, "East")) continue;
+            g_debug("%s is %.3f isnt %.3f", result[i].patch->name, result[i].probability_is, result[i].probability_isnt);
         }
     }
 
@@ -551,7 +638,7 @@ int k_nearest(struct recording* recordings,
         for (int j = i+1; j < k; j++)
         {
             // Same patch, we merge the two scores
-            if (strcmp(result[i].patch->name, result[j].patch->name) == 0)
+            if (result[i].patch->id == result[j].patch->id)
             {
                 //tc++;
                 result[j].used = TRUE;
@@ -614,7 +701,11 @@ int k_nearest(struct recording* recordings,
 
 // FILE OPERATIONS
 
-bool read_observations_file (const char * dirname, const char* filename, struct OverallState* state, bool confirmed)
+/*
+   Read a recordings file, adding each recording to the front of recordings
+*/
+bool read_observations_file (const char * dirname, const char* filename, struct OverallState* state, bool confirmed,
+    struct recording** recordings)
 {
 	g_return_val_if_fail (filename != NULL, FALSE);
 
@@ -664,7 +755,7 @@ bool read_observations_file (const char * dirname, const char* filename, struct
         if (strlen(line) > 0)
         {
             //g_debug("%s", line);
-            bool ok = json_to_recording(line, state, &current_patch, confirmed);
+            bool ok = json_to_recording(line, state, &current_patch, confirmed, recordings);
             if (!ok)
             {
                 // TODO: Log just once per missing access point
@@ -681,21 +772,6 @@ bool read_observations_file (const char * dirname, const char* filename, struct
 	return TRUE;
 }
 
-/*
-   free recordings linked list
-*/
-void free_list(struct recording** head)
-{
-   struct recording* tmp;
-
-   while (*head != NULL)
-    {
-       tmp = *head;
-       *head = (*head)->next;
-       free(tmp);
-    }
-}
-
 /*
   Create the recordings or beacon directory
 */
@@ -711,43 +787,6 @@ void ensure_directory(const char* directory)
     g_object_unref(dir2);
 }
 
-/**
- * Read observations
- * @file: observations file name
- * @error: a %GError to put the error code and message in, or %NULL
- *
- * Reads observations into memory
- *
- * Return value: %TRUE if there were no errors.
- *
- **/
-bool read_observations (const char * dirname,  struct OverallState* state, bool confirmed)
-{
-    ensure_directory(dirname);
-
-    //g_info("Reading directory '%s'",dirname);
-
-    GDir *dir;
-    GError *error;
-    const gchar *filename;
-
-    bool ok = TRUE;
-
-    dir = g_dir_open(dirname, 0, &error);
-
-    if (dir != NULL)
-    {
-        while ((filename = g_dir_read_name(dir)))
-        {
-            //g_debug("Reading file '%s'",filename);
-            ok = read_observations_file(dirname, filename, state, confirmed) && ok;
-        }
-        g_dir_close(dir);
-    }
-
-    return TRUE;
-}
-
 /*
     record_observation
 */
@@ -830,106 +869,176 @@ bool record (const char* directory, const char* device_name,
 }
 
 /*
-*  Compare two distances using heuristic with cut off and no match handling
+*  Fill the comparison vectors for a head, times in seconds relative to epoch
+*/
+void closest_features_fill(struct closest_features* f, struct ClosestHead* head, time_t epoch)
+{
+    // Find a representative start time for comparison with earlier ranges that don't have a match
+    // Use median start time
+    float ordered_start_times[N_ACCESS_POINTS];
+    int n = 0;
+    for (struct ClosestTo* c = head->closest; c < head->closest + closest_count(head); c++)
+    {
+        float start = (float)difftime(c->earliest, epoch);
+        int k = n++;
+        for (; k > 0 && ordered_start_times[k - 1] > start; k--)
+        {
+            ordered_start_times[k] = ordered_start_times[k - 1];
+        }
+        ordered_start_times[k] = start;
+    }
+    float median_start_time = n > 0 ? ordered_start_times[n / 2] : 0.0f;
+
+    f->ap_mask = head->ap_mask;
+    for (int ap_id = 0; ap_id < N_ACCESS_POINTS; ap_id++)
+    {
+        struct ClosestTo* c = closest_for(head, ap_id);
+        f->distance[ap_id] = c != NULL ? c->distance : EFFECTIVE_INFINITE;
+        f->start[ap_id] = c != NULL ? (float)difftime(c->earliest, epoch) : median_start_time;
+        f->latest[ap_id] = c != NULL ? (float)difftime(c->latest, epoch) : 0.0f;
+    }
+}
+
+#if defined(__SSE2__)
+
+static inline __m128 select_ps(__m128 mask, __m128 a, __m128 b)
+{
+    return _mm_or_ps(_mm_and_ps(mask, a), _mm_andnot_ps(mask, b));
+}
+
+/*
+*  Score four access points at once, see compare_features for the heuristic
 */
-double score_one_pair(float a_distance, float b_distance, time_t a_time, time_t b_time)
+static inline __m128 score_four(const float* ad, const float* bd, const float* as, const float* bl)
 {
-    double delta_time = fabs(difftime(a_time, b_time));
+    const __m128 infinite = _mm_set1_ps(EFFECTIVE_INFINITE_TEST);
+    const __m128 one = _mm_set1_ps(1.0f);
+    const __m128 sign = _mm_set1_ps(-0.0f);
+
+    __m128 a_distance = _mm_loadu_ps(ad);
+    __m128 b_distance = _mm_loadu_ps(bd);
+    __m128 a_seen = _mm_cmplt_ps(a_distance, infinite);
+    __m128 b_seen = _mm_cmplt_ps(b_distance, infinite);
+    __m128 delta_time = _mm_andnot_ps(sign, _mm_sub_ps(_mm_loadu_ps(as), _mm_loadu_ps(bl)));
+
+    // Both seen it: closer distances more likely, more so if close in time
+    __m128 delta = _mm_andnot_ps(sign, _mm_sub_ps(a_distance, b_distance));
+    __m128 both = _mm_sub_ps(one, _mm_min_ps(_mm_set1_ps(0.8f), _mm_mul_ps(_mm_set1_ps(0.1f), delta)));
+    __m128 close = _mm_cmplt_ps(delta_time, _mm_set1_ps(30.0f));
+    both = select_ps(close, _mm_sub_ps(_mm_add_ps(both, both), _mm_mul_ps(both, both)), both);
+
+    // Only B seen it: 0.8, 0.9 or 1.0 the longer ago B was there
+    __m128 only_b = select_ps(_mm_cmpgt_ps(delta_time, _mm_set1_ps(300.0f)), one,
+        select_ps(_mm_cmpgt_ps(delta_time, _mm_set1_ps(200.0f)), _mm_set1_ps(0.9f), _mm_set1_ps(0.8f)));
+
+    // Only A seen it: 0.5, neither: 1.0
+    __m128 with_a = select_ps(b_seen, both, _mm_set1_ps(0.5f));
+    __m128 without_a = select_ps(b_seen, only_b, one);
+    return select_ps(a_seen, with_a, without_a);
+}
+
+#elif defined(__ARM_NEON)
+
+/*
+*  Score four access points at once, see compare_features for the heuristic
+*/
+static inline float32x4_t score_four(const float* ad, const float* bd, const float* as, const float* bl)
+{
+    const float32x4_t infinite = vdupq_n_f32(EFFECTIVE_INFINITE_TEST);
+    const float32x4_t one = vdupq_n_f32(1.0f);
+
+    float32x4_t a_distance = vld1q_f32(ad);
+    float32x4_t b_distance = vld1q_f32(bd);
+    uint32x4_t a_seen = vcltq_f32(a_distance, infinite);
+    uint32x4_t b_seen = vcltq_f32(b_distance, infinite);
+    float32x4_t delta_time = vabdq_f32(vld1q_f32(as), vld1q_f32(bl));
+
+    // Both seen it: closer distances more likely, more so if close in time
+    float32x4_t delta = vabdq_f32(a_distance, b_distance);
+    float32x4_t both = vsubq_f32(one, vminq_f32(vdupq_n_f32(0.8f), vmulq_f32(vdupq_n_f32(0.1f), delta)));
+    uint32x4_t close = vcltq_f32(delta_time, vdupq_n_f32(30.0f));
+    both = vbslq_f32(close, vsubq_f32(vaddq_f32(both, both), vmulq_f32(both, both)), both);
+
+    // Only B seen it: 0.8, 0.9 or 1.0 the longer ago B was there
+    float32x4_t only_b = vbslq_f32(vcgtq_f32(delta_time, vdupq_n_f32(300.0f)), one,
+        vbslq_f32(vcgtq_f32(delta_time, vdupq_n_f32(200.0f)), vdupq_n_f32(0.9f), vdupq_n_f32(0.8f)));
+
+    // Only A seen it: 0.5, neither: 1.0
+    float32x4_t with_a = vbslq_f32(b_seen, both, vdupq_n_f32(0.5f));
+    float32x4_t without_a = vbslq_f32(b_seen, only_b, one);
+    return vbslq_f32(a_seen, with_a, without_a);
+}
+
+#else
+
+/*
+*  Score one access point, see compare_features for the heuristic
+*/
+static inline float score_one(float a_distance, float b_distance, float a_start, float b_latest)
+{
+    float delta_time = fabsf(a_start - b_latest);
     if (a_distance >= EFFECTIVE_INFINITE_TEST && b_distance >= EFFECTIVE_INFINITE_TEST)
     {
-        return 1.00;
+        return 1.0f;
     }
     else if (a_distance >= EFFECTIVE_INFINITE_TEST)
     {
-        // We have a B but no A.  Maybe A is too new and we haven't seen same AP yet.
-        // If B is really old we may have moved away from it.
-        if (delta_time > 300) return 1.0;
-        else if (delta_time > 200) return 0.9;
-        else return 0.8;
+        if (delta_time > 300) return 1.0f;
+        else if (delta_time > 200) return 0.9f;
+        else return 0.8f;
     }
     else if (b_distance >= EFFECTIVE_INFINITE_TEST)
     {
-        // We have an A but no B, maybe we moved but less likely than prior case
-        // we should have seen the same AP if we switched mac address
-        return 0.50;
+        return 0.5f;
     }
     else
     {
-        float delta = fabs(a_distance - b_distance);
-        double prob = 1.0 - fmin(0.8, 0.1 * fmin(delta, 8));
-
-        // The closer these are in time, the more likely they are to be related
-        if (delta_time < 30)
-        {
-            prob = (prob + prob) - prob * prob;
-        }
-
+        float prob = 1.0f - fminf(0.8f, 0.1f * fabsf(a_distance - b_distance));
+        if (delta_time < 30) prob = (prob + prob) - prob * prob;
         return prob;
     }
 }
 
+#endif
+
 /*
-*  Compare two closest values
+*  Probability that later head A is the same device as earlier head B judging by distances
+*
+*  Each access point contributes a factor, multiplied together:
+*    neither has seen it: 1.0
+*    only B has: 0.8, 0.9 or 1.0 as B was there 200s, 300s before A's median start time
+*      (maybe A is too new and we haven't seen the same AP yet, or B is old and we moved away)
+*    only A has: 0.5 (we should have seen the same AP if we switched mac address)
+*    both have: closer distances more likely, more so if A started within 30s of B leaving
 */
-float compare_closest (struct ClosestHead* a, struct ClosestHead* b, struct OverallState* state)
+float compare_features(const struct closest_features* a, const struct closest_features* b)
 {
-    double probability = 1.0;
-    bool at_least_one = false;
+    if ((a->ap_mask | b->ap_mask) == 0) return 0.0;
 
-    // Find a representative start time for comparison with earlier ranges that don't have a match
-    // Use median start time
-    time_t ordered_start_times[N_ACCESS_POINTS];
-    int n = 0;
-    for (struct ClosestTo* c = a->closest; c != NULL; c=c->next)
+#if defined(__SSE2__)
+    __m128 product = _mm_set1_ps(1.0f);
+    for (int i = 0; i < N_ACCESS_POINTS; i += 4)
     {
-        int insertion_point = 0;
-        for (int i = 0; i < n; i++)
-        {
-            insertion_point = i;
-            if (c->earliest < ordered_start_times[i]) break;
-        }
-        if (insertion_point < n)
-        {
-            for (int k = n; k > insertion_point; k--)
-            {
-                ordered_start_times[k] = ordered_start_times[k-1];
-            }
-        }
-        ordered_start_times[insertion_point] = c->earliest;
+        product = _mm_mul_ps(product, score_four(a->distance + i, b->distance + i, a->start + i, b->latest + i));
     }
-
-    time_t median_start_time = ordered_start_times[n / 2];
-
-    for (struct AccessPoint* ap = state->access_points; ap != NULL; ap=ap->next)
+    float lanes[4];
+    _mm_storeu_ps(lanes, product);
+    return (lanes[0] * lanes[1]) * (lanes[2] * lanes[3]);
+#elif defined(__ARM_NEON)
+    float32x4_t product = vdupq_n_f32(1.0f);
+    for (int i = 0; i < N_ACCESS_POINTS; i += 4)
     {
-        float a_distance = EFFECTIVE_INFINITE;
-        float b_distance = EFFECTIVE_INFINITE;
-        time_t a_time = median_start_time;
-        time_t b_time = time(0);
-
-        // a is later than b
-
-        for (struct ClosestTo* c = a->closest; c != NULL; c = c->next)
-        {
-            if (c->access_point->id == ap->id) 
-            { 
-                a_distance = c->distance; at_least_one = TRUE;
-                a_time = c->earliest;
-            }
-        }
-
-        for (struct ClosestTo* c = b->closest; c != NULL; c = c->next)
-        {
-            if (c->access_point->id == ap->id) 
-            { 
-                b_distance = c->distance; at_least_one = TRUE; 
-                b_time = c->latest;
-            }
-        }
-
-        double pair_score = score_one_pair(a_distance, b_distance, a_time, b_time);
-
-        probability = probability * pair_score;
+        product = vmulq_f32(product, score_four(a->distance + i, b->distance + i, a->start + i, b->latest + i));
+    }
+    float lanes[4];
+    vst1q_f32(lanes, product);
+    return (lanes[0] * lanes[1]) * (lanes[2] * lanes[3]);
+#else
+    float probability = 1.0f;
+    for (int i = 0; i < N_ACCESS_POINTS; i++)
+    {
+        probability *= score_one(a->distance[i], b->distance[i], a->start[i], b->latest[i]);
     }
-    return at_least_one ? probability : 0.0;
+    return probability;
+#endif
 }
@@ -28,9 +28,16 @@ struct recording
 
 bool record (const char* directory, const char* device_name, float access_distances[N_ACCESS_POINTS], struct AccessPoint* access_points);
 
-bool read_observations (const char * dirname, struct OverallState* state, bool confirmed);
+/*
+   Read a recordings file, adding each recording to the front of recordings
+*/
+bool read_observations_file (const char * dirname, const char* filename, struct OverallState* state, bool confirmed,
+    struct recording** recordings);
 
-void free_list(struct recording** head);
+/*
+  Create the recordings or beacon directory
+*/
+void ensure_directory(const char* directory);
 
 // KNN CLASSIFIER
 
@@ -57,21 +64,57 @@ struct top_k
     float normalized_probability;
 };
 
+/*
+   Score one recording against a device's distances, the reference the recording matrix follows
+*/
+void get_probability(struct recording* recording,
+    float accessdistances[N_ACCESS_POINTS],
+    float accesstimes[N_ACCESS_POINTS],
+    double average_gap,
+    float* out_probability_is,
+    float* out_probability_isnt,
+    struct AccessPoint* access_points, bool debug);
+
+struct recording_matrix;
+struct recording_index;
+
+/*
+   Best matching patches for a device's distances, scored from the index (only recordings near the
+   device's closest access points) or else the matrix when they match recordings and access points,
+   otherwise one recording at a time. Debugging traces each access point when scoring one at a time
+   and logs the best patches when scoring in bulk
+*/
 int k_nearest(struct recording* recordings, 
+    const struct recording_matrix* matrix,
+    struct recording_index* index,
     float accessdistances[N_ACCESS_POINTS],
     float accesstimes[N_ACCESS_POINTS], 
     double average_gap,
     struct AccessPoint* access_points, struct top_k* top_result, int top_count, 
     bool confirmed, bool debug);
 
+// COMPARING HEADS
+
+/*
+   Per head vectors for comparing one head with another, indexed by access point id,
+   filled once per analysis pass. Times are seconds relative to a common epoch.
+*/
+struct closest_features
+{
+    float distance[N_ACCESS_POINTS];    // EFFECTIVE_INFINITE where not seen
+    float start[N_ACCESS_POINTS];       // earliest where seen, the median earliest elsewhere
+    float latest[N_ACCESS_POINTS];      // latest where seen
+    uint32_t ap_mask;
+};
+
 /*
-*  Compare two closest values
+*  Fill the comparison vectors for a head, times in seconds relative to epoch
 */
-float compare_closest (struct ClosestHead* a, struct ClosestHead* b, struct OverallState* state);
+void closest_features_fill(struct closest_features* f, struct ClosestHead* head, time_t epoch);
 
 /*
-*  Compare two distances using heuristic with cut off and no match handling
+*  Probability that later head A is the same device as earlier head B judging by distances
 */
-double score_one_pair(float a_distance, float b_distance, time_t a_time, time_t b_time);
+float compare_features(const struct closest_features* a, const struct closest_features* b);
 
 #endif
\ No newline at end of file
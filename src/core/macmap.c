@@ -0,0 +1,178 @@
+/*
+    Open addressing hash map keyed by a 64 bit mac address
+*/
+
+#include "macmap.h"
+
+#include <glib.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+    Fibonacci hashing: sequential and near-sequential macs spread over the whole table
+*/
+static inline int home_slot(struct mac_map* map, int64_t key)
+{
+    uint64_t h = (uint64_t)key * 0x9E3779B97F4A7C15ULL;
+    return (int)(h >> 32) & (map->capacity - 1);
+}
+
+static void allocate_slots(struct mac_map* map, int capacity)
+{
+    map->capacity = capacity;
+    map->count = 0;
+    map->keys = g_malloc(capacity * sizeof(int64_t));
+    map->values = g_malloc(capacity * sizeof(void*));
+    for (int i = 0; i < capacity; i++)
+    {
+        map->keys[i] = MAC_MAP_EMPTY;
+        map->values[i] = NULL;
+    }
+}
+
+/*
+    Initialize a map with room for at least capacity entries before it needs to grow
+*/
+void mac_map_init(struct mac_map* map, int capacity)
+{
+    // Keep the load factor at or below 0.5
+    int slots = 16;
+    while (slots < capacity * 2) slots = slots * 2;
+    allocate_slots(map, slots);
+    map->lookups = 0;
+    map->probes = 0;
+}
+
+/*
+    Free the storage used by a map
+*/
+void mac_map_free(struct mac_map* map)
+{
+    g_free(map->keys);
+    g_free(map->values);
+    map->keys = NULL;
+    map->values = NULL;
+    map->capacity = 0;
+    map->count = 0;
+}
+
+/*
+    Find the slot holding key or -1
+*/
+static int find_slot(struct mac_map* map, int64_t key)
+{
+    int mask = map->capacity - 1;
+    long probes = 0;
+    int found = -1;
+    for (int i = home_slot(map, key); ; i = (i + 1) & mask)
+    {
+        probes++;
+        if (map->keys[i] == key) { found = i; break; }
+        if (map->keys[i] == MAC_MAP_EMPTY) break;
+    }
+
+    // Readers on other threads may be counting at the same time
+    __atomic_fetch_add(&map->lookups, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&map->probes, probes, __ATOMIC_RELAXED);
+    return found;
+}
+
+/*
+    Double the size of the table and re-insert every key
+*/
+static void grow(struct mac_map* map)
+{
+    int64_t* old_keys = map->keys;
+    void** old_values = map->values;
+    int old_capacity = map->capacity;
+
+    allocate_slots(map, old_capacity * 2);
+
+    for (int i = 0; i < old_capacity; i++)
+    {
+        if (old_keys[i] != MAC_MAP_EMPTY)
+        {
+            mac_map_put(map, old_keys[i], old_values[i]);
+        }
+    }
+
+    g_free(old_keys);
+    g_free(old_values);
+}
+
+/*
+    Find a value, returns false if the key is not present
+*/
+bool mac_map_lookup(struct mac_map* map, int64_t key, void** value)
+{
+    int slot = find_slot(map, key);
+    if (slot < 0) return FALSE;
+    if (value != NULL) *value = map->values[slot];
+    return TRUE;
+}
+
+/*
+    Find a value, returns NULL if the key is not present
+*/
+void* mac_map_get(struct mac_map* map, int64_t key)
+{
+    int slot = find_slot(map, key);
+    return slot < 0 ? NULL : map->values[slot];
+}
+
+/*
+    Add or replace a value
+*/
+void mac_map_put(struct mac_map* map, int64_t key, void* value)
+{
+    g_assert(key != MAC_MAP_EMPTY);
+
+    if ((map->count + 1) * 2 > map->capacity) grow(map);
+
+    int mask = map->capacity - 1;
+    int i = home_slot(map, key);
+    while (map->keys[i] != MAC_MAP_EMPTY)
+    {
+        if (map->keys[i] == key)
+        {
+            map->values[i] = value;
+            return;
+        }
+        i = (i + 1) & mask;
+    }
+
+    map->keys[i] = key;
+    map->values[i] = value;
+    map->count++;
+}
+
+/*
+    Remove a key, returns false if it was not present
+
+    Backward-shift deletion: later entries in the same probe run are moved up into the gap
+    unless their home slot lies cyclically after the gap.
+*/
+bool mac_map_remove(struct mac_map* map, int64_t key)
+{
+    int gap = find_slot(map, key);
+    if (gap < 0) return FALSE;
+
+    int mask = map->capacity - 1;
+    for (int j = (gap + 1) & mask; map->keys[j] != MAC_MAP_EMPTY; j = (j + 1) & mask)
+    {
+        int home = home_slot(map, map->keys[j]);
+
+        // Can entry j stay where it is? Only if its home is in the cyclic range (gap, j]
+        bool stays = (gap <= j) ? (gap < home && home <= j) : (gap < home || home <= j);
+        if (stays) continue;
+
+        map->keys[gap] = map->keys[j];
+        map->values[gap] = map->values[j];
+        gap = j;
+    }
+
+    map->keys[gap] = MAC_MAP_EMPTY;
+    map->values[gap] = NULL;
+    map->count--;
+    return TRUE;
+}
@@ -0,0 +1,61 @@
+#ifndef MACMAP_H
+#define MACMAP_H
+/*
+    Open addressing hash map keyed by a 64 bit mac address
+
+    Linear probing with backward-shift deletion (no tombstones) so that a long running
+    scanner with constant mac address rotation never degrades. Grows when half full.
+
+    Not synchronized: growing frees the old table, so a map shared between threads needs its
+    owner's lock around put and remove as well as lookups. Only the statistics are atomic.
+*/
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Marker for an unused slot, mac addresses only use the bottom 48 bits so this can never be a key
+#define MAC_MAP_EMPTY (-1LL)
+
+struct mac_map
+{
+    int capacity;       // number of slots, always a power of two
+    int count;          // number of slots in use
+    int64_t* keys;      // MAC_MAP_EMPTY when the slot is free
+    void** values;      // value for each key
+
+    // Statistics, probes / lookups is the average cost of a lookup, updated atomically
+    long lookups;
+    long probes;
+};
+
+/*
+    Initialize a map with room for at least capacity entries before it needs to grow
+*/
+void mac_map_init(struct mac_map* map, int capacity);
+
+/*
+    Free the storage used by a map
+*/
+void mac_map_free(struct mac_map* map);
+
+/*
+    Find a value, returns false if the key is not present
+*/
+bool mac_map_lookup(struct mac_map* map, int64_t key, void** value);
+
+/*
+    Find a value, returns NULL if the key is not present
+*/
+void* mac_map_get(struct mac_map* map, int64_t key);
+
+/*
+    Add or replace a value
+*/
+void mac_map_put(struct mac_map* map, int64_t key, void* value);
+
+/*
+    Remove a key, returns false if it was not present
+*/
+bool mac_map_remove(struct mac_map* map, int64_t key);
+
+#endif
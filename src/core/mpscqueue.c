@@ -0,0 +1,127 @@
+/*
+    Bounded lock-free multi-producer single-consumer queue of fixed size records
+*/
+
+#include "mpscqueue.h"
+
+#include <glib.h>
+#include <string.h>
+
+#define CELL_ALIGN 8
+
+static inline uint32_t* cell_sequence(struct mpsc_queue* queue, uint32_t position)
+{
+    return (uint32_t*)(queue->cells + (size_t)(position & queue->mask) * queue->cell_size);
+}
+
+static inline void* cell_record(struct mpsc_queue* queue, uint32_t position)
+{
+    return queue->cells + (size_t)(position & queue->mask) * queue->cell_size + CELL_ALIGN;
+}
+
+/*
+    Initialize an empty queue with room for at least capacity records of record_size bytes
+*/
+void mpsc_queue_init(struct mpsc_queue* queue, int capacity, size_t record_size)
+{
+    uint32_t size = 2;
+    while ((int)size < capacity) size <<= 1;
+
+    queue->capacity = size;
+    queue->mask = size - 1;
+    queue->record_size = record_size;
+    queue->cell_size = CELL_ALIGN + ((record_size + CELL_ALIGN - 1) & ~(size_t)(CELL_ALIGN - 1));
+    queue->cells = g_malloc0(queue->cell_size * size);
+
+    // A cell is free for the producer at position p when its sequence is p
+    for (uint32_t i = 0; i < size; i++)
+    {
+        *cell_sequence(queue, i) = i;
+    }
+
+    queue->head = 0;
+    queue->tail = 0;
+    queue->pushed = 0;
+    queue->dropped = 0;
+    queue->peak = 0;
+}
+
+/*
+    Free the storage used by a queue, it must be empty or hold nothing that needs freeing
+*/
+void mpsc_queue_free(struct mpsc_queue* queue)
+{
+    g_free(queue->cells);
+    queue->cells = NULL;
+    queue->capacity = 0;
+}
+
+/*
+    Copy a record into the queue from any thread, returns false and drops it if full
+*/
+bool mpsc_queue_push(struct mpsc_queue* queue, const void* record)
+{
+    uint32_t position = __atomic_load_n(&queue->head, __ATOMIC_RELAXED);
+    for (;;)
+    {
+        uint32_t sequence = __atomic_load_n(cell_sequence(queue, position), __ATOMIC_ACQUIRE);
+        int32_t difference = (int32_t)(sequence - position);
+        if (difference == 0)
+        {
+            // Cell is free, claim the position (on failure position is reloaded)
+            if (__atomic_compare_exchange_n(&queue->head, &position, position + 1, true,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                break;
+        }
+        else if (difference < 0)
+        {
+            // Consumer has not freed this cell from the last lap: full
+            __atomic_fetch_add(&queue->dropped, 1, __ATOMIC_RELAXED);
+            return false;
+        }
+        else
+        {
+            // Another producer took this position, try the next
+            position = __atomic_load_n(&queue->head, __ATOMIC_RELAXED);
+        }
+    }
+
+    memcpy(cell_record(queue, position), record, queue->record_size);
+    // Publish the record to the consumer
+    __atomic_store_n(cell_sequence(queue, position), position + 1, __ATOMIC_RELEASE);
+
+    __atomic_fetch_add(&queue->pushed, 1, __ATOMIC_RELAXED);
+    uint32_t depth = position + 1 - __atomic_load_n(&queue->tail, __ATOMIC_RELAXED);
+    uint32_t peak = __atomic_load_n(&queue->peak, __ATOMIC_RELAXED);
+    while (depth > peak && depth <= queue->capacity &&
+           !__atomic_compare_exchange_n(&queue->peak, &peak, depth, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+    {
+    }
+    return true;
+}
+
+/*
+    Copy the oldest record out of the queue, consumer thread only, returns false if empty
+*/
+bool mpsc_queue_pop(struct mpsc_queue* queue, void* record)
+{
+    uint32_t position = queue->tail;
+    uint32_t sequence = __atomic_load_n(cell_sequence(queue, position), __ATOMIC_ACQUIRE);
+    if ((int32_t)(sequence - (position + 1)) < 0) return false;   // not yet published
+
+    memcpy(record, cell_record(queue, position), queue->record_size);
+    // Hand the cell back to the producer that reaches it on the next lap
+    __atomic_store_n(cell_sequence(queue, position), position + queue->capacity, __ATOMIC_RELEASE);
+    __atomic_store_n(&queue->tail, position + 1, __ATOMIC_RELAXED);
+    return true;
+}
+
+/*
+    Approximate number of records waiting
+*/
+uint32_t mpsc_queue_depth(struct mpsc_queue* queue)
+{
+    uint32_t head = __atomic_load_n(&queue->head, __ATOMIC_RELAXED);
+    uint32_t tail = __atomic_load_n(&queue->tail, __ATOMIC_RELAXED);
+    return head - tail;
+}
@@ -0,0 +1,60 @@
+#ifndef MPSCQUEUE_H
+#define MPSCQUEUE_H
+/*
+    Bounded lock-free multi-producer single-consumer queue of fixed size records
+
+    Any number of threads may push, exactly one thread pops. Each cell carries a sequence
+    number that says whether it is free for the producer that claimed that position or full
+    for the consumer, so neither side ever takes a lock or waits on the other.
+    When the queue is full push fails and the record is counted as dropped rather than
+    blocking the producer.
+*/
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+struct mpsc_queue
+{
+    uint32_t capacity;          // number of cells, always a power of two
+    uint32_t mask;
+    size_t record_size;         // bytes in each record
+    size_t cell_size;           // sequence number plus record, rounded up for alignment
+    uint8_t* cells;
+
+    uint32_t head;              // next position a producer claims, shared by producers
+    uint32_t tail;              // next position to pop, consumer only
+
+    // Statistics, updated atomically by producers
+    long pushed;
+    long dropped;               // pushes that found the queue full
+    uint32_t peak;              // deepest the queue has been
+};
+
+/*
+    Initialize an empty queue with room for at least capacity records of record_size bytes
+*/
+void mpsc_queue_init(struct mpsc_queue* queue, int capacity, size_t record_size);
+
+/*
+    Free the storage used by a queue, it must be empty or hold nothing that needs freeing
+*/
+void mpsc_queue_free(struct mpsc_queue* queue);
+
+/*
+    Copy a record into the queue from any thread, returns false and drops it if full
+*/
+bool mpsc_queue_push(struct mpsc_queue* queue, const void* record);
+
+/*
+    Copy the oldest record out of the queue, consumer thread only, returns false if empty
+*/
+bool mpsc_queue_pop(struct mpsc_queue* queue, void* record);
+
+/*
+    Approximate number of records waiting, exact when called from the consumer with no
+    producers active
+*/
+uint32_t mpsc_queue_depth(struct mpsc_queue* queue);
+
+#endif
@@ -0,0 +1,98 @@
+/*
+    Fixed size node pool
+*/
+
+#include "nodepool.h"
+
+#include <glib.h>
+#include <stdint.h>
+
+#define NEXT(pool, node) (*(void**)((uint8_t*)(node) + (pool)->link_offset))
+
+/*
+    Initialize an empty pool of nodes of node_size bytes with a next pointer at link_offset
+*/
+void node_pool_init(struct node_pool* pool, const char* name, size_t node_size, size_t link_offset)
+{
+    pool->name = name;
+    pool->node_size = node_size;
+    pool->link_offset = link_offset;
+    pool->slabs = NULL;
+    pool->slab_count = 0;
+    pool->free_list = NULL;
+    pool->in_use = 0;
+    pool->peak = 0;
+}
+
+/*
+    Add a slab and put all of its nodes on the free list
+*/
+static void add_slab(struct node_pool* pool)
+{
+    uint8_t* slab = g_malloc(pool->node_size * NODE_POOL_SLAB);
+    pool->slabs = g_realloc(pool->slabs, (pool->slab_count + 1) * sizeof(void*));
+    pool->slabs[pool->slab_count++] = slab;
+
+    // Link back to front so nodes are handed out in address order
+    for (int i = NODE_POOL_SLAB - 1; i >= 0; i--)
+    {
+        void* node = slab + i * pool->node_size;
+        NEXT(pool, node) = pool->free_list;
+        pool->free_list = node;
+    }
+}
+
+/*
+    Get an uninitialized node
+*/
+void* node_pool_alloc(struct node_pool* pool)
+{
+    if (pool->free_list == NULL) add_slab(pool);
+
+    void* node = pool->free_list;
+    pool->free_list = NEXT(pool, node);
+
+    pool->in_use++;
+    if (pool->in_use > pool->peak) pool->peak = pool->in_use;
+    return node;
+}
+
+/*
+    Return a node to the pool
+*/
+void node_pool_free(struct node_pool* pool, void* node)
+{
+    NEXT(pool, node) = pool->free_list;
+    pool->free_list = node;
+    pool->in_use--;
+}
+
+/*
+    Return a whole chain of nodes linked through their next pointers, NULL is an empty chain
+*/
+void node_pool_free_chain(struct node_pool* pool, void* first)
+{
+    if (first == NULL) return;
+
+    // The chain is already linked the way the free list is, just splice it on the front
+    void* last = first;
+    long count = 1;
+    while (NEXT(pool, last) != NULL)
+    {
+        last = NEXT(pool, last);
+        count++;
+    }
+    NEXT(pool, last) = pool->free_list;
+    pool->free_list = first;
+    pool->in_use -= count;
+}
+
+/*
+    Log occupancy
+*/
+void node_pool_report(struct node_pool* pool)
+{
+    long capacity = (long)pool->slab_count * NODE_POOL_SLAB;
+    g_info("%s pool: %li in use, peak %li, %li allocated in %i slabs (%li KB)", pool->name,
+        pool->in_use, pool->peak, capacity, pool->slab_count, capacity * (long)pool->node_size / 1024);
+}
@@ -0,0 +1,57 @@
+#ifndef NODEPOOL_H
+#define NODEPOOL_H
+/*
+    Fixed size node pool
+
+    Nodes are carved out of slabs allocated NODE_POOL_SLAB at a time and recycled through a
+    free list, so allocating and freeing a node is O(1) and constant churn of short lived
+    nodes never fragments the heap. Slabs are kept for reuse, never returned.
+
+    Free nodes are linked through the node's own next pointer (at link_offset) which lets a
+    whole chain of nodes already linked that way be handed back in one call.
+*/
+
+#include <stddef.h>
+
+#define NODE_POOL_SLAB 256
+
+struct node_pool
+{
+    const char* name;           // for logging
+    size_t node_size;
+    size_t link_offset;         // offset of the node's next pointer
+    void** slabs;
+    int slab_count;
+    void* free_list;
+
+    // Statistics
+    long in_use;                // nodes handed out and not yet freed
+    long peak;                  // most nodes in use at once
+};
+
+/*
+    Initialize an empty pool of nodes of node_size bytes with a next pointer at link_offset
+*/
+void node_pool_init(struct node_pool* pool, const char* name, size_t node_size, size_t link_offset);
+
+/*
+    Get an uninitialized node
+*/
+void* node_pool_alloc(struct node_pool* pool);
+
+/*
+    Return a node to the pool
+*/
+void node_pool_free(struct node_pool* pool, void* node);
+
+/*
+    Return a whole chain of nodes linked through their next pointers, NULL is an empty chain
+*/
+void node_pool_free_chain(struct node_pool* pool, void* first);
+
+/*
+    Log occupancy
+*/
+void node_pool_report(struct node_pool* pool);
+
+#endif
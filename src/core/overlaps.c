@@ -4,6 +4,8 @@
 #include "aggregate.h"
 #include "device.h"
 #include <math.h>
+#include <stdlib.h>
+#include <string.h>
 
 /*
     Do these two devices overlap in time? If so they cannot be the same device
@@ -75,176 +77,671 @@ bool justABlip(time_t a_earliest, time_t a_latest, int a_count,
         Every matching pair satisfies A before B
         Probability is based on lowest gap between A(ap) and B(ap)
 
+    Only heads with the same known category and neither with a public address can be successors,
+    so heads are put into buckets by category first and A is only paired with later heads in its
+    own bucket. Names are still checked pairwise: a temporary name can match anything.
+
+    B also has to have gone from every access point they share before A arrived there, so it
+    must at least have gone from one of A's access points before A arrived. An interval index
+    of the heads seen on each access point in each bucket, sorted by when they were last seen
+    there, gives those as a prefix found by binary search. Only heads in one of those prefixes
+    are paired with A.
+
+    Whether A and B could be successors, and how likely by distance, only depends on A and B.
+    Updating a head moves it to the front of the chain, so the heads updated since the last pass
+    (dirty) are always ahead of the rest and a clean A's later heads are a subset of the ones it
+    had last time. Clean heads keep the pairs they had and only dirty heads are paired again;
+    claiming still runs over every head in chain order, skipping pairs whose B has since gone
+    or moved ahead of A, so the result is the same as pairing everything again.
+
+    When the same A has claimed B for IDENTITY_PASSES passes in a row they are linked as one
+    identity (see identity.h). Only the latest head of each identity, its tip, is paired from
+    then on; the rest are marked superseded by the tip without comparing them with anything,
+    so a phone that has rotated its mac five times costs one head in the pairing, not five.
+    A head whose tip status changes is paired again as if it had been updated.
+*/
+
+// Head last seen on an access point, sorted by range then latest
+struct interval_entry
+{
+    int range;          // bucket * N_ACCESS_POINTS + access point id
+    int head;           // index in the snapshot
+    time_t latest;      // last seen on the access point
+};
+
+static int compare_interval_entry(const void* x, const void* y)
+{
+    const struct interval_entry* a = x;
+    const struct interval_entry* b = y;
+    if (a->range != b->range) return a->range < b->range ? -1 : 1;
+    if (a->latest != b->latest) return a->latest < b->latest ? -1 : 1;
+    return a->head - b->head;
+}
 
+/*
+    Index of the first entry in [lo, hi) last seen after time t
 */
-void pack_closest_columns(struct OverallState* state)
+static int ended_by(struct interval_entry* entries, int lo, int hi, time_t t)
 {
-    // Working backwards in time through the array
-    // Push every device back to column zero as category may have changed
+    while (lo < hi)
+    {
+        int mid = lo + (hi - lo) / 2;
+        if (entries[mid].latest <= t) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
 
-    time_t now = time(0);
+/*
+    Index of the first candidate at or after from, -1 if none
+*/
+static int next_candidate(uint64_t* candidates, int words, int from)
+{
+    int w = from / 64;
+    if (w >= words) return -1;
+    uint64_t bits = candidates[w] & (~(uint64_t)0 << (from % 64));
+    while (bits == 0)
+    {
+        if (++w >= words) return -1;
+        bits = candidates[w];
+    }
+    return w * 64 + __builtin_ctzll(bits);
+}
 
-    for (struct ClosestHead* a = state->closestHead; a != NULL; a=a->next)
+/*
+    Could B be an earlier instance of A under another mac address?
+    Everything except the distance between them, which only matters if they could
+*/
+static bool might_be_successor(struct ClosestHead* a, struct ClosestHead* b)
+{
+    // We have an A and a B, now do pairwise comparison of all A's and all B's
+    // if any of them overlap then these two devices cannot be successors
+
+    // cannot be the same device if one is public and the other is random address type
+    // (or we don't have an address type yet)
+    bool haveDifferentAddressTypes = (a->addressType > 0 && b->addressType > 0 && 
+        a->addressType != b->addressType);
+
+    // cannot be the same device if either is a public mac address (already know macs are different)
+    bool haveDifferentMacAndPublic = (a->addressType == PUBLIC_ADDRESS_TYPE || b->addressType == PUBLIC_ADDRESS_TYPE);
+
+    // cannot be the same if they both have names and the names are different
+    // but don't reject _ names as they are temporary and will get replaced
+    bool haveDifferentNames =
+        // can reject as soon as they both have a partial name that is same type but doesn't match
+        // but cannot reject while one or other has a temporary name as it may match
+        (a->name_type == b->name_type || 
+            (a->name_type==nt_alias || b->name_type == nt_alias) ||   // if known beacon both obs would know it
+            (a->name_type>=nt_known && b->name_type>=nt_known))       // both well known enough to be same
+            && (g_strcmp0(a->name, b->name) != 0);
+
+    // A paired phone may have a name and be compared with an unpaired instance of itself (HACK)
+    if (string_ends_with(a->name, " phone") && g_strcmp0(b->name, "iPhone") == 0)
     {
-        a->debug_supersededby_prior = a->supersededby;
-        a->supersededby = 0;
-        a->superseded_probability = 0.0;
+        haveDifferentNames = false;
     }
+    if (string_ends_with(b->name, " phone") && g_strcmp0(a->name, "iPhone") == 0)
+    {
+        haveDifferentNames = false;
+    }
+
+    // cannot be the same if they both have known categories and they are different
+    bool haveDifferentCategories = (a->category != b->category) || (a->category == CATEGORY_UNKNOWN);
+
+    bool might_supersede = !(haveDifferentAddressTypes || haveDifferentNames || haveDifferentCategories || 
+            haveDifferentMacAndPublic);
+
+    if (!might_supersede) return false;
+
+    // Require at least one matching access point
+    // e.g. two devices at opposite ends of the mesh that never overlapped are unlikely to be the same device
+
+    bool allBlips = true;  // When looking for a blip, all of the readings need to be single values
+    bool over = false;
 
-    for (struct ClosestHead* a = state->closestHead; a != NULL; a=a->next)
+    // Compare same access point records, only access points both have seen
+    uint32_t shared = a->ap_mask & b->ap_mask;
+    while (shared != 0)
     {
-        int delta_time = difftime(now, a->closest->latest);
+        int ap_id = __builtin_ctz(shared);
+        shared &= shared - 1;
 
-        // Ignore any that are expired
-        if (delta_time > 400) continue;
+        struct ClosestTo* am = closest_for(a, ap_id);
+        struct ClosestTo* bm = closest_for(b, ap_id);
+
+        //g_debug("Compare %s(%i) x %s(%i) for %s", am->name, am->name_type, bm->name, bm->name_type,
+        //    am->access_point->client_id);
+
+        // Same access point so the times are comparable
+
+        bool blip2 = justABlip(am->earliest, am->latest, am->count, bm->earliest, bm->latest, bm->count);
+
+        // We know A was around after B was last seen so only need to check one direction                    
+        // to see if A could be entirely after B
+        bool over2 = overlapsOneWay(am->earliest, bm->latest);
+
+        // Could model probability based on non-overlap distance
+        // int delta_time = difftime(a_earliest, b_latest);
+
+        // // How close are the two in distance
+        // double delta = compare_closest(am->device_64, bm->device_64, state);
+
+        allBlips = allBlips && blip2;
+        over = over || over2;
+    }
+
+    if (allBlips || over)
+    {
+        // could not be same device with new MAC address
+        might_supersede = false;
+    }
+
+    return might_supersede;
+}
 
-        // TODO: Find the BEST fit and use that, proceed in order, best first, only claim 1 per leading device
 
-        // Examine lower triangle, only looking at ones that were last seen prior to this one's last seen time
-        for (struct ClosestHead* b = a->next; b != NULL; b=b->next)
+// Pairs found by one thread, in the order it took heads
+struct supersession_pairs
+{
+    struct supersession_pair* pairs;
+    int count;
+    int capacity;
+};
+
+// Batch of heads an analysis thread takes at a time
+#define SUPERSESSION_BATCH 16
+
+/*
+    Shared by the analysis threads for one supersession pass
+    Finding the pairs for each A is independent of every other A so they can be found in any
+    order on any thread, claiming them has to follow the chain order and is done afterwards
+*/
+struct supersession_job
+{
+    struct OverallState* state;
+    struct ClosestHead* heads;
+    struct closest_features* features;
+    int count;
+    time_t now;
+    bool dirty_only;                    // only find pairs again for heads updated since the last pass
+
+    // Buckets and interval index
+    int* bucket;
+    struct interval_entry* entries;
+    int* range_start;
+
+    // Per thread
+    int words;
+    uint64_t* candidates;               // words per thread, candidates for the current A
+    struct supersession_pairs* found;
+
+    // Per head, where its pairs were put
+    int* found_by;                      // thread, -1 if it was not examined
+    int* first;
+    int* pair_count;
+
+    int next;                           // next head to take
+    long pairs;                         // statistics, updated atomically
+    long examined;
+};
+
+/*
+    Find the pairs for one A
+*/
+static void find_pairs(struct supersession_job* job, int i, int worker)
+{
+    struct ClosestHead* heads = job->heads;
+    struct ClosestHead* a = &heads[i];
+
+    // Pairs kept from an earlier pass are still good
+    if (job->dirty_only && !a->dirty) return;
+
+    struct supersession_pairs* found = &job->found[worker];
+    job->found_by[i] = worker;
+    job->first[i] = found->count;
+    job->pair_count[i] = 0;
+
+    int delta_time = difftime(job->now, closest_latest(a)->latest);
+
+    // Ignore any that are expired (they stay expired until updated, which makes them dirty)
+    if (delta_time > 400) return;
+
+    // Every later head would have been a pair without the buckets and index
+    __atomic_fetch_add(&job->pairs, job->count - 1 - i, __ATOMIC_RELAXED);
+
+    // Not in a bucket, cannot supersede anything
+    if (job->bucket[i] < 0) return;
+
+    // Mark the heads in A's bucket that had gone from one of A's access points before A arrived there
+    uint64_t* candidates = job->candidates + (size_t)worker * job->words;
+    memset(candidates, 0, job->words * sizeof(uint64_t));
+    uint32_t mask = a->ap_mask;
+    while (mask != 0)
+    {
+        int ap_id = __builtin_ctz(mask);
+        mask &= mask - 1;
+
+        int range = job->bucket[i] * N_ACCESS_POINTS + ap_id;
+        int lo = job->range_start[range];
+        int hi = ended_by(job->entries, lo, job->range_start[range + 1], closest_for(a, ap_id)->earliest);
+        for (int k = lo; k < hi; k++)
         {
-            
-// TODO: Crash here - concurrency issue, need a lock around CLOSEST
-// TODO: Happened again!
+            candidates[job->entries[k].head / 64] |= (uint64_t)1 << (job->entries[k].head % 64);
+        }
+    }
 
-            g_assert(a->mac64 != b->mac64);
-            if (b->supersededby != 0) continue;  // already claimed
+    long examined = 0;
 
-            // We have an A and a B, now do pairwise comparison of all A's and all B's
-            // if any of them overlap then these two devices cannot be successors
-
-            // cannot be the same device if one is public and the other is random address type
-            // (or we don't have an address type yet)
-            bool haveDifferentAddressTypes = (a->addressType > 0 && b->addressType > 0 && 
-                a->addressType != b->addressType);
-
-            // cannot be the same device if either is a public mac address (already know macs are different)
-            bool haveDifferentMacAndPublic = (a->addressType == PUBLIC_ADDRESS_TYPE || b->addressType == PUBLIC_ADDRESS_TYPE);
-
-            // cannot be the same if they both have names and the names are different
-            // but don't reject _ names as they are temporary and will get replaced
-            bool haveDifferentNames =
-                // can reject as soon as they both have a partial name that is same type but doesn't match
-                // but cannot reject while one or other has a temporary name as it may match
-                (a->name_type == b->name_type || 
-                    (a->name_type==nt_alias || b->name_type == nt_alias) ||   // if known beacon both obs would know it
-                    (a->name_type>=nt_known && b->name_type>=nt_known))       // both well known enough to be same
-                    && (g_strcmp0(a->name, b->name) != 0);
-
-            // A paired phone may have a name and be compared with an unpaired instance of itself (HACK)
-            if (string_ends_with(a->name, " phone") && g_strcmp0(b->name, "iPhone") == 0)
-            {
-                haveDifferentNames = false;
-            }
-            if (string_ends_with(b->name, " phone") && g_strcmp0(a->name, "iPhone") == 0)
-            {
-                haveDifferentNames = false;
-            }
+    // Examine lower triangle, only looking at ones that were last seen prior to this one's last seen time
+    // (candidates in snapshot order after A)
+    for (int j = next_candidate(candidates, job->words, i + 1); j >= 0; j = next_candidate(candidates, job->words, j + 1))
+    {
+        struct ClosestHead* b = &heads[j];
+        examined++;
 
-            // cannot be the same if they both have known categories and they are different
-            bool haveDifferentCategories = (a->category != b->category) || (a->category == CATEGORY_UNKNOWN);
+        g_assert(a->mac64 != b->mac64);
+        if (!might_be_successor(a, b)) continue;
 
-            bool might_supersede = !(haveDifferentAddressTypes || haveDifferentNames || haveDifferentCategories || 
-                    haveDifferentMacAndPublic);
+        if (found->count == found->capacity)
+        {
+            found->capacity = found->capacity == 0 ? 64 : found->capacity * 2;
+            found->pairs = g_renew(struct supersession_pair, found->pairs, found->capacity);
+        }
+        // How close are the two in distance
+        found->pairs[found->count].b = b->mac64;
+        found->pairs[found->count].probability = compare_features(&job->features[i], &job->features[j]);
+        found->count++;
+    }
 
-            if (!might_supersede) continue;
+    job->pair_count[i] = found->count - job->first[i];
+    __atomic_fetch_add(&job->examined, examined, __ATOMIC_RELAXED);
+}
 
-            // Require at least one matching access point
-            // e.g. two devices at opposite ends of the mesh that never overlapped are unlikely to be the same device
+/*
+    Analysis thread: take batches of heads until there are none left
+*/
+static void find_pairs_worker(void* context, int worker)
+{
+    struct supersession_job* job = context;
+    for (;;)
+    {
+        int i = __atomic_fetch_add(&job->next, SUPERSESSION_BATCH, __ATOMIC_RELAXED);
+        if (i >= job->count) break;
+        int end = i + SUPERSESSION_BATCH < job->count ? i + SUPERSESSION_BATCH : job->count;
+        for (; i < end; i++)
+        {
+            find_pairs(job, i, worker);
+        }
+    }
+}
 
-            bool allBlips = true;  // When looking for a blip, all of the readings need to be single values
-            bool over = false;
+/*
+    Find the pairs for the heads in the snapshot, all of them or only the dirty ones
+    Each head examined gets a new list in lists (NULL if empty) and found[i] set, the caller frees them
+*/
+static void find_supersession_pairs(struct OverallState* state, struct closest_snapshot* snapshot, time_t now,
+    bool dirty_only, struct supersession_pair** lists, int* counts, bool* found, long* pairs, long* examined)
+{
+    struct ClosestHead* heads = snapshot->heads;
+    int count = snapshot->count;
+    int dirty = 0;
 
-            for (struct ClosestTo* am = a->closest; am != NULL; am = am->next)
-            {
-                for (struct ClosestTo* bm = b->closest; bm != NULL; bm = bm->next)
-                {
-                    // Compare same access point records
-                    if (am->access_point->id != bm->access_point->id) continue;
+    for (int i = 0; i < count; i++)
+    {
+        lists[i] = NULL;
+        counts[i] = 0;
+        found[i] = false;
+        if (heads[i].dirty) dirty++;
+    }
+    *pairs = 0;
+    *examined = 0;
+
+    // Nothing has changed since the last pass
+    if (dirty_only && dirty == 0) return;
+
+    // Bucket the heads that could be successors by category, -1 for those that cannot
+    int* bucket = g_new(int, count > 0 ? count : 1);
+    int bucket_of_category[256];
+    for (int k = 0; k < 256; k++) bucket_of_category[k] = -1;
+    int buckets = 0;
+    int entry_count = 0;
 
-                    //g_debug("Compare %s(%i) x %s(%i) for %s", am->name, am->name_type, bm->name, bm->name_type,
-                    //    am->access_point->client_id);
+    for (int i = 0; i < count; i++)
+    {
+        bucket[i] = -1;
+        if (heads[i].category == CATEGORY_UNKNOWN || heads[i].addressType == PUBLIC_ADDRESS_TYPE) continue;
+        if (!heads[i].identity_tip) continue;
+        uint8_t category = (uint8_t)heads[i].category;
+        if (bucket_of_category[category] < 0) bucket_of_category[category] = buckets++;
+        bucket[i] = bucket_of_category[category];
+        entry_count += closest_count(&heads[i]);
+    }
 
-                    // Same access point so the times are comparable
+    // Interval index: every observation of a bucketed head, grouped by bucket and access point
+    struct interval_entry* entries = g_new(struct interval_entry, entry_count > 0 ? entry_count : 1);
+    int e = 0;
+    for (int i = 0; i < count; i++)
+    {
+        if (bucket[i] < 0) continue;
+        for (int k = 0; k < closest_count(&heads[i]); k++)
+        {
+            struct ClosestTo* c = &heads[i].closest[k];
+            entries[e].range = bucket[i] * N_ACCESS_POINTS + c->access_point->id;
+            entries[e].head = i;
+            entries[e].latest = c->latest;
+            e++;
+        }
+    }
+    qsort(entries, entry_count, sizeof(struct interval_entry), compare_interval_entry);
+
+    int ranges = buckets * N_ACCESS_POINTS;
+    int* range_start = g_new0(int, ranges + 1);
+    for (int k = 0; k < entry_count; k++) range_start[entries[k].range + 1]++;
+    for (int r = 0; r < ranges; r++) range_start[r + 1] += range_start[r];
+
+    // Find the pairs on every analysis thread
+    int threads = state->analysis_pool.threads;
+    struct supersession_job job;
+    job.state = state;
+    job.heads = heads;
+    job.features = snapshot->features;
+    job.count = count;
+    job.now = now;
+    job.dirty_only = dirty_only;
+    job.bucket = bucket;
+    job.entries = entries;
+    job.range_start = range_start;
+    job.words = (count + 63) / 64;
+    job.candidates = g_new(uint64_t, (size_t)threads * job.words + 1);
+    job.found = g_new0(struct supersession_pairs, threads);
+    job.found_by = g_new(int, count > 0 ? count : 1);
+    job.first = g_new(int, count > 0 ? count : 1);
+    job.pair_count = g_new(int, count > 0 ? count : 1);
+    for (int i = 0; i < count; i++) job.found_by[i] = -1;
+    job.next = 0;
+    job.pairs = 0;
+    job.examined = 0;
+
+    work_pool_run(&state->analysis_pool, find_pairs_worker, &job);
+
+    // Hand each head its own list so it can be kept until the head is next updated
+    for (int i = 0; i < count; i++)
+    {
+        if (job.found_by[i] < 0) continue;
+        found[i] = true;
+        counts[i] = job.pair_count[i];
+        if (counts[i] > 0)
+        {
+            lists[i] = g_new(struct supersession_pair, counts[i]);
+            memcpy(lists[i], job.found[job.found_by[i]].pairs + job.first[i], counts[i] * sizeof(struct supersession_pair));
+        }
+    }
 
-                    bool blip2 = justABlip(am->earliest, am->latest, am->count, bm->earliest, bm->latest, bm->count);
+    for (int t = 0; t < threads; t++)
+    {
+        g_free(job.found[t].pairs);
+    }
+    g_free(job.found);
+    g_free(job.found_by);
+    g_free(job.first);
+    g_free(job.pair_count);
+    g_free(job.candidates);
+    g_free(range_start);
+    g_free(entries);
+    g_free(bucket);
+
+    *pairs = job.pairs;
+    *examined = job.examined;
+}
 
-                    // We know A was around after B was last seen so only need to check one direction                    
-                    // to see if A could be entirely after B
-                    bool over2 = overlapsOneWay(am->earliest, bm->latest);
+/*
+    Mark each head that is not the tip of its identity, returns how many there are
+    tip_of gets the tip's mac for those and 0 for tips
+*/
+static int find_tips(struct closest_snapshot* snapshot, int64_t* tip_of)
+{
+    struct ClosestHead* heads = snapshot->heads;
+    int count = snapshot->count;
 
-                    // Could model probability based on non-overlap distance
-                    // int delta_time = difftime(a_earliest, b_latest);
+    // The chain is in order of last update so the first head of each identity is its tip
+    struct mac_map tips;
+    mac_map_init(&tips, count);
+    int hidden = 0;
+    int uncovered = -1;
 
-                    // // How close are the two in distance
-                    // double delta = compare_closest(am->device_64, bm->device_64, state);
+    for (int i = 0; i < count; i++)
+    {
+        tip_of[i] = 0;
+        // Identities as they were when the snapshot was taken, the main loop keeps changing the graph
+        int64_t identity = snapshot->identities[i];
+        struct ClosestHead* tip = mac_map_get(&tips, identity);
+        if (tip == NULL) mac_map_put(&tips, identity, &heads[i]);
+        else tip_of[i] = tip->mac64;
+
+        // A head that becomes or stops being a tip needs pairing again
+        bool is_tip = tip_of[i] == 0;
+        if (heads[i].identity_tip != is_tip)
+        {
+            heads[i].identity_tip = is_tip;
+            heads[i].dirty = true;
+            if (is_tip) uncovered = i;
+        }
+        if (!is_tip) hidden++;
+    }
 
-                    allBlips = allBlips && blip2;
-                    over = over || over2;
-                }
-            }
+    // A head that was hidden behind a tip is missing from the pairs kept by the heads ahead of it,
+    // rare (only when a link is undone) so pair all of those again
+    for (int i = 0; i < uncovered; i++) heads[i].dirty = true;
 
-            if (allBlips || over)
-            {
-                // could not be same device with new MAC address
-                might_supersede = false;
-            }
+    mac_map_free(&tips);
+    return hidden;
+}
 
-            // How close are the two in distance
-            double probability_by_distance = compare_closest(a, b, state);
+/*
+    Claim the pairs in chain order, each A supersedes at most one B that nobody claimed before it
+    Pairs kept from an earlier pass may name heads that have since been pruned or updated (and
+    so are no longer after A), or that are no longer tips, those are skipped
+    Heads behind an identity tip are superseded by the tip
+*/
+static void claim_pairs(struct closest_snapshot* snapshot, time_t now, struct supersession_pair** lists, int* counts,
+    int64_t* tip_of)
+{
+    struct ClosestHead* heads = snapshot->heads;
+    int count = snapshot->count;
+
+    for (int i = 0; i < count; i++)
+    {
+        heads[i].supersededby = tip_of[i];
+        heads[i].superseded_probability = tip_of[i] != 0 ? 1.0 : 0.0;
+    }
 
-            char a_mac[18];
-            char b_mac[18];
-            mac_64_to_string(a_mac, sizeof(a_mac), a->mac64);
-            mac_64_to_string(b_mac, sizeof(b_mac), b->mac64);
+    for (int i = 0; i < count; i++)
+    {
+        struct ClosestHead* a = &heads[i];
+        if (!a->identity_tip) continue;
+
+        int delta_time = difftime(now, closest_latest(a)->latest);
+
+        // Ignore any that are expired
+        if (delta_time > 400) continue;
+
+        // TODO: Find the BEST fit and use that, proceed in order, best first, only claim 1 per leading device
+
+        for (int k = 0; k < counts[i]; k++)
+        {
+            struct ClosestHead* b = closest_snapshot_find(snapshot, lists[i][k].b);
+            if (b == NULL || b <= a) continue;   // gone, or updated since so no longer after A
+            if (!b->identity_tip) continue;      // linked to a later head since
+            if (b->supersededby != 0) continue;  // already claimed
+
+            double probability_by_distance = lists[i][k].probability;
 
             // Tune the 0.05 parameter: 5% chance they are the same by distances
             // May improve taking time into account
-            if (might_supersede)
+            if (probability_by_distance > 0.01)   // 0.046, 0.0212 observed as valid
             {
-                if (probability_by_distance > 0.01)   // 0.046, 0.0212 observed as valid
-                {
-                    // All of the observations are consistent with being superceded
-                    b->supersededby = a->mac64;
-                    b->superseded_probability = probability_by_distance;
-                    // // if (a->category == CATEGORY_PHONE)
-                    // // {
-                    // //     char* summary = b->supersededby == b->debug_supersededby_prior ?
-                    // //         "superceded" :
-                    // //         (b->debug_supersededby_prior == 0 ? "NEW SUPERSEDED" : "REPLACE SUPERSEDED");
-                    // //     g_debug("%s:%s %s %s:%s prob %.5f", a_mac, a->name, summary, b_mac, b->name, probability_by_distance);
-                    // // }
-                    // A can only supersede one of the B
-                    break;
-                }
-                else
-                {
-                    // // if (a->category == CATEGORY_PHONE)
-                    // // {
-                    // //     g_debug("%s:%s almost superceded %s:%s prob %.5f", a_mac, a->name, b_mac, b->name, probability_by_distance);
-                    // // }
-
-                    if (b->supersededby == 0 || b->superseded_probability < probability_by_distance)
-                    {
-                        b->superseded_probability = probability_by_distance;
-                    }
-                }
+                // All of the observations are consistent with being superceded
+                b->supersededby = a->mac64;
+                b->superseded_probability = probability_by_distance;
+                // A can only supersede one of the B
+                break;
             }
-            else
+            else if (b->supersededby == 0 || b->superseded_probability < probability_by_distance)
+            {
+                b->superseded_probability = probability_by_distance;
+            }
+        }
+    }
+}
+
+/*
+    Find every pair again and check the claims match the incremental pass, SUPERSESSION_VERIFY
+    Leaves the incremental results on the heads either way
+*/
+static void verify_supersession(struct OverallState* state, struct closest_snapshot* snapshot, time_t now,
+    int64_t* tip_of)
+{
+    int count = snapshot->count;
+    int n = count > 0 ? count : 1;
+    struct ClosestHead* heads = snapshot->heads;
+
+    int64_t* supersededby = g_new(int64_t, n);
+    float* probability = g_new(float, n);
+    for (int i = 0; i < count; i++)
+    {
+        supersededby[i] = heads[i].supersededby;
+        probability[i] = heads[i].superseded_probability;
+    }
+
+    struct supersession_pair** lists = g_new(struct supersession_pair*, n);
+    int* counts = g_new(int, n);
+    bool* found = g_new(bool, n);
+    long pairs, examined;
+    find_supersession_pairs(state, snapshot, now, FALSE, lists, counts, found, &pairs, &examined);
+    claim_pairs(snapshot, now, lists, counts, tip_of);
+
+    int mismatches = 0;
+    for (int i = 0; i < count; i++)
+    {
+        if (heads[i].supersededby != supersededby[i] || heads[i].superseded_probability != probability[i])
+        {
+            if (mismatches == 0)
             {
-                // // if (a->category == CATEGORY_PHONE && !over)
-                // // {
-                // //     g_debug("%s:%s cannot superceded %s:%s %s%s%s%s%s%s prob %.5f", a_mac, a->name, b_mac, b->name, 
-                // //         allBlips ? "blip " : "",
-                // //         over ? "overlaps " : "",
-                // //         haveDifferentAddressTypes ? "addressTypes " : "",
-                // //         haveDifferentNames ? "names ": "", 
-                // //         haveDifferentCategories ? "categories ":"", 
-                // //         haveDifferentMacAndPublic ? "mac ": "",
-                // //         probability_by_distance);
-                // // }
+                char mac[18];
+                mac_64_to_string(mac, sizeof(mac), heads[i].mac64);
+                g_warning("Supersession verify: %s %s superseded by %li (%.3f) incrementally, %li (%.3f) in full",
+                    mac, heads[i].name, (long)supersededby[i], probability[i],
+                    (long)heads[i].supersededby, heads[i].superseded_probability);
             }
+            mismatches++;
         }
+        heads[i].supersededby = supersededby[i];
+        heads[i].superseded_probability = probability[i];
+        g_free(lists[i]);
+    }
+    if (mismatches > 0)
+    {
+        g_warning("Supersession verify: %i of %i heads differ from a full pass", mismatches, count);
     }
 
+    __atomic_fetch_add(&state->supersession_verified, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&state->supersession_mismatches, mismatches, __ATOMIC_RELAXED);
+
+    g_free(found);
+    g_free(counts);
+    g_free(lists);
+    g_free(probability);
+    g_free(supersededby);
+}
+
+void pack_closest_columns(struct OverallState* state, struct closest_snapshot* snapshot)
+{
+    // Working backwards in time through the array
+    // Push every device back to column zero as category may have changed
+
+    time_t now = time(0);
+    gint64 started = g_get_monotonic_time();
+
+    for (struct ClosestHead* a = closest_snapshot_first(snapshot); a != NULL; a=a->next)
+    {
+        a->debug_supersededby_prior = a->supersededby;
+    }
+
+    struct ClosestHead* heads = snapshot->heads;
+    int count = snapshot->count;
+    int n = count > 0 ? count : 1;
+
+    // Only the latest head of each identity is paired
+    int64_t* tip_of = g_new(int64_t, n);
+    int hidden = find_tips(snapshot, tip_of);
+
+    // Find the pairs again for the heads updated since the last pass, the rest keep theirs
+    struct supersession_pair** lists = g_new(struct supersession_pair*, n);
+    int* counts = g_new(int, n);
+    long pairs, examined;
+    find_supersession_pairs(state, snapshot, now, TRUE, lists, counts, snapshot->recomputed, &pairs, &examined);
+
+    int recomputed = 0;
+    long reused = 0;
+    for (int i = 0; i < count; i++)
+    {
+        if (snapshot->recomputed[i])
+        {
+            // Owned by the snapshot until published
+            g_free(heads[i].pairs);
+            heads[i].pairs = lists[i];
+            heads[i].pair_count = counts[i];
+            recomputed++;
+        }
+        else
+        {
+            lists[i] = heads[i].pairs;
+            counts[i] = heads[i].pair_count;
+            reused += counts[i];
+        }
+    }
+
+    claim_pairs(snapshot, now, lists, counts, tip_of);
+    g_free(counts);
+    g_free(lists);
+
+    if (state->supersession_verify) verify_supersession(state, snapshot, now, tip_of);
+
+    // Link the tips that have claimed the same head for long enough, when the snapshot is published
+    int linked = 0;
+    for (int i = 0; i < count; i++)
+    {
+        struct ClosestHead* b = &heads[i];
+        if (!b->identity_tip) continue;
+        if (b->supersededby == 0)
+        {
+            b->link_passes = 0;
+            continue;
+        }
+
+        if (b->link_candidate == b->supersededby) b->link_passes++;
+        else
+        {
+            b->link_candidate = b->supersededby;
+            b->link_passes = 1;
+        }
+
+        if (state->identity_passes > 0 && b->link_passes >= state->identity_passes)
+        {
+            snapshot->link[i] = true;
+            linked++;
+            b->link_passes = 0;
+        }
+    }
+    g_free(tip_of);
+
+    // Runs on the analysis thread, the main loop reads these for the statistics log
+    __atomic_fetch_add(&state->supersession_pairs, pairs, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&state->supersession_examined, examined, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&state->supersession_recomputed, recomputed, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&state->supersession_reused, reused, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&state->supersession_hidden, hidden, __ATOMIC_RELAXED);
+    g_debug("Supersession: %i of %i heads recomputed (%i behind a tip, %i to link), %li pairs reused, %li of %li pairs examined on %i threads, %.1fms",
+        recomputed, count, hidden, linked, reused, examined, pairs, state->analysis_pool.threads,
+        (g_get_monotonic_time() - started) / 1000.0);
 }
@@ -3,6 +3,13 @@
 
 #include "state.h"
 
+// A later head that a head could supersede and the probability that it is the same device by distance
+struct supersession_pair
+{
+    int64_t b;                  // mac address of B
+    double probability;
+};
+
 /*
     Do these two devices overlap in time? If so they cannot be the same device
     (allowed to touch given granularity of time)
@@ -11,7 +18,8 @@
 
 /*
     Compute the minimum number of devices present by assigning each in a non-overlapping manner to columns
+    Works on the heads in the snapshot, marking those superseded
 */
-void pack_closest_columns(struct OverallState* state);
+void pack_closest_columns(struct OverallState* state, struct closest_snapshot* snapshot);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,84 @@
+/*
+    Hardware cache miss counters for measuring hot paths
+*/
+
+#include "perfcount.h"
+
+#include <glib.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+static int perf_fd = -1;
+
+static uint64_t read_counter()
+{
+    uint64_t value = 0;
+    if (read(perf_fd, &value, sizeof(value)) != sizeof(value)) return 0;
+    return value;
+}
+
+/*
+    Open the cache miss counter for this thread if PERF_COUNTERS is set
+*/
+void perf_count_init()
+{
+    const char* env = getenv("PERF_COUNTERS");
+    if (env == NULL || strcmp(env, "1") != 0) return;
+
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = PERF_COUNT_HW_CACHE_MISSES;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+
+    perf_fd = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+    if (perf_fd < 0)
+    {
+        g_warning("PERF_COUNTERS set but cache miss counter is not available on this system");
+        return;
+    }
+    g_info("PERF_COUNTERS cache miss counter enabled");
+}
+
+/*
+    True if counters are enabled and working
+*/
+bool perf_count_enabled()
+{
+    return perf_fd >= 0;
+}
+
+/*
+    Begin a measured section
+*/
+void perf_count_start(struct perf_count* count)
+{
+    if (perf_fd < 0) return;
+    count->started = read_counter();
+}
+
+/*
+    End a measured section and accumulate
+*/
+void perf_count_stop(struct perf_count* count)
+{
+    if (perf_fd < 0) return;
+    count->misses += read_counter() - count->started;
+    count->calls++;
+}
+
+/*
+    Log average misses per call and reset
+*/
+void perf_count_report(struct perf_count* count)
+{
+    if (perf_fd < 0 || count->calls == 0) return;
+    g_info("PERF %-20s %8li calls %10.1f cache misses per call", count->name, count->calls, (double)count->misses / count->calls);
+    count->calls = 0;
+    count->misses = 0;
+}
@@ -0,0 +1,46 @@
+#ifndef PERFCOUNT_H
+#define PERFCOUNT_H
+/*
+    Hardware cache miss counters for measuring hot paths
+
+    Uses perf_event_open on the calling thread. Off unless PERF_COUNTERS=1 is set in the
+    environment, and silently stays off when the kernel or platform does not allow it.
+*/
+
+#include <stdbool.h>
+#include <stdint.h>
+
+struct perf_count
+{
+    const char* name;    // what is being measured, for logging
+    long calls;          // how many measured sections
+    uint64_t misses;     // total cache misses over all sections
+    uint64_t started;    // counter value at perf_count_start
+};
+
+/*
+    Open the cache miss counter for this thread if PERF_COUNTERS is set
+*/
+void perf_count_init();
+
+/*
+    True if counters are enabled and working
+*/
+bool perf_count_enabled();
+
+/*
+    Begin a measured section
+*/
+void perf_count_start(struct perf_count* count);
+
+/*
+    End a measured section and accumulate
+*/
+void perf_count_stop(struct perf_count* count);
+
+/*
+    Log average misses per call and reset
+*/
+void perf_count_report(struct perf_count* count);
+
+#endif
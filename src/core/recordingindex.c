@@ -0,0 +1,144 @@
+/*
+    Recordings bucketed by their closest access point
+*/
+
+#include "recordingindex.h"
+#include "knn.h"
+
+#include <glib.h>
+#include <string.h>
+
+void recording_index_init(struct recording_index* index)
+{
+    memset(index, 0, sizeof(struct recording_index));
+    recording_matrix_init(&index->matrix);
+}
+
+void recording_index_free(struct recording_index* index)
+{
+    recording_matrix_free(&index->matrix);
+    memset(index->first, 0, sizeof(index->first));
+    memset(index->count, 0, sizeof(index->count));
+}
+
+/*
+    Bucket for a recording: the closest access point it recorded that is not ignored
+*/
+static int bucket_for(const struct recording_matrix* matrix, struct recording* recording)
+{
+    int bucket = N_ACCESS_POINTS;
+    float closest = EFFECTIVE_INFINITE_TEST;
+    for (int c = 0; c < matrix->columns; c++)
+    {
+        int id = matrix->ap_ids[c];
+        if (recording->access_point_distances[id] < closest)
+        {
+            closest = recording->access_point_distances[id];
+            bucket = id;
+        }
+    }
+    return bucket;
+}
+
+/*
+    Bucket the recordings for the access points there are now, nothing is built if probes is 0
+*/
+void recording_index_build(struct recording_index* index, struct recording* recordings, struct AccessPoint* access_points,
+    int probes)
+{
+    recording_index_free(index);
+    index->probes = probes;
+    if (probes <= 0 || recordings == NULL) return;
+
+    // The columns (access points not ignored) are worked out by an empty build
+    recording_matrix_build_rows(&index->matrix, recordings, NULL, 0, access_points);
+
+    int count = 0;
+    for (struct recording* r = recordings; r != NULL; r = r->next) count++;
+    int* buckets = g_new(int, count);
+
+    int row = 0;
+    for (struct recording* r = recordings; r != NULL; r = r->next)
+    {
+        buckets[row] = bucket_for(&index->matrix, r);
+        index->count[buckets[row]]++;
+        row++;
+    }
+
+    // Each bucket starts on a whole lane, the gaps are padding rows
+    int total = 0;
+    for (int b = 0; b < RECORDING_INDEX_BUCKETS; b++)
+    {
+        index->first[b] = total;
+        index->count[b] = (index->count[b] + RECORDING_MATRIX_LANES - 1) / RECORDING_MATRIX_LANES * RECORDING_MATRIX_LANES;
+        total += index->count[b];
+    }
+
+    int next[RECORDING_INDEX_BUCKETS];
+    memcpy(next, index->first, sizeof(next));
+    struct recording** rows = g_new0(struct recording*, total);
+    row = 0;
+    for (struct recording* r = recordings; r != NULL; r = r->next)
+    {
+        rows[next[buckets[row]]++] = r;
+        row++;
+    }
+
+    long builds = index->matrix.builds;
+    recording_matrix_build_rows(&index->matrix, recordings, rows, total, access_points);
+    index->matrix.builds = builds;
+
+    g_free(rows);
+    g_free(buckets);
+}
+
+/*
+    Was the index built from this list with these access points?
+*/
+bool recording_index_usable(const struct recording_index* index, struct recording* recordings, struct AccessPoint* access_points)
+{
+    return index->probes > 0 && recording_matrix_usable(&index->matrix, recordings, access_points);
+}
+
+/*
+    Buckets to score for a device's distances, most likely first, returns how many (0 if it saw nothing)
+*/
+int recording_index_buckets(struct recording_index* index, const float accessdistances[N_ACCESS_POINTS],
+    int buckets[RECORDING_INDEX_BUCKETS])
+{
+    // The probes closest access points the device saw, kept sorted by insertion
+    float distances[RECORDING_INDEX_BUCKETS];
+    int count = 0;
+    int probes = MIN(index->probes, N_ACCESS_POINTS);
+    const struct recording_matrix* matrix = &index->matrix;
+
+    for (int c = 0; c < matrix->columns; c++)
+    {
+        int id = matrix->ap_ids[c];
+        float distance = accessdistances[id];
+        if (!(distance < EFFECTIVE_INFINITE_TEST)) continue;
+        if (count == probes && !(distance < distances[count - 1])) continue;
+
+        int i = count < probes ? count++ : count - 1;
+        for (; i > 0 && distances[i - 1] > distance; i--)
+        {
+            distances[i] = distances[i - 1];
+            buckets[i] = buckets[i - 1];
+        }
+        distances[i] = distance;
+        buckets[i] = id;
+    }
+
+    if (count == 0) return 0;
+
+    // Recordings with nothing recorded could match anything
+    buckets[count++] = N_ACCESS_POINTS;
+
+    long scored = 0;
+    for (int i = 0; i < count; i++) scored += index->count[buckets[i]];
+
+    __atomic_fetch_add(&index->queries, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&index->scored, scored, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&index->skipped, matrix->rows - scored, __ATOMIC_RELAXED);
+    return count;
+}
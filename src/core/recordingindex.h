@@ -0,0 +1,62 @@
+#ifndef RECORDINGINDEX_H
+#define RECORDINGINDEX_H
+/*
+    Recordings bucketed by their closest access point
+
+    Scoring every recording for every device is what k_nearest costs on a large site: a recording
+    made in one building has no chance of matching a device in another, yet gets scored anyway.
+    The scores are not a distance (missing access points count for and against) so the usual
+    metric trees do not apply, but a close match needs the device to be close to the access points
+    the recording was close to. So each recording goes in a bucket for the access point it was
+    closest to, and a device only has the buckets of its nearest few access points scored.
+
+    probes is the recall / speed knob (KNN_PROBES): the number of the device's nearest access
+    points whose buckets are scored, more finds more of the best matches, 0 (the default) turns the
+    index off and every recording is scored. Recordings with no access point recorded are always
+    scored.
+
+    The buckets are kept as one recording_matrix with the rows grouped by bucket, each bucket
+    padded to whole lanes, so a bucket is scored the same way as the full matrix.
+
+    Read only once built apart from the statistics.
+*/
+
+#include "recordingmatrix.h"
+
+#define RECORDING_INDEX_BUCKETS (N_ACCESS_POINTS + 1)      // one per access point id and one for none recorded
+
+struct recording_index
+{
+    int probes;
+    struct recording_matrix matrix;     // rows grouped by bucket
+    int first[RECORDING_INDEX_BUCKETS]; // first row of each bucket
+    int count[RECORDING_INDEX_BUCKETS]; // rows in each bucket, padding included
+
+    // Statistics, updated from analysis threads
+    long queries;
+    long scored;                        // rows scored
+    long skipped;                       // rows not scored
+};
+
+void recording_index_init(struct recording_index* index);
+
+/*
+    Bucket the recordings for the access points there are now, nothing is built if probes is 0
+*/
+void recording_index_build(struct recording_index* index, struct recording* recordings, struct AccessPoint* access_points,
+    int probes);
+
+void recording_index_free(struct recording_index* index);
+
+/*
+    Was the index built from this list with these access points?
+*/
+bool recording_index_usable(const struct recording_index* index, struct recording* recordings, struct AccessPoint* access_points);
+
+/*
+    Buckets to score for a device's distances, most likely first, returns how many (0 if it saw nothing)
+*/
+int recording_index_buckets(struct recording_index* index, const float accessdistances[N_ACCESS_POINTS],
+    int buckets[RECORDING_INDEX_BUCKETS]);
+
+#endif
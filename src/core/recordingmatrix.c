@@ -0,0 +1,387 @@
+/*
+    Recordings laid out for scoring in bulk
+*/
+
+#include "recordingmatrix.h"
+#include "knn.h"
+#include "utility.h"
+
+#include <glib.h>
+#include <math.h>
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define RECORDING_MATRIX_AVX2 1
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+// Coefficients of 2^f on [-0.5, 0.5], good to a few parts in a million
+#define EXP2_C1 0.6931472f
+#define EXP2_C2 0.2402265f
+#define EXP2_C3 0.05550411f
+#define EXP2_C4 0.009618129f
+#define EXP2_C5 0.001333355f
+#define LOG2_E 1.442695f
+
+void recording_matrix_init(struct recording_matrix* matrix)
+{
+    memset(matrix, 0, sizeof(struct recording_matrix));
+}
+
+void recording_matrix_free(struct recording_matrix* matrix)
+{
+    g_free(matrix->row_recordings);
+    g_free(matrix->distances);
+    g_free(matrix->missed);
+    long builds = matrix->builds;
+    recording_matrix_init(matrix);
+    matrix->builds = builds;
+}
+
+/*
+    Cell for a row and column: each lane group of rows has every column in turn so a run of rows
+    however short is read in order
+*/
+static inline size_t cell_of(const struct recording_matrix* matrix, int column, int row)
+{
+    return ((size_t)(row / RECORDING_MATRIX_LANES) * matrix->columns + column) * RECORDING_MATRIX_LANES + row % RECORDING_MATRIX_LANES;
+}
+
+static bool is_ignored(struct AccessPoint* ap)
+{
+    return strcmp(ap->client_id, "ignore") == 0 || strcmp(ap->short_client_id, "ignore") == 0;
+}
+
+/*
+    Lay out recordings in a given row order, NULL rows are padding, for the index
+*/
+void recording_matrix_build_rows(struct recording_matrix* matrix, struct recording* recordings, struct recording** rows,
+    int row_count, struct AccessPoint* access_points)
+{
+    recording_matrix_free(matrix);
+    matrix->builds++;
+
+    matrix->recordings = recordings;
+    for (struct AccessPoint* ap = access_points; ap != NULL; ap = ap->next)
+    {
+        matrix->access_point_count++;
+        if (!is_ignored(ap)) matrix->ap_ids[matrix->columns++] = ap->id;
+    }
+
+    matrix->rows = row_count;
+    matrix->stride = (matrix->rows + RECORDING_MATRIX_BLOCK - 1) / RECORDING_MATRIX_BLOCK * RECORDING_MATRIX_BLOCK;
+
+    size_t cells = (size_t)matrix->columns * matrix->stride;
+    matrix->row_recordings = g_new(struct recording*, matrix->rows);
+    // No rows (the index finding its columns, or no recordings) leaves both NULL
+    if (matrix->rows > 0) memcpy(matrix->row_recordings, rows, matrix->rows * sizeof(struct recording*));
+    matrix->distances = g_new(float, cells);
+    matrix->missed = g_new(float, cells);
+
+    for (int c = 0; c < matrix->columns; c++)
+    {
+        int id = matrix->ap_ids[c];
+        for (int row = 0; row < matrix->stride; row++)
+        {
+            struct recording* r = row < matrix->rows ? rows[row] : NULL;
+            float recording_distance = r != NULL ? r->access_point_distances[id] : EFFECTIVE_INFINITE;
+            size_t cell = cell_of(matrix, c, row);
+            matrix->distances[cell] = recording_distance;
+            // As get_probability: below 1m no chance we missed it, at 5m a fair chance, by 10m certain
+            matrix->missed[cell] = 1.0 / (1 + exp(5 - recording_distance) / 3);
+        }
+    }
+}
+
+/*
+    Lay out a list of recordings for the access points there are now
+*/
+void recording_matrix_build(struct recording_matrix* matrix, struct recording* recordings, struct AccessPoint* access_points)
+{
+    int count = 0;
+    for (struct recording* r = recordings; r != NULL; r = r->next) count++;
+
+    struct recording** rows = g_new(struct recording*, count);
+    int row = 0;
+    for (struct recording* r = recordings; r != NULL; r = r->next) rows[row++] = r;
+
+    recording_matrix_build_rows(matrix, recordings, rows, count, access_points);
+    g_free(rows);
+}
+
+/*
+    Was the matrix built from this list with these access points? If not score one by one
+*/
+bool recording_matrix_usable(const struct recording_matrix* matrix, struct recording* recordings, struct AccessPoint* access_points)
+{
+    if (matrix->recordings == NULL || matrix->recordings != recordings) return false;
+
+    // A single access point is scored on distance alone by get_probability
+    if (access_points == NULL || access_points->next == NULL) return false;
+
+    int count = 0;
+    for (struct AccessPoint* ap = access_points; ap != NULL; ap = ap->next) count++;
+    return count == matrix->access_point_count;
+}
+
+void recording_matrix_query(const struct recording_matrix* matrix, const float accessdistances[N_ACCESS_POINTS],
+    struct recording_query* query)
+{
+    for (int c = 0; c < matrix->columns; c++)
+    {
+        float measured_distance = accessdistances[matrix->ap_ids[c]];
+        query->distance[c] = measured_distance;
+        query->measured[c] = measured_distance < EFFECTIVE_INFINITE_TEST;
+        // Seen by the device but not in the recording, less telling the further away it was seen
+        float p_missed_due_to_distance = 2.0 - 2.0 / (1 + exp(-measured_distance / 5));
+        query->not_expected[c] = 1 - p_missed_due_to_distance;
+    }
+}
+
+/*
+    e^x for x in about -87..87 from 2^n scaled 2^f
+*/
+static inline float fast_exp(float x)
+{
+    float t = fminf(fmaxf(x, -87.0f), 87.0f) * LOG2_E;
+    float n = floorf(t + 0.5f);
+    float f = t - n;
+    float p = 1.0f + f * (EXP2_C1 + f * (EXP2_C2 + f * (EXP2_C3 + f * (EXP2_C4 + f * EXP2_C5))));
+    union { float f; int32_t i; } scale = { .i = ((int32_t)n + 127) << 23 };
+    return p * scale.f;
+}
+
+/*
+    One recording at a time, also the reference the vector kernels follow
+*/
+static void score_scalar(const struct recording_matrix* matrix, const struct recording_query* query, int first, int count,
+    float* probability_is, float* probability_isnt)
+{
+    for (int i = 0; i < count; i++)
+    {
+        // probability_is is the OR of every positive: 1 - product of (1 - p)
+        float not_is = 1.0f;
+        float not_isnt = 1.0f;
+        for (int c = 0; c < matrix->columns; c++)
+        {
+            size_t cell = cell_of(matrix, c, first + i);
+            float recording_distance = matrix->distances[cell];
+            bool recorded = recording_distance < EFFECTIVE_INFINITE_TEST;
+            float measured_distance = query->distance[c];
+
+            if (!query->measured[c])
+            {
+                if (recorded) not_isnt *= matrix->missed[cell];
+                else not_is *= 0.95f;
+            }
+            else if (!recorded)
+            {
+                not_isnt *= query->not_expected[c];
+            }
+            else
+            {
+                float error = fabsf(measured_distance - recording_distance);
+                float p_close_match = 1.0f / (1.0f + fast_exp(error - 4.0f));
+                float min_dist = fmaxf(1.0f, fminf(measured_distance, recording_distance) * 0.5f);
+                not_is *= 1.0f - p_close_match / min_dist;
+            }
+        }
+        probability_is[i] = 1.0f - not_is;
+        probability_isnt[i] = 1.0f - not_isnt;
+    }
+}
+
+#if defined(RECORDING_MATRIX_AVX2)
+
+#define AVX2_TARGET __attribute__((target("avx2,fma")))
+
+static inline AVX2_TARGET __m256 fast_exp8(__m256 x)
+{
+    __m256 t = _mm256_mul_ps(_mm256_min_ps(_mm256_max_ps(x, _mm256_set1_ps(-87.0f)), _mm256_set1_ps(87.0f)), _mm256_set1_ps(LOG2_E));
+    __m256 n = _mm256_floor_ps(_mm256_add_ps(t, _mm256_set1_ps(0.5f)));
+    __m256 f = _mm256_sub_ps(t, n);
+    __m256 p = _mm256_fmadd_ps(f, _mm256_set1_ps(EXP2_C5), _mm256_set1_ps(EXP2_C4));
+    p = _mm256_fmadd_ps(f, p, _mm256_set1_ps(EXP2_C3));
+    p = _mm256_fmadd_ps(f, p, _mm256_set1_ps(EXP2_C2));
+    p = _mm256_fmadd_ps(f, p, _mm256_set1_ps(EXP2_C1));
+    p = _mm256_fmadd_ps(f, p, _mm256_set1_ps(1.0f));
+    __m256i scale = _mm256_slli_epi32(_mm256_add_epi32(_mm256_cvtps_epi32(n), _mm256_set1_epi32(127)), 23);
+    return _mm256_mul_ps(p, _mm256_castsi256_ps(scale));
+}
+
+/*
+    Eight recordings at a time
+*/
+static AVX2_TARGET void score_avx2(const struct recording_matrix* matrix, const struct recording_query* query, int first, int count,
+    float* probability_is, float* probability_isnt)
+{
+    const __m256 one = _mm256_set1_ps(1.0f);
+    const __m256 infinite = _mm256_set1_ps(EFFECTIVE_INFINITE_TEST);
+
+    for (int i = 0; i < count; i += 8)
+    {
+        __m256 not_is = one;
+        __m256 not_isnt = one;
+        const float* distances = matrix->distances + cell_of(matrix, 0, first + i);
+        const float* missed_row = matrix->missed + cell_of(matrix, 0, first + i);
+        for (int c = 0; c < matrix->columns; c++)
+        {
+            size_t cell = (size_t)c * RECORDING_MATRIX_LANES;
+            __m256 recording_distance = _mm256_loadu_ps(distances + cell);
+            __m256 unrecorded = _mm256_cmp_ps(recording_distance, infinite, _CMP_GE_OQ);
+
+            if (!query->measured[c])
+            {
+                __m256 missed = _mm256_loadu_ps(missed_row + cell);
+                not_isnt = _mm256_mul_ps(not_isnt, _mm256_blendv_ps(missed, one, unrecorded));
+                not_is = _mm256_mul_ps(not_is, _mm256_blendv_ps(one, _mm256_set1_ps(0.95f), unrecorded));
+            }
+            else
+            {
+                __m256 measured_distance = _mm256_set1_ps(query->distance[c]);
+                not_isnt = _mm256_mul_ps(not_isnt, _mm256_blendv_ps(one, _mm256_set1_ps(query->not_expected[c]), unrecorded));
+
+                __m256 difference = _mm256_sub_ps(measured_distance, recording_distance);
+                __m256 error = _mm256_andnot_ps(_mm256_set1_ps(-0.0f), difference);
+                __m256 p_close_match = _mm256_div_ps(one, _mm256_add_ps(one, fast_exp8(_mm256_sub_ps(error, _mm256_set1_ps(4.0f)))));
+                __m256 min_dist = _mm256_max_ps(one, _mm256_mul_ps(_mm256_min_ps(measured_distance, recording_distance), _mm256_set1_ps(0.5f)));
+                __m256 factor = _mm256_sub_ps(one, _mm256_div_ps(p_close_match, min_dist));
+                not_is = _mm256_mul_ps(not_is, _mm256_blendv_ps(factor, one, unrecorded));
+            }
+        }
+        _mm256_storeu_ps(probability_is + i, _mm256_sub_ps(one, not_is));
+        _mm256_storeu_ps(probability_isnt + i, _mm256_sub_ps(one, not_isnt));
+    }
+}
+
+#elif defined(__ARM_NEON)
+
+/*
+    1 / x from the estimate and two Newton steps, ARMv7 has no divide
+*/
+static inline float32x4_t reciprocal4(float32x4_t x)
+{
+    float32x4_t r = vrecpeq_f32(x);
+    r = vmulq_f32(r, vrecpsq_f32(x, r));
+    return vmulq_f32(r, vrecpsq_f32(x, r));
+}
+
+static inline float32x4_t fast_exp4(float32x4_t x)
+{
+    float32x4_t t = vmulq_f32(vminq_f32(vmaxq_f32(x, vdupq_n_f32(-87.0f)), vdupq_n_f32(87.0f)), vdupq_n_f32(LOG2_E));
+    // Conversion truncates so round from the positive side
+    int32x4_t n = vsubq_s32(vcvtq_s32_f32(vaddq_f32(t, vdupq_n_f32(128.5f))), vdupq_n_s32(128));
+    float32x4_t f = vsubq_f32(t, vcvtq_f32_s32(n));
+    float32x4_t p = vmlaq_f32(vdupq_n_f32(EXP2_C4), f, vdupq_n_f32(EXP2_C5));
+    p = vmlaq_f32(vdupq_n_f32(EXP2_C3), f, p);
+    p = vmlaq_f32(vdupq_n_f32(EXP2_C2), f, p);
+    p = vmlaq_f32(vdupq_n_f32(EXP2_C1), f, p);
+    p = vmlaq_f32(vdupq_n_f32(1.0f), f, p);
+    int32x4_t scale = vshlq_n_s32(vaddq_s32(n, vdupq_n_s32(127)), 23);
+    return vmulq_f32(p, vreinterpretq_f32_s32(scale));
+}
+
+/*
+    Four recordings at a time
+*/
+static void score_neon(const struct recording_matrix* matrix, const struct recording_query* query, int first, int count,
+    float* probability_is, float* probability_isnt)
+{
+    const float32x4_t one = vdupq_n_f32(1.0f);
+    const float32x4_t infinite = vdupq_n_f32(EFFECTIVE_INFINITE_TEST);
+
+    for (int i = 0; i < count; i += 4)
+    {
+        float32x4_t not_is = one;
+        float32x4_t not_isnt = one;
+        const float* distances = matrix->distances + cell_of(matrix, 0, first + i);
+        const float* missed_row = matrix->missed + cell_of(matrix, 0, first + i);
+        for (int c = 0; c < matrix->columns; c++)
+        {
+            size_t cell = (size_t)c * RECORDING_MATRIX_LANES;
+            float32x4_t recording_distance = vld1q_f32(distances + cell);
+            uint32x4_t unrecorded = vcgeq_f32(recording_distance, infinite);
+
+            if (!query->measured[c])
+            {
+                float32x4_t missed = vld1q_f32(missed_row + cell);
+                not_isnt = vmulq_f32(not_isnt, vbslq_f32(unrecorded, one, missed));
+                not_is = vmulq_f32(not_is, vbslq_f32(unrecorded, vdupq_n_f32(0.95f), one));
+            }
+            else
+            {
+                float32x4_t measured_distance = vdupq_n_f32(query->distance[c]);
+                not_isnt = vmulq_f32(not_isnt, vbslq_f32(unrecorded, vdupq_n_f32(query->not_expected[c]), one));
+
+                float32x4_t error = vabdq_f32(measured_distance, recording_distance);
+                float32x4_t p_close_match = reciprocal4(vaddq_f32(one, fast_exp4(vsubq_f32(error, vdupq_n_f32(4.0f)))));
+                float32x4_t min_dist = vmaxq_f32(one, vmulq_f32(vminq_f32(measured_distance, recording_distance), vdupq_n_f32(0.5f)));
+                float32x4_t factor = vsubq_f32(one, vmulq_f32(p_close_match, reciprocal4(min_dist)));
+                not_is = vmulq_f32(not_is, vbslq_f32(unrecorded, one, factor));
+            }
+        }
+        vst1q_f32(probability_is + i, vsubq_f32(one, not_is));
+        vst1q_f32(probability_isnt + i, vsubq_f32(one, not_isnt));
+    }
+}
+
+#endif
+
+#if defined(RECORDING_MATRIX_AVX2)
+static bool has_avx2(void)
+{
+    static int supported = -1;
+    if (supported < 0) supported = __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+    return supported;
+}
+#endif
+
+/*
+    Score count rows (up to RECORDING_MATRIX_BLOCK) starting at first, both multiples of RECORDING_MATRIX_LANES,
+    same as get_probability on each recording to within the fast exp, results for padding rows are meaningless
+*/
+void recording_matrix_score(const struct recording_matrix* matrix, const struct recording_query* query, int first, int count,
+    float probability_is[RECORDING_MATRIX_BLOCK], float probability_isnt[RECORDING_MATRIX_BLOCK])
+{
+    g_assert(first % RECORDING_MATRIX_LANES == 0 && count % RECORDING_MATRIX_LANES == 0);
+    g_assert(count <= RECORDING_MATRIX_BLOCK && first + count <= matrix->stride);
+#if defined(RECORDING_MATRIX_AVX2)
+    if (has_avx2())
+    {
+        score_avx2(matrix, query, first, count, probability_is, probability_isnt);
+        return;
+    }
+#elif defined(__ARM_NEON)
+    score_neon(matrix, query, first, count, probability_is, probability_isnt);
+    return;
+#endif
+    score_scalar(matrix, query, first, count, probability_is, probability_isnt);
+}
+
+/*
+    Same with the scalar kernel whatever the CPU has, to check the vector kernels against
+*/
+void recording_matrix_score_scalar(const struct recording_matrix* matrix, const struct recording_query* query, int first, int count,
+    float probability_is[RECORDING_MATRIX_BLOCK], float probability_isnt[RECORDING_MATRIX_BLOCK])
+{
+    g_assert(first % RECORDING_MATRIX_LANES == 0 && count % RECORDING_MATRIX_LANES == 0);
+    g_assert(count <= RECORDING_MATRIX_BLOCK && first + count <= matrix->stride);
+    score_scalar(matrix, query, first, count, probability_is, probability_isnt);
+}
+
+/*
+    Name of the kernel in use, for the log
+*/
+const char* recording_matrix_kernel(void)
+{
+#if defined(RECORDING_MATRIX_AVX2)
+    return has_avx2() ? "AVX2" : "scalar";
+#elif defined(__ARM_NEON)
+    return "NEON";
+#else
+    return "scalar";
+#endif
+}
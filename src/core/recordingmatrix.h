@@ -0,0 +1,100 @@
+#ifndef RECORDINGMATRIX_H
+#define RECORDINGMATRIX_H
+/*
+    Recordings laid out for scoring in bulk
+
+    k_nearest scores every recording against a device's distances, for every device on every
+    pass, while the recordings themselves only change when the files do. So whenever the recording
+    store relinks the list it also lays it out as a matrix: one column per access point that is not
+    ignored (resolved here once, not with two strcmp per access point per recording), each column
+    holding that access point's distance in every recording in list order. Scoring then does the
+    same few operations down a column several recordings at a time (AVX2 or NEON where the CPU
+    has it) with a fast exp in place of the libm one. The columns are stored a lane group of
+    recordings at a time (every column for recordings 0-7, then 8-15, ...) so short runs of
+    recordings, as the index scores, are read as one stretch of memory.
+
+    The chance an access point was missed by the device only depends on the recorded distance so
+    that is worked out once here too and kept alongside each distance.
+
+    Read only once built so any number of analysis threads can score against it.
+*/
+
+#include "device.h"
+#include <stdbool.h>
+
+struct recording;
+struct AccessPoint;
+
+// Rows scored per call at most, callers keep results for this many on the stack
+#define RECORDING_MATRIX_BLOCK 256
+// Rows scored together, ranges start and end on a multiple of this
+#define RECORDING_MATRIX_LANES 8
+
+struct recording_matrix
+{
+    struct recording* recordings;       // list the matrix was built from, NULL if none
+    int access_point_count;             // access points when built, ignored ones included
+    int rows;
+    int stride;                         // rows padded to a whole block
+    int columns;                        // access points not ignored
+    int ap_ids[N_ACCESS_POINTS];        // access point id of each column
+    struct recording** row_recordings;  // recording for each row, NULL for padding
+    float* distances;                   // stride x columns by lane group, EFFECTIVE_INFINITE in padding
+    float* missed;                      // stride x columns by lane group, chance the device missed the access point
+
+    // Statistics
+    long builds;
+};
+
+/*
+    Per device values for scoring, made once per k_nearest call
+*/
+struct recording_query
+{
+    float distance[N_ACCESS_POINTS];    // measured distance for each column
+    float not_expected[N_ACCESS_POINTS];// factor when the recording lacks a measured access point
+    bool measured[N_ACCESS_POINTS];
+};
+
+void recording_matrix_init(struct recording_matrix* matrix);
+
+/*
+    Lay out a list of recordings for the access points there are now
+*/
+void recording_matrix_build(struct recording_matrix* matrix, struct recording* recordings, struct AccessPoint* access_points);
+
+/*
+    Lay out recordings in a given row order, NULL rows are padding, for the index
+*/
+void recording_matrix_build_rows(struct recording_matrix* matrix, struct recording* recordings, struct recording** rows,
+    int row_count, struct AccessPoint* access_points);
+
+void recording_matrix_free(struct recording_matrix* matrix);
+
+/*
+    Was the matrix built from this list with these access points? If not score one by one
+*/
+bool recording_matrix_usable(const struct recording_matrix* matrix, struct recording* recordings, struct AccessPoint* access_points);
+
+void recording_matrix_query(const struct recording_matrix* matrix, const float accessdistances[N_ACCESS_POINTS],
+    struct recording_query* query);
+
+/*
+    Score count rows (up to RECORDING_MATRIX_BLOCK) starting at first, both multiples of RECORDING_MATRIX_LANES,
+    same as get_probability on each recording to within the fast exp, results for padding rows are meaningless
+*/
+void recording_matrix_score(const struct recording_matrix* matrix, const struct recording_query* query, int first, int count,
+    float probability_is[RECORDING_MATRIX_BLOCK], float probability_isnt[RECORDING_MATRIX_BLOCK]);
+
+/*
+    Same with the scalar kernel whatever the CPU has, to check the vector kernels against
+*/
+void recording_matrix_score_scalar(const struct recording_matrix* matrix, const struct recording_query* query, int first, int count,
+    float probability_is[RECORDING_MATRIX_BLOCK], float probability_isnt[RECORDING_MATRIX_BLOCK]);
+
+/*
+    Name of the kernel in use, for the log
+*/
+const char* recording_matrix_kernel(void);
+
+#endif
@@ -0,0 +1,412 @@
+/*
+    Recordings kept in memory between passes
+*/
+
+#include "recordingstore.h"
+#include "state.h"
+#include "knn.h"
+#include "rooms.h"
+#include "utility.h"
+
+#include <glib.h>
+#include <errno.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+
+#define DEFAULT_RECORDINGS 4
+
+#define WATCH_EVENTS (IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_DELETE | IN_CREATE | IN_MODIFY | IN_DELETE_SELF)
+
+/*
+    (Re)start the inotify watches, falls back to checking every pass if that fails
+*/
+static void watch_directories(struct recording_store* store)
+{
+    if (store->inotify_fd >= 0) close(store->inotify_fd);
+
+    store->inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (store->inotify_fd < 0)
+    {
+        g_warning("Could not watch recordings directories (%s), checking them every pass", strerror(errno));
+        return;
+    }
+
+    for (int d = 0; d < 2; d++)
+    {
+        store->watches[d] = inotify_add_watch(store->inotify_fd, store->directories[d], WATCH_EVENTS);
+        if (store->watches[d] < 0)
+        {
+            g_warning("Could not watch '%s' (%s), checking it every pass", store->directories[d], strerror(errno));
+            close(store->inotify_fd);
+            store->inotify_fd = -1;
+            return;
+        }
+    }
+}
+
+/*
+    Read any pending inotify events, true if a directory changed
+*/
+static bool drain_events(struct recording_store* store)
+{
+    bool changed = false;
+    bool lost = false;
+    char buffer[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+
+    for (;;)
+    {
+        ssize_t length = read(store->inotify_fd, buffer, sizeof(buffer));
+        if (length <= 0) break;  // EAGAIN, nothing more for now
+
+        for (char* p = buffer; p < buffer + length; )
+        {
+            struct inotify_event* event = (struct inotify_event*)p;
+            // Overflowed, or the directory itself went away: rescan and watch again
+            if (event->mask & (IN_Q_OVERFLOW | IN_IGNORED | IN_DELETE_SELF)) lost = true;
+            changed = true;
+            p += sizeof(struct inotify_event) + event->len;
+        }
+    }
+
+    if (lost)
+    {
+        for (int d = 0; d < 2; d++) ensure_directory(store->directories[d]);
+        watch_directories(store);
+    }
+    return changed;
+}
+
+static void free_recordings(struct recording_file* file)
+{
+    // The last recording is linked on to the next file's so go by count
+    struct recording* r = file->recordings;
+    for (int i = 0; i < file->count; i++)
+    {
+        struct recording* next = r->next;
+        free(r);
+        r = next;
+    }
+    file->recordings = NULL;
+    file->last = NULL;
+    file->count = 0;
+}
+
+static void free_file(struct recording_file* file)
+{
+    free_recordings(file);
+    compiled_recordings_close(&file->compiled);
+    g_free(file->path);
+    g_free(file);
+}
+
+/*
+    Column holding the access point's distances under one of its names, -1 if none
+*/
+static int find_column(const struct compiled_recordings* compiled, const char* name)
+{
+    if (name == NULL) return -1;
+    for (uint32_t c = 0; c < compiled->header->column_count; c++)
+    {
+        if (strcmp(compiled_recordings_string(compiled, compiled->names[c]), name) == 0) return c;
+    }
+    return -1;
+}
+
+/*
+    Add a recording for each row of a compiled file to the front of recordings, using the access points known now
+*/
+static void expand_compiled(const struct compiled_recordings* compiled, struct OverallState* state, bool confirmed,
+    struct recording** recordings)
+{
+    const struct compiled_recordings_header* header = compiled->header;
+
+    // Files may use the long, short or alternate name for an access point, preferred in that order line by line
+    int columns[N_ACCESS_POINTS][3];
+    for (int i = 0; i < N_ACCESS_POINTS; i++) columns[i][0] = columns[i][1] = columns[i][2] = -1;
+    for (struct AccessPoint* ap = state->access_points; ap != NULL; ap = ap->next)
+    {
+        columns[ap->id][0] = find_column(compiled, ap->client_id);
+        columns[ap->id][1] = find_column(compiled, ap->short_client_id);
+        columns[ap->id][2] = find_column(compiled, ap->alternate_name);
+    }
+
+    struct patch** patches = g_new(struct patch*, header->patch_count);
+    for (uint32_t i = 0; i < header->patch_count; i++)
+    {
+        const struct compiled_patch* p = &compiled->patches[i];
+        patches[i] = get_or_create_patch(compiled_recordings_string(compiled, p->name), compiled_recordings_string(compiled, p->room),
+            compiled_recordings_string(compiled, p->group), compiled_recordings_string(compiled, p->tags),
+            &state->patches, &state->groups, &state->place_ids, confirmed);
+    }
+
+    // Rows with none of the access points seen yet are kept all at infinity, as parsing the JSONL does
+    for (uint32_t row = 0; row < header->row_count; row++)
+    {
+        const float* distances = compiled->matrix + (size_t)row * header->column_count;
+
+        struct recording* ralloc = malloc(sizeof(struct recording));
+        ralloc->confirmed = confirmed;
+        ralloc->patch = patches[compiled->rows[row]];
+        for (int i = 0; i < N_ACCESS_POINTS; i++)
+        {
+            float distance = NAN;
+            for (int n = 0; n < 3 && isnan(distance); n++)
+            {
+                if (columns[i][n] >= 0) distance = distances[columns[i][n]];
+            }
+            ralloc->access_point_distances[i] = isnan(distance) ? EFFECTIVE_INFINITE : distance;
+        }
+        ralloc->next = *recordings;
+        *recordings = ralloc;
+    }
+
+    g_free(patches);
+}
+
+/*
+    Parse a file again into its own list of recordings, a compiled file is mapped again only if it changed
+*/
+static void read_file(struct recording_store* store, struct OverallState* state, struct recording_file* file,
+    const char* directory, const char* filename, bool changed)
+{
+    free_recordings(file);
+
+    struct recording* recordings = NULL;
+    if (!file->is_compiled)
+    {
+        read_observations_file(directory, filename, state, file->confirmed, &recordings);
+    }
+    else
+    {
+        if (changed)
+        {
+            compiled_recordings_close(&file->compiled);
+            compiled_recordings_open(&file->compiled, file->path);
+        }
+        if (file->compiled.map != NULL)
+        {
+            expand_compiled(&file->compiled, state, file->confirmed, &recordings);
+        }
+    }
+
+    file->recordings = recordings;
+    for (struct recording* r = recordings; r != NULL; r = r->next)
+    {
+        file->last = r;
+        file->count++;
+    }
+    store->files_read++;
+}
+
+/*
+    Recordings for the standard patches, used when no recordings have been made for the site yet
+*/
+static struct recording* create_defaults(struct OverallState* state)
+{
+    static const struct { const char* patch; const char* room; const char* tags; float distance; } defaults[DEFAULT_RECORDINGS] =
+    {
+        { "Close", "4m", "group=inside", 2.0 },
+        { "Near", "7m", "group=inside", 5.0 },          // 3.5m
+        { "Far", "9m", "group=outside", 9.0 },          // 7m
+        { "Distant", "Far", "group=outside", 12.0 },    // 10.5m
+    };
+
+    char* local_id = state->local->client_id; // Used as group_id
+
+    // Last created first as they used to be added to the front of the list
+    struct recording* recordings = g_new(struct recording, DEFAULT_RECORDINGS);
+    for (int i = 0; i < DEFAULT_RECORDINGS; i++)
+    {
+        struct recording* ralloc = &recordings[DEFAULT_RECORDINGS - 1 - i];
+        ralloc->confirmed = TRUE;
+        ralloc->patch = get_or_create_patch(defaults[i].patch, defaults[i].room, local_id, defaults[i].tags,
+            &state->patches, &state->groups, &state->place_ids, TRUE);
+        for (int ap = 0; ap < N_ACCESS_POINTS; ap++) ralloc->access_point_distances[ap] = EFFECTIVE_INFINITE;
+        ralloc->access_point_distances[0] = defaults[i].distance;
+        ralloc->next = i > 0 ? &recordings[DEFAULT_RECORDINGS - i] : NULL;
+    }
+    return recordings;
+}
+
+/*
+    Link every file's recordings into state->recordings in the order they used to be read:
+    each file's recordings go in front of those from the files before it
+*/
+static void link_recordings(struct recording_store* store, struct OverallState* state)
+{
+    struct recording* recordings = NULL;
+    store->confirmed_count = 0;
+    store->total_count = 0;
+    store->compiled_count = 0;
+
+    for (struct recording_file* file = store->files; file != NULL; file = file->next)
+    {
+        if (file->compiled.map != NULL) store->compiled_count++;
+        if (file->count == 0) continue;
+        file->last->next = recordings;
+        recordings = file->recordings;
+        if (file->confirmed) store->confirmed_count += file->count;
+        store->total_count += file->count;
+    }
+
+    if (store->confirmed_count == 0)
+    {
+        if (store->defaults == NULL) store->defaults = create_defaults(state);
+        store->defaults[DEFAULT_RECORDINGS - 1].next = recordings;
+        recordings = store->defaults;
+    }
+
+    state->recordings = recordings;
+    recording_matrix_build(&store->matrix, recordings, state->access_points);
+    recording_index_build(&store->index, recordings, state->access_points, state->knn_probes);
+}
+
+/*
+    Create the directories if need be and start watching them, nothing is read until the first refresh
+*/
+void recording_store_init(struct recording_store* store, const char* recordings_directory, const char* beacons_directory)
+{
+    store->directories[0] = g_strdup(recordings_directory);
+    store->directories[1] = g_strdup(beacons_directory);
+    for (int d = 0; d < 2; d++) ensure_directory(store->directories[d]);
+
+    store->inotify_fd = -1;
+    watch_directories(store);
+
+    store->changed = true;
+    store->access_points = 0;
+    store->files = NULL;
+    store->defaults = NULL;
+    recording_matrix_init(&store->matrix);
+    recording_index_init(&store->index);
+    store->confirmed_count = 0;
+    store->total_count = 0;
+    store->compiled_count = 0;
+    store->scans = 0;
+    store->files_read = 0;
+}
+
+/*
+    Bring state->recordings up to date with the files, returns true if anything changed
+*/
+bool recording_store_refresh(struct recording_store* store, struct OverallState* state)
+{
+    if (store->inotify_fd < 0) store->changed = true;
+    else if (drain_events(store)) store->changed = true;
+
+    // Recordings only have distances for the access points known when they were parsed
+    int access_points = 0;
+    for (struct AccessPoint* ap = state->access_points; ap != NULL; ap = ap->next) access_points++;
+    bool reparse = access_points != store->access_points;
+    store->access_points = access_points;
+
+    if (!store->changed && !reparse) return false;
+    store->changed = false;
+    store->scans++;
+
+    // Go through the directories in order, keeping the files in the order they were found
+    bool modified = false;
+    struct recording_file* files = NULL;
+    struct recording_file** tail = &files;
+
+    for (int d = 0; d < 2; d++)
+    {
+        const char* directory = store->directories[d];
+        ensure_directory(directory);
+        GDir* dir = g_dir_open(directory, 0, NULL);
+        if (dir == NULL)
+        {
+            g_warning("Failed to read recordings in '%s'", directory);
+            continue;
+        }
+
+        const gchar* filename;
+        while ((filename = g_dir_read_name(dir)))
+        {
+            bool is_compiled = string_ends_with(filename, COMPILED_RECORDINGS_EXTENSION);
+            if (!is_compiled && !string_ends_with(filename, ".jsonl")) continue;
+
+            char fullpath[128];
+            g_snprintf(fullpath, sizeof(fullpath), "%s/%s", directory, filename);
+
+            struct stat info;
+            if (stat(fullpath, &info) != 0) continue;
+
+            struct recording_file** previous = &store->files;
+            while (*previous != NULL && strcmp((*previous)->path, fullpath) != 0) previous = &(*previous)->next;
+            struct recording_file* file = *previous;
+
+            if (file != NULL)
+            {
+                // Unlink it from the old order, anything but the first left there means the order changed
+                if (previous != &store->files) modified = true;
+                *previous = file->next;
+            }
+            else
+            {
+                file = g_new0(struct recording_file, 1);
+                file->path = g_strdup(fullpath);
+                file->confirmed = d == 0;
+                file->is_compiled = is_compiled;
+            }
+
+            bool unchanged = file->inode == info.st_ino && file->size == info.st_size &&
+                file->mtime.tv_sec == info.st_mtim.tv_sec && file->mtime.tv_nsec == info.st_mtim.tv_nsec;
+            if (!unchanged || reparse)
+            {
+                file->inode = info.st_ino;
+                file->size = info.st_size;
+                file->mtime = info.st_mtim;
+                read_file(store, state, file, directory, filename, !unchanged);
+                modified = true;
+            }
+
+            file->next = NULL;
+            *tail = file;
+            tail = &file->next;
+        }
+        g_dir_close(dir);
+    }
+
+    // Anything left was not found again
+    while (store->files != NULL)
+    {
+        struct recording_file* gone = store->files;
+        store->files = gone->next;
+        free_file(gone);
+        modified = true;
+    }
+    store->files = files;
+
+    // Without inotify every pass gets here, the list and the matrix are only rebuilt when they would differ
+    if (modified || reparse || state->recordings == NULL) link_recordings(store, state);
+    return modified;
+}
+
+/*
+    Stop watching and free every recording
+*/
+void recording_store_free(struct recording_store* store)
+{
+    if (store->inotify_fd >= 0) close(store->inotify_fd);
+    store->inotify_fd = -1;
+
+    while (store->files != NULL)
+    {
+        struct recording_file* file = store->files;
+        store->files = file->next;
+        free_file(file);
+    }
+
+    g_free(store->defaults);
+    store->defaults = NULL;
+    recording_matrix_free(&store->matrix);
+    recording_index_free(&store->index);
+
+    g_free(store->directories[0]);
+    g_free(store->directories[1]);
+}
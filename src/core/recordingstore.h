@@ -0,0 +1,84 @@
+#ifndef RECORDINGSTORE_H
+#define RECORDINGSTORE_H
+/*
+    Recordings kept in memory between passes
+
+    The recordings (confirmed, in /var/sniffer/recordings) and beacons (unconfirmed, in
+    /var/sniffer/beacons) directories are parsed into state->recordings once and then only
+    looked at again when something in them changes. An inotify watch on each directory says
+    when, and each file's modification time, size and inode say which files need reading again;
+    the rest keep the recordings they have. Without inotify the directories are listed and each
+    file checked on every pass instead, which is still no reading of file contents.
+
+    Compiled recordings files (see compiledrecordings.h) in either directory are mapped rather
+    than parsed and are layered in the same way as the JSONL files.
+
+    Recordings only have distances for access points known when the file was parsed, so every
+    file is parsed again when a new access point shows up (compiled files are expanded again
+    from the mapping they already have).
+
+    Main loop only.
+*/
+
+#include "compiledrecordings.h"
+#include "recordingindex.h"
+#include "recordingmatrix.h"
+#include <stdbool.h>
+#include <sys/types.h>
+#include <time.h>
+
+struct OverallState;
+struct recording;
+
+struct recording_file
+{
+    char* path;
+    bool confirmed;                     // from the recordings directory rather than beacons
+    bool is_compiled;                   // mapped into compiled rather than parsed
+    struct compiled_recordings compiled;
+    struct timespec mtime;
+    off_t size;
+    ino_t inode;
+    struct recording* recordings;       // this file's recordings, last in the file first
+    struct recording* last;             // linked on to the next file's when the list is built
+    int count;
+    struct recording_file* next;
+};
+
+struct recording_store
+{
+    char* directories[2];               // recordings then beacons, in the order they are layered
+    int inotify_fd;                     // -1 when checking every pass instead
+    int watches[2];
+    bool changed;                       // a directory changed since the last scan
+    int access_points;                  // access points known when the files were parsed
+    struct recording_file* files;       // in scan order
+    struct recording* defaults;         // array used when there are no confirmed recordings
+    struct recording_matrix matrix;     // state->recordings laid out for k_nearest, rebuilt with the list
+    struct recording_index index;       // and bucketed by closest access point, unless KNN_PROBES is 0
+
+    int confirmed_count;
+    int total_count;
+    int compiled_count;                 // files mapped
+
+    // Statistics
+    long scans;                         // directory listings
+    long files_read;                    // files parsed
+};
+
+/*
+    Create the directories if need be and start watching them, nothing is read until the first refresh
+*/
+void recording_store_init(struct recording_store* store, const char* recordings_directory, const char* beacons_directory);
+
+/*
+    Bring state->recordings up to date with the files, returns true if anything changed
+*/
+bool recording_store_refresh(struct recording_store* store, struct OverallState* state);
+
+/*
+    Stop watching and free every recording
+*/
+void recording_store_free(struct recording_store* store);
+
+#endif
@@ -55,7 +55,7 @@ char* access_point_to_json (struct AccessPoint* a)
 /*
 *  Send minimal access point information and minimal device information over mesh
 */
-char* device_to_json (struct AccessPoint* a, struct Device* device)
+char* device_to_json (struct AccessPoint* a, struct Device* device, const struct device_hot* hot)
 {
     char *string = NULL;
     cJSON *j = cJSON_CreateObject();
@@ -89,12 +89,12 @@ char* device_to_json (struct AccessPoint* a, struct Device* device)
 //    cJSON_AddNumberToObject(j, CJ_UUIDS_HASH, device->uuid_hash);
 //    cJSON_AddNumberToObject(j, CJ_TXPOWER, device->txpower);
     cJSON_AddNumberToObject(j, CJ_LAST_SENT, device->last_sent);
-    cJSON_AddRounded3(j, CJ_DISTANCE, device->distance);
+    cJSON_AddRounded3(j, CJ_DISTANCE, hot->distance);
     cJSON_AddNumberToObject(j, CJ_EARLIEST, device->earliest);
     cJSON_AddNumberToObject(j, CJ_LATEST, device->latest_local);
     cJSON_AddNumberToObject(j, CJ_COUNT, device->count);  // integer
     cJSON_AddRounded3(j, CJ_FILTERED_RSSI, device->filtered_rssi.current_estimate);
-    cJSON_AddNumberToObject(j, CJ_RAW_RSSI, device->raw_rssi);  // integer
+    cJSON_AddNumberToObject(j, CJ_RAW_RSSI, hot->raw_rssi);  // integer
     cJSON_AddNumberToObject(j, CJ_TRY_CONNECT_STATE, device->try_connect_state);
     cJSON_AddNumberToObject(j, CJ_NAME_TYPE, device->name_type);
     cJSON_AddNumberToObject(j, CJ_ADDRESS_TYPE, device->address_type);
@@ -114,7 +114,7 @@ char* device_to_json (struct AccessPoint* a, struct Device* device)
 
 
 
-struct AccessPoint* device_from_json(const char* json, struct OverallState* state, struct Device* device)
+struct AccessPoint* device_from_json(const char* json, struct OverallState* state, struct Device* device, struct device_hot* hot)
 {
     cJSON *djson = cJSON_Parse(json);
 
@@ -295,13 +295,13 @@ struct AccessPoint* device_from_json(const char* json, struct OverallState* stat
     {
         // TODO: Full date time serialization and deserialization
         device->latest_local = latestj->valueint;
-        device->latest_any = latestj->valueint;
+        hot->latest_any = latestj->valueint;
     }
 
     cJSON *distance = cJSON_GetObjectItemCaseSensitive(djson, CJ_DISTANCE);
     if (cJSON_IsNumber(distance))
     {
-        device->distance = (float)distance->valuedouble;
+        hot->distance = (float)distance->valuedouble;
     }
 
     cJSON *filtered_rssi = cJSON_GetObjectItemCaseSensitive(djson, CJ_FILTERED_RSSI);
@@ -314,7 +314,7 @@ struct AccessPoint* device_from_json(const char* json, struct OverallState* stat
     cJSON *raw_rssi = cJSON_GetObjectItemCaseSensitive(djson, CJ_RAW_RSSI);
     if (cJSON_IsNumber(raw_rssi))
     {
-        device->raw_rssi = (float)raw_rssi->valuedouble;
+        hot->raw_rssi = (int16_t)raw_rssi->valuedouble;
     }
 
     cJSON *countj = cJSON_GetObjectItemCaseSensitive(djson, CJ_COUNT);
@@ -5,11 +5,11 @@
 #include "utility.h"
 #include "../model/accesspoints.h"
 
-char *device_to_json(struct AccessPoint *a, struct Device *device);
+char *device_to_json(struct AccessPoint *a, struct Device *device, const struct device_hot *hot);
 
 char *access_point_to_json(struct AccessPoint *a);
 
-struct AccessPoint* device_from_json(const char* json, struct OverallState* state, struct Device* device);
+struct AccessPoint* device_from_json(const char* json, struct OverallState* state, struct Device* device, struct device_hot* hot);
 
 
 #endif
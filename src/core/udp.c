@@ -25,6 +25,8 @@
 
 #define MAXLINE 1024
 
+#define MESH_MESSAGE_SIZE 2048
+
 void udp_send(int port, const char *message, int message_length)
 {
     if (port == 0) return; // not configured
@@ -71,6 +73,119 @@ void udp_send(int port, const char *message, int message_length)
 static GCancellable *cancellable;
 static pthread_t listen_thread;
 
+/*
+    A datagram as received by the listener thread, waiting for the main loop
+*/
+struct mesh_message
+{
+    time_t received;            // to compare against time sent to check clock-sync
+    char buffer[MESH_MESSAGE_SIZE];
+};
+
+/*
+    Apply one mesh datagram to the local state, main loop only
+*/
+static void handle_mesh_message(struct OverallState *state, char *buffer, time_t now)
+{
+    struct Device d = {0}; //  universal zero initializer
+    struct device_hot hot = {0};
+    strncpy(d.mac, "notset", 7);  // access point only messages have no device mac address
+    d.mac64 = 0;
+
+    // ESP32 sensor don't have RTC, we need to do all the work for them
+    hot.latest_any = now;
+    d.latest_local = now;
+    d.earliest = now;
+
+    struct AccessPoint* ap = device_from_json(buffer, state, &d, &hot);
+
+    if (ap != NULL)
+    {
+        // ignore messages from self
+        if (strcmp(ap->client_id, state->local->client_id) == 0)
+        {
+            //g_debug("Ignoring message from self %s : %s\n", dummy.client_id, d.mac);
+            return;
+        }
+
+        if (d.mac64 == 0)
+        {
+            //g_info("Ignoring access point only message from %s", ap->client_id);
+            return;
+        }
+
+        // First stomp on any bad names coming in over UDP, e.g. ESP32 devices that don't know better
+        if (d.name_type < nt_known)
+        {
+            for (struct Beacon* b = state->beacons; b != NULL; b = b->next)
+            {
+                if ((strcmp(b->name, d.name) == 0 || b->mac64 == d.mac64))
+                {
+                    g_utf8_strncpy(d.name, b->alias, NAME_LENGTH);
+                    d.name_type = nt_alias;
+                    break;
+                }
+            }
+        }
+
+        // Find matching local devices and merge in any data it doesn't have
+
+        struct Device* local = device_store_find(&state->devices, d.mac64);
+        if (local != NULL)
+        {
+            int delta_time = difftime(now, d.latest_local);
+
+            merge(local, &d, ap->client_id, ap);
+            device_store_touch(&state->devices, local);
+
+            // Only trust their last seen time when our clocks agree
+            if (delta_time == 0) device_store_seen(&state->devices, local, hot.latest_any);
+
+            // This is a current observation, time should match
+
+            // If the delta time between our clock and theirs is > 0, log it
+            if (delta_time < 0)
+            {
+                // This is problematic, they are ahead of us
+                g_warning("%s '%s' %s dist=%.2fm time=%is", d.mac, d.name, ap->client_id, hot.distance, delta_time);
+            }
+        }
+
+        // Update the closest data structure
+
+        //g_debug("UDP: %s %s count=%i ap=%s %s %.1fm", d.mac, d.name, d.count, actual->client_id, dummy.client_id, hot.distance);
+        add_closest(state, d.mac64, ap, d.earliest, d.latest_local, hot.distance, d.category,
+            d.known_interval,
+            d.count, d.name, 
+            d.name_type, d.address_type,
+            d.is_training_beacon);
+    }
+    else
+    {
+        g_warning("Did not find ap in %s", buffer);
+    }
+}
+
+/*
+    Apply up to max queued mesh datagrams, main loop only, returns how many were applied
+*/
+int drain_mesh_queue(struct OverallState *state, int max)
+{
+    if (state->mesh_queue.capacity == 0) return 0;  // no listener
+
+    static struct mesh_message message;
+    int n = 0;
+    while (n < max && mpsc_queue_pop(&state->mesh_queue, &message))
+    {
+        handle_mesh_message(state, message.buffer, message.received);
+        n++;
+    }
+    return n;
+}
+
+/*
+    Listener thread, receives datagrams and queues them for the main loop, never touches state
+*/
 void *listen_loop(void *param)
 {
     struct OverallState *state = (struct OverallState *)param;
@@ -92,12 +207,14 @@ void *listen_loop(void *param)
 
     if (!is_any_interface_up()) g_warning("LT: No interface to listen on");
 
+    static struct mesh_message message;
+
     while (!g_cancellable_is_cancelled(cancellable))
     {
-        char buffer[2048];
+        char *buffer = message.buffer;
         buffer[0] = '\0';
-        int bytes_read = g_socket_receive_from(broadcast_socket, NULL, buffer, sizeof(buffer), cancellable, &error);
-        if (bytes_read < 50 || bytes_read == sizeof(buffer))
+        int bytes_read = g_socket_receive_from(broadcast_socket, NULL, buffer, sizeof(message.buffer), cancellable, &error);
+        if (bytes_read < 50 || bytes_read == sizeof(message.buffer))
         {
             //g_print("Received bytes on listen thread %i < %i\n", bytes_read, 10);
             continue; // not enough to be a device message
@@ -107,88 +224,12 @@ void *listen_loop(void *param)
         buffer[bytes_read] = '\0';
 
         // Record time received to compare against time sent to check clock-sync
-        time_t now;
-        time(&now);
+        time(&message.received);
 
-        struct Device d = {0}; //  universal zero initializer
-        strncpy(d.mac, "notset", 7);  // access point only messages have no device mac address
-        d.mac64 = 0;
-        
-        // ESP32 sensor don't have RTC, we need to do all the work for them
-        time(&d.latest_any);
-        time(&d.latest_local);
-        time(&d.earliest);
-
-        struct AccessPoint* ap = device_from_json(buffer, state, &d);
-
-        if (ap != NULL)
-        {
-            // ignore messages from self
-            if (strcmp(ap->client_id, state->local->client_id) == 0)
-            {
-                //g_debug("Ignoring message from self %s : %s\n", dummy.client_id, d.mac);
-                continue;
-            }
-
-            if (d.mac64 == 0)
-            {
-                //g_info("Ignoring access point only message from %s", ap->client_id);
-                continue;
-            }
-
-            // First stomp on any bad names coming in over UDP, e.g. ESP32 devices that don't know better
-            if (d.name_type < nt_known)
-            {
-                for (struct Beacon* b = state->beacons; b != NULL; b = b->next)
-                {
-                    if ((strcmp(b->name, d.name) == 0 || b->mac64 == d.mac64))
-                    {
-                        g_utf8_strncpy(d.name, b->alias, NAME_LENGTH);
-                        d.name_type = nt_alias;
-                        break;
-                    }
-                }
-            }
-
-            pthread_mutex_lock(&state->lock);
-
-            // Find matching local devices and merge in any data it doesn't have
-
-            for (int i = 0; i < state->n; i++)
-            {
-                if (d.mac64 == state->devices[i].mac64)
-                {
-                    int delta_time = difftime(now, d.latest_local);
-
-                    merge(&state->devices[i], &d, ap->client_id, delta_time == 0, ap);
-
-                    // This is a current observation, time should match
-
-                    // If the delta time between our clock and theirs is > 0, log it
-                    if (delta_time < 0)
-                    {
-                        // This is problematic, they are ahead of us
-                        g_warning("%s '%s' %s dist=%.2fm time=%is", d.mac, d.name, ap->client_id, d.distance, delta_time);
-                    }
-
-                    break;
-                }
-            }
-
-            // Update the closest data structure
-
-            //g_debug("UDP: %s %s count=%i ap=%s %s %.1fm", d.mac, d.name, d.count, actual->client_id, dummy.client_id, d.distance);
-            add_closest(state, d.mac64, ap, d.earliest, d.latest_local, d.distance, d.category,
-                d.known_interval,
-                d.count, d.name, 
-                d.name_type, d.address_type,
-                d.is_training_beacon);
-
-            pthread_mutex_unlock(&state->lock);
-        }
-        else
+        // Full means the main loop is behind, the datagram is dropped and counted
+        if (mpsc_queue_push(&state->mesh_queue, &message))
         {
-            g_warning("Did not find ap in %s", buffer);
+            ingest_wake(state);
         }
     }
     g_info("LT: Listen thread finished");
@@ -209,6 +250,7 @@ GCancellable *create_socket_service(struct OverallState *state)
     }
 
     g_info("Creating UDP listener on port %i", state->udp_mesh_port);
+    mpsc_queue_init(&state->mesh_queue, state->mesh_queue_capacity, sizeof(struct mesh_message));
  
     if (pthread_create(&listen_thread, NULL, listen_loop, state))
     {
@@ -230,7 +272,8 @@ void send_device_udp(struct OverallState *state, struct Device *device)
 {
     //printf("    Send UDP %i device %s '%s'\n", PORT, device->mac, device->name);
     state->local->sequence++;
-    char *json = device_to_json(state->local, device);
+    struct device_hot hot = device_store_hot(&state->devices, device);
+    char *json = device_to_json(state->local, device, &hot);
     //printf("    %s\n", json);
     udp_send(state->udp_mesh_port, json, strlen(json) + 1);
     free(json);
@@ -245,7 +288,7 @@ void update_closest(struct OverallState *state, struct Device *device)
     //g_debug("update_closest(%s, %i, %s)", state->local->client_id, state->local->id, device->mac);
     // Add local observations into the same structure
     int64_t id_64 = mac_string_to_int_64(device->mac);
-    add_closest(state, id_64, state->local, device->earliest, device->latest_local, device->distance, 
+    add_closest(state, id_64, state->local, device->earliest, device->latest_local, state->devices.distance[device->slot], 
         device->category, 
         device->known_interval, 
         device->count, 
@@ -254,6 +297,66 @@ void update_closest(struct OverallState *state, struct Device *device)
         device->is_training_beacon);
 }
 
+/*
+    End of a coalescing window, update and send every device that changed during it
+*/
+static gboolean flush_device_sends(void *parameters)
+{
+    struct OverallState *state = (struct OverallState *)parameters;
+
+    for (int i = 0; i < state->pending_count; i++)
+    {
+        // Device may have expired or been evicted since it was queued
+        struct Device *device = device_store_resolve(&state->devices, state->pending[i]);
+        if (device == NULL) continue;
+        device->send_pending = FALSE;
+        update_closest(state, device);
+        send_device_udp(state, device);
+        state->sends_made++;
+    }
+    state->pending_count = 0;
+    state->pending_timer = FALSE;
+
+    return FALSE;   // one shot, next change schedules it again
+}
+
+/*
+    Update closest and broadcast a device after a change, merging changes within the window
+    Takes a handle as the send may go out after the device has expired or been evicted
+*/
+void queue_device_send(struct OverallState *state, struct device_handle handle)
+{
+    struct Device *device = device_store_resolve(&state->devices, handle);
+    if (device == NULL) return;
+
+    state->sends_requested++;
+
+    if (state->coalesce_ms <= 0)
+    {
+        update_closest(state, device);
+        send_device_udp(state, device);
+        state->sends_made++;
+        return;
+    }
+
+    // Already going out at the end of this window with the latest values
+    if (device->send_pending) return;
+
+    if (state->pending_count == state->pending_capacity)
+    {
+        state->pending_capacity = state->pending_capacity == 0 ? 64 : state->pending_capacity * 2;
+        state->pending = g_realloc(state->pending, state->pending_capacity * sizeof(struct device_handle));
+    }
+    state->pending[state->pending_count++] = handle;
+    device->send_pending = TRUE;
+
+    if (!state->pending_timer)
+    {
+        state->pending_timer = TRUE;
+        g_timeout_add(state->coalesce_ms, flush_device_sends, state);
+    }
+}
+
 /*
     Send access point over UDP broadcast to all other access points
 */
@@ -12,6 +12,11 @@ void udp_send(int port, const char* message, int message_length);
 
 GCancellable* create_socket_service (struct OverallState* state);
 
+/*
+*    Apply up to max datagrams queued by the listener thread, main loop only
+*/
+int drain_mesh_queue(struct OverallState* state, int max);
+
 void close_socket_service();
 
 /*
@@ -24,6 +29,12 @@ void send_device_udp(struct OverallState* state, struct Device* device);
 */
 void update_closest(struct OverallState* state, struct Device* device); 
 
+/*
+*    Update closest and broadcast a device after a change, merging changes that
+*    arrive within state->coalesce_ms into one update and one send (main loop only)
+*/
+void queue_device_send(struct OverallState* state, struct device_handle device);
+
 /*
 *  Send update with access point information
 */
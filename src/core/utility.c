@@ -483,55 +483,45 @@ bool is_any_interface_up()
 
 
 /*
-   free summary linked list
+   Clear count summaries, growing the array only when there are more ids than before
 */
-void free_summary(struct summary** head)
+void summaries_reset(struct summaries* summaries, int count)
 {
-   struct summary* tmp;
-
-   while (*head != NULL)
+    if (count > summaries->capacity)
     {
-       tmp = *head;
-       *head = (*head)->next;
-       free(tmp);
+        summaries->capacity = MAX(count, summaries->capacity * 2);
+        summaries->items = g_renew(struct summary, summaries->items, summaries->capacity);
     }
+    summaries->count = count;
+    memset(summaries->items, 0, count * sizeof(struct summary));
 }
 
 /*
-   update_summary linked list
+   free the summaries array
 */
-void update_summary(struct summary** summary, const char* category, const char* extra, double phone_value, double tablet_value, double computer_value, double watch_value, double wearable_value, 
-    double beacon_value, double covid_value, double other_value)
+void summaries_free(struct summaries* summaries)
 {
-    for (struct summary* s = *summary; s != NULL; s = s->next)
-    {
-        if (strcmp(s->category, category) == 0)
-        {
-            s->phone_total += phone_value;
-            s->tablet_total += tablet_value;
-            s->computer_total += computer_value;
-            s->watch_total += watch_value;
-            s->wearable_total += wearable_value;
-            s->beacon_total += beacon_value;
-            s->covid_total += covid_value;
-            s->other_total += other_value;
-            return;
-        }
-    }
+    g_free(summaries->items);
+    summaries->items = NULL;
+    summaries->count = 0;
+    summaries->capacity = 0;
+}
 
-    struct summary* s = malloc(sizeof(struct summary));
-    s->category = category;
-    s->extra = extra;
-    s->phone_total = phone_value;
-    s->tablet_total = tablet_value;
-    s->computer_total = computer_value;
-    s->watch_total = watch_value;
-    s->wearable_total = wearable_value;
-    s->beacon_total = beacon_value;
-    s->covid_total = covid_value;
-    s->other_total = other_value;
-    s->next = *summary;
-    *summary = s;
+/*
+   Add counts to a summary
+*/
+void update_summary(struct summary* s, double phone_value, double tablet_value, double computer_value, double watch_value, double wearable_value, 
+    double beacon_value, double covid_value, double other_value)
+{
+    s->present = true;
+    s->phone_total += phone_value;
+    s->tablet_total += tablet_value;
+    s->computer_total += computer_value;
+    s->watch_total += watch_value;
+    s->wearable_total += wearable_value;
+    s->beacon_total += beacon_value;
+    s->covid_total += covid_value;
+    s->other_total += other_value;
 }
 
 /*
@@ -103,12 +103,12 @@ void soft_set_category(int8_t* field, int8_t field_new);
 
 void soft_set_u16(uint16_t* field, uint16_t field_new);
 
-// A summary list
+// A summary of one room or group
 struct summary
 {
     const char* category;
     const char* extra;          // extra object
-    struct summary* next;
+    bool present;               // anything was added, entries for ids nothing was added to are skipped
     double phone_total;         // how many phones
     double tablet_total;        // how many tablet
     double computer_total;      // how many computers
@@ -119,15 +119,28 @@ struct summary
     double other_total;         // how many other
 };
 
+// Summaries indexed by room or group id, kept between passes so summarizing allocates nothing
+struct summaries
+{
+    struct summary* items;
+    int count;
+    int capacity;
+};
+
+/*
+   Clear count summaries, growing the array only when there are more ids than before
+*/
+void summaries_reset(struct summaries* summaries, int count);
+
 /*
-   free summary linked list
+   free the summaries array
 */
-void free_summary(struct summary** head);
+void summaries_free(struct summaries* summaries);
 
 /*
-   update_summary linked list
+   Add counts to a summary
 */
-void update_summary(struct summary** summary, const char* category, const char* extra, double phone_value, double tablet_value, double computer_value,
+void update_summary(struct summary* s, double phone_value, double tablet_value, double computer_value,
    double watch_value, double wearable_value, double beacon_value, double covid_value, double other_value);
 
 /*
@@ -0,0 +1,134 @@
+/*
+    Fixed pool of worker threads for the analysis pass
+*/
+
+#include "workpool.h"
+
+#include <glib.h>
+
+struct worker_start
+{
+    struct work_pool* pool;
+    int worker;
+};
+
+static void* worker_loop(void* parameter)
+{
+    struct worker_start* start = parameter;
+    struct work_pool* pool = start->pool;
+    int worker = start->worker;
+    g_free(start);
+
+    long seen = 0;
+    pthread_mutex_lock(&pool->lock);
+    for (;;)
+    {
+        while (!pool->stopping && pool->generation == seen)
+        {
+            pthread_cond_wait(&pool->start, &pool->lock);
+        }
+        if (pool->stopping) break;
+        seen = pool->generation;
+
+        work_pool_job job = pool->job;
+        void* context = pool->context;
+        pthread_mutex_unlock(&pool->lock);
+
+        job(context, worker);
+
+        pthread_mutex_lock(&pool->lock);
+        if (--pool->running == 0) pthread_cond_signal(&pool->finished);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+/*
+    Start a pool of threads workers, counting the calling thread
+*/
+void work_pool_init(struct work_pool* pool, int threads)
+{
+    pool->threads = threads < 1 ? 1 : threads;
+    pool->workers = NULL;
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->start, NULL);
+    pthread_cond_init(&pool->finished, NULL);
+    pool->job = NULL;
+    pool->context = NULL;
+    pool->generation = 0;
+    pool->running = 0;
+    pool->stopping = false;
+    pool->jobs = 0;
+
+    if (pool->threads == 1) return;
+
+    pool->workers = g_new(pthread_t, pool->threads - 1);
+    for (int i = 1; i < pool->threads; i++)
+    {
+        struct worker_start* start = g_new(struct worker_start, 1);
+        start->pool = pool;
+        start->worker = i;
+        if (pthread_create(&pool->workers[i - 1], NULL, worker_loop, start))
+        {
+            // Carry on with the threads we have
+            g_warning("Could not start analysis worker %i, using %i threads", i, i);
+            g_free(start);
+            pool->threads = i;
+            break;
+        }
+    }
+}
+
+/*
+    Run job on every thread in the pool and wait for all of them to finish, one caller at a time
+*/
+void work_pool_run(struct work_pool* pool, work_pool_job job, void* context)
+{
+    pool->jobs++;
+    if (pool->threads == 1)
+    {
+        job(context, 0);
+        return;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    pool->job = job;
+    pool->context = context;
+    pool->running = pool->threads - 1;
+    pool->generation++;
+    pthread_cond_broadcast(&pool->start);
+    pthread_mutex_unlock(&pool->lock);
+
+    job(context, 0);
+
+    pthread_mutex_lock(&pool->lock);
+    while (pool->running > 0)
+    {
+        pthread_cond_wait(&pool->finished, &pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+}
+
+/*
+    Stop and join the workers
+*/
+void work_pool_free(struct work_pool* pool)
+{
+    if (pool->workers != NULL)
+    {
+        pthread_mutex_lock(&pool->lock);
+        pool->stopping = true;
+        pthread_cond_broadcast(&pool->start);
+        pthread_mutex_unlock(&pool->lock);
+
+        for (int i = 1; i < pool->threads; i++)
+        {
+            pthread_join(pool->workers[i - 1], NULL);
+        }
+        g_free(pool->workers);
+        pool->workers = NULL;
+    }
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->start);
+    pthread_cond_destroy(&pool->finished);
+}
@@ -0,0 +1,51 @@
+#ifndef WORKPOOL_H
+#define WORKPOOL_H
+/*
+    Fixed pool of worker threads for the analysis pass
+
+    work_pool_run hands one job to every worker and runs it on the calling thread as well,
+    returning once all of them have finished it. The job function is called once per thread
+    with the thread's worker number (0 is the caller) and divides the work up itself, usually
+    by taking batches from a shared atomic counter. Workers sleep between jobs.
+
+    A pool of one thread has no workers and simply runs the job on the caller.
+*/
+
+#include <pthread.h>
+#include <stdbool.h>
+
+typedef void (*work_pool_job)(void* context, int worker);
+
+struct work_pool
+{
+    int threads;                // including the calling thread
+    pthread_t* workers;
+    pthread_mutex_t lock;
+    pthread_cond_t start;       // a new job or stopping
+    pthread_cond_t finished;    // last worker finished the job
+    work_pool_job job;
+    void* context;
+    long generation;            // bumped for each job
+    int running;                // workers still on the current job
+    bool stopping;
+
+    // Statistics
+    long jobs;
+};
+
+/*
+    Start a pool of threads workers, counting the calling thread
+*/
+void work_pool_init(struct work_pool* pool, int threads);
+
+/*
+    Run job on every thread in the pool and wait for all of them to finish, one caller at a time
+*/
+void work_pool_run(struct work_pool* pool, work_pool_job job, void* context);
+
+/*
+    Stop and join the workers
+*/
+void work_pool_free(struct work_pool* pool);
+
+#endif
@@ -108,8 +108,8 @@ void print_min_distance_matrix(struct OverallState* state)
     {
         if (ahead->category != CATEGORY_PHONE && ahead->category != CATEGORY_COVID) continue;
 
-        for (struct ClosestTo* a = ahead->closest; a != NULL; a = a->next)
-        for (struct ClosestTo* b = ahead->closest; b != NULL; b = b->next)
+        for (struct ClosestTo* a = ahead->closest; a < ahead->closest + closest_count(ahead); a++)
+        for (struct ClosestTo* b = ahead->closest; b < ahead->closest + closest_count(ahead); b++)
         {
             if (a->access_point->id == b->access_point->id) continue;  // same ap
 
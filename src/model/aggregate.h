@@ -9,26 +9,26 @@
 #include "device.h"
 
 
+/*
+*  Observation of a device from one access point, held in the head's dense array
+*/
 struct ClosestTo
 {
    // Which access point
    struct AccessPoint* access_point;
-   // How far from the access point was it
-   float distance;
    // Earliest for this mac on this access point
    time_t earliest;
    // Latest for this mac on this access point
    time_t latest;
+   // How far from the access point was it
+   float distance;
    // count from access point
    int count;
-
-   // second sweep pass
-   bool mark_pass_2;
-
-   // next in chain of same mac address
-   struct ClosestTo* next;
 };
 
+// Observation arrays come in capacities of 1, 2, 4, ... N_ACCESS_POINTS
+#define CLOSEST_SIZE_CLASSES 6
+
 
 /*
 * Short linked list of recent patches for a device
@@ -68,9 +68,16 @@ struct ClosestHead
     // address type is public or random
     int8_t addressType; // 0, 1, 2
 
-    // Pointer to first item, chain along each observation
-    // also maintained in most recent first order
+    // One observation per access point, ordered by access point id, with a bit set in
+    // ap_mask for each access point id present (so observation i is the i-th set bit)
     struct ClosestTo* closest;
+    uint32_t ap_mask;
+
+    // Slots allocated in closest, a power of two
+    int8_t closest_capacity;
+
+    // Access point id of the most recently updated observation
+    int8_t latest_ap;
 
     // Superseded by another: i.e. access_id has seen this mac address
     // in a column more recently than this one that it superseeds
@@ -82,6 +89,20 @@ struct ClosestHead
     // Max probabiity that it was superseded even if didn't mark it as such
     float superseded_probability;
 
+    // Updated since the last supersession pass
+    bool dirty;
+
+    // Later heads this one could supersede, kept from the last pass it was dirty for
+    struct supersession_pair* pairs;
+    int pair_count;
+
+    // Latest head of its identity (see identity.h) at the last pass, only tips are paired
+    bool identity_tip;
+
+    // Head that has claimed this one on consecutive passes, linked as one identity after enough
+    int64_t link_candidate;
+    int link_passes;
+
     // the most likely patch for this device
     struct patch* patch;
 
@@ -91,8 +112,44 @@ struct ClosestHead
     // linked list of recent rooms
     struct RecentRoom* recent_rooms; 
 
-    // next closest head in chain
+    // next and previous closest head in chain, most recent first
     struct ClosestHead* next;
+    struct ClosestHead* prev;
 };
 
+/*
+*  Number of observations on a head
+*/
+static inline int closest_count(const struct ClosestHead* head)
+{
+    return __builtin_popcount(head->ap_mask);
+}
+
+/*
+*  Observation for an access point id, NULL if there is none
+*/
+static inline struct ClosestTo* closest_for(const struct ClosestHead* head, int ap_id)
+{
+    if ((unsigned)ap_id >= N_ACCESS_POINTS || !(head->ap_mask & (1u << ap_id))) return NULL;
+    return &head->closest[__builtin_popcount(head->ap_mask & ((1u << ap_id) - 1))];
+}
+
+/*
+*  Most recently updated observation
+*/
+static inline struct ClosestTo* closest_latest(const struct ClosestHead* head)
+{
+    return closest_for(head, head->latest_ap);
+}
+
+/*
+*  Size class for an observation array holding n
+*/
+static inline int closest_size_class(int n)
+{
+    int size_class = 0;
+    while ((1 << size_class) < n) size_class++;
+    return size_class;
+}
+
 #endif
\ No newline at end of file
@@ -40,7 +40,7 @@ char* category_from_int(uint8_t i)
 /*
    merge
 */
-void merge(struct Device* local, struct Device* remote, char* access_name, bool safe, struct AccessPoint* ap)
+void merge(struct Device* local, struct Device* remote, char* access_name, struct AccessPoint* ap)
 {
     local->is_training_beacon = local->is_training_beacon || remote->is_training_beacon;
 
@@ -95,16 +95,6 @@ void merge(struct Device* local, struct Device* remote, char* access_name, bool
     if (remote->known_interval > local->known_interval) local->known_interval = remote->known_interval;
 
     // TODO: Other fields that we can transfer over
-
-    if (safe)  // i.e. difference between our clock and theirs was zero
-    {
-        if (remote->latest_any > local->latest_any)
-        {
-            //g_debug("Bumping %s '%s' by %.1fs from %s", local->mac, local->name, difftime(remote->latest, local->latest), access_name);
-            local->latest_any = remote->latest_any;
-        }
-    }
-
 }
 
 
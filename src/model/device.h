@@ -15,7 +15,7 @@ typedef uint16_t u_int16_t;
 typedef uint32_t u_int32_t;
 typedef uint64_t u_int64_t;
 
-// Max allowed devices on this sensor
+// Default max devices on this sensor, DEVICE_CAPACITY overrides it at runtime
 #define N 2048
 
 // How many closest mac addresses to track
@@ -98,21 +98,43 @@ enum ap_class {
   ap_class_gateway_node = 3
 };
 
+/*
+   Fields every advertisement writes and expiry reads. A device in the device store keeps these
+   in the store's hot table, arrays by slot; a device read from a mesh message carries them here.
+*/
+struct device_hot
+{
+   time_t latest_any;             // Latest time seen by ANY sensor, used to keep alive
+   float distance;                // Filtered by Kalman filter on RSSI
+   int16_t raw_rssi;              // RSSI last measurement
+};
+
 /*
    Structure for tracking BLE devices in range
+   latest_any, distance and raw_rssi are in the device store's hot table (see struct device_hot)
 */
 struct Device
 {
+   // Warm: touched on every advertisement, kept together at the front
+   int64_t mac64;                 // mac address (moving off string)
+   time_t latest_local;           // Latest time seen by this sensor, used to calculate overlap
+   time_t last_rssi;              // last time an RSSI was received. If gap > 0.5 hour, ignore initial point (dead letter post)
+   time_t last_sent;
+   int count;                     // Count how many times seen
    int id;
+   int slot;                      // slot in the device store
+   int8_t category;    // Reasoned guess at what kind of device it is
    bool hidden;            // not seen by this access point (yet)
-   uint8_t ttl;            // time to live count down during removal process
+   bool send_pending;      // waiting for the coalescing window to close
+   int8_t address_type; // 0, 1, 2
+   struct Kalman filtered_rssi;   // RSSI Kalman filter
+   struct Kalman kalman_interval; // Tracks time between RSSI events in order to detect large gaps
+
+   // Cold: metadata that changes rarely
    char mac[18];           // mac address string
-   int64_t mac64;          // mac address (moving off string)
    char name[NAME_LENGTH];
    enum name_type name_type;      // not set, heuristic, known, or alias
    char alias[NAME_LENGTH];
-   int8_t address_type; // 0, 1, 2
-   int8_t category;    // Reasoned guess at what kind of device it is
    bool paired;
    bool bonded;
    bool connected;
@@ -124,16 +146,7 @@ struct Device
    int uuids_length;
    int uuid_hash;                 // Hash value of all UUIDs - may ditinguish devices
    int txpower;                   // TX Power
-   time_t last_rssi;              // last time an RSSI was received. If gap > 0.5 hour, ignore initial point (dead letter post)
-   struct Kalman filtered_rssi;   // RSSI Kalman filter
-   int raw_rssi;                  // RSSI last measurement
-   time_t last_sent;
-   float distance;                // Filtered by Kalman filter on RSSI
-   struct Kalman kalman_interval; // Tracks time between RSSI events in order to detect large gaps
    time_t earliest;               // Earliest time seen, used to calculate overlap
-   time_t latest_local;           // Latest time seen by this sensor, used to calculate overlap
-   time_t latest_any;             // Latest time seen by ANY sensor, used to keep alive
-   int count;                     // Count how many times seen
    int known_interval;            // Recognized device has known frequency of advertising
    int8_t try_connect_state;      // Zero = never tried, 1..N-1 = Try in progress, N = Done
    int8_t try_connect_attempts;   // How many attempts have been made to connect
@@ -232,7 +245,11 @@ int category_to_int(char *category);
 
 char *category_from_int(uint8_t i);
 
-void merge(struct Device *local, struct Device *remote, char *access_name, bool safe, struct AccessPoint* ap);
+/*
+   Merge what a remote access point knows about a device into the local device
+   latest_any is not merged here, it is in the device store's hot table
+*/
+void merge(struct Device *local, struct Device *remote, char *access_name, struct AccessPoint* ap);
 
 /*
    How much data is sent over MQTT
@@ -0,0 +1,315 @@
+/*
+    Device store: a slot map of devices with generation checked handles
+*/
+
+#include "devicestore.h"
+
+#include <glib.h>
+
+#define SLOT_IN_USE(store, slot) (((store)->generation[slot] & 1) == 1)
+
+// Upper limit on any timeout in minutes
+#define MAX_TIME_AGO_CACHE 60
+
+/*
+    Seconds a device of this category can go unseen before it is removed
+*/
+int device_timeout_seconds(int8_t category)
+{
+    // 3 min for a regular device
+    int max_time_ago_seconds = 3 * 60;
+
+    // 5 min if we got to know it
+    if (category != CATEGORY_UNKNOWN){
+        max_time_ago_seconds = 5 * 60; // was 10 * 60;
+    }
+
+    // 12 min for ibeacons
+    if (category == CATEGORY_BEACON){
+        max_time_ago_seconds = 12 * 60;
+    }
+
+    // 1 hour upper limit
+    if (max_time_ago_seconds > 60 * MAX_TIME_AGO_CACHE)
+    {
+        max_time_ago_seconds = 60 * MAX_TIME_AGO_CACHE;
+    }
+
+    return max_time_ago_seconds;
+}
+
+/*
+    Bytes of store memory used by each slot
+*/
+long device_store_bytes_per_slot()
+{
+    return sizeof(struct Device)
+        + sizeof(uint32_t) + sizeof(int)                                    // generation, free stack
+        + sizeof(time_t) + sizeof(float) + 2 * sizeof(int16_t) + sizeof(uint8_t)   // hot table
+        + 2 * sizeof(int)                                                   // seen order
+        + 2 * sizeof(int) + sizeof(int16_t) + sizeof(int64_t)               // expiry wheel
+        + 2 * (sizeof(int64_t) + sizeof(void*));                            // index at half load
+}
+
+/*
+    Add one chunk of slots, returns false if the capacity limit or memory budget does not allow it
+*/
+static bool grow(struct device_store* store)
+{
+    int capacity = store->capacity + DEVICE_CHUNK;
+    if (capacity > store->max_capacity) return FALSE;
+    if (store->memory_budget > 0 && capacity * device_store_bytes_per_slot() > store->memory_budget) return FALSE;
+
+    int chunk_count = capacity >> DEVICE_CHUNK_BITS;
+    store->chunks = g_realloc(store->chunks, chunk_count * sizeof(struct Device*));
+    store->chunks[chunk_count - 1] = g_malloc0(DEVICE_CHUNK * sizeof(struct Device));
+
+    // Everything else is indexed by slot and can move
+    store->generation = g_realloc(store->generation, capacity * sizeof(uint32_t));
+    store->free_list = g_realloc(store->free_list, capacity * sizeof(int));
+    store->latest_any = g_realloc(store->latest_any, capacity * sizeof(time_t));
+    store->distance = g_realloc(store->distance, capacity * sizeof(float));
+    store->raw_rssi = g_realloc(store->raw_rssi, capacity * sizeof(int16_t));
+    store->timeout = g_realloc(store->timeout, capacity * sizeof(int16_t));
+    store->seen_next = g_realloc(store->seen_next, capacity * sizeof(int));
+    store->seen_prev = g_realloc(store->seen_prev, capacity * sizeof(int));
+    store->ttl = g_realloc(store->ttl, capacity * sizeof(uint8_t));
+    expiry_wheel_grow(&store->expiry, capacity);
+
+    for (int i = store->capacity; i < capacity; i++)
+    {
+        store->generation[i] = 0;
+    }
+
+    g_info("Device store grown to %i slots (%li kB)", capacity, capacity * device_store_bytes_per_slot() / 1024);
+    store->capacity = capacity;
+    return TRUE;
+}
+
+/*
+    Initialize an empty store that may grow to max_capacity slots or memory_budget bytes
+*/
+void device_store_init(struct device_store* store, int max_capacity, long memory_budget)
+{
+    store->count = 0;
+    store->high = 0;
+    store->free_count = 0;
+    store->capacity = 0;
+    store->max_capacity = max_capacity;
+    store->memory_budget = memory_budget;
+    store->chunks = NULL;
+    store->generation = NULL;
+    store->free_list = NULL;
+    store->latest_any = NULL;
+    store->distance = NULL;
+    store->raw_rssi = NULL;
+    store->timeout = NULL;
+    store->seen_next = NULL;
+    store->seen_prev = NULL;
+    store->seen_head = -1;
+    store->seen_tail = -1;
+    store->ttl = NULL;
+    store->peak = 0;
+    store->evictions = 0;
+    store->rejected = 0;
+    mac_map_init(&store->index, DEVICE_CHUNK);
+    pthread_mutex_init(&store->index_lock, NULL);
+    expiry_wheel_init(&store->expiry, 0, time(NULL));
+
+    // Always allow at least one chunk
+    if (store->max_capacity < DEVICE_CHUNK) store->max_capacity = DEVICE_CHUNK;
+    if (store->memory_budget > 0 && store->memory_budget < DEVICE_CHUNK * device_store_bytes_per_slot())
+    {
+        store->memory_budget = DEVICE_CHUNK * device_store_bytes_per_slot();
+    }
+    grow(store);
+}
+
+/*
+    Take a slot out of the seen order
+*/
+static void seen_unlink(struct device_store* store, int slot)
+{
+    int prev = store->seen_prev[slot];
+    int next = store->seen_next[slot];
+    if (prev >= 0) store->seen_next[prev] = next; else store->seen_head = next;
+    if (next >= 0) store->seen_prev[next] = prev; else store->seen_tail = prev;
+}
+
+/*
+    Put a slot in the seen order by its latest_any, searching from the newest end
+    Nearly always goes on the end, a time from another access point can be a little older
+*/
+static void seen_insert(struct device_store* store, int slot)
+{
+    int prev = store->seen_tail;
+    while (prev >= 0 && store->latest_any[prev] > store->latest_any[slot]) prev = store->seen_prev[prev];
+
+    int next = prev >= 0 ? store->seen_next[prev] : store->seen_head;
+    store->seen_prev[slot] = prev;
+    store->seen_next[slot] = next;
+    if (prev >= 0) store->seen_next[prev] = slot; else store->seen_head = slot;
+    if (next >= 0) store->seen_prev[next] = slot; else store->seen_tail = slot;
+}
+
+/*
+    Find a device by mac address, NULL if not present
+*/
+struct Device* device_store_find(struct device_store* store, int64_t mac64)
+{
+    void* value;
+    pthread_mutex_lock(&store->index_lock);
+    bool found = mac_map_lookup(&store->index, mac64, &value);
+    pthread_mutex_unlock(&store->index_lock);
+    if (!found) return NULL;
+    return DEVICE_STORE_SLOT(store, GPOINTER_TO_INT(value));
+}
+
+/*
+    Add a device for a mac address, growing if allowed, returns NULL if the store is full
+*/
+struct Device* device_store_add(struct device_store* store, int64_t mac64)
+{
+    int slot;
+    if (store->free_count > 0)
+    {
+        slot = store->free_list[--store->free_count];
+    }
+    else if (store->high < store->capacity || grow(store))
+    {
+        slot = store->high;
+    }
+    else
+    {
+        return NULL;
+    }
+
+    if (slot >= store->high) store->high = slot + 1;
+
+    store->generation[slot]++;     // now odd = in use
+    store->count++;
+    if (store->count > store->peak) store->peak = store->count;
+    pthread_mutex_lock(&store->index_lock);
+    mac_map_put(&store->index, mac64, GINT_TO_POINTER(slot));
+    pthread_mutex_unlock(&store->index_lock);
+
+    struct Device* device = DEVICE_STORE_SLOT(store, slot);
+    device->slot = slot;
+    device->mac64 = mac64;
+    device->category = CATEGORY_UNKNOWN;
+
+    time(&store->latest_any[slot]);
+    store->distance[slot] = 10;
+    store->raw_rssi[slot] = -90;
+    store->ttl[slot] = 10;         // arbitrary, set during countdown to ejection
+    store->timeout[slot] = device_timeout_seconds(device->category);
+    seen_insert(store, slot);
+    expiry_wheel_schedule(&store->expiry, slot, store->latest_any[slot] + store->timeout[slot]);
+    return device;
+}
+
+/*
+    When full, the device to evict: the one unseen the longest, O(1)
+*/
+struct Device* device_store_eviction_candidate(struct device_store* store)
+{
+    return store->seen_head < 0 ? NULL : DEVICE_STORE_SLOT(store, store->seen_head);
+}
+
+/*
+    Record that a device was seen at a time, ignored if it is not later than latest_any
+*/
+void device_store_seen(struct device_store* store, struct Device* device, time_t when)
+{
+    int slot = device->slot;
+    if (when <= store->latest_any[slot]) return;
+    store->latest_any[slot] = when;
+    seen_unlink(store, slot);
+    seen_insert(store, slot);
+}
+
+/*
+    Refresh the hot table for a device after its category changed, rescheduling its expiry if the timeout changed
+*/
+void device_store_touch(struct device_store* store, struct Device* device)
+{
+    int slot = device->slot;
+    int16_t timeout = device_timeout_seconds(device->category);
+    if (timeout == store->timeout[slot]) return;
+    store->timeout[slot] = timeout;
+
+    // Move it to the new deadline, a shorter timeout would only be seen when the old deadline fired
+    // Not once it is counting down to removal, that has its own deadline
+    if (store->ttl[slot] == 10)
+    {
+        expiry_wheel_schedule(&store->expiry, slot, store->latest_any[slot] + timeout);
+    }
+}
+
+/*
+    Copy of a device's hot table entry
+*/
+struct device_hot device_store_hot(const struct device_store* store, const struct Device* device)
+{
+    struct device_hot hot;
+    hot.latest_any = store->latest_any[device->slot];
+    hot.distance = store->distance[device->slot];
+    hot.raw_rssi = store->raw_rssi[device->slot];
+    return hot;
+}
+
+/*
+    Remove a device, O(1), any handles to it become stale
+*/
+void device_store_remove(struct device_store* store, struct Device* device)
+{
+    int slot = device->slot;
+    g_assert(SLOT_IN_USE(store, slot));
+
+    pthread_mutex_lock(&store->index_lock);
+    mac_map_remove(&store->index, device->mac64);
+    pthread_mutex_unlock(&store->index_lock);
+    expiry_wheel_cancel(&store->expiry, slot);
+    seen_unlink(store, slot);
+    store->generation[slot]++;     // now even = free
+    store->count--;
+
+    if (slot == store->high - 1)
+    {
+        // Trim the iteration bound past any free slots at the top, they are still on the free stack
+        // and add raises high again if it pops one of them
+        store->high--;
+        while (store->high > 0 && !SLOT_IN_USE(store, store->high - 1)) store->high--;
+    }
+    store->free_list[store->free_count++] = slot;
+}
+
+/*
+    Device in a slot or NULL if the slot is free
+*/
+struct Device* device_store_at(struct device_store* store, int slot)
+{
+    return SLOT_IN_USE(store, slot) ? DEVICE_STORE_SLOT(store, slot) : NULL;
+}
+
+/*
+    Get a handle to a live device
+*/
+struct device_handle device_store_handle(struct device_store* store, struct Device* device)
+{
+    struct device_handle handle;
+    handle.slot = device->slot;
+    handle.generation = store->generation[handle.slot];
+    return handle;
+}
+
+/*
+    Get the device for a handle, NULL if it has since been removed
+*/
+struct Device* device_store_resolve(struct device_store* store, struct device_handle handle)
+{
+    if (handle.slot < 0 || handle.slot >= store->capacity) return NULL;
+    if (store->generation[handle.slot] != handle.generation) return NULL;
+    if (!SLOT_IN_USE(store, handle.slot)) return NULL;
+    return DEVICE_STORE_SLOT(store, handle.slot);
+}
@@ -0,0 +1,156 @@
+#ifndef DEVICESTORE_H
+#define DEVICESTORE_H
+/*
+    Device store: a slot map of devices
+
+    Devices never move once added. Removing a device pushes its slot number onto free_list, an
+    array used as a stack that add pops from before taking a new slot, and bumps the slot's
+    generation, so a handle taken before the removal no longer resolves rather than silently
+    pointing at whatever device reuses the slot.
+
+    Devices are allocated in chunks of DEVICE_CHUNK so the store grows at runtime without moving
+    any device, up to max_capacity slots or until the memory budget is reached. After that the
+    caller makes room with device_store_eviction_candidate, the head of a list of live slots kept
+    in order of latest_any so that it is O(1). latest_any is only changed through
+    device_store_seen, which keeps that order.
+
+    Anything that keeps a device beyond the call it was found in (a queued send, a BlueZ
+    property update) keeps a handle and resolves it when it next needs the device.
+
+    Devices are only added, changed and removed on the main loop. device_store_find may be
+    called from any thread: the mac index is locked for lookups and for the puts and removes
+    that can resize it, though the device it returns is only safe to read on the main loop.
+
+    The fields every advert writes and expiry and eviction read (latest_any, distance, raw_rssi,
+    the timeout and ttl) are not in struct Device but in a hot table, a structure of arrays by
+    slot, so that expiry reads a few contiguous arrays instead of every whole struct Device.
+    Call device_store_touch after changing category on a device to refresh its timeout.
+    Each device is scheduled on an expiry wheel at latest_any + timeout when added; the owner
+    advances the wheel and reschedules lazily as latest_any advances. A change of timeout can
+    bring the deadline forward, so touch moves the device in the wheel when its timeout changes.
+*/
+
+#include "device.h"
+#include "macmap.h"
+#include "expirywheel.h"
+#include <pthread.h>
+#include <time.h>
+
+#define DEVICE_CHUNK_BITS 8
+#define DEVICE_CHUNK (1 << DEVICE_CHUNK_BITS)
+#define DEVICE_CHUNK_MASK (DEVICE_CHUNK - 1)
+
+// Device in a slot whether or not it is in use
+#define DEVICE_STORE_SLOT(store, slot) (&(store)->chunks[(slot) >> DEVICE_CHUNK_BITS][(slot) & DEVICE_CHUNK_MASK])
+
+/*
+    Handle to a device that can be held across removals
+*/
+struct device_handle
+{
+    int32_t slot;
+    uint32_t generation;
+};
+
+struct device_store
+{
+    int count;                      // live devices
+    int high;                       // slots [0, high) may be in use, bound for iteration
+    int capacity;                   // slots allocated, a multiple of DEVICE_CHUNK
+    int max_capacity;               // never grow past this many slots
+    long memory_budget;             // soft limit in bytes on memory used by the store
+    struct Device** chunks;         // capacity / DEVICE_CHUNK chunks of devices
+    uint32_t* generation;           // odd while the slot holds a live device
+    int* free_list;                 // free slot numbers, a stack of free_count entries, add pops the last one
+    int free_count;
+    struct mac_map index;           // mac64 -> slot
+    pthread_mutex_t index_lock;     // held around every use of index, a put can grow and free the table
+
+    // Hot table, by slot (see struct device_hot)
+    time_t* latest_any;             // Latest time seen by ANY sensor, used to keep alive
+    float* distance;                // Filtered by Kalman filter on RSSI
+    int16_t* raw_rssi;              // RSSI last measurement
+    int16_t* timeout;               // seconds unseen before removal starts, from category
+    int* seen_next;                 // live slots in order of latest_any, oldest first, -1 for end
+    int* seen_prev;
+    int seen_head;                  // unseen the longest, the eviction candidate
+    int seen_tail;
+    uint8_t* ttl;                   // time to live count down during removal process
+
+    struct expiry_wheel expiry;     // when each slot next needs its expiry checked
+
+    // Counters
+    int peak;                       // most live devices at once
+    long evictions;                 // devices removed to make room
+    long rejected;                  // devices dropped because nothing could be evicted
+};
+
+/*
+    Seconds a device of this category can go unseen before it is removed
+*/
+int device_timeout_seconds(int8_t category);
+
+/*
+    Initialize an empty store that may grow to max_capacity slots or memory_budget bytes
+*/
+void device_store_init(struct device_store* store, int max_capacity, long memory_budget);
+
+/*
+    Bytes of store memory used by each slot
+*/
+long device_store_bytes_per_slot();
+
+/*
+    Find a device by mac address, NULL if not present
+*/
+struct Device* device_store_find(struct device_store* store, int64_t mac64);
+
+/*
+    Add a device for a mac address, growing if allowed, returns NULL if the store is full
+    Caller initializes the device fields, mac64 is set, the hot table is initialized and the
+    expiry clock starts now
+*/
+struct Device* device_store_add(struct device_store* store, int64_t mac64);
+
+/*
+    When full, the device to evict: the one unseen the longest, O(1)
+*/
+struct Device* device_store_eviction_candidate(struct device_store* store);
+
+/*
+    Record that a device was seen at a time, ignored if it is not later than latest_any
+*/
+void device_store_seen(struct device_store* store, struct Device* device, time_t when);
+
+/*
+    Refresh the hot table for a device after its category changed, rescheduling its expiry if
+    the timeout changed
+*/
+void device_store_touch(struct device_store* store, struct Device* device);
+
+/*
+    Copy of a device's hot table entry, e.g. to send it
+*/
+struct device_hot device_store_hot(const struct device_store* store, const struct Device* device);
+
+/*
+    Remove a device, O(1), any handles to it become stale
+*/
+void device_store_remove(struct device_store* store, struct Device* device);
+
+/*
+    Device in a slot or NULL if the slot is free, iterate with slot from 0 to store->high
+*/
+struct Device* device_store_at(struct device_store* store, int slot);
+
+/*
+    Get a handle to a live device
+*/
+struct device_handle device_store_handle(struct device_store* store, struct Device* device);
+
+/*
+    Get the device for a handle, NULL if it has since been removed
+*/
+struct Device* device_store_resolve(struct device_store* store, struct device_handle handle);
+
+#endif
@@ -0,0 +1,142 @@
+/*
+    Hierarchical timing wheel for device expiry
+*/
+
+#include "expirywheel.h"
+
+#include <glib.h>
+
+/*
+    Initialize an empty wheel for slots [0, capacity) starting at now
+*/
+void expiry_wheel_init(struct expiry_wheel* wheel, int capacity, time_t now)
+{
+    wheel->current_tick = now / EXPIRY_TICK_SECONDS;
+    for (int i = 0; i < 2 * EXPIRY_WHEEL_SIZE; i++)
+    {
+        wheel->heads[i] = -1;
+    }
+    wheel->capacity = 0;
+    wheel->next = NULL;
+    wheel->prev = NULL;
+    wheel->bucket = NULL;
+    wheel->due = NULL;
+    expiry_wheel_grow(wheel, capacity);
+    wheel->fired = 0;
+    wheel->cascaded = 0;
+}
+
+/*
+    Extend the wheel to cover more slots
+*/
+void expiry_wheel_grow(struct expiry_wheel* wheel, int capacity)
+{
+    if (capacity <= wheel->capacity) return;
+
+    wheel->next = g_realloc(wheel->next, capacity * sizeof(int));
+    wheel->prev = g_realloc(wheel->prev, capacity * sizeof(int));
+    wheel->bucket = g_realloc(wheel->bucket, capacity * sizeof(int16_t));
+    wheel->due = g_realloc(wheel->due, capacity * sizeof(int64_t));
+
+    for (int i = wheel->capacity; i < capacity; i++)
+    {
+        wheel->next[i] = -1;
+        wheel->prev[i] = -1;
+        wheel->bucket[i] = -1;
+        wheel->due[i] = 0;
+    }
+    wheel->capacity = capacity;
+}
+
+/*
+    Remove a slot from the wheel if it is scheduled
+*/
+void expiry_wheel_cancel(struct expiry_wheel* wheel, int slot)
+{
+    int b = wheel->bucket[slot];
+    if (b < 0) return;
+
+    if (wheel->prev[slot] >= 0) wheel->next[wheel->prev[slot]] = wheel->next[slot];
+    else wheel->heads[b] = wheel->next[slot];
+    if (wheel->next[slot] >= 0) wheel->prev[wheel->next[slot]] = wheel->prev[slot];
+
+    wheel->next[slot] = -1;
+    wheel->prev[slot] = -1;
+    wheel->bucket[slot] = -1;
+}
+
+/*
+    Put a slot in the right bucket for its due tick, no earlier than the earliest tick
+*/
+static void insert(struct expiry_wheel* wheel, int slot, int64_t earliest)
+{
+    int64_t tick = wheel->due[slot];
+    if (tick < earliest) tick = earliest;
+
+    int64_t delta = tick - wheel->current_tick;
+    int b;
+    if (delta < EXPIRY_WHEEL_SIZE)
+    {
+        b = (int)(tick & EXPIRY_WHEEL_MASK);
+    }
+    else
+    {
+        // Beyond level 1 gets parked in the furthest bucket and re-placed when it cascades
+        int64_t furthest = wheel->current_tick + EXPIRY_WHEEL_SIZE * EXPIRY_WHEEL_SIZE - 1;
+        if (tick > furthest) tick = furthest;
+        b = EXPIRY_WHEEL_SIZE + (int)((tick >> EXPIRY_WHEEL_BITS) & EXPIRY_WHEEL_MASK);
+    }
+
+    wheel->bucket[slot] = b;
+    wheel->prev[slot] = -1;
+    wheel->next[slot] = wheel->heads[b];
+    if (wheel->heads[b] >= 0) wheel->prev[wheel->heads[b]] = slot;
+    wheel->heads[b] = slot;
+}
+
+/*
+    Schedule (or reschedule) a slot to fire at the first tick at or after deadline
+*/
+void expiry_wheel_schedule(struct expiry_wheel* wheel, int slot, time_t deadline)
+{
+    expiry_wheel_cancel(wheel, slot);
+    wheel->due[slot] = (deadline + EXPIRY_TICK_SECONDS - 1) / EXPIRY_TICK_SECONDS;
+    // Never into the bucket being processed, so a handler can reschedule without looping
+    insert(wheel, slot, wheel->current_tick + 1);
+}
+
+/*
+    Advance to now calling handler for every slot that is due
+*/
+void expiry_wheel_advance(struct expiry_wheel* wheel, time_t now, expiry_handler handler, void* context)
+{
+    int64_t target = now / EXPIRY_TICK_SECONDS;
+
+    while (wheel->current_tick < target)
+    {
+        wheel->current_tick++;
+
+        // Entering a new level 1 span, move its entries down into level 0
+        if ((wheel->current_tick & EXPIRY_WHEEL_MASK) == 0)
+        {
+            int b = EXPIRY_WHEEL_SIZE + (int)((wheel->current_tick >> EXPIRY_WHEEL_BITS) & EXPIRY_WHEEL_MASK);
+            int slot;
+            while ((slot = wheel->heads[b]) >= 0)
+            {
+                expiry_wheel_cancel(wheel, slot);
+                insert(wheel, slot, wheel->current_tick);
+                wheel->cascaded++;
+            }
+        }
+
+        // The handler may reschedule or remove the slot, it always lands in a later bucket
+        int b = (int)(wheel->current_tick & EXPIRY_WHEEL_MASK);
+        int slot;
+        while ((slot = wheel->heads[b]) >= 0)
+        {
+            expiry_wheel_cancel(wheel, slot);
+            wheel->fired++;
+            handler(slot, now, context);
+        }
+    }
+}
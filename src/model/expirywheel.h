@@ -0,0 +1,69 @@
+#ifndef EXPIRYWHEEL_H
+#define EXPIRYWHEEL_H
+/*
+    Hierarchical timing wheel for device expiry
+
+    Two levels of 64 buckets. Level 0 buckets are one tick (EXPIRY_TICK_SECONDS) wide and cover
+    the next 64 ticks, level 1 buckets are 64 ticks wide and cascade down into level 0 as time
+    reaches them. Entries are slots in the device store, linked through arrays indexed by slot,
+    so scheduling and unscheduling are O(1) and a tick only touches the slots that are due.
+
+    Deadlines are lazy: when a device is seen again nothing is rescheduled, the handler checks
+    the real deadline when the old one fires and schedules it again if it is not yet due.
+    That only works for deadlines that move later, one that moves earlier must be rescheduled.
+*/
+
+#include <stdint.h>
+#include <time.h>
+
+#define EXPIRY_TICK_SECONDS 5
+#define EXPIRY_WHEEL_BITS 6
+#define EXPIRY_WHEEL_SIZE (1 << EXPIRY_WHEEL_BITS)
+#define EXPIRY_WHEEL_MASK (EXPIRY_WHEEL_SIZE - 1)
+
+struct expiry_wheel
+{
+    int64_t current_tick;                       // last tick processed
+    int heads[2 * EXPIRY_WHEEL_SIZE];           // level 0 then level 1, -1 for empty
+    int capacity;                               // slots covered by the arrays below
+    int* next;                                  // links by slot, -1 for end
+    int* prev;
+    int16_t* bucket;                            // bucket a slot is in, -1 if not scheduled
+    int64_t* due;                               // tick a slot is due
+
+    // Statistics
+    long fired;                                 // handler calls
+    long cascaded;                              // moves from level 1 to level 0
+};
+
+/*
+    Called for each slot that comes due, the slot is no longer scheduled
+*/
+typedef void (*expiry_handler)(int slot, time_t now, void* context);
+
+/*
+    Initialize an empty wheel for slots [0, capacity) starting at now
+*/
+void expiry_wheel_init(struct expiry_wheel* wheel, int capacity, time_t now);
+
+/*
+    Extend the wheel to cover more slots
+*/
+void expiry_wheel_grow(struct expiry_wheel* wheel, int capacity);
+
+/*
+    Schedule (or reschedule) a slot to fire at the first tick at or after deadline
+*/
+void expiry_wheel_schedule(struct expiry_wheel* wheel, int slot, time_t deadline);
+
+/*
+    Remove a slot from the wheel if it is scheduled
+*/
+void expiry_wheel_cancel(struct expiry_wheel* wheel, int slot);
+
+/*
+    Advance to now calling handler for every slot that is due
+*/
+void expiry_wheel_advance(struct expiry_wheel* wheel, time_t now, expiry_handler handler, void* context);
+
+#endif
@@ -0,0 +1,21 @@
+#ifndef PLACEIDS_H
+#define PLACEIDS_H
+/*
+    Dense ids for patches, rooms and group names, handed out by get_or_create_patch as patches are
+    created so that totals can be summed into arrays indexed by id rather than found by name on
+    every pass. Patches are never thrown away so an id, once handed out, stays valid.
+*/
+
+struct place_ids
+{
+    int patch_count;
+    const char** room_names;    // by room id
+    int* room_groups;           // group id of the first patch seen in each room
+    int room_count;
+    int room_capacity;
+    const char** group_names;   // by group id, groups with the same name and other tags share an id
+    int group_count;
+    int group_capacity;
+};
+
+#endif
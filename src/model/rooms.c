@@ -12,10 +12,43 @@
 #include <string.h>
 #include "utility.h"
 
+/*
+    Id of a name, adding it if it is new, names are only ever added as patches are created
+*/
+static int intern_name(const char*** names, int* count, int* capacity, const char* name)
+{
+    for (int i = 0; i < *count; i++)
+    {
+        if (strcmp((*names)[i], name) == 0) return i;
+    }
+    if (*count == *capacity)
+    {
+        *capacity = MAX(16, *capacity * 2);
+        *names = g_renew(const char*, *names, *capacity);
+    }
+    (*names)[*count] = name;
+    return (*count)++;
+}
+
+/*
+    Id of a room, a new room is reported under the group of the patch that added it
+*/
+static int intern_room(struct place_ids* ids, const char* room_name, int group_id)
+{
+    int count = ids->room_count;
+    int id = intern_name(&ids->room_names, &ids->room_count, &ids->room_capacity, room_name);
+    if (ids->room_count > count)
+    {
+        ids->room_groups = g_renew(int, ids->room_groups, ids->room_capacity);
+        ids->room_groups[id] = group_id;
+    }
+    return id;
+}
+
 /*
     Get or add a group
 */
-struct group* get_or_add_group(struct group** group_list, const char* group_name, const char* tags)
+struct group* get_or_add_group(struct group** group_list, const char* group_name, const char* tags, struct place_ids* ids)
 {
     char* group_name_m = strdup(group_name);
     url_slug(group_name_m);  // destructive
@@ -37,6 +70,7 @@ struct group* get_or_add_group(struct group** group_list, const char* group_name
     struct group* group = g_malloc(sizeof(struct group));
     group->name = group_name_m;
     group->tags = tags_m;
+    group->id = intern_name(&ids->group_names, &ids->group_count, &ids->group_capacity, group->name);
     group->next = NULL;
 
     if (*group_list == NULL)
@@ -58,7 +92,7 @@ struct group* get_or_add_group(struct group** group_list, const char* group_name
    get or create a room and update any existing group also
 */
 struct patch* get_or_create_patch(const char* patch_name, const char* room_name, const char* group_name, const char* tags,
-    struct patch** patch_list, struct group** groups_list, bool confirmed)
+    struct patch** patch_list, struct group** groups_list, struct place_ids* ids, bool confirmed)
 {
     g_assert(patch_name != NULL);
     g_assert(group_name != NULL);
@@ -87,7 +121,9 @@ struct patch* get_or_create_patch(const char* patch_name, const char* room_name,
         found->room = url_slug(strdup(room_name));
         found->confirmed = confirmed;
         // no strdup here, get_or_add_group handles that
-        found->group = get_or_add_group(groups_list, group_name, tags);
+        found->group = get_or_add_group(groups_list, group_name, tags, ids);
+        found->id = ids->patch_count++;
+        found->room_id = intern_room(ids, found->room, found->group->id);
         //g_info("Added patch %s in %s with tags %s", found->name, group_name, tags);
 
         found->phone_total = 0;
@@ -337,33 +373,48 @@ int top_k_by_patch_score(struct patch* result[], int k, struct patch* patch_list
 }
 
 /*
-    summarize_by_room
+    Add a patch's counts to a summary
 */
-void summarize_by_room(struct patch* patches, struct summary** summary)
+static void add_patch(struct summary* s, struct patch* p)
 {
+    update_summary(s, p->phone_total, p->tablet_total, p->computer_total, p->watch_total, 
+        p->wearable_total, p->beacon_total, p->covid_total, p->other_total);
+}
+
+/*
+    summarize_by_room, one entry per room id, present if any confirmed patch is in the room
+*/
+void summarize_by_room(struct patch* patches, const struct place_ids* ids, struct summaries* summary)
+{
+    summaries_reset(summary, ids->room_count);
+    for (int i = 0; i < ids->room_count; i++)
+    {
+        summary->items[i].category = ids->room_names[i];
+        summary->items[i].extra = ids->group_names[ids->room_groups[i]];
+    }
+
     for (struct patch* p = patches; p != NULL; p = p->next)
     {
-        if (p->confirmed)
-        {
-            update_summary(summary, p->room, p->group->name, p->phone_total, p->tablet_total, p->computer_total, p->watch_total, 
-                p->wearable_total, p->beacon_total, p->covid_total, p->other_total);
-        }
+        if (p->confirmed) add_patch(&summary->items[p->room_id], p);
     }
 }
 
 
 /*
-    summarize_by_area
+    summarize_by_area, one entry per group id, present if any confirmed patch is in the group
 */
-void summarize_by_group(struct patch* patches, struct summary** summary)
+void summarize_by_group(struct patch* patches, const struct place_ids* ids, struct summaries* summary)
 {
+    summaries_reset(summary, ids->group_count);
+    for (int i = 0; i < ids->group_count; i++)
+    {
+        // group tags are fairly useless
+        summary->items[i].category = ids->group_names[i];
+        summary->items[i].extra = "";
+    }
+
     for (struct patch* p = patches; p != NULL; p = p->next)
     {
-        if (p->confirmed)
-        {
-            // group tags are fairly useless
-            update_summary(summary, p->group->name, "", p->phone_total, p->tablet_total, p->computer_total, p->watch_total, 
-                p->wearable_total, p->beacon_total, p->covid_total, p->other_total);
-        }
+        if (p->confirmed) add_patch(&summary->items[p->group->id], p);
     }
-}
\ No newline at end of file
+}
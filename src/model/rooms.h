@@ -6,6 +6,7 @@
 #include "device.h"
 #include "utility.h"
 #include "accesspoints.h"
+#include "placeids.h"
 #include <string.h>
 #include <math.h>
 
@@ -18,6 +19,7 @@ struct group
 {
     const char* name;           // group for reporting
     const char* tags;           // CSV tags with no spaces
+    int id;                     // dense id of the name, groups with the same name and other tags share it
     struct group* next;         // next ptr
 };
 
@@ -29,6 +31,8 @@ struct patch
     const char* name;
     const char* room;           // Room that owns this patch
     struct group* group;        // Group/area that owns this patch (parent of room)
+    int id;                     // dense id, patches are unique by name
+    int room_id;                // dense id of the room
     struct patch* next;         // next ptr
     bool confirmed;             // confirmed came from recordings subdirectory not beacons subdirectory
 
@@ -55,18 +59,19 @@ void read_configuration_files(struct OverallState* state);
 /*
    get or create a patch and update any existing group also
 */
-struct patch* get_or_create_patch(const char* patch_name, const char* room_name, const char* group_name, const char* tags, struct patch** patch_list, struct group** groups_list, bool confirmed);
+struct patch* get_or_create_patch(const char* patch_name, const char* room_name, const char* group_name, const char* tags, struct patch** patch_list, struct group** groups_list,
+    struct place_ids* ids, bool confirmed);
 
 // ------------------------------------------------------------------
 
 /*
-    summarize_by_room
+    summarize_by_room, one entry per room id, present if any confirmed patch is in the room
 */
-void summarize_by_room(struct patch* patches, struct summary** summary);
+void summarize_by_room(struct patch* patches, const struct place_ids* ids, struct summaries* summary);
 
 /*
-    summarize_by_area
+    summarize_by_area, one entry per group id, present if any confirmed patch is in the group
 */
-void summarize_by_group(struct patch* patches, struct summary** summary);
+void summarize_by_group(struct patch* patches, const struct place_ids* ids, struct summaries* summary);
 
 #endif
\ No newline at end of file
@@ -28,12 +28,38 @@ void initialize_state(struct OverallState* state)
     state->reboot_hour = 7;      // reboot after 7 hours (TODO: Make this time of day)
     state->access_points = NULL; // linked list
     state->patches = NULL;       // linked list
+    state->recordings = NULL;    // linked list, owned by the recording store
+    recording_store_init(&state->recording_store, "/var/sniffer/recordings", "/var/sniffer/beacons");
     state->groups = NULL;        // linked list
+    memset(&state->place_ids, 0, sizeof(state->place_ids));     // ids handed out as patches are created
+    memset(&state->room_summary, 0, sizeof(state->room_summary));
+    memset(&state->group_summary, 0, sizeof(state->group_summary));
     state->patch_hash = 0;       // hash to detect changes
     state->beacons = NULL;       // linked list
     state->access_mappings = NULL; // linked list
     state->beacon_hash = 0;      // initial unseen hash
     state->closestHead = NULL;   // chain of closest heads
+    state->closestTail = NULL;
+    state->closest_pruned = 0;
+    mac_map_init(&state->closest_index, 2 * CLOSEST_N);
+    node_pool_init(&state->head_pool, "Closest head", sizeof(struct ClosestHead), offsetof(struct ClosestHead, next));
+    static const char* closest_pool_names[CLOSEST_SIZE_CLASSES] = { "Closest x1", "Closest x2", "Closest x4",
+        "Closest x8", "Closest x16", "Closest x32" };
+    for (int i = 0; i < CLOSEST_SIZE_CLASSES; i++)
+    {
+        // Free arrays link through their first bytes
+        node_pool_init(&state->closest_pools[i], closest_pool_names[i], sizeof(struct ClosestTo) << i, 0);
+    }
+    node_pool_init(&state->room_pool, "Recent room", sizeof(struct RecentRoom), offsetof(struct RecentRoom, next));
+    closest_snapshot_init(&state->closest_snapshot);
+    state->supersession_pairs = 0;
+    state->supersession_examined = 0;
+    state->supersession_recomputed = 0;
+    state->supersession_reused = 0;
+    state->supersession_verified = 0;
+    state->supersession_mismatches = 0;
+    identity_graph_init(&state->identities);
+    state->supersession_hidden = 0;
     state->json = NULL;          // DBUS JSON message
     state->led_flash_count = 3;  // Fixed for now, TODO: Back to calculated value
     time(&state->influx_last_sent);
@@ -51,7 +77,12 @@ void initialize_state(struct OverallState* state)
     read_configuration_files(state);
 
     // no devices yet
-    state->n = 0;
+    // Device store grows in chunks up to DEVICE_CAPACITY devices or DEVICE_MEMORY_KB, then evicts
+    int device_capacity;
+    int device_memory_kb;
+    get_int_env("DEVICE_CAPACITY", &device_capacity, 4 * N);
+    get_int_env("DEVICE_MEMORY_KB", &device_memory_kb, 4096);
+    device_store_init(&state->devices, device_capacity, device_memory_kb * 1024L);
 
     if (gethostname(client_id, META_LENGTH) != 0)
     {
@@ -121,6 +152,45 @@ void initialize_state(struct OverallState* state)
     // TODO: Expand this to an arbitrary JSON blob
     get_float_env("UDP_SCALE_FACTOR", &state->udp_scale_factor, 1.0);
 
+    // Merge bursts of property changes on a device into one closest update and one mesh send
+    get_int_env("COALESCE_MS", &state->coalesce_ms, 250);
+    state->pending = NULL;
+    state->pending_count = 0;
+    state->pending_capacity = 0;
+    state->pending_timer = FALSE;
+    state->sends_requested = 0;
+    state->sends_made = 0;
+
+    // Ingest from BlueZ (default) or straight from HCI, optionally replaying a capture file
+    get_string_env("INGEST", &state->ingest, "bluez");
+    state->use_hci = strcmp(state->ingest, "hci") == 0;
+    get_int_env("HCI_DEVICE", &state->hci_device, 0);
+    get_string_env("HCI_REPLAY", &state->hci_replay, "");
+
+    // Bounded ingest queues, when full new reports are dropped and counted
+    get_int_env("INGEST_QUEUE", &state->bluez_queue_capacity, 4096);
+    get_int_env("MESH_QUEUE", &state->mesh_queue_capacity, 256);
+    state->ingest_wake = 0;
+    state->ingest_drain = NULL;
+
+    // Analysis pass threads, up to four cores by default
+    int cores = g_get_num_processors();
+    get_int_env("ANALYSIS_THREADS", &state->analysis_threads, cores < 4 ? cores : 4);
+    work_pool_init(&state->analysis_pool, state->analysis_threads);
+    mpsc_queue_init(&state->analysis_queue, 1, sizeof(struct closest_snapshot*));
+    state->analysis_running = false;
+    state->analysis_joinable = false;
+
+    // Check incremental supersession against pairing every head on every pass
+    get_int_env("SUPERSESSION_VERIFY", &state->supersession_verify, 0);
+
+    // Link rotated macs as one device once the same claim has held for this many passes
+    get_int_env("IDENTITY_PASSES", &state->identity_passes, 3);
+
+    // Score only recordings closest to this many of a device's closest access points, 0 = score them all.
+    // Off by default as it can pick a different patch (see bin/bench/recordingindex for how often)
+    get_int_env("KNN_PROBES", &state->knn_probes, 0);
+
     // MQTT Settings
 
     get_string_env("MQTT_TOPIC", &state->mqtt_topic, "BLF");  // sorry, historic name
@@ -181,8 +251,18 @@ void display_state(struct OverallState* state)
     g_info("UDP_MESH_PORT=%i", state->udp_mesh_port);
     g_info("UDP_SIGN_PORT=%i", state->udp_sign_port);
     g_info("UDP_SCALE_FACTOR=%.1f", state->udp_scale_factor);
+    g_info("COALESCE_MS=%i", state->coalesce_ms);
+    g_info("INGEST=%s", state->ingest);
+    if (state->use_hci) g_info("HCI_DEVICE=%i HCI_REPLAY='%s'", state->hci_device, state->hci_replay);
+    g_info("INGEST_QUEUE=%i MESH_QUEUE=%i", state->bluez_queue_capacity, state->mesh_queue_capacity);
+    g_info("ANALYSIS_THREADS=%i", state->analysis_pool.threads);
+    g_info("SUPERSESSION_VERIFY=%i", state->supersession_verify);
+    g_info("IDENTITY_PASSES=%i", state->identity_passes);
+    g_info("KNN_PROBES=%i", state->knn_probes);
 
     g_info("VERBOSITY=%i", state->verbosity);
+    g_info("DEVICE_CAPACITY=%i", state->devices.max_capacity);
+    g_info("DEVICE_MEMORY_KB=%li (%li bytes per device)", state->devices.memory_budget / 1024, device_store_bytes_per_slot());
     g_info("DBUS_SENDER=%i", state->isMain);
 
     g_info("MQTT_TOPIC='%s'", state->mqtt_topic);
@@ -215,3 +295,15 @@ void display_state(struct OverallState* state)
     for (struct Beacon* beacon = state->beacons; beacon != NULL; beacon=beacon->next){ count ++; }
     g_info("ASSET_COUNT: %i", count);
 }
+
+/*
+   Schedule the ingest drain on the main loop after a push, callable from any thread
+   Only the first push after a drain finishes adds an idle source, the rest ride along
+*/
+void ingest_wake(struct OverallState* state)
+{
+    if (__atomic_exchange_n(&state->ingest_wake, 1, __ATOMIC_ACQ_REL) == 0)
+    {
+        g_idle_add(state->ingest_drain, state);
+    }
+}
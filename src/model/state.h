@@ -3,17 +3,26 @@
 
 #include "device.h"
 #include "aggregate.h"
+#include "devicestore.h"
+#include "mpscqueue.h"
+#include "nodepool.h"
+#include "closestsnapshot.h"
+#include "workpool.h"
+#include "identity.h"
+#include "recordingstore.h"
+#include "placeids.h"
+#include "utility.h"
 #include <pthread.h>
 #include "sniffer-generated.h"
 
-// Shared device state object (one globally for app, thread safe access needed)
+// Shared device state object (one globally for app, only the main loop mutates it,
+// other threads hand their work to it through the ingest queues, apart from the analysis
+// thread which has the closest snapshot and the patch totals while a pass runs)
 struct OverallState
 {
-   int n; // current devices
    bool network_up;        // Is the network up
    bool web_polling;        // website is running locally
-   pthread_mutex_t lock;
-   struct Device devices[N];
+   struct device_store devices; // local devices, indexed by mac64
 
    // Time when service started running (used to print a delta time)
    time_t started;
@@ -36,6 +45,40 @@ struct OverallState
    int udp_sign_port;      // The display for this group of sensors
    int udp_mesh_port;      // The mesh port for this group of sensors
    float udp_scale_factor; // Scale factor to multiply people by to send to screen
+
+   // Coalescing of closest updates and mesh sends for bursts of PropertiesChanged
+   int coalesce_ms;                   // window, 0 = send on every change
+   struct device_handle* pending;     // devices waiting for the end of the window
+   int pending_count;
+   int pending_capacity;
+   bool pending_timer;                // flush is scheduled
+   long sends_requested;              // changes that asked for a send
+   long sends_made;                   // sends actually made
+
+   // Where adverts come from: BlueZ over DBus or a raw HCI socket / capture replay
+   char *ingest;                      // "bluez" or "hci"
+   bool use_hci;                      // ingest is "hci"
+   int hci_device;                    // hciN to open for live HCI ingest
+   char *hci_replay;                  // btsnoop or pcap file to replay instead, "" for live
+
+   // Ingest queues, producers push and the main loop drains them in batches
+   struct mpsc_queue bluez_queue;     // device reports from D-Bus signals
+   struct mpsc_queue mesh_queue;      // datagrams from the UDP listener thread
+   int bluez_queue_capacity;
+   int mesh_queue_capacity;
+   int ingest_wake;                   // a drain is scheduled, set atomically by producers
+   GSourceFunc ingest_drain;          // drains both queues on the main loop
+
+   // Threads for the analysis pass (supersession pairs and locations), the main loop is one of them
+   int analysis_threads;
+   struct work_pool analysis_pool;
+
+   // The pass runs on its own thread against the closest snapshot, the main loop keeps ingesting
+   // and publishes the results when the snapshot comes back through the analysis queue
+   struct mpsc_queue analysis_queue;  // finished snapshots, drained with the ingest queues
+   pthread_t analysis_thread;
+   bool analysis_running;             // started and not yet published
+   bool analysis_joinable;            // on analysis_thread, not run on the main loop
    // TODO: Settable parameters for the display
 
    char *mqtt_topic;
@@ -84,8 +127,14 @@ struct OverallState
    // linked list of groups
    struct group* groups;
 
+   // dense ids for patches, rooms and groups, and summaries by id reused every pass
+   struct place_ids place_ids;
+   struct summaries room_summary;
+   struct summaries group_summary;
+
    // linked list of recorded locations for k-means
    struct recording* recordings;
+   struct recording_store recording_store;   // owns the recordings, reloads them when the files change
 
 //   // Most recent 2048 closest to observations
 //   int closest_n;
@@ -97,6 +146,24 @@ struct OverallState
 
    // Chain of chains of closest records
    struct ClosestHead* closestHead;
+   struct ClosestHead* closestTail;   // least recently updated, pruned from here
+   long closest_pruned;               // heads removed by age or count
+   struct mac_map closest_index;      // mac64 -> ClosestHead*, one head per mac
+   struct node_pool head_pool;        // ClosestHead nodes
+   struct node_pool closest_pools[CLOSEST_SIZE_CLASSES];  // ClosestTo arrays by size class
+   struct node_pool room_pool;        // RecentRoom nodes
+   struct closest_snapshot closest_snapshot;  // copy of the chain the analysis pass works on
+   long supersession_pairs;           // head pairs the supersession pass would compare without buckets
+   long supersession_examined;        // pairs actually compared after bucketing and the interval index
+   long supersession_recomputed;      // heads paired again because they were updated since the last pass
+   long supersession_reused;          // pairs kept from an earlier pass
+   int supersession_verify;           // also pair every head and compare, for testing
+   long supersession_verified;        // passes checked against a full pass
+   long supersession_mismatches;      // heads claimed differently by the full pass
+   struct identity_graph identities;  // macs linked as the same device after rotating
+   int identity_passes;               // consecutive passes a claim must hold to be linked, 0 = never link
+   long supersession_hidden;          // heads left out of pairing as they are behind an identity tip
+   int knn_probes;                    // closest access points whose recordings k_nearest scores, 0 = all
 
    // linked list of beacons
    struct Beacon* beacons;
@@ -146,4 +213,9 @@ void initialize_state(struct OverallState* state);
 */
 void display_state(struct OverallState* state);
 
+/*
+   Schedule the ingest drain on the main loop after a push, callable from any thread
+*/
+void ingest_wake(struct OverallState* state);
+
 #endif
@@ -27,6 +27,8 @@
 #include "closest.h"
 #include "webhook.h"
 #include "state.h"
+#include "perfcount.h"
+#include "hci.h"
 #include "sniffer-generated.h"
 #include "sniffer-dbus.h"
 
@@ -71,7 +73,14 @@ static bool starting = TRUE;
 // Handle Ctrl-c
 void int_handler(int);
 
+// Send the counts when the analysis pass is done
+static void report_counts_finished();
+
 static int id_gen = 0;
+
+// Cache misses per BlueZ ingest and per expiry sweep (only when PERF_COUNTERS=1)
+static struct perf_count ingest_perf = { .name = "ingest" };
+static struct perf_count sweep_perf = { .name = "clear_cache sweep" };
 bool logTable = FALSE; // set to true each time something changes
 
 /*
@@ -99,21 +108,8 @@ void apply_known_beacons(struct OverallState* state, struct Device* device)
     }
 }
 
-/*
-   Remove a device from array and move all later devices up one spot
-*/
-void remove_device(int index)
-{
-    for (int i = index; i < state.n - 1; i++)
-    {
-        state.devices[i] = state.devices[i + 1];
-    }
-    state.n--;
-}
-
 #define MAX_TIME_AGO_COUNTING_MINUTES 5
 #define MAX_TIME_AGO_LOGGING_MINUTES 10
-#define MAX_TIME_AGO_CACHE 60
 
 // Updated before any function that needs to calculate relative time
 time_t now;
@@ -128,658 +124,877 @@ void report_devices_count()
 }
 
 /*
-    Report a new or changed device to MQTT endpoint
-    NOTE: Free's address when done
+   Everything a BlueZ property handler needs from report_device_internal
 */
-static void report_device_internal(GVariant *properties, char *known_address, bool isUpdate)
+struct property_update
 {
-    logTable = TRUE;
-    //pretty_print("report_device", properties);
-    char address[18];
+    struct device_handle device;    // resolved by each handler, NULL once the device has gone
+    char *address;
+    const char *property_name;
+    bool isUpdate;
+    bool send_distance;     // set when the distance should be sent once all properties are handled
+    bool update_latest;     // cleared for a disconnect which is sent after the device has gone
+};
 
-    if (known_address)
+typedef void (*property_handler)(struct property_update *u, GVariant *prop_val);
+
+/*
+   Device an update is for, NULL if it has been removed since the update started
+*/
+static struct Device *property_device(struct property_update *u)
+{
+    return device_store_resolve(&state.devices, u->device);
+}
+
+static void prop_ignore(struct property_update *u, GVariant *prop_val)
+{
+    (void)u;
+    (void)prop_val;
+}
+
+static void prop_print(struct property_update *u, GVariant *prop_val)
+{
+    pretty_print2(u->property_name, prop_val, TRUE);
+}
+
+static void update_name(struct property_update *u, char *name)
+{
+    struct Device *existing = property_device(u);
+    if (existing == NULL) return;
+
+    // Trim whitespace (Bad Tracker device keeps flipping name)
+    trim(name);
+
+    // -1 on name length because of a badly behaved beacon I have!
+    if (strncmp(name, existing->name, NAME_LENGTH - 1) != 0)
     {
-        g_strlcpy(address, known_address, 18);
+        // g_debug("  %s changed name '%s' -> '%s'\n", u->address, existing->name, name);
+#ifdef MQTT
+        if (state.network_up) send_to_mqtt_single(u->address, "name", name);
+#endif
+        u->send_distance = TRUE;
+        set_name(existing, name, nt_known, "bt");
+
+        apply_known_beacons(&state, existing);        // must apply beacons first to prevent hashing names
+        apply_name_heuristics (existing, name);
     }
-    else
+}
+
+static void prop_name(struct property_update *u, GVariant *prop_val)
+{
+    char *name = g_variant_dup_string(prop_val, NULL);
+    update_name(u, name);
+    g_free(name);  // Free allocated memory
+}
+
+static void prop_alias(struct property_update *u, GVariant *prop_val)
+{
+    struct Device *existing = property_device(u);
+    if (existing == NULL) return;
+
+    char *alias = g_variant_dup_string(prop_val, NULL);
+    if (alias)
     {
-        // Get address from properies dictionary if not already present
-        GVariant *address_from_dict = g_variant_lookup_value(properties, "Address", G_VARIANT_TYPE_STRING);
-        if (address_from_dict)
+        trim(alias);
+
+        if (strncmp(alias, existing->alias, NAME_LENGTH - 1) != 0) // has_prefix because we may have truncated it
         {
-            const char *addr = g_variant_get_string(address_from_dict, NULL);
-            if (addr) {
-                g_strlcpy(address, addr, 18);
-            } else {
-                g_warning("ERROR address from variant is null");
-                return;
-            }
-            g_variant_unref(address_from_dict);
+            //g_debug("  %s Alias has changed '%s' -> '%s'\n", u->address, existing->alias, alias);
+            // NOT CURRENTLY USED: send_to_mqtt_single(u->address, "alias", alias);
+            g_strlcpy(existing->alias, alias, NAME_LENGTH);
         }
         else
         {
-            g_warning("ERROR address is null");
-            return;
+            // g_print("  Alias unchanged '%s'=='%s'\n", alias, existing->alias);
         }
+        g_free(alias);  // Free allocated memory
     }
+}
 
-    struct Device *existing = NULL;
+static void update_address_type(struct property_update *u, const char *addressType)
+{
+    struct Device *existing = property_device(u);
+    if (existing == NULL) return;
 
-    // Get existing device report
-    for (int i = 0; i < state.n; i++)
+    int newAddressType = (g_strcmp0("public", addressType) == 0) ? PUBLIC_ADDRESS_TYPE : RANDOM_ADDRESS_TYPE;
+
+    // Compare values and send
+    if (existing->address_type != newAddressType)
     {
-        if (memcmp(state.devices[i].mac, address, 18) == 0)
+        existing->address_type = newAddressType;
+        if (newAddressType == PUBLIC_ADDRESS_TYPE)
         {
-            existing = &state.devices[i];
+            g_trace("  %s Address type: '%s'", u->address, addressType);
+            // Not interested in random as most devices are random
+            apply_known_beacons(&state, existing);
+            apply_mac_address_heuristics(existing);
         }
+#ifdef MQTT
+        if (state.network_up) send_to_mqtt_single(u->address, "type", addressType);
+#endif
     }
-
-    if (existing == NULL)
+    else
     {
-        if (!isUpdate)
-        {
-            // These devices need to be removed from BLUEZ otherwise BLUEZ's cache gets huge!
-            // g_warning("report_devices_internal, not an update, not found");
-            //pretty_print2("Properties", properties, true);
-            //g_debug("Remove %s, bluez get_devices called back, and not seen yet", address);
-            bluez_remove_device(conn, address);
-            return;
-        }
+        // DEBUG g_print("  Address type unchanged\n");
+    }
+}
 
-        if (state.n == N)
-        {
-            g_warning("Error, array of devices is full");
-            return;
-        }
+static void prop_address_type(struct property_update *u, GVariant *prop_val)
+{
+    char *addressType = g_variant_dup_string(prop_val, NULL);
+    update_address_type(u, addressType);
+    g_free(addressType);
+}
 
-        // Grab the next empty item in the array
-        existing = &state.devices[state.n++];
-        existing->id = id_gen++;                // unique ID for each
-        existing->ttl = 10;                     // arbitrary, set during countdown to ejection
-        existing->hidden = false;               // we own this one
-        g_strlcpy(existing->mac, address, 18);  // address
-        existing->mac64 = mac_string_to_int_64(address);    // mac64
-
-        // dummy struct filled with unmatched values
-        existing->name[0] = '\0';
-        existing->name_type = nt_initial;
-        existing->alias[0] = '\0';
-        existing->address_type = 0;
-        existing->category = CATEGORY_UNKNOWN;
-        existing->connected = FALSE;
-        existing->trusted = FALSE;
-        existing->paired = FALSE;
-        existing->bonded = FALSE;
-        existing->deviceclass = 0;
-        existing->manufacturer_data_hash = 0;
-        existing->service_data_hash = 0;
-        existing->appearance = 0;
-        existing->uuids_length = 0;
-        existing->uuid_hash = 0;
-        existing->txpower = 12;
-        time(&existing->earliest);
-        existing->count = 0;
-        existing->try_connect_state = TRY_CONNECT_ZERO;
-        existing->try_connect_attempts = 0;
-        existing->is_training_beacon = false;
-        existing->known_interval = 0;
-
-        time(&existing->last_sent);
-        time(&existing->last_rssi);
-
-        // RSSI values are stored with kalman filtering
-        kalman_initialize(&existing->filtered_rssi);
-        existing->raw_rssi = -90;
-        existing->distance = 10;
+static void update_rssi(struct property_update *u, int16_t rssi)
+{
+    struct Device *existing = property_device(u);
+    if (existing == NULL) return;
+
+    //send_to_mqtt_single_value(u->address, "rssi", rssi);
 
-        existing->last_sent = existing->last_sent - 1000; //1s back so first RSSI goes through
-        existing->last_rssi = existing->last_rssi - 1000;
+    time_t now;
+    time(&now);
 
-        kalman_initialize(&existing->kalman_interval);
+    // track gap between RSSI received events
+    double delta_time_received = difftime(now, existing->last_rssi);
+    time(&existing->last_rssi);
+    state.devices.raw_rssi[existing->slot] = rssi;  // unfiltered
 
-        g_info("Added device %i. %s", existing->id, address);
-        apply_known_beacons(&state, existing);
+    // If the gap is large we maybe lost this device and now it's back, so we can't assume continuity
+    if (delta_time_received > 1000)
+    {
+        kalman_initialize(&existing->filtered_rssi);
     }
-    else
+
+    double smoothed_rssi = kalman_update(&existing->filtered_rssi, rssi);
+
+    // TODO: Different devices have different signal strengths
+    // iPad, Apple TV, Samsung TV, ... seems to be particulary strong. Need to calibrate this and have
+    // a per-device. PowerLevel is supposed to do this but it's not reliably sent.
+    double rangefactor = 1.0;
+
+    double exponent = ((state.local->rssi_one_meter  - smoothed_rssi) / (10.0 * state.local->rssi_factor));
+
+    double distance = pow(10.0, exponent) * rangefactor;
+
+    if (distance > 99.0) distance = 99.0;  // eliminate the ridiculous
+
+    state.devices.distance[existing->slot] = distance;
+
+    // 10s with distance change of 1m triggers send
+    // 1s with distance change of 10m triggers send
+
+    //int delta_time_sent = difftime(now, existing->last_sent);
+    //double delta_v = fabs(existing->distance - averaged);
+    //double score = delta_v * delta_time_sent;
+
+    //if (score > 10.0 || delta_time_sent > 10)
     {
-        if (!isUpdate)
-        {
-            // from get_all_devices which includes stale data
-            //g_debug("Repeat device %i. %s '%s' (%s)\n", existing->id, address, existing->name, existing->alias);
-        }
-        else
-        {
-            g_trace("Existing device %i. %s '%s' (%s)", existing->id, address, existing->name, existing->alias);
-        }
+        //g_print("  %s Will send rssi=%i dist=%.1fm, delta v=%.1fm t=%.0fs score=%.0f\n", u->address, rssi, averaged, delta_v, delta_time_sent, score);
+        u->send_distance = TRUE;
+        g_trace("  %s RSSI %i filtered=%.1f d=%.1fm", u->address, rssi, existing->filtered_rssi.current_estimate, distance);
     }
+    //else
+    //{
+    //    g_trace("  %s Skip sending rssi=%i dist=%.1fm, delta v=%.1fm t=%is score=%.0f", u->address, rssi, averaged, delta_v, delta_time_sent, score);
+    //}
+}
 
-    // Mark the most recent time for this device (but not if it's a get all devices call)
+static void prop_rssi(struct property_update *u, GVariant *prop_val)
+{
+    if (!u->isUpdate)
+    {
+        // Ignore this, it isn't helpful when it's not an update
+        // int16_t rssi = g_variant_get_int16(prop_val);
+        // g_print("  %s RSSI repeat %i\n", u->address, rssi);
+        return;
+    }
 
-    bool update_latest = isUpdate;   // May get cancelled if we see a DISCONNECTED message
+    update_rssi(u, g_variant_get_int16(prop_val));
+}
 
-    // If after examining every key/value pair, distance has been set then we will send it
-    bool send_distance = FALSE;
+static void update_tx_power(struct property_update *u, int16_t p)
+{
+    struct Device *existing = property_device(u);
+    if (existing == NULL) return;
 
-    const gchar *property_name;
-    GVariantIter i;
-    GVariant *prop_val;
-    g_variant_iter_init(&i, properties); // no need to free this
-    while (g_variant_iter_next(&i, "{&sv}", &property_name, &prop_val))
+    if (p != existing->txpower)
     {
-        //bool isStringValue = g_variant_type_equal(g_variant_get_type(prop_val), G_VARIANT_TYPE_STRING);
+        g_trace("  %s TXPOWER has changed %i\n", u->address, p);
+        // NOT CURRENTLY USED ... send_to_mqtt_single_value(u->address, "txpower", p);
+        existing->txpower = p;
+    }
+}
 
-        if (strcmp(property_name, "Address") == 0)
-        {
-            // do nothing, already picked off
-        }
-        else if (strcmp(property_name, "Name") == 0)
-        {
-            char *name = g_variant_dup_string(prop_val, NULL);
+static void prop_tx_power(struct property_update *u, GVariant *prop_val)
+{
+    update_tx_power(u, g_variant_get_int16(prop_val));
+}
 
-            // Trim whitespace (Bad Tracker device keeps flipping name)
-            trim(name);
+static void prop_paired(struct property_update *u, GVariant *prop_val)
+{
+    struct Device *existing = property_device(u);
+    if (existing == NULL) return;
 
-            // -1 on name length because of a badly behaved beacon I have!
-            if (strncmp(name, existing->name, NAME_LENGTH - 1) != 0)
-            {
-                // g_debug("  %s changed name '%s' -> '%s'\n", address, existing->name, name);
+    bool paired = g_variant_get_boolean(prop_val);
+    if (existing->paired != paired)
+    {
+        g_debug("  %s Paired has changed        ", u->address);
 #ifdef MQTT
-                if (state.network_up) send_to_mqtt_single(address, "name", name);
+        if (state.verbosity >= Details) {
+            if (state.network_up) send_to_mqtt_single_value(u->address, "paired", paired ? 1 : 0);
+        }
 #endif
-                send_distance = TRUE;
-                set_name(existing, name, nt_known, "bt");
+        existing->paired = paired;
+    }
+}
 
-                apply_known_beacons(&state, existing);        // must apply beacons first to prevent hashing names
-                apply_name_heuristics (existing, name);
-            }
+static void prop_bonded(struct property_update *u, GVariant *prop_val)
+{
+    struct Device *existing = property_device(u);
+    if (existing == NULL) return;
 
-            g_free(name);  // Free allocated memory
+    bool bonded = g_variant_get_boolean(prop_val);
+    if (existing->bonded != bonded)
+    {
+        g_debug("  %s Bonded has changed        ", u->address);
+#ifdef MQTT
+        if (state.verbosity >= Details) {
+            if (state.network_up) send_to_mqtt_single_value(u->address, "bonded", bonded ? 1 : 0);
         }
-        else if (strcmp(property_name, "Alias") == 0)
-        {
-            char *alias = g_variant_dup_string(prop_val, NULL);
-            if (alias)
-            {
-                trim(alias);
+#endif
+        existing->bonded = bonded;
+    }
+}
 
-                if (strncmp(alias, existing->alias, NAME_LENGTH - 1) != 0) // has_prefix because we may have truncated it
-                {
-                    //g_debug("  %s Alias has changed '%s' -> '%s'\n", address, existing->alias, alias);
-                    // NOT CURRENTLY USED: send_to_mqtt_single(address, "alias", alias);
-                    g_strlcpy(existing->alias, alias, NAME_LENGTH);
-                }
-                else
-                {
-                    // g_print("  Alias unchanged '%s'=='%s'\n", alias, existing->alias);
-                }
-                g_free(alias);  // Free allocated memory
-            }
-        }
-        else if (strcmp(property_name, "AddressType") == 0)
-        {
-            char *addressType = g_variant_dup_string(prop_val, NULL);
-            int newAddressType = (g_strcmp0("public", addressType) == 0) ? PUBLIC_ADDRESS_TYPE : RANDOM_ADDRESS_TYPE;
+static void prop_connected(struct property_update *u, GVariant *prop_val)
+{
+    struct Device *existing = property_device(u);
+    if (existing == NULL) return;
 
-            // Compare values and send
-            if (existing->address_type != newAddressType)
-            {
-                existing->address_type = newAddressType;
-                if (newAddressType == PUBLIC_ADDRESS_TYPE)
-                {
-                    g_trace("  %s Address type: '%s'", address, addressType);
-                    // Not interested in random as most devices are random
-                    apply_known_beacons(&state, existing);
-                    apply_mac_address_heuristics(existing);
-                }
-#ifdef MQTT
-                if (state.network_up) send_to_mqtt_single(address, "type", addressType);
-#endif
-            }
-            else
-            {
-                // DEBUG g_print("  Address type unchanged\n");
-            }
-            g_free(addressType);
-        }
-        else if (strcmp(property_name, "RSSI") == 0 && !isUpdate)
+    bool connected_device = g_variant_get_boolean(prop_val);
+    if (existing->connected != connected_device)
+    {
+        if (connected_device)
+            g_debug("  %s Connected      ", u->address);
+        else
         {
-            // Ignore this, it isn't helpful when it's not an update
-            // int16_t rssi = g_variant_get_int16(prop_val);
-            // g_print("  %s RSSI repeat %i\n", address, rssi);
+            g_debug("  %s Disconnected   ", u->address);
+            // And do not count this as an updated time
+            u->update_latest = FALSE;
         }
-        else if (strcmp(property_name, "RSSI") == 0)
-        {
-            int16_t rssi = g_variant_get_int16(prop_val);
-            //send_to_mqtt_single_value(address, "rssi", rssi);
-
-            time_t now;
-            time(&now);
 
-            // track gap between RSSI received events
-            double delta_time_received = difftime(now, existing->last_rssi);
-            time(&existing->last_rssi);
-            existing->raw_rssi = rssi;  // unfiltered
-
-            // If the gap is large we maybe lost this device and now it's back, so we can't assume continuity
-            if (delta_time_received > 1000)
-            {
-                kalman_initialize(&existing->filtered_rssi);
-            }
+#ifdef MQTT
+        if (state.verbosity >= Details) {
+          if (state.network_up) send_to_mqtt_single_value(u->address, "connected", connected_device ? 1 : 0);
+        }
+#endif
+        existing->connected = connected_device;
+    }
+}
 
-            double smoothed_rssi = kalman_update(&existing->filtered_rssi, rssi);
+static void prop_trusted(struct property_update *u, GVariant *prop_val)
+{
+    struct Device *existing = property_device(u);
+    if (existing == NULL) return;
 
-            // TODO: Different devices have different signal strengths
-            // iPad, Apple TV, Samsung TV, ... seems to be particulary strong. Need to calibrate this and have
-            // a per-device. PowerLevel is supposed to do this but it's not reliably sent.
-            double rangefactor = 1.0;
+    bool trusted = g_variant_get_boolean(prop_val);
+    if (existing->trusted != trusted)
+    {
+        g_debug("  %s Trusted has changed       ", u->address);
+#ifdef MQTT
+        if (state.verbosity >= Details) {
+            if (state.network_up) send_to_mqtt_single_value(u->address, "trusted", trusted ? 1 : 0);
+        }
+#endif
+        existing->trusted = trusted;
+    }
+}
 
-            double exponent = ((state.local->rssi_one_meter  - smoothed_rssi) / (10.0 * state.local->rssi_factor));
+static void update_uuids(struct property_update *u, char **uuidArray, int actualLength)
+{
+    struct Device *existing = property_device(u);
+    if (existing == NULL) return;
 
-            double distance = pow(10.0, exponent) * rangefactor;
+    int uuid_hash = 0;
+    int existing_uuid_hash = existing->uuid_hash;
 
-            if (distance > 99.0) distance = 99.0;  // eliminate the ridiculous
+    for (int j = 0; j < actualLength; j++)
+    {
+        const char *str = uuidArray[j];
+        for (uint32_t i = 0; i < strlen(str); i++)
+        {
+            uuid_hash += (i + 1) * str[i]; // sensitive to position in UUID but not to order of UUIDs
+        }
+    }
 
-            existing->distance = distance;
+    if (actualLength > 0)
+    {
+        existing->uuid_hash = uuid_hash & 0xffffffff;
+    }
 
-            // 10s with distance change of 1m triggers send
-            // 1s with distance change of 10m triggers send
+    if ((existing->uuid_hash != existing_uuid_hash))
+    {
+        char gatts[1024];
+        gatts[0] = '\0';
 
-            //int delta_time_sent = difftime(now, existing->last_sent);
-            //double delta_v = fabs(existing->distance - averaged);
-            //double score = delta_v * delta_time_sent;
+        bool was = existing->is_training_beacon;
+        existing->is_training_beacon = false;  // will set true if it's still there after (handles beacon stopping on iPhone nRF app)
+        handle_uuids(existing, uuidArray, actualLength, gatts, sizeof(gatts));
 
-            //if (score > 10.0 || delta_time_sent > 10)
-            {
-                //g_print("  %s Will send rssi=%i dist=%.1fm, delta v=%.1fm t=%.0fs score=%.0f\n", address, rssi, averaged, delta_v, delta_time_sent, score);
-                send_distance = TRUE;
-                g_trace("  %s RSSI %i filtered=%.1f d=%.1fm", address, rssi, existing->filtered_rssi.current_estimate, distance);
-            }
-            //else
-            //{
-            //    g_trace("  %s Skip sending rssi=%i dist=%.1fm, delta v=%.1fm t=%is score=%.0f", address, rssi, averaged, delta_v, delta_time_sent, score);
-            //}
+        if (was && !existing->is_training_beacon){
+            g_warning("  %s (%s) is no longer transmitting an Indoor Positioning UUID", existing->mac, existing->name);
         }
-        else if (strcmp(property_name, "TxPower") == 0)
+        else if (!was && existing->is_training_beacon)
         {
-            int16_t p = g_variant_get_int16(prop_val);
-            if (p != existing->txpower)
-            {
-                g_trace("  %s TXPOWER has changed %i\n", address, p);
-                // NOT CURRENTLY USED ... send_to_mqtt_single_value(address, "txpower", p);
-                existing->txpower = p;
-            }
+            g_warning("  %s (%s) is now transmitting an Indoor Positioning UUID", existing->mac, existing->name);
         }
 
-        else if (strcmp(property_name, "Paired") == 0)
+        if (actualLength > 0)
         {
-            bool paired = g_variant_get_boolean(prop_val);
-            if (existing->paired != paired)
-            {
-                g_debug("  %s Paired has changed        ", address);
+            char **allocdata = g_malloc(actualLength * sizeof(char *)); // array of pointers to strings
+            memcpy(allocdata, uuidArray, actualLength * sizeof(char *));
+            g_info ("  %s UUIDs: %s", u->address, gatts);
 #ifdef MQTT
-                if (state.verbosity >= Details) {
-                    if (state.network_up) send_to_mqtt_single_value(address, "paired", paired ? 1 : 0);
-                }
-#endif
-                existing->paired = paired;
+            if (state.network_up && state.verbosity >= Details) {
+                send_to_mqtt_uuids(u->address, "uuids", allocdata, actualLength);
             }
-        }
-
-        else if (strcmp(property_name, "Bonded") == 0)
-        {
-            bool bonded = g_variant_get_boolean(prop_val);
-            if (existing->bonded != bonded)
-            {
-                g_debug("  %s Bonded has changed        ", address);
-#ifdef MQTT
-                if (state.verbosity >= Details) {
-                    if (state.network_up) send_to_mqtt_single_value(address, "bonded", bonded ? 1 : 0);
-                }
 #endif
-                existing->bonded = bonded;
-            }
+            g_free(allocdata); // no need to free the actual strings, that happens below
         }
-        else if (strcmp(property_name, "Connected") == 0)
-        {
-            bool connected_device = g_variant_get_boolean(prop_val);
-            if (existing->connected != connected_device)
-            {
-                if (connected_device)
-                    g_debug("  %s Connected      ", address);
-                else
-                {
-                    g_debug("  %s Disconnected   ", address);
-                    // And do not count this as an updated time
-                    update_latest = FALSE;
-                }
+        existing->uuids_length = actualLength;
+    }
+    else 
+    {
+       // g_debug("  %s UUIDs unchanged", existing->mac);
+    }
+}
 
+static void prop_uuids(struct property_update *u, GVariant *prop_val)
+{
+    //pretty_print2("UUIDs", prop_val, TRUE);  // as
+    //char **array = (char**) malloc((N+1)*sizeof(char*));
+
+    char *uuidArray[2048];
+    int actualLength = 0;
+
+    GVariantIter *iter_array;
+    char *str;
+
+    g_variant_get(prop_val, "as", &iter_array);
+
+    while (g_variant_iter_loop(iter_array, "s", &str))
+    {
+        if (strlen(str) < 36)
+            continue; // invalid GUID
+
+        uuidArray[actualLength++] = strdup(str);
+    }
+    g_variant_iter_free(iter_array);
+
+    update_uuids(u, uuidArray, actualLength);
+
+    // Free up the individual UUID strings after sending them
+    for (int i = 0; i < actualLength; i++)
+    {
+        g_free(uuidArray[i]);
+    }
+}
+
+static void prop_class(struct property_update *u, GVariant *prop_val)
+{
+    struct Device *existing = property_device(u);
+    if (existing == NULL) return;
+
+    // Very few devices send this information (not very useful)
+    uint32_t deviceclass = g_variant_get_uint32(prop_val);
+    if (existing->deviceclass != deviceclass)
+    {
+        g_debug("  %s Class has changed to 0x%.4x ", u->address, deviceclass);
 #ifdef MQTT
-                if (state.verbosity >= Details) {
-                  if (state.network_up) send_to_mqtt_single_value(address, "connected", connected_device ? 1 : 0);
-                }
-#endif
-                existing->connected = connected_device;
-            }
-        }
-        else if (strcmp(property_name, "Trusted") == 0)
-        {
-            bool trusted = g_variant_get_boolean(prop_val);
-            if (existing->trusted != trusted)
-            {
-                g_debug("  %s Trusted has changed       ", address);
-#ifdef MQTT
-                if (state.verbosity >= Details) {
-                    if (state.network_up) send_to_mqtt_single_value(address, "trusted", trusted ? 1 : 0);
-                }
+        if (state.network_up) send_to_mqtt_single_value(u->address, "class", deviceclass);
 #endif
-                existing->trusted = trusted;
-            }
-        }
-        else if (strcmp(property_name, "LegacyPairing") == 0)
-        {
-            // not used
-        }
-        else if (strcmp(property_name, "Blocked") == 0)
-        {
-            // not used
-        }
-        else if (strcmp(property_name, "UUIDs") == 0)
-        {
-            //pretty_print2("UUIDs", prop_val, TRUE);  // as
-            //char **array = (char**) malloc((N+1)*sizeof(char*));
+        existing->deviceclass = deviceclass;
 
-            char *uuidArray[2048];
-            int actualLength = 0;
+        handle_class(existing, deviceclass);
+    }
+}
 
-            GVariantIter *iter_array;
-            char *str;
+static void prop_icon(struct property_update *u, GVariant *prop_val)
+{
+    struct Device *existing = property_device(u);
+    if (existing == NULL) return;
 
-            int uuid_hash = 0;
-            int existing_uuid_hash = existing->uuid_hash;
+    char *icon = g_variant_dup_string(prop_val, NULL);
 
-            g_variant_get(prop_val, "as", &iter_array);
+    if (existing->category == CATEGORY_UNKNOWN)
+    {
+        // Should track icon and test against that instead
+        g_debug("  %s Icon: '%s'\n", u->address, icon);
+    }
+    handle_icon(existing, icon);
 
-            while (g_variant_iter_loop(iter_array, "s", &str))
-            {
-                if (strlen(str) < 36)
-                    continue; // invalid GUID
+    g_free(icon);
+}
 
-                uuidArray[actualLength++] = strdup(str);
+static void update_appearance(struct property_update *u, uint16_t appearance)
+{
+    struct Device *existing = property_device(u);
+    if (existing == NULL) return;
 
-                for (uint32_t i = 0; i < strlen(str); i++)
-                {
-                    uuid_hash += (i + 1) * str[i]; // sensitive to position in UUID but not to order of UUIDs
-                }
-            }
-            g_variant_iter_free(iter_array);
+    if (existing->appearance != appearance)
+    {
+        g_debug("  %s '%s' Appearance %i->%i", u->address, existing->name, existing->appearance, appearance);
+#ifdef MQTT
+        if (state.network_up) send_to_mqtt_single_value(u->address, "appearance", appearance);
+#endif
+        existing->appearance = appearance;
+    }
 
-            if (actualLength > 0)
-            {
-                existing->uuid_hash = uuid_hash & 0xffffffff;
-            }
+    handle_appearance(existing, appearance);
+}
 
-            if ((existing->uuid_hash != existing_uuid_hash))
-            {
-                char gatts[1024];
-                gatts[0] = '\0';
+static void prop_appearance(struct property_update *u, GVariant *prop_val)
+{   // type 'q' which is uint16
+    update_appearance(u, g_variant_get_uint16(prop_val));
+}
 
-                bool was = existing->is_training_beacon;
-                existing->is_training_beacon = false;  // will set true if it's still there after (handles beacon stopping on iPhone nRF app)
-                handle_uuids(existing, uuidArray, actualLength, gatts, sizeof(gatts));
+static void prop_service_data(struct property_update *u, GVariant *prop_val)
+{
+    struct Device *existing = property_device(u);
+    if (existing == NULL) return;
 
-                if (was && !existing->is_training_beacon){
-                    g_warning("  %s (%s) is no longer transmitting an Indoor Positioning UUID", existing->mac, existing->name);
-                }
-                else if (!was && existing->is_training_beacon)
-                {
-                    g_warning("  %s (%s) is now transmitting an Indoor Positioning UUID", existing->mac, existing->name);
-                }
+    if (u->isUpdate == FALSE)
+    {
+        return; // ignore this, it's stale
+    }
+    // A a{sv} value
+    // {'000080e7-0000-1000-8000-00805f9b34fb':
+    //    <[byte 0xb0, 0x23, 0x25, 0xcb, ...]>}
+    //    <[byte 0xb0, 0x23, 0x25, 0xcb, 0x66, 0x54, 0xae, 0xab, 0x0a, 0x2b, 0x00, 0x04, 0x33, 0x09, 0xee, 0x60, 0x24, 0x2e, 0x00, 0xf7, 0x07, 0x00, 0x00]>}
 
-                if (actualLength > 0)
-                {
-                    char **allocdata = g_malloc(actualLength * sizeof(char *)); // array of pointers to strings
-                    memcpy(allocdata, uuidArray, actualLength * sizeof(char *));
-                    g_info ("  %s UUIDs: %s", address, gatts);
+    //pretty_print2("  ServiceData ", prop_val, TRUE); // a{sv}
+
+    GVariant *s_value;
+    GVariantIter i;
+    char *service_guid;
+
+    g_variant_iter_init(&i, prop_val);
+    while (g_variant_iter_next(&i, "{sv}", &service_guid, &s_value))
+    { // Just one
+
+        uint16_t hash;
+        int actualLength;
+        unsigned char *allocdata = read_byte_array(s_value, &actualLength, &hash);
+
+        if (existing->service_data_hash != hash)
+        {
+            //g_debug("  ServiceData has changed ");
+            pretty_print2_trace("  ServiceData", prop_val, TRUE); // a{qv}
+            // Sends the service GUID as a key in the JSON object
 #ifdef MQTT
-                    if (state.network_up && state.verbosity >= Details) {
-                        send_to_mqtt_uuids(address, "uuids", allocdata, actualLength);
-                    }
+            if (state.network_up && state.verbosity >= Details) {
+              send_to_mqtt_array(u->address, "ServiceData", service_guid, allocdata, actualLength);
+            }
 #endif
-                    g_free(allocdata); // no need to free the actual strings, that happens below
+            existing->service_data_hash = hash;
+
+            // temp={p[16] - 10} brightness={p[17]} motioncount={p[19] + p[20] * 256} moving={p[22]}");
+            if (strcmp(service_guid, "000080e7-0000-1000-8000-00805f9b34fb") == 0)
+            { 
+                // Sensoro (used during testing, hence special treatement, TODO: Generalize)
+                if (strlen(existing->name) == 0) { 
+                    g_strlcpy(existing->name, "Sensoro", NAME_LENGTH);
                 }
-                existing->uuids_length = actualLength;
-            }
-            else 
-            {
-               // g_debug("  %s UUIDs unchanged", existing->mac);
-            }
-            // Free up the individual UUID strings after sending them
-            for (int i = 0; i < actualLength; i++)
-            {
-                g_free(uuidArray[i]);
-            }
-        }
-        else if (strcmp(property_name, "Modalias") == 0)
-        {
-            // not used
-        }
-        else if (strcmp(property_name, "Class") == 0)
-        {
-            // Very few devices send this information (not very useful)
-            uint32_t deviceclass = g_variant_get_uint32(prop_val);
-            if (existing->deviceclass != deviceclass)
-            {
-                g_debug("  %s Class has changed to 0x%.4x ", address, deviceclass);
+                existing->category = CATEGORY_BEACON;
+
+                int battery = allocdata[14] + 256 * allocdata[15]; // ???
+                int p14 = allocdata[14];
+                int p15 = allocdata[15];
+                int temp = allocdata[16] - 10;
+                int brightness = allocdata[18];
+                int motionCount = allocdata[19] + allocdata[20] * 256;
+                int moving = allocdata[21];
+                g_debug("Sensoro battery=%i, p14=%i, p15=%i, temp=%i, brightness=%i, motionCount=%i, moving=%i\n", battery, p14, p15, temp, brightness, motionCount, moving);
 #ifdef MQTT
-                if (state.network_up) send_to_mqtt_single_value(address, "class", deviceclass);
+                send_to_mqtt_single_value(u->address, "temperature", temp);
+                send_to_mqtt_single_value(u->address, "brightness", brightness);
+                send_to_mqtt_single_value(u->address, "motionCount", motionCount);
+                send_to_mqtt_single_value(u->address, "moving", moving);
 #endif
-                existing->deviceclass = deviceclass;
-
-                handle_class(existing, deviceclass);
             }
         }
-        else if (strcmp(property_name, "Icon") == 0)
-        {
-            char *icon = g_variant_dup_string(prop_val, NULL);
 
-            if (existing->category == CATEGORY_UNKNOWN)
-            {
-                // Should track icon and test against that instead
-                g_debug("  %s Icon: '%s'\n", address, icon);
-            }
-            handle_icon(existing, icon);
+        //handle_service_data(existing, manufacturer, allocdata);
+
+        g_variant_unref(s_value);
+        g_free(allocdata);
+    }
+}
+
+static void update_manufacturer(struct property_update *u, uint16_t manufacturer, unsigned char *allocdata, int actualLength)
+{
+    (void)actualLength;     // only sent on with MQTT
+    struct Device *existing = property_device(u);
+    if (existing == NULL) return;
 
-            g_free(icon);
+    if (manufacturer == 0x4c && allocdata[0] == 0x02){
+        g_debug("  %s iBeacon  ", u->address);
+    } else if (manufacturer == 0x4c){
+        g_trace("  %s Manufacturer Apple  ", u->address);
+    } else {
+        g_trace("  %s Manufacturer 0x%4x  ", u->address, manufacturer);
         }
-        else if (strcmp(property_name, "Appearance") == 0)
-        { // type 'q' which is uint16
-            uint16_t appearance = g_variant_get_uint16(prop_val);
 
-            if (existing->appearance != appearance)
-            {
-                g_debug("  %s '%s' Appearance %i->%i", address, existing->name, existing->appearance, appearance);
 #ifdef MQTT
-                if (state.network_up) send_to_mqtt_single_value(address, "appearance", appearance);
+    // Need to send actual manufacturer number not always 76 here TODO
+    if (state.verbosity >= Details) {
+    send_to_mqtt_array(u->address, "manufacturerdata", "76", allocdata, actualLength);
+        }
 #endif
-                existing->appearance = appearance;
-            }
 
-            handle_appearance(existing, appearance);
-        }
-        else if (strcmp(property_name, "ServiceData") == 0)
-        {
-            if (isUpdate == FALSE)
-            {
-                continue; // ignore this, it's stale
-            }
-            // A a{sv} value
-            // {'000080e7-0000-1000-8000-00805f9b34fb':
-            //    <[byte 0xb0, 0x23, 0x25, 0xcb, ...]>}
-            //    <[byte 0xb0, 0x23, 0x25, 0xcb, 0x66, 0x54, 0xae, 0xab, 0x0a, 0x2b, 0x00, 0x04, 0x33, 0x09, 0xee, 0x60, 0x24, 0x2e, 0x00, 0xf7, 0x07, 0x00, 0x00]>}
+    if (state.devices.distance[existing->slot] > 0)
+    {
+        // And repeat the RSSI value every time someone locks or unlocks their phone
+        // Even if the change notification did not include an updated RSSI
+        //g_print("  %s Will resend distance\n", u->address);
+        u->send_distance = TRUE;
+    }
 
-            //pretty_print2("  ServiceData ", prop_val, TRUE); // a{sv}
+    handle_manufacturer(existing, manufacturer, allocdata);
+}
 
-            GVariant *s_value;
-            GVariantIter i;
-            char *service_guid;
+static void prop_manufacturer_data(struct property_update *u, GVariant *prop_val)
+{
+    struct Device *existing = property_device(u);
+    if (existing == NULL) return;
 
-            g_variant_iter_init(&i, prop_val);
-            while (g_variant_iter_next(&i, "{sv}", &service_guid, &s_value))
-            { // Just one
+    if (u->isUpdate == FALSE)
+    {
+        return; // ignore this, it's stale
+    }
+    // ManufacturerData {uint16 76: <[byte 0x10, 0x06, 0x10, 0x1a, 0x52, 0xe9, 0xc8, 0x08]>}
+    // {a(sv)}
 
-                uint16_t hash;
-                int actualLength;
-                unsigned char *allocdata = read_byte_array(s_value, &actualLength, &hash);
+    GVariant *s_value;
+    GVariantIter i;
+    uint16_t manufacturer;
 
-                if (existing->service_data_hash != hash)
-                {
-                    //g_debug("  ServiceData has changed ");
-                    pretty_print2_trace("  ServiceData", prop_val, TRUE); // a{qv}
-                    // Sends the service GUID as a key in the JSON object
-#ifdef MQTT
-                    if (state.network_up && state.verbosity >= Details) {
-                      send_to_mqtt_array(address, "ServiceData", service_guid, allocdata, actualLength);
-                    }
-#endif
-                    existing->service_data_hash = hash;
-
-                    // temp={p[16] - 10} brightness={p[17]} motioncount={p[19] + p[20] * 256} moving={p[22]}");
-                    if (strcmp(service_guid, "000080e7-0000-1000-8000-00805f9b34fb") == 0)
-                    { 
-                        // Sensoro (used during testing, hence special treatement, TODO: Generalize)
-                        if (strlen(existing->name) == 0) { 
-                            g_strlcpy(existing->name, "Sensoro", NAME_LENGTH);
-                        }
-                        existing->category = CATEGORY_BEACON;
-
-                        int battery = allocdata[14] + 256 * allocdata[15]; // ???
-                        int p14 = allocdata[14];
-                        int p15 = allocdata[15];
-                        int temp = allocdata[16] - 10;
-                        int brightness = allocdata[18];
-                        int motionCount = allocdata[19] + allocdata[20] * 256;
-                        int moving = allocdata[21];
-                        g_debug("Sensoro battery=%i, p14=%i, p15=%i, temp=%i, brightness=%i, motionCount=%i, moving=%i\n", battery, p14, p15, temp, brightness, motionCount, moving);
-#ifdef MQTT
-                        send_to_mqtt_single_value(address, "temperature", temp);
-                        send_to_mqtt_single_value(address, "brightness", brightness);
-                        send_to_mqtt_single_value(address, "motionCount", motionCount);
-                        send_to_mqtt_single_value(address, "moving", moving);
-#endif
-                    }
-                }
+    // First calculate the sum of all the manufacturerdata values to see if they have changed
+    uint16_t hash = 0;
 
-                //handle_service_data(existing, manufacturer, allocdata);
+    g_variant_iter_init(&i, prop_val);
+    while (g_variant_iter_next(&i, "{qv}", &manufacturer, &s_value))
+    {
+        int actualLength;
+        unsigned char *allocdata = read_byte_array(s_value, &actualLength, &hash);
+        g_variant_unref(s_value);
+        g_free(allocdata);
+    }
 
-                g_variant_unref(s_value);
-                g_free(allocdata);
-            }
-        }
-        else if (strcmp(property_name, "Adapter") == 0)
+    // Now read it again if it changed
+    if (existing->manufacturer_data_hash != hash)
+    {
+        existing->manufacturer_data_hash = hash;
+
+        g_variant_iter_init(&i, prop_val);
+        while (g_variant_iter_next(&i, "{qv}", &manufacturer, &s_value))
         {
+            uint16_t hash_for_one = 0;
+            int actualLength;
+            unsigned char *allocdata = read_byte_array(s_value, &actualLength, &hash_for_one);
+
+            // TODO: If detailed logging
+            pretty_print2_trace("  ManufacturerData", s_value, TRUE); // a{qv}
+
+            update_manufacturer(u, manufacturer, allocdata, actualLength);
+
+            g_variant_unref(s_value);
+            g_free(allocdata);
         }
-        else if (strcmp(property_name, "ServicesResolved") == 0)
+    }
+}
+
+/*
+   BlueZ device properties and their handlers, add a property here
+*/
+static const struct
+{
+    const char *name;
+    property_handler handler;
+} property_handlers[] = {
+    { "Address",          prop_ignore },             // already picked off
+    { "Name",             prop_name },
+    { "Alias",            prop_alias },
+    { "AddressType",      prop_address_type },
+    { "RSSI",             prop_rssi },
+    { "TxPower",          prop_tx_power },
+    { "Paired",           prop_paired },
+    { "Bonded",           prop_bonded },
+    { "Connected",        prop_connected },
+    { "Trusted",          prop_trusted },
+    { "LegacyPairing",    prop_ignore },             // not used
+    { "Blocked",          prop_ignore },             // not used
+    { "UUIDs",            prop_uuids },
+    { "Modalias",         prop_ignore },             // not used
+    { "Class",            prop_class },
+    { "Icon",             prop_icon },
+    { "Appearance",       prop_appearance },
+    { "ServiceData",      prop_service_data },
+    { "Adapter",          prop_ignore },             // not used
+    { "ServicesResolved", prop_ignore },             // not used
+    { "ManufacturerData", prop_manufacturer_data },
+    { "Player",           prop_print },              // Property: Player o
+    { "Repeat",           prop_print },              // Property: Repeat s
+    { "Shuffle",          prop_print },              // Property: Shuffle s
+    { "Track",            prop_print },              // Property: Track a {sv}
+    { "Position",         prop_print },              // Property: Position {u}
+    { "State",            prop_print },              // Property: State s
+};
+
+/*
+   Property name -> handler, an open addressing table built once at startup so that
+   dispatch is one hash and (almost always) one string compare instead of a chain of them
+*/
+#define PROPERTY_TABLE_SIZE 64
+static int property_table[PROPERTY_TABLE_SIZE];
+
+static void init_property_table()
+{
+    for (int i = 0; i < PROPERTY_TABLE_SIZE; i++) property_table[i] = -1;
+
+    int n = sizeof(property_handlers) / sizeof(property_handlers[0]);
+    g_assert(n * 2 <= PROPERTY_TABLE_SIZE);
+    for (int k = 0; k < n; k++)
+    {
+        int i = g_str_hash(property_handlers[k].name) & (PROPERTY_TABLE_SIZE - 1);
+        while (property_table[i] >= 0) i = (i + 1) & (PROPERTY_TABLE_SIZE - 1);
+        property_table[i] = k;
+    }
+}
+
+static property_handler find_property_handler(const char *property_name)
+{
+    int i = g_str_hash(property_name) & (PROPERTY_TABLE_SIZE - 1);
+    for (; property_table[i] >= 0; i = (i + 1) & (PROPERTY_TABLE_SIZE - 1))
+    {
+        int k = property_table[i];
+        if (strcmp(property_handlers[k].name, property_name) == 0) return property_handlers[k].handler;
+    }
+    return NULL;
+}
+
+/*
+    Add a device not seen before, evicting one if the store is full
+    Returns NULL if there is no room
+*/
+static struct Device *add_device(const char *address, int64_t mac64)
+{
+    // Grab the next empty slot in the store
+    struct Device *existing = device_store_add(&state.devices, mac64);
+    if (existing == NULL)
+    {
+        // At capacity or memory budget: make room by dropping the device unseen the longest
+        struct Device* victim = device_store_eviction_candidate(&state.devices);
+        if (victim == NULL)
         {
+            state.devices.rejected++;
+            g_warning("Error, array of devices is full");
+            return NULL;
         }
-        else if (strcmp(property_name, "ManufacturerData") == 0)
+        g_debug("Evict %s '%s' to make room for %s", victim->mac, victim->name, address);
+        if (!state.use_hci) bluez_remove_device(conn, victim->mac);
+        device_store_remove(&state.devices, victim);
+        state.devices.evictions++;
+        existing = device_store_add(&state.devices, mac64);
+    }
+
+    existing->id = id_gen++;                // unique ID for each
+    existing->hidden = false;               // we own this one
+    existing->send_pending = false;         // nothing queued yet
+    g_strlcpy(existing->mac, address, 18);  // address
+
+    // dummy struct filled with unmatched values
+    existing->name[0] = '\0';
+    existing->name_type = nt_initial;
+    existing->alias[0] = '\0';
+    existing->address_type = 0;
+    existing->category = CATEGORY_UNKNOWN;
+    existing->connected = FALSE;
+    existing->trusted = FALSE;
+    existing->paired = FALSE;
+    existing->bonded = FALSE;
+    existing->deviceclass = 0;
+    existing->manufacturer_data_hash = 0;
+    existing->service_data_hash = 0;
+    existing->appearance = 0;
+    existing->uuids_length = 0;
+    existing->uuid_hash = 0;
+    existing->txpower = 12;
+    time(&existing->earliest);
+    existing->count = 0;
+    existing->try_connect_state = TRY_CONNECT_ZERO;
+    existing->try_connect_attempts = 0;
+    existing->is_training_beacon = false;
+    existing->known_interval = 0;
+
+    time(&existing->last_sent);
+    time(&existing->last_rssi);
+
+    // RSSI values are stored with kalman filtering, the store starts raw_rssi at -90 and distance at 10
+    kalman_initialize(&existing->filtered_rssi);
+
+    existing->last_sent = existing->last_sent - 1000; //1s back so first RSSI goes through
+    existing->last_rssi = existing->last_rssi - 1000;
+
+    kalman_initialize(&existing->kalman_interval);
+
+    g_info("Added device %i. %s", existing->id, address);
+    apply_known_beacons(&state, existing);
+    return existing;
+}
+
+/*
+    After all the properties in an update have been applied: mark the device seen,
+    refresh the store and send the distance if it changed enough
+*/
+static void finish_update(struct property_update *u)
+{
+    struct Device *existing = property_device(u);
+    if (existing == NULL) return;
+
+    // May have been cancelled if we saw a DISCONNECTED message
+    bool update_latest = u->update_latest;
+    // If after examining every key/value pair, distance has been set then we will send it
+    bool send_distance = u->send_distance;
+
+    if (update_latest)
+    {
+        // DO NOT DO THIS IF THE MESSAGE IS "DISCONNECTED" AS THAT IS SENT AFTER IT HAS GONE!
+        time(&existing->latest_local);
+        device_store_seen(&state.devices, existing, existing->latest_local);
+        existing->count++;
+    }
+
+    // category feeds the expiry timeout
+    device_store_touch(&state.devices, existing);
+
+    if (starting && send_distance)
+    {
+        g_trace("Skip sending, starting");
+    }
+    else
+    {
+        if (send_distance)
         {
-            if (isUpdate == FALSE)
-            {
-                continue; // ignore this, it's stale
+            //g_debug("  **** Send distance %6.3f                        ", state.devices.distance[existing->slot]);
+#ifdef MQTT
+            if (state.network_up && state.verbosity >= Distances){
+              send_to_mqtt_single_float(u->address, "distance", state.devices.distance[existing->slot]);
             }
-            // ManufacturerData {uint16 76: <[byte 0x10, 0x06, 0x10, 0x1a, 0x52, 0xe9, 0xc8, 0x08]>}
-            // {a(sv)}
-
-            GVariant *s_value;
-            GVariantIter i;
-            uint16_t manufacturer;
-
-            // First calculate the sum of all the manufacturerdata values to see if they have changed
-            uint16_t hash = 0;
-
-            g_variant_iter_init(&i, prop_val);
-            while (g_variant_iter_next(&i, "{qv}", &manufacturer, &s_value))
+#endif
+            time(&existing->last_sent);
+            // Broadcast what we know about the device to all other listeners
+            // only send when isUpdate is set, i.e. not for get all devices requests
+            if (u->isUpdate)
             {
-                int actualLength;
-                unsigned char *allocdata = read_byte_array(s_value, &actualLength, &hash);
-                g_variant_unref(s_value);
-                g_free(allocdata);
+                //pack_columns();
+                queue_device_send(&state, u->device);
             }
+        }
+    }
 
-            // Now read it again if it changed
-            if (existing->manufacturer_data_hash != hash)
-            {
-                existing->manufacturer_data_hash = hash;
-
-                g_variant_iter_init(&i, prop_val);
-                while (g_variant_iter_next(&i, "{qv}", &manufacturer, &s_value))
-                {
-                    uint16_t hash_for_one = 0;
-                    int actualLength;
-                    unsigned char *allocdata = read_byte_array(s_value, &actualLength, &hash_for_one);
-
-                    if (manufacturer == 0x4c && allocdata[0] == 0x02){
-                        g_debug("  %s iBeacon  ", address);
-                    } else if (manufacturer == 0x4c){
-                        g_trace("  %s Manufacturer Apple  ", address);
-                    } else {
-                        g_trace("  %s Manufacturer 0x%4x  ", address, manufacturer);
-                        }
-
-                    // TODO: If detailed logging
-                    pretty_print2_trace("  ManufacturerData", s_value, TRUE); // a{qv}
-
-    #ifdef MQTT
-                    // Need to send actual manufacturer number not always 76 here TODO
-                    if (state.verbosity >= Details) {
-                    send_to_mqtt_array(address, "manufacturerdata", "76", allocdata, actualLength);
-                        }
-    #endif
-
-                    if (existing->distance > 0)
-                    {
-                        // And repeat the RSSI value every time someone locks or unlocks their phone
-                        // Even if the change notification did not include an updated RSSI
-                        //g_print("  %s Will resend distance\n", address);
-                        send_distance = TRUE;
-                    }
+    report_devices_count();
+}
 
-                    handle_manufacturer(existing, manufacturer, allocdata);
+/*
+    Report a new or changed device to MQTT endpoint
+    NOTE: Free's address when done
+*/
+static void report_device_internal(GVariant *properties, char *known_address, bool isUpdate)
+{
+    logTable = TRUE;
+    //pretty_print("report_device", properties);
+    char address[18];
 
-                    g_variant_unref(s_value);
-                    g_free(allocdata);
-                }
-            }
-        }
-        else if (strcmp(property_name, "Player") == 0)
+    if (known_address)
+    {
+        g_strlcpy(address, known_address, 18);
+    }
+    else
+    {
+        // Get address from properies dictionary if not already present
+        GVariant *address_from_dict = g_variant_lookup_value(properties, "Address", G_VARIANT_TYPE_STRING);
+        if (address_from_dict)
         {
-            // Property: Player o
-            pretty_print2(property_name, prop_val, TRUE);
+            const char *addr = g_variant_get_string(address_from_dict, NULL);
+            if (addr) {
+                g_strlcpy(address, addr, 18);
+            } else {
+                g_warning("ERROR address from variant is null");
+                return;
+            }
+            g_variant_unref(address_from_dict);
         }
-        else if (strcmp(property_name, "Repeat") == 0)
+        else
         {
-            // Property: Repeat s
-            pretty_print2(property_name, prop_val, TRUE);
+            g_warning("ERROR address is null");
+            return;
         }
-        else if (strcmp(property_name, "Shuffle") == 0)
+    }
+
+    int64_t mac64 = mac_string_to_int_64(address);
+
+    // Get existing device report
+    struct Device *existing = device_store_find(&state.devices, mac64);
+
+    if (existing == NULL)
+    {
+        if (!isUpdate)
         {
-            // Property: Shuffle s
-            pretty_print2(property_name, prop_val, TRUE);
+            // These devices need to be removed from BLUEZ otherwise BLUEZ's cache gets huge!
+            // g_warning("report_devices_internal, not an update, not found");
+            //pretty_print2("Properties", properties, true);
+            //g_debug("Remove %s, bluez get_devices called back, and not seen yet", address);
+            bluez_remove_device(conn, address);
+            return;
         }
-        else if (strcmp(property_name, "Track") == 0)
+
+        existing = add_device(address, mac64);
+        if (existing == NULL) return;
+    }
+    else
+    {
+        if (!isUpdate)
         {
-            // Property: Track a {sv}
-            pretty_print2(property_name, prop_val, TRUE);
+            // from get_all_devices which includes stale data
+            //g_debug("Repeat device %i. %s '%s' (%s)\n", existing->id, address, existing->name, existing->alias);
         }
-        else if (strcmp(property_name, "Position") == 0)
+        else
         {
-            // Property: Position {u}
-            pretty_print2(property_name, prop_val, TRUE);
+            g_trace("Existing device %i. %s '%s' (%s)", existing->id, address, existing->name, existing->alias);
         }
-        else if (strcmp(property_name, "State") == 0)
+    }
+
+    struct property_update u;
+    u.device = device_store_handle(&state.devices, existing);
+    u.address = address;
+    u.isUpdate = isUpdate;
+    u.send_distance = FALSE;
+    u.update_latest = isUpdate;   // Mark the most recent time for this device (but not if it's a get all devices call)
+
+    const gchar *property_name;
+    GVariantIter i;
+    GVariant *prop_val;
+    g_variant_iter_init(&i, properties); // no need to free this
+    while (g_variant_iter_next(&i, "{&sv}", &property_name, &prop_val))
+    {
+        property_handler handler = find_property_handler(property_name);
+        if (handler != NULL)
         {
-            // Property: Position {u}
-            pretty_print2(property_name, prop_val, TRUE);
+            u.property_name = property_name;
+            handler(&u, prop_val);
         }
         else
         {
@@ -791,52 +1006,158 @@ static void report_device_internal(GVariant *properties, char *known_address, bo
         g_variant_unref(prop_val);
     }
 
-    if (update_latest)
+    finish_update(&u);
+}
+
+/*
+   A device report from D-Bus waiting in the ingest queue, holds a reference on properties
+*/
+struct bluez_report
+{
+    GVariant *properties;
+    char address[18];           // empty to take it from the properties
+    bool isUpdate;
+};
+
+/*
+  Queue a device report for the ingest drain, the caller keeps its own reference to properties
+*/
+static void report_device(struct OverallState *state, GVariant *properties, char *known_address, bool isUpdate)
+{
+    struct bluez_report report;
+    report.properties = g_variant_ref(properties);
+    if (known_address) g_strlcpy(report.address, known_address, 18);
+    else report.address[0] = '\0';
+    report.isUpdate = isUpdate;
+
+    if (mpsc_queue_push(&state->bluez_queue, &report))
     {
-        // DO NOT DO THIS IF THE MESSAGE IS "DISCONNECTED" AS THAT IS SENT AFTER IT HAS GONE!
-        time(&existing->latest_local);
-        time(&existing->latest_any);
-        existing->count++;
+        ingest_wake(state);
+    }
+    else
+    {
+        g_variant_unref(report.properties);    // dropped, counted by the queue
     }
+}
 
-    if (starting && send_distance)
+// Most records handled per pass so timers and D-Bus stay responsive under a flood
+#define INGEST_BATCH 512
+
+/*
+   Drain the ingest queues on the main loop, the one place device reports and mesh
+   datagrams mutate state, so nothing on this path needs the lock any more
+*/
+static gboolean drain_ingest(void *parameters)
+{
+    struct OverallState *state = (struct OverallState *)parameters;
+
+    struct bluez_report report;
+    int n = 0;
+    while (n < INGEST_BATCH && mpsc_queue_pop(&state->bluez_queue, &report))
     {
-        g_trace("Skip sending, starting");
+        perf_count_start(&ingest_perf);
+        report_device_internal(report.properties, report.address[0] ? report.address : NULL, report.isUpdate);
+        perf_count_stop(&ingest_perf);
+        g_variant_unref(report.properties);
+        n++;
     }
-    else
+    n += drain_mesh_queue(state, INGEST_BATCH);
+
+    // An analysis pass that has finished is published between batches
+    struct closest_snapshot* analysed;
+    if (mpsc_queue_pop(&state->analysis_queue, &analysed))
     {
-        if (send_distance)
+        report_counts_finished();
+    }
+    if (n >= INGEST_BATCH) return TRUE;    // more may be waiting, run again next iteration
+
+    // Clear the flag, then look again: a push that saw the flag still set did not schedule us
+    __atomic_store_n(&state->ingest_wake, 0, __ATOMIC_SEQ_CST);
+    bool more = mpsc_queue_depth(&state->bluez_queue) > 0 ||
+                (state->mesh_queue.capacity > 0 && mpsc_queue_depth(&state->mesh_queue) > 0) ||
+                mpsc_queue_depth(&state->analysis_queue) > 0;
+    if (more && __atomic_exchange_n(&state->ingest_wake, 1, __ATOMIC_ACQ_REL) == 0) return TRUE;
+    return FALSE;
+}
+
+/*
+   Report an advertising report read straight from HCI, same path as a BlueZ PropertiesChanged
+   Every report is a fresh sighting so it always counts as an update
+*/
+static void report_hci_advert(const struct hci_advert *advert, void *context)
+{
+    struct OverallState *state = (struct OverallState *)context;
+    logTable = TRUE;
+
+    perf_count_start(&ingest_perf);
+
+    char address[18];
+    g_strlcpy(address, advert->mac, 18);
+    int64_t mac64 = mac_string_to_int_64(address);
+
+    struct Device *existing = device_store_find(&state->devices, mac64);
+    if (existing == NULL) existing = add_device(address, mac64);
+
+    if (existing != NULL)
+    {
+        struct property_update u;
+        u.device = device_store_handle(&state->devices, existing);
+        u.address = address;
+        u.property_name = "HCI";
+        u.isUpdate = TRUE;
+        u.send_distance = FALSE;
+        u.update_latest = TRUE;
+
+        update_address_type(&u, advert->address_type == PUBLIC_ADDRESS_TYPE ? "public" : "random");
+        if (advert->name[0] != '\0')
         {
-            //g_debug("  **** Send distance %6.3f                        ", existing->distance);
-#ifdef MQTT
-            if (state.network_up && state.verbosity >= Distances){
-              send_to_mqtt_single_float(address, "distance", existing->distance);
+            char name[sizeof(advert->name)];
+            g_strlcpy(name, advert->name, sizeof(name));
+            update_name(&u, name);
+        }
+        if (advert->has_tx_power) update_tx_power(&u, advert->tx_power);
+        if (advert->has_appearance) update_appearance(&u, advert->appearance);
+
+        if (advert->uuids_length > 0)
+        {
+            char *uuidArray[HCI_MAX_UUIDS];
+            for (int i = 0; i < advert->uuids_length; i++)
+            {
+                uuidArray[i] = (char *)advert->uuids[i];
             }
-#endif
-            time(&existing->last_sent);
-            // Broadcast what we know about the device to all other listeners
-            // only send when isUpdate is set, i.e. not for get all devices requests
-            if (isUpdate)
+            update_uuids(&u, uuidArray, advert->uuids_length);
+        }
+
+        // Same hash as read_byte_array so a device seen both ways does not look changed
+        uint16_t hash = 0;
+        for (int m = 0; m < advert->manufacturers_length; m++)
+        {
+            for (int i = 0; i < advert->manufacturers[m].length; i++)
             {
-                //pack_columns();
-                update_closest(&state, existing);
-                send_device_udp(&state, existing);
+                hash = (hash << 5) + hash + advert->manufacturers[m].data[i];
+            }
+        }
+        if (advert->manufacturers_length > 0 && existing->manufacturer_data_hash != hash)
+        {
+            existing->manufacturer_data_hash = hash;
+            for (int m = 0; m < advert->manufacturers_length; m++)
+            {
+                // The heuristics index into the data without a length, give them a zeroed tail
+                int length = advert->manufacturers[m].length;
+                unsigned char *allocdata = g_malloc0(length < 32 ? 32 : length);
+                memcpy(allocdata, advert->manufacturers[m].data, length);
+                update_manufacturer(&u, advert->manufacturers[m].manufacturer, allocdata, length);
+                g_free(allocdata);
             }
         }
-    }
 
-    report_devices_count();
-}
+        // RSSI last, so the distance sent reflects everything above
+        if (advert->has_rssi) update_rssi(&u, advert->rssi);
 
-/*
-  Report device with lock on data structures
-  NOTE: Frees the address when done
-*/
-static void report_device(struct OverallState *state, GVariant *properties, char *known_address, bool isUpdate)
-{
-    pthread_mutex_lock(&state->lock);
-    report_device_internal(properties, known_address, isUpdate);
-    pthread_mutex_unlock(&state->lock);
+        finish_update(&u);
+    }
+
+    perf_count_stop(&ingest_perf);
 }
 
 /*
@@ -1151,60 +1472,38 @@ int get_managed_objects(void *parameters)
 }
 
 
-// Remove old items from cache
-gboolean should_remove(struct Device *existing)
+/*
+   Expiry wheel handler, called when a device's deadline (latest_any + category timeout) may have passed
+   Once past it the device is removed from BlueZ, and from here 20s later unless it has been seen again
+*/
+static void expire_device(int slot, time_t now, void* context)
 {
-    time_t now;
-    time(&now);
-
-    int delta_time = difftime(now, existing->latest_any);
+    struct device_store* store = (struct device_store*)context;
 
-    // 3 min for a regular device
-    int max_time_ago_seconds = 3 * 60;
+    time_t deadline = store->latest_any[slot] + store->timeout[slot];
 
-    // 5 min if we got to know it
-    if (existing->category != CATEGORY_UNKNOWN){
-        max_time_ago_seconds = 5 * 60; // was 10 * 60;
+    if (now < deadline){
+        // Seen since it was scheduled, lazily move it out to its new deadline
+        store->ttl[slot] = 10;
+        expiry_wheel_schedule(&store->expiry, slot, deadline);
     }
-
-    // 12 min for ibeacons
-    if (existing->category == CATEGORY_BEACON){
-        max_time_ago_seconds = 12 * 60;
-    }
-
-    // 1 hour upper limit
-    if (max_time_ago_seconds > 60 * MAX_TIME_AGO_CACHE)
+    else if (store->ttl[slot] == 10)
     {
-        max_time_ago_seconds = 60 * MAX_TIME_AGO_CACHE;
-    }
-
-    if (delta_time < max_time_ago_seconds){
-        existing->ttl = 10;
+        struct Device* existing = DEVICE_STORE_SLOT(store, slot);
+        //g_debug("%s '%s' BLUEZ Cache remove count=%i dt=%.1fmin dist=%.1fm", existing->mac, existing->name, existing->count, difftime(now, store->latest_any[slot])/60.0, store->distance[slot]);
+        // And so when this device reconnects we get a proper reconnect message and so that BlueZ doesn't fill up a huge
+        // cache of iOS devices that have passed by or changed mac address
+        if (!state.use_hci) bluez_remove_device(conn, existing->mac);
+
+        // It might come right back ... or it might be truly gone
+        store->ttl[slot] = 9;
+        expiry_wheel_schedule(&store->expiry, slot, now + 20);
     }
-    else {
-        // Count down to removal completely
-        existing->ttl = existing->ttl - 1;
-
-        if (existing->ttl == 9)
-        {
-            //g_debug("%s '%s' BLUEZ Cache remove count=%i dt=%.1fmin dist=%.1fm", existing->mac, existing->name, existing->count, delta_time/60.0, existing->distance);
-            // And so when this device reconnects we get a proper reconnect message and so that BlueZ doesn't fill up a huge
-            // cache of iOS devices that have passed by or changed mac address
-            bluez_remove_device(conn, existing->mac);
-
-            // It might come right back ... or it might be truly gone
-            return FALSE;
-        }
-        else if (existing->ttl == 5)    // 4x5s later = 20s later
-        {
-            //g_info("%s '%s' LOCAL Cache remove count=%i dt=%.1fmin dist=%.1fm", existing->mac, existing->name, existing->count, delta_time/60.0, existing->distance);
-            return TRUE;
-        }
-
+    else
+    {
+        //g_info("%s LOCAL Cache remove", DEVICE_STORE_SLOT(store, slot)->mac);
+        device_store_remove(store, DEVICE_STORE_SLOT(store, slot)); // O(1), slot goes on the free list
     }
-
-
-    return FALSE;
 }
 
 int clear_cache(void *parameters)
@@ -1212,14 +1511,14 @@ int clear_cache(void *parameters)
     //    g_print("Clearing cache\n");
     (void)parameters; // not used
 
-    // Remove any item in cache that hasn't been seen for a long time
-    for (int i = 0; i < state.n; i++)
-    {
-        while (i < state.n && should_remove(&state.devices[i]))
-        {
-            remove_device(i); // changes n, but brings a new device to position i
-        }
-    }
+    // Remove any item in cache that hasn't been seen for a long time, only devices that are due get touched
+    perf_count_start(&sweep_perf);
+    time_t now;
+    time(&now);
+    expiry_wheel_advance(&state.devices.expiry, now, expire_device, &state.devices);
+    // Same for the closest chain, from its tail
+    prune_closest(&state, now);
+    perf_count_stop(&sweep_perf);
 
     // And report the updated count of devices present
     report_devices_count();
@@ -1262,7 +1561,7 @@ void dump_device(struct OverallState* state, struct Device *d)
 
     g_info("%4i %s%s%s%s %4i %5.1fm  %6li-%6li %20s %8.8s %5.1fm %2i %s", d->id % 10000, d->mac, addressType,
         connectState, connectCount, 
-        d->count, d->distance, (d->earliest - state->started), (d->latest_local - state->started), d->name, closest_ap, closest_dist, d->txpower, category);
+        d->count, state->devices.distance[d->slot], (d->earliest - state->started), (d->latest_local - state->started), d->name, closest_ap, closest_dist, d->txpower, category);
 }
 
 
@@ -1335,14 +1634,15 @@ int report_to_influx_tick(struct OverallState* state)
 
     time_t now = time(0);
 
-    struct summary* summary = NULL;
-    summarize_by_room(state->patches, &summary);
+    struct summaries* summary = &state->room_summary;
+    summarize_by_room(state->patches, &state->place_ids, summary);
 
     // Clean out a stuck signal on InfluxDB
     //ok = ok && append_influx_line(body, sizeof(body), "<Group>", "room=<room>", "beacon=0.0,computer=0.0,phone=0.0,tablet=0.0,watch=0.0,wear=0.0", now);
 
-    for (struct summary* s = summary; s != NULL; s = s->next)
+    for (struct summary* s = summary->items; s < summary->items + summary->count; s++)
     {
+        if (!s->present) continue;
         char tags[120];
         char field[120];
 
@@ -1362,8 +1662,6 @@ int report_to_influx_tick(struct OverallState* state)
         //g_debug("INFLUX: %s %s %s", s->extra, tags, field);
     }
 
-    free_summary(&summary);
-
     if (strlen(body) > 0)
     {
         //g_debug("%s", body);
@@ -1387,15 +1685,14 @@ void send_to_udp_display(struct OverallState *state)
     {
         cJSON *jobject = cJSON_CreateObject();
 
-        struct summary* summary = NULL;
+        struct summaries* summary = &state->group_summary;
 
-        summarize_by_group(state->patches, &summary);
+        summarize_by_group(state->patches, &state->place_ids, summary);
 
-        for (struct summary* s=summary; s!=NULL; s=s->next)
+        for (struct summary* s = summary->items; s < summary->items + summary->count; s++)
         {
-            cJSON_AddRounded(jobject, s->category, s->phone_total);
+            if (s->present) cJSON_AddRounded(jobject, s->category, s->phone_total);
         }
-        free_summary(&summary);
 
         // Add metadata for the sign to consume (so that signage can be adjusted remotely)
         // TODO: More levels etc. settable remotely
@@ -1414,9 +1711,60 @@ void send_to_udp_display(struct OverallState *state)
 
 static int report_count = 0;
 
+/*
+    Send the counts from an analysis pass that has finished to DBus, Influx, Web and UDP
+    Called from the ingest drain when the analysis queue hands the snapshot back
+*/
+static void report_counts_finished()
+{
+    time(&now);
+    // Set JSON for all ways to receive it (GET, POST, INFLUX, MQTT)
+    bool changed = finish_counts_by_closest(&state);
+
+    // Send dbus always, receiver handles throttling
+    if (state.json == NULL)
+    {
+        g_debug("Skipped send, no json");
+    }
+    else if (!changed)
+    {
+        g_debug("Skipped send, json is unchanged");
+    }
+    else 
+    {
+        g_info("Send DBus notification %s", changed?"changed":"unchanged");
+        pi_sniffer_emit_notification (state.proxy, state.json);
+    }
+
+    int influx_seconds = difftime(now, state.influx_last_sent);
+
+    if (influx_seconds > state.influx_max_period_seconds || 
+        (changed && (influx_seconds > state.influx_min_period_seconds)))
+    {
+        g_debug("Sending to influx %is since last", influx_seconds);
+        state.influx_last_sent = now;
+        report_to_influx_tick(&state);
+    }
+
+    int webhook_seconds = difftime(now, state.webhook_last_sent);
+
+    if (webhook_is_configured() &&
+        (webhook_seconds > state.webhook_max_period_seconds || 
+        (changed && (webhook_seconds > state.webhook_min_period_seconds))))
+    {
+        g_debug("Sending to webhook %is since last", webhook_seconds);
+        state.webhook_last_sent = now;
+        report_to_http_post_tick();
+    }
+
+    // Every 20s
+    send_to_udp_display(&state);
+}
+
 /*
     Report access point counts to InfluxDB, Web, UDP
     Called every 20s but Web hook only called once a minute and Influx once every five minutes
+    Starts the analysis pass, the counts are sent by report_counts_finished when it is done
 */
 int report_counts(void *parameters)
 {
@@ -1429,48 +1777,10 @@ int report_counts(void *parameters)
 
     if (state.isMain)
     {
-        time(&now);
-        // Set JSON for all ways to receive it (GET, POST, INFLUX, MQTT)
-        bool changed = print_counts_by_closest(&state);
-
-        // Send dbus always, receiver handles throttling
-        if (state.json == NULL)
-        {
-            g_debug("Skipped send, no json");
-        }
-        else if (!changed)
-        {
-            g_debug("Skipped send, json is unchanged");
-        }
-        else 
+        if (!start_counts_by_closest(&state))
         {
-            g_info("Send DBus notification %s", changed?"changed":"unchanged");
-            pi_sniffer_emit_notification (state.proxy, state.json);
+            g_warning("Analysis pass is still running, skipped this one");
         }
-
-        int influx_seconds = difftime(now, state.influx_last_sent);
-
-        if (influx_seconds > state.influx_max_period_seconds || 
-            (changed && (influx_seconds > state.influx_min_period_seconds)))
-        {
-            g_debug("Sending to influx %is since last", influx_seconds);
-            state.influx_last_sent = now;
-            report_to_influx_tick(&state);
-        }
-
-        int webhook_seconds = difftime(now, state.webhook_last_sent);
-
-        if (webhook_is_configured() &&
-            (webhook_seconds > state.webhook_max_period_seconds || 
-            (changed && (webhook_seconds > state.webhook_min_period_seconds))))
-        {
-            g_debug("Sending to webhook %is since last", webhook_seconds);
-            state.webhook_last_sent = now;
-            report_to_http_post_tick();
-        }
-
-        // Every 20s
-        send_to_udp_display(&state);
         return TRUE;
     }
     else
@@ -1517,11 +1827,72 @@ void print_log_table()
     g_info("Id   Address             Count   Dist    First  Last                 Name         Closest Tx Category");
     g_info("-----------------------------------------------------------------------------------------------------------");
 
-    for (int i = 0; i < state.n; i++)
+    for (int i = 0; i < state.devices.high; i++)
     {
-        dump_device(&state, &state.devices[i]);
+        struct Device* device = device_store_at(&state.devices, i);
+        if (device != NULL) dump_device(&state, device);
     }
     g_info("-----------------------------------------------------------------------------------------------------------");
+
+    struct mac_map* index = &state.devices.index;
+    g_info("Device index: %i devices in %i slots, %.2f probes per lookup over %li lookups", index->count, index->capacity,
+        index->lookups > 0 ? (double)index->probes / index->lookups : 0.0, index->lookups);
+
+    struct mac_map* closest_index = &state.closest_index;
+    g_info("Closest index: %i heads in %i slots, %.2f probes per lookup over %li lookups, %li pruned", closest_index->count, closest_index->capacity,
+        closest_index->lookups > 0 ? (double)closest_index->probes / closest_index->lookups : 0.0, closest_index->lookups,
+        state.closest_pruned);
+
+    struct closest_snapshot* snapshot = &state.closest_snapshot;
+    g_info("Closest snapshot: %i heads, %i observations, %li taken, %li results published, %li pruned and %li updated before publishing",
+        snapshot->count, snapshot->observation_count, snapshot->snapshots, snapshot->published, snapshot->vanished,
+        snapshot->changed);
+
+    // Counted on the analysis thread, which may be running
+    long supersession_examined = __atomic_load_n(&state.supersession_examined, __ATOMIC_RELAXED);
+    g_info("Supersession: %li pairs examined, %li pruned by bucket and interval index, %li heads recomputed, %li pairs reused",
+        supersession_examined, __atomic_load_n(&state.supersession_pairs, __ATOMIC_RELAXED) - supersession_examined,
+        __atomic_load_n(&state.supersession_recomputed, __ATOMIC_RELAXED),
+        __atomic_load_n(&state.supersession_reused, __ATOMIC_RELAXED));
+    struct recording_store* recordings = &state.recording_store;
+    g_info("Recordings: %i (%i confirmed), %i compiled files mapped, %li scans, %li files read, %li %s matrix builds, %s",
+        recordings->total_count, recordings->confirmed_count, recordings->compiled_count, recordings->scans, recordings->files_read,
+        recordings->matrix.builds, recording_matrix_kernel(), recordings->inotify_fd >= 0 ? "watching for changes" : "checking every pass");
+    struct recording_index* recording_index = &recordings->index;
+    long queries = __atomic_load_n(&recording_index->queries, __ATOMIC_RELAXED);
+    g_info("Recording index: %i probes, %li queries, %.1f recordings scored and %.1f skipped per query",
+        recording_index->probes, queries,
+        queries > 0 ? (double)__atomic_load_n(&recording_index->scored, __ATOMIC_RELAXED) / queries : 0.0,
+        queries > 0 ? (double)__atomic_load_n(&recording_index->skipped, __ATOMIC_RELAXED) / queries : 0.0);
+    g_info("Identities: %i macs in %i identities, %li links made, %li macs removed, %li rebuilds, %li heads left out of pairing",
+        state.identities.count, state.identities.identities, state.identities.linked, state.identities.removed,
+        state.identities.rebuilds, __atomic_load_n(&state.supersession_hidden, __ATOMIC_RELAXED));
+    if (state.supersession_verify)
+    {
+        g_info("Supersession verify: %li passes, %li heads differed", __atomic_load_n(&state.supersession_verified, __ATOMIC_RELAXED),
+            __atomic_load_n(&state.supersession_mismatches, __ATOMIC_RELAXED));
+    }
+
+    g_info("Device store: %i devices, peak %i, capacity %i of %i, %li evicted, %li rejected", state.devices.count, state.devices.peak,
+        state.devices.capacity, state.devices.max_capacity, state.devices.evictions, state.devices.rejected);
+    g_info("Expiry wheel: %li fired, %li cascaded", state.devices.expiry.fired, state.devices.expiry.cascaded);
+    g_info("Coalesced sends: %li changes, %li sent, %li saved", state.sends_requested, state.sends_made,
+        state.sends_requested - state.sends_made);
+    g_info("Ingest queues: bluez %li queued, %li dropped, peak %u of %u; mesh %li queued, %li dropped, peak %u of %u",
+        state.bluez_queue.pushed, state.bluez_queue.dropped, state.bluez_queue.peak, state.bluez_queue.capacity,
+        state.mesh_queue.pushed, state.mesh_queue.dropped, state.mesh_queue.peak, state.mesh_queue.capacity);
+    if (state.use_hci)
+    {
+        g_info("HCI ingest: %li events, %li adverts, %li malformed", hci_stats.events, hci_stats.reports, hci_stats.malformed);
+    }
+    node_pool_report(&state.head_pool);
+    for (int i = 0; i < CLOSEST_SIZE_CLASSES; i++)
+    {
+        node_pool_report(&state.closest_pools[i]);
+    }
+    node_pool_report(&state.room_pool);
+    perf_count_report(&ingest_perf);
+    perf_count_report(&sweep_perf);
 }
 
 /*
@@ -1620,7 +1991,7 @@ gboolean try_connect(struct Device *a)
 
     // Don't attempt connection until a device is close enough, or has been seen enough
     // otherwise likely to fail for a transient device at 12.0+m
-    if (a->count == 1 && a->distance > 18.0)
+    if (a->count == 1 && state.devices.distance[a->slot] > 18.0)
         return FALSE;
 
     // At some point we just give up
@@ -1679,15 +2050,18 @@ int try_connect_tick(void *parameters)
     int simultaneus_connections = 0; // assumes none left from previous tick
     if (starting)
         return TRUE; // not during first 30s startup time
-    for (int i = 0; i < state.n; i++)
+    for (int i = 0; i < state.devices.high; i++)
     {
         // Disconnect all devices that are in a try connect state
-        try_disconnect(&state.devices[i]);
+        struct Device* device = device_store_at(&state.devices, i);
+        if (device != NULL) try_disconnect(device);
     }
-    for (int i = 0; i < state.n; i++)
+    for (int i = 0; i < state.devices.high; i++)
     {
+        struct Device* device = device_store_at(&state.devices, i);
+        if (device == NULL) continue;
         // Connect up to SIMULTANEOUS_CONNECTIONS devices at once
-        if (try_connect(&state.devices[i]))
+        if (try_connect(device))
             simultaneus_connections++;
         if (simultaneus_connections > SIMULTANEOUS_CONNECTIONS)
             break;
@@ -1892,14 +2266,12 @@ int main(int argc, char **argv)
     g_info("INFO MESSAGE");
     g_warning("WARNING MESSAGE");
 
-    if (pthread_mutex_init(&state.lock, NULL) != 0)
-    {
-        g_error("mutex init failed");
-        exit(123);
-    }
-
     g_info("initialize_state()");
     initialize_state(&state);
+    mpsc_queue_init(&state.bluez_queue, state.bluez_queue_capacity, sizeof(struct bluez_report));
+    state.ingest_drain = drain_ingest;
+    perf_count_init();
+    init_property_table();
 
     display_state(&state);
 
@@ -1971,41 +2343,56 @@ int main(int argc, char **argv)
 
     loop = g_main_loop_new(NULL, FALSE);
 
-    prop_changed = g_dbus_connection_signal_subscribe(conn,
-                                                      "org.bluez",
-                                                      "org.freedesktop.DBus.Properties",
-                                                      "PropertiesChanged",
-                                                      NULL,
-                                                      NULL,
-                                                      G_DBUS_SIGNAL_FLAGS_NONE,
-                                                      bluez_signal_adapter_changed,
-                                                      NULL,
-                                                      NULL);
-
-    iface_added = g_dbus_connection_signal_subscribe(conn,
-                                                     "org.bluez",
-                                                     "org.freedesktop.DBus.ObjectManager",
-                                                     "InterfacesAdded",
-                                                     NULL,
-                                                     NULL,
-                                                     G_DBUS_SIGNAL_FLAGS_NONE,
-                                                     bluez_device_appeared,
-                                                     loop,
-                                                     NULL);
-
-    iface_removed = g_dbus_connection_signal_subscribe(conn,
-                                                       "org.bluez",
-                                                       "org.freedesktop.DBus.ObjectManager",
-                                                       "InterfacesRemoved",
-                                                       NULL,
-                                                       NULL,
-                                                       G_DBUS_SIGNAL_FLAGS_NONE,
-                                                       bluez_device_disappeared,
-                                                       loop,
-                                                       NULL);
-
-    ensure_bluetooth_tick(&state);
-    g_info("Started discovery");
+    if (state.use_hci)
+    {
+        // Adverts come straight from the controller or a capture file, BlueZ is not involved
+        bool started = (strlen(state.hci_replay) > 0)
+            ? hci_start_replay(state.hci_replay, report_hci_advert, &state)
+            : hci_start_live(state.hci_device, report_hci_advert, &state);
+        if (!started)
+        {
+            g_error("Could not start HCI ingest");
+            exit(EXIT_FAILURE);
+        }
+    }
+    else
+    {
+        prop_changed = g_dbus_connection_signal_subscribe(conn,
+                                                          "org.bluez",
+                                                          "org.freedesktop.DBus.Properties",
+                                                          "PropertiesChanged",
+                                                          NULL,
+                                                          NULL,
+                                                          G_DBUS_SIGNAL_FLAGS_NONE,
+                                                          bluez_signal_adapter_changed,
+                                                          NULL,
+                                                          NULL);
+
+        iface_added = g_dbus_connection_signal_subscribe(conn,
+                                                         "org.bluez",
+                                                         "org.freedesktop.DBus.ObjectManager",
+                                                         "InterfacesAdded",
+                                                         NULL,
+                                                         NULL,
+                                                         G_DBUS_SIGNAL_FLAGS_NONE,
+                                                         bluez_device_appeared,
+                                                         loop,
+                                                         NULL);
+
+        iface_removed = g_dbus_connection_signal_subscribe(conn,
+                                                           "org.bluez",
+                                                           "org.freedesktop.DBus.ObjectManager",
+                                                           "InterfacesRemoved",
+                                                           NULL,
+                                                           NULL,
+                                                           G_DBUS_SIGNAL_FLAGS_NONE,
+                                                           bluez_device_disappeared,
+                                                           loop,
+                                                           NULL);
+
+        ensure_bluetooth_tick(&state);
+        g_info("Started discovery");
+    }
 
 #ifdef MQTT
     prepare_mqtt(state.mqtt_server, state.mqtt_topic, 
@@ -2016,7 +2403,7 @@ int main(int argc, char **argv)
     // Periodically ask Bluez for every device including ones that are long departed
     // but only do updates to devices we have seen, do no not create a device for each
     // as there are too many and most are old, random mac addresses
-    g_timeout_add_seconds(60, get_managed_objects, loop);
+    if (!state.use_hci) g_timeout_add_seconds(60, get_managed_objects, loop);
 
     // MQTT send
     g_timeout_add_seconds(5, mqtt_refresh, loop);
@@ -2035,7 +2422,7 @@ int main(int argc, char **argv)
     g_timeout_add_seconds(301, print_access_points_tick, loop);
 
     // Every 10min make sure Bluetooth is in scan mode
-    g_timeout_add_seconds(603, ensure_bluetooth_tick, loop);
+    if (!state.use_hci) g_timeout_add_seconds(603, ensure_bluetooth_tick, loop);
 
     // It used to be the case that attempting to pair with a device would divulge additinal information about that device
     // But now iPhones display a pairing dialog when you attempt pairing this has become annoying so it is disabled
@@ -2064,9 +2451,12 @@ int main(int argc, char **argv)
             g_warning("Not able to remove discovery filter");
     }
 
-    rc = bluez_adapter_call_method(conn, "StopDiscovery", NULL, NULL);
-    if (rc)
-        g_warning("Not able to stop scanning");
+    if (!state.use_hci)
+    {
+        rc = bluez_adapter_call_method(conn, "StopDiscovery", NULL, NULL);
+        if (rc)
+            g_warning("Not able to stop scanning");
+    }
     g_usleep(100);
 
     g_bus_unown_name(name_connection_id);
@@ -2099,6 +2489,12 @@ void int_handler(int dummy)
     conn = NULL;
 
     // Ensure all GLib worker threads exit cleanly
+    if (state.analysis_joinable) pthread_join(state.analysis_thread, NULL);
+    work_pool_free(&state.analysis_pool);
+    identity_graph_free(&state.identities);
+    recording_store_free(&state.recording_store);
+    summaries_free(&state.room_summary);
+    summaries_free(&state.group_summary);
     g_thread_pool_free(NULL, FALSE, TRUE);
     g_thread_unref(g_thread_self());
 
@@ -2107,8 +2503,6 @@ void int_handler(int dummy)
 #endif
     close_socket_service(socket_service);
 
-    pthread_mutex_destroy(&state.lock);
-
     g_info("Clean exit\n");
 
     exit(0);
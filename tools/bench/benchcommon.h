@@ -0,0 +1,28 @@
+#ifndef BENCHCOMMON_H
+#define BENCHCOMMON_H
+/*
+    Timing and random inputs shared by the benchmarks
+*/
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <time.h>
+
+static inline double now_seconds()
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+static inline int64_t random_mac()
+{
+    return (((int64_t)rand() << 24) ^ rand()) & 0xffffffffffffLL;
+}
+
+static inline float random_unit()
+{
+    return rand() / (float)RAND_MAX;
+}
+
+#endif
@@ -0,0 +1,162 @@
+/*
+    Device hot table benchmark
+
+    The two paths the hot table is for, at 2000, 10000 and 50000 devices:
+      ingest:  one advert, find the device and update its rssi, distance, last seen and count
+      sweep:   an expiry check of every device (last seen + timeout against now, ttl)
+
+    Reports ns per call and, with PERF_COUNTERS=1 where the kernel allows it, cache misses per call.
+
+    make bench, or bin/bench/devicehot --check for a quick run that checks the sweep finds the
+    devices that are due and ingest updated the devices it found
+*/
+
+#include "devicestore.h"
+#include "kalman.h"
+#include "perfcount.h"
+#include "benchcommon.h"
+
+#include <glib.h>
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define SWEEPS 50
+
+/*
+    One advert for a device, as update_rssi and finish_update in scan.c
+*/
+static void advert(struct device_store* store, struct Device* device, int16_t rssi, time_t now)
+{
+    int slot = device->slot;
+    store->raw_rssi[slot] = rssi;
+    double smoothed_rssi = kalman_update(&device->filtered_rssi, rssi);
+    store->distance[slot] = fmin(pow(10.0, (-64 - smoothed_rssi) / 35.0), 99.0);
+    device->latest_local = now;
+    device_store_seen(store, device, now);
+    device->count++;
+    device_store_touch(store, device);
+}
+
+/*
+    Expiry check of every device as expire_device in scan.c, returns how many are past their deadline
+*/
+static int sweep(struct device_store* store, time_t now)
+{
+    int due = 0;
+    for (int slot = 0; slot < store->high; slot++)
+    {
+        if (device_store_at(store, slot) == NULL) continue;
+        if (now >= store->latest_any[slot] + store->timeout[slot] && store->ttl[slot] == 10) due++;
+    }
+    return due;
+}
+
+/*
+    Returns the number of wrong results
+*/
+static int run(int device_count, int adverts, bool report)
+{
+    struct device_store store;
+    device_store_init(&store, device_count + DEVICE_CHUNK, 0);
+
+    time_t now = time(NULL);
+    int64_t* macs = g_malloc(device_count * sizeof(int64_t));
+    int expected_due = 0;
+    for (int i = 0; i < device_count; i++)
+    {
+        macs[i] = random_mac();
+        struct Device* device = device_store_add(&store, macs[i]);
+        if (device == NULL) { macs[i] = 0; continue; }
+        kalman_initialize(&device->filtered_rssi);
+        device->category = (i % 3 == 0) ? CATEGORY_BEACON : CATEGORY_UNKNOWN;
+        // One in ten last seen long enough ago to be due, set directly as seen only moves forward
+        store.latest_any[device->slot] = now - (i % 10 == 0 ? 3600 : rand() % 60);
+        device_store_touch(&store, device);
+        if (i % 10 == 0) expected_due++;
+    }
+
+    int* order = g_malloc(adverts * sizeof(int));
+    for (int i = 0; i < adverts; i++) order[i] = rand() % device_count;
+
+    struct perf_count ingest = { .name = "ingest" };
+    int wrong = 0;
+    double start = now_seconds();
+    for (int i = 0; i < adverts; i++)
+    {
+        perf_count_start(&ingest);
+        struct Device* device = device_store_find(&store, macs[order[i]]);
+        if (device != NULL) advert(&store, device, -50 - (i & 31), now);
+        perf_count_stop(&ingest);
+        if (device == NULL) wrong++;
+    }
+    double ingest_time = now_seconds() - start;
+
+    // Every device advertised now is no longer due
+    int advertised = 0;
+    for (int i = 0; i < device_count; i++)
+    {
+        struct Device* device = device_store_find(&store, macs[i]);
+        if (device != NULL && store.latest_any[device->slot] == now) advertised++;
+    }
+
+    struct perf_count swept = { .name = "sweep" };
+    int due = 0;
+    start = now_seconds();
+    for (int i = 0; i < SWEEPS; i++)
+    {
+        perf_count_start(&swept);
+        due = sweep(&store, now);
+        perf_count_stop(&swept);
+    }
+    double sweep_time = now_seconds() - start;
+
+    int stale = 0;
+    for (int i = 0; i < device_count; i += 10)
+    {
+        struct Device* device = device_store_find(&store, macs[i]);
+        if (device != NULL && store.latest_any[device->slot] != now) stale++;
+    }
+    if (due != stale) wrong++;
+    if (advertised == 0 || expected_due == 0) wrong++;
+
+    if (report)
+    {
+        printf("%6i devices: ingest %6.1f ns per advert, sweep %8.1f us (%.1f ns per device)",
+            device_count, ingest_time / adverts * 1e9, sweep_time / SWEEPS * 1e6, sweep_time / SWEEPS / device_count * 1e9);
+        if (perf_count_enabled())
+        {
+            printf(", cache misses %.2f per advert, %.0f per sweep", (double)ingest.misses / ingest.calls, (double)swept.misses / swept.calls);
+        }
+        printf("\n");
+    }
+
+    g_free(order);
+    g_free(macs);
+    return wrong;
+}
+
+int main(int argc, char** argv)
+{
+    bool check = argc > 1 && strcmp(argv[1], "--check") == 0;
+    srand(1);
+    perf_count_init();
+
+    int sizes[] = { 2000, 10000, 50000 };
+    int wrong = 0;
+    for (int i = 0; i < 3; i++)
+    {
+        wrong += run(sizes[i], check ? 10000 : 2000000, !check);
+    }
+
+    if (wrong > 0)
+    {
+        printf("devicehot: %i wrong results\n", wrong);
+        return 1;
+    }
+    if (check) printf("devicehot: ok\n");
+    return 0;
+}
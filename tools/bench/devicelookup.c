@@ -0,0 +1,116 @@
+/*
+    Device lookup benchmark
+
+    Finds devices by mac address the way BlueZ reports and mesh datagrams used to (a linear scan
+    of the device array comparing the mac string, or the mac64) and the way they do now
+    (device_store_find through the mac index) at 100, 1000 and 2000 devices.
+
+    make bench, or bin/bench/devicelookup --check for a quick run that only checks every
+    device is found and no absent mac is
+*/
+
+#include "devicestore.h"
+#include "utility.h"
+#include "benchcommon.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define ABSENT_FRACTION 4       // one lookup in four is for a mac not yet seen, as for a new device
+
+/*
+    Returns the number of lookups that gave the wrong answer
+*/
+static int run(int device_count, int lookups, bool report)
+{
+    struct device_store store;
+    device_store_init(&store, device_count + DEVICE_CHUNK, 0);
+
+    // As the old fixed array: whole devices in a row
+    struct Device* array = g_malloc0(device_count * sizeof(struct Device));
+    for (int i = 0; i < device_count; i++)
+    {
+        int64_t mac64 = random_mac();
+        struct Device* device = device_store_add(&store, mac64);
+        mac_64_to_string(device->mac, sizeof(device->mac), mac64);
+        array[i] = *device;
+    }
+
+    int64_t* macs = g_malloc(lookups * sizeof(int64_t));
+    char (*mac_strings)[18] = g_malloc(lookups * 18);
+    for (int i = 0; i < lookups; i++)
+    {
+        macs[i] = (rand() % ABSENT_FRACTION == 0) ? random_mac() : array[rand() % device_count].mac64;
+        mac_64_to_string(mac_strings[i], 18, macs[i]);
+    }
+
+    int wrong = 0;
+    double start = now_seconds();
+    for (int i = 0; i < lookups; i++)
+    {
+        struct Device* found = NULL;
+        for (int j = 0; j < device_count; j++)
+        {
+            if (memcmp(array[j].mac, mac_strings[i], 18) == 0) found = &array[j];
+        }
+        if (found != NULL && found->mac64 != macs[i]) wrong++;
+    }
+    double string_scan = now_seconds() - start;
+
+    start = now_seconds();
+    for (int i = 0; i < lookups; i++)
+    {
+        struct Device* found = NULL;
+        for (int j = 0; j < device_count; j++)
+        {
+            if (array[j].mac64 == macs[i]) { found = &array[j]; break; }
+        }
+        struct Device* indexed = device_store_find(&store, macs[i]);
+        if ((found == NULL) != (indexed == NULL) || (indexed != NULL && indexed->mac64 != macs[i])) wrong++;
+    }
+    double mac64_scan_and_check = now_seconds() - start;
+
+    start = now_seconds();
+    long hits = 0;
+    for (int i = 0; i < lookups; i++)
+    {
+        if (device_store_find(&store, macs[i]) != NULL) hits++;
+    }
+    double indexed = now_seconds() - start;
+
+    if (report)
+    {
+        double mac64_scan = mac64_scan_and_check - indexed;
+        printf("%6i devices: string scan %8.1f ns, mac64 scan %8.1f ns, index %6.1f ns per lookup (%.0fx faster than the string scan), %.2f probes per lookup\n",
+            device_count, string_scan / lookups * 1e9, mac64_scan / lookups * 1e9, indexed / lookups * 1e9,
+            string_scan / indexed, (double)store.index.probes / store.index.lookups);
+    }
+
+    g_free(array);
+    g_free(macs);
+    g_free(mac_strings);
+    return wrong + (hits == 0);
+}
+
+int main(int argc, char** argv)
+{
+    bool check = argc > 1 && strcmp(argv[1], "--check") == 0;
+    srand(1);
+
+    int sizes[] = { 100, 1000, 2000 };
+    int wrong = 0;
+    for (int i = 0; i < 3; i++)
+    {
+        wrong += run(sizes[i], check ? 2000 : 100000, !check);
+    }
+
+    if (wrong > 0)
+    {
+        printf("devicelookup: %i lookups disagreed with a linear scan\n", wrong);
+        return 1;
+    }
+    if (check) printf("devicelookup: ok\n");
+    return 0;
+}
@@ -0,0 +1,256 @@
+/*
+    Recording index benchmark
+
+    A site of four buildings with eight access points each and recordings made at patches across
+    all of them, with the distances a phone would report there (log normal rssi noise, access
+    points out of range or missed now and then). Devices are placed at random patches and
+    k_nearest finds their best patches by scoring every recording (the matrix, KNN_PROBES=0) and
+    from the index with KNN_PROBES 1 to 5, at 5000 and 20000 recordings.
+
+    Reports us per device, rows scored and how often the index finds the same best patch and the
+    same top three as scoring every recording (recall), and how often each is the true patch.
+
+    make bench, or bin/bench/recordingindex --check for a quick run that checks the index finds
+    the same best patch as scoring every recording for at least MIN_RECALL of devices at
+    CHECK_PROBES, and that debugging uses the index and finds the same patches
+*/
+
+#include "knn.h"
+#include "recordingmatrix.h"
+#include "recordingindex.h"
+#include "rooms.h"
+#include "utility.h"
+#include "benchcommon.h"
+
+#include <glib.h>
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define BUILDINGS 4
+#define ACCESS_POINTS_PER_BUILDING 8
+#define ACCESS_POINTS (BUILDINGS * ACCESS_POINTS_PER_BUILDING)
+#define PATCHES_PER_BUILDING 12
+#define PATCHES (BUILDINGS * PATCHES_PER_BUILDING)
+#define MAX_PROBES 5
+#define AVERAGE_GAP 60
+
+#define CHECK_PROBES 3
+#define MIN_RECALL 0.97
+
+static float ap_x[ACCESS_POINTS], ap_y[ACCESS_POINTS];
+static float patch_x[PATCHES], patch_y[PATCHES];
+
+static float random_normal()
+{
+    float u = random_unit() + 1e-7f;
+    float v = random_unit();
+    return sqrtf(-2 * logf(u)) * cosf(6.2831853f * v);
+}
+
+/*
+    Distances a phone near a patch reports, EFFECTIVE_INFINITE for access points it didn't hear
+*/
+static void observe(int patch, float distances[N_ACCESS_POINTS])
+{
+    float x = patch_x[patch] + random_normal() * 1.5f;
+    float y = patch_y[patch] + random_normal() * 1.5f;
+    for (int i = 0; i < N_ACCESS_POINTS; i++) distances[i] = EFFECTIVE_INFINITE;
+    for (int i = 0; i < ACCESS_POINTS; i++)
+    {
+        float actual = hypotf(x - ap_x[i], y - ap_y[i]) + 0.5f;
+        float measured = actual * expf(random_normal() * 0.25f);
+        if (measured < 20 && random_unit() > 0.1f) distances[i] = measured;
+    }
+}
+
+/*
+    Access points on a grid in each building, buildings 70m apart
+*/
+static struct AccessPoint* make_site(struct patch* patches)
+{
+    struct AccessPoint* list = NULL;
+    for (int i = ACCESS_POINTS - 1; i >= 0; i--)
+    {
+        int building = i / ACCESS_POINTS_PER_BUILDING;
+        int j = i % ACCESS_POINTS_PER_BUILDING;
+        ap_x[i] = building * 70 + (j % 4) * 12 + 2;
+        ap_y[i] = (j / 4) * 20 + 5;
+
+        struct AccessPoint* ap = g_malloc0(sizeof(struct AccessPoint));
+        ap->id = i;
+        ap->client_id = g_strdup_printf("ap-%i", i);
+        ap->short_client_id = ap->client_id;
+        ap->alternate_name = "";
+        ap->next = list;
+        list = ap;
+    }
+    for (int p = 0; p < PATCHES; p++)
+    {
+        int building = p / PATCHES_PER_BUILDING;
+        int j = p % PATCHES_PER_BUILDING;
+        patch_x[p] = building * 70 + (j % 4) * 11 + 3;
+        patch_y[p] = (j / 4) * 10 + 4;
+        patches[p].name = g_strdup_printf("patch-%i", p);
+        patches[p].id = p;
+    }
+    return list;
+}
+
+/*
+    Returns the number of wrong results
+*/
+static int run(int recording_count, int device_count, bool report)
+{
+    struct patch* patches = g_new0(struct patch, PATCHES);
+    struct AccessPoint* access_points = make_site(patches);
+
+    struct recording* recordings = NULL;
+    for (int i = 0; i < recording_count; i++)
+    {
+        struct recording* r = g_malloc0(sizeof(struct recording));
+        r->confirmed = true;
+        r->patch = &patches[rand() % PATCHES];
+        observe(r->patch->id, r->access_point_distances);
+        r->next = recordings;
+        recordings = r;
+    }
+
+    float (*devices)[N_ACCESS_POINTS] = g_malloc(device_count * sizeof(*devices));
+    int* actual = g_new(int, device_count);
+    for (int d = 0; d < device_count; d++)
+    {
+        actual[d] = rand() % PATCHES;
+        observe(actual[d], devices[d]);
+    }
+    float times[N_ACCESS_POINTS];
+    for (int i = 0; i < N_ACCESS_POINTS; i++) times[i] = 10;
+
+    struct recording_matrix matrix;
+    recording_matrix_init(&matrix);
+    recording_matrix_build(&matrix, recordings, access_points);
+
+    // Every recording scored, what the index is measured against
+    struct top_k (*every)[3] = g_malloc(device_count * sizeof(*every));
+    int* every_count = g_new(int, device_count);
+    int every_right = 0;
+    double start = now_seconds();
+    for (int d = 0; d < device_count; d++)
+    {
+        every_count[d] = k_nearest(recordings, &matrix, NULL, devices[d], times, AVERAGE_GAP, access_points, every[d], 3, true, false);
+    }
+    double every_time = now_seconds() - start;
+    for (int d = 0; d < device_count; d++)
+    {
+        if (every_count[d] > 0 && every[d][0].patch == &patches[actual[d]]) every_right++;
+    }
+
+    if (report)
+    {
+        printf("%6i recordings: every recording %6.1f us per device, %i rows, best patch right for %i/%i\n",
+            recording_count, every_time / device_count * 1e6, matrix.rows, every_right, device_count);
+    }
+
+    int wrong = 0;
+    for (int probes = 1; probes <= MAX_PROBES; probes++)
+    {
+        struct recording_index index;
+        recording_index_init(&index);
+        recording_index_build(&index, recordings, access_points, probes);
+
+        struct top_k top[3];
+        int same = 0;
+        int same_three = 0;
+        int right = 0;
+        start = now_seconds();
+        for (int d = 0; d < device_count; d++)
+        {
+            int n = k_nearest(recordings, &matrix, &index, devices[d], times, AVERAGE_GAP, access_points, top, 3, true, false);
+            if (n > 0 && every_count[d] > 0 && top[0].patch == every[d][0].patch) same++;
+            bool all_three = n == every_count[d];
+            for (int i = 0; i < n && all_three; i++) all_three = top[i].patch == every[d][i].patch;
+            if (all_three) same_three++;
+            if (n > 0 && top[0].patch == &patches[actual[d]]) right++;
+        }
+        double index_time = now_seconds() - start;
+
+        // Debugging (phones are) goes through the index too and finds the same patches
+        int debug_differs = 0;
+        for (int d = 0; d < device_count; d++)
+        {
+            struct top_k debugging[3];
+            long queries = index.queries;
+            int n = k_nearest(recordings, &matrix, &index, devices[d], times, AVERAGE_GAP, access_points, top, 3, true, false);
+            long indexed = index.queries - queries;
+            int b = k_nearest(recordings, &matrix, &index, devices[d], times, AVERAGE_GAP, access_points, debugging, 3, true, true);
+            bool same = b == n && index.queries - queries == 2 * indexed;
+            for (int i = 0; i < n && same; i++) same = debugging[i].patch == top[i].patch;
+            if (!same) debug_differs++;
+        }
+        if (debug_differs > 0)
+        {
+            printf("%i recordings: %i devices scored differently when debugging at %i probes\n", recording_count,
+                debug_differs, probes);
+            wrong++;
+        }
+
+        if (report)
+        {
+            printf("        probes %i: %6.1f us per device (%4.1fx), %6.0f rows, best patch same %i/%i, top three same %i/%i, right %i/%i\n",
+                probes, index_time / device_count * 1e6, every_time / index_time, (double)index.scored / index.queries,
+                same, device_count, same_three, device_count, right, device_count);
+        }
+        if (probes == CHECK_PROBES && same < device_count * MIN_RECALL)
+        {
+            if (!report) printf("%i recordings: best patch same for %i/%i at %i probes\n", recording_count, same, device_count, probes);
+            wrong++;
+        }
+        recording_index_free(&index);
+    }
+
+    recording_matrix_free(&matrix);
+    while (recordings != NULL)
+    {
+        struct recording* next = recordings->next;
+        g_free(recordings);
+        recordings = next;
+    }
+    for (int p = 0; p < PATCHES; p++) g_free((char*)patches[p].name);
+    g_free(patches);
+    while (access_points != NULL)
+    {
+        struct AccessPoint* next = access_points->next;
+        g_free(access_points->client_id);
+        g_free(access_points);
+        access_points = next;
+    }
+    g_free(every_count);
+    g_free(every);
+    g_free(actual);
+    g_free(devices);
+    return wrong;
+}
+
+int main(int argc, char** argv)
+{
+    bool check = argc > 1 && strcmp(argv[1], "--check") == 0;
+    srand(5);
+
+    int sizes[] = { 5000, 20000 };
+    int wrong = 0;
+    for (int i = 0; i < 2; i++)
+    {
+        wrong += run(sizes[i], check ? 300 : 2000, !check);
+    }
+
+    if (wrong > 0)
+    {
+        printf("recordingindex: %i wrong results\n", wrong);
+        return 1;
+    }
+    if (check) printf("recordingindex: ok\n");
+    return 0;
+}
@@ -0,0 +1,253 @@
+/*
+    Recording matrix benchmark
+
+    Scores 1000, 5000 and 20000 recordings over 16 access points (one of them ignored) against
+    random devices three ways: get_probability one recording at a time as k_nearest does without
+    a matrix, recording_matrix_score with the kernel the CPU has (AVX2, NEON or scalar) and
+    recording_matrix_score_scalar.
+
+    Reports recordings per second each way and the largest difference from get_probability.
+
+    make bench, or bin/bench/recordingmatrix --check for a quick run that checks both kernels are
+    within MAX_DIFFERENCE of get_probability on every recording, that k_nearest picks the same
+    best patch with the matrix as without and that debugging doesn't change what it picks
+*/
+
+#include "knn.h"
+#include "recordingmatrix.h"
+#include "rooms.h"
+#include "utility.h"
+#include "benchcommon.h"
+
+#include <glib.h>
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define ACCESS_POINTS 16
+#define PATCHES 50
+#define AVERAGE_GAP 60
+
+// The fast exp is good to a few parts in a million and the products of float and double factors
+// differ by less than that
+#define MAX_DIFFERENCE 2e-6
+
+/*
+    Distances for the access points a recording or device might see, the rest EFFECTIVE_INFINITE
+*/
+static void random_distances(float distances[N_ACCESS_POINTS])
+{
+    for (int i = 0; i < N_ACCESS_POINTS; i++)
+    {
+        distances[i] = (i < ACCESS_POINTS && random_unit() < 0.6) ? 0.3 + random_unit() * 25 : EFFECTIVE_INFINITE;
+    }
+}
+
+static struct AccessPoint* make_access_points()
+{
+    struct AccessPoint* list = NULL;
+    for (int i = ACCESS_POINTS - 1; i >= 0; i--)
+    {
+        struct AccessPoint* ap = g_malloc0(sizeof(struct AccessPoint));
+        ap->id = i;
+        ap->client_id = i == 3 ? g_strdup("ignore") : g_strdup_printf("ap-%i", i);
+        ap->short_client_id = ap->client_id;
+        ap->alternate_name = "";
+        ap->next = list;
+        list = ap;
+    }
+    return list;
+}
+
+static struct recording* make_recordings(int count, struct patch* patches)
+{
+    struct recording* list = NULL;
+    for (int i = 0; i < count; i++)
+    {
+        struct recording* r = g_malloc0(sizeof(struct recording));
+        r->confirmed = rand() % 10 != 0;
+        r->patch = &patches[rand() % PATCHES];
+        random_distances(r->access_point_distances);
+        r->next = list;
+        list = r;
+    }
+    return list;
+}
+
+typedef void (*score_function)(const struct recording_matrix* matrix, const struct recording_query* query, int first, int count,
+    float probability_is[RECORDING_MATRIX_BLOCK], float probability_isnt[RECORDING_MATRIX_BLOCK]);
+
+/*
+    Score every row of the matrix for every device, returns the largest difference from get_probability
+    on any row, or just the time taken in *seconds when not checking
+*/
+static double score_all(const struct recording_matrix* matrix, score_function score, float (*devices)[N_ACCESS_POINTS],
+    int device_count, float* times, struct AccessPoint* access_points, bool compare, double* seconds)
+{
+    double largest = 0.0;
+    volatile float sink = 0.0f;
+    double start = now_seconds();
+    for (int d = 0; d < device_count; d++)
+    {
+        struct recording_query query;
+        recording_matrix_query(matrix, devices[d], &query);
+        for (int first = 0; first < matrix->rows; first += RECORDING_MATRIX_BLOCK)
+        {
+            int count = matrix->stride - first < RECORDING_MATRIX_BLOCK ? matrix->stride - first : RECORDING_MATRIX_BLOCK;
+            float is[RECORDING_MATRIX_BLOCK];
+            float isnt[RECORDING_MATRIX_BLOCK];
+            score(matrix, &query, first, count, is, isnt);
+            sink += is[0];
+            if (!compare) continue;
+
+            for (int i = 0; i < count && first + i < matrix->rows; i++)
+            {
+                float expected_is = 0.0f;
+                float expected_isnt = 0.0f;
+                get_probability(matrix->row_recordings[first + i], devices[d], times, AVERAGE_GAP,
+                    &expected_is, &expected_isnt, access_points, false);
+                largest = fmax(largest, fabs(expected_is - is[i]));
+                largest = fmax(largest, fabs(expected_isnt - isnt[i]));
+            }
+        }
+    }
+    *seconds = now_seconds() - start;
+    return largest;
+}
+
+/*
+    Returns the number of wrong results
+*/
+static int run(int recording_count, int device_count, bool report)
+{
+    struct AccessPoint* access_points = make_access_points();
+    struct patch* patches = g_new0(struct patch, PATCHES);
+    for (int i = 0; i < PATCHES; i++)
+    {
+        patches[i].name = g_strdup_printf("patch-%i", i);
+        patches[i].id = i;
+    }
+    struct recording* recordings = make_recordings(recording_count, patches);
+
+    float (*devices)[N_ACCESS_POINTS] = g_malloc(device_count * sizeof(*devices));
+    for (int d = 0; d < device_count; d++) random_distances(devices[d]);
+    float times[N_ACCESS_POINTS];
+    for (int i = 0; i < N_ACCESS_POINTS; i++) times[i] = 10;
+
+    struct recording_matrix matrix;
+    recording_matrix_init(&matrix);
+    recording_matrix_build(&matrix, recordings, access_points);
+
+    int wrong = 0;
+
+    // Agreement, every recording for every device, with both kernels
+    double seconds;
+    double kernel_difference = score_all(&matrix, recording_matrix_score, devices, device_count, times, access_points, true, &seconds);
+    double scalar_difference = score_all(&matrix, recording_matrix_score_scalar, devices, device_count, times, access_points, true, &seconds);
+    if (!(kernel_difference <= MAX_DIFFERENCE) || !(scalar_difference <= MAX_DIFFERENCE)) wrong++;
+
+    int same_best = 0;
+    int debug_differs = 0;
+    struct top_k without[3];
+    struct top_k with[3];
+    struct top_k debugging[3];
+    for (int d = 0; d < device_count; d++)
+    {
+        int n = k_nearest(recordings, NULL, NULL, devices[d], times, AVERAGE_GAP, access_points, without, 3, true, false);
+        int m = k_nearest(recordings, &matrix, NULL, devices[d], times, AVERAGE_GAP, access_points, with, 3, true, false);
+        if (n > 0 && m > 0 && without[0].patch == with[0].patch) same_best++;
+
+        // Debugging (phones are) scores from the matrix too, so exactly the same results
+        int b = k_nearest(recordings, &matrix, NULL, devices[d], times, AVERAGE_GAP, access_points, debugging, 3, true, true);
+        bool same = b == m;
+        for (int i = 0; i < m && same; i++)
+        {
+            same = debugging[i].patch == with[i].patch && debugging[i].probability_is == with[i].probability_is &&
+                debugging[i].probability_isnt == with[i].probability_isnt;
+        }
+        if (!same) debug_differs++;
+    }
+    if (debug_differs > 0) wrong++;
+    // Ties between patches can go either way to within the fast exp
+    if (same_best < device_count * 0.98) wrong++;
+
+    // Speed
+    struct top_k top[3];
+    volatile int sink = 0;
+    double start = now_seconds();
+    for (int d = 0; d < device_count; d++)
+    {
+        sink += k_nearest(recordings, NULL, NULL, devices[d], times, AVERAGE_GAP, access_points, top, 3, true, false);
+    }
+    double one_by_one = now_seconds() - start;
+
+    start = now_seconds();
+    for (int d = 0; d < device_count; d++)
+    {
+        sink += k_nearest(recordings, &matrix, NULL, devices[d], times, AVERAGE_GAP, access_points, top, 3, true, false);
+    }
+    double with_matrix = now_seconds() - start;
+
+    double kernel_time;
+    double scalar_time;
+    score_all(&matrix, recording_matrix_score, devices, device_count, times, access_points, false, &kernel_time);
+    score_all(&matrix, recording_matrix_score_scalar, devices, device_count, times, access_points, false, &scalar_time);
+
+    if (report)
+    {
+        double scored = (double)matrix.rows * device_count / 1e6;
+        printf("%6i recordings: k_nearest %6.1fM/s one by one, %6.1fM/s with the matrix; %s kernel %6.1fM/s, scalar %6.1fM/s; "
+            "largest difference %.1e (%s), %.1e (scalar), best patch the same for %i/%i\n",
+            matrix.rows, scored / one_by_one, scored / with_matrix, recording_matrix_kernel(), scored / kernel_time,
+            scored / scalar_time, kernel_difference, recording_matrix_kernel(), scalar_difference, same_best, device_count);
+    }
+    else if (wrong > 0)
+    {
+        printf("%i recordings: largest difference %.1e (%s), %.1e (scalar), best patch the same for %i/%i, "
+            "%i different when debugging\n", matrix.rows, kernel_difference, recording_matrix_kernel(), scalar_difference,
+            same_best, device_count, debug_differs);
+    }
+
+    recording_matrix_free(&matrix);
+    while (recordings != NULL)
+    {
+        struct recording* next = recordings->next;
+        g_free(recordings);
+        recordings = next;
+    }
+    for (int i = 0; i < PATCHES; i++) g_free((char*)patches[i].name);
+    g_free(patches);
+    while (access_points != NULL)
+    {
+        struct AccessPoint* next = access_points->next;
+        g_free(access_points->client_id);
+        g_free(access_points);
+        access_points = next;
+    }
+    g_free(devices);
+    return wrong;
+}
+
+int main(int argc, char** argv)
+{
+    bool check = argc > 1 && strcmp(argv[1], "--check") == 0;
+    srand(11);
+
+    int sizes[] = { 1000, 5000, 20000 };
+    int wrong = 0;
+    for (int i = 0; i < 3; i++)
+    {
+        wrong += run(sizes[i], check ? 20 : 200, !check);
+    }
+
+    if (wrong > 0)
+    {
+        printf("recordingmatrix: %i wrong results\n", wrong);
+        return 1;
+    }
+    if (check) printf("recordingmatrix: ok\n");
+    return 0;
+}
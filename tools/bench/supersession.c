@@ -0,0 +1,325 @@
+/*
+    Supersession benchmark
+
+    Finds which heads supersede which the way the pass used to (every head A against every later
+    head B in chain order) and the way pack_closest_columns does now (heads bucketed by category,
+    only the Bs in the interval index compared) at 500, 1000 and 2000 heads. Every head is dirty,
+    so this is a pass with nothing kept from the last one.
+
+    Reports ms per pass and how many pairs each compared. Then runs pack_closest_columns
+    (find_pairs_worker on every thread of the analysis pool) over the same sizes with a pool of 1, 2
+    and 4 threads and reports ms per pass and the speedup over one thread, which can be no more
+    than the number of cores it prints first. --threads runs only that part.
+
+    make bench, or bin/bench/supersession --check for a quick run that checks both passes claim
+    the same heads with the same probabilities and so does every pool size
+*/
+
+#include "closest.h"
+#include "closestsnapshot.h"
+#include "overlaps.h"
+#include "knn.h"
+#include "utility.h"
+#include "workpool.h"
+#include "state.h"
+#include "benchcommon.h"
+
+#include <glib.h>
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define ACCESS_POINTS 8
+#define POOLS 3
+
+/*
+    The closest chain and what the pass needs of the rest of the state
+*/
+static void bench_state(struct OverallState* state)
+{
+    memset(state, 0, sizeof(struct OverallState));
+    mac_map_init(&state->closest_index, 2 * CLOSEST_N);
+    node_pool_init(&state->head_pool, "Closest head", sizeof(struct ClosestHead), offsetof(struct ClosestHead, next));
+    for (int i = 0; i < CLOSEST_SIZE_CLASSES; i++)
+    {
+        node_pool_init(&state->closest_pools[i], "Closest", sizeof(struct ClosestTo) << i, 0);
+    }
+    node_pool_init(&state->room_pool, "Recent room", sizeof(struct RecentRoom), offsetof(struct RecentRoom, next));
+    closest_snapshot_init(&state->closest_snapshot);
+    identity_graph_init(&state->identities);
+    state->identity_passes = 0;
+    work_pool_init(&state->analysis_pool, 1);
+
+    for (int i = 0; i < ACCESS_POINTS; i++)
+    {
+        struct AccessPoint* ap = g_malloc0(sizeof(struct AccessPoint));
+        ap->id = i;
+        ap->client_id = g_strdup_printf("ap-%i", i);
+        ap->short_client_id = ap->client_id;
+        ap->alternate_name = "";
+        ap->next = state->access_points;
+        state->access_points = ap;
+    }
+}
+
+/*
+    A mix of phones, watches, tablets, beacons and unknown devices, some rotating their mac, added
+    oldest first so the chain is in order of last update as it is live
+*/
+static void add_heads(struct OverallState* state, int count)
+{
+    static const char* names[] = { "iPhone", "Bob's phone", "", "Beacon", "iPad", "Apple Watch" };
+    static const enum name_type name_types[] = { nt_device, nt_known, nt_initial, nt_device, nt_device, nt_device };
+    static const int8_t categories[] = { CATEGORY_PHONE, CATEGORY_PHONE, CATEGORY_UNKNOWN, CATEGORY_BEACON,
+        CATEGORY_TABLET, CATEGORY_WATCH, CATEGORY_COMPUTER };
+
+    struct AccessPoint* access_points[ACCESS_POINTS];
+    for (struct AccessPoint* ap = state->access_points; ap != NULL; ap = ap->next) access_points[ap->id] = ap;
+
+    time_t now = time(NULL);
+    for (int i = count - 1; i >= 0; i--)
+    {
+        int8_t category = categories[rand() % 7];
+        int8_t address_type = rand() % 5 == 0 ? PUBLIC_ADDRESS_TYPE : (rand() % 2 ? RANDOM_ADDRESS_TYPE : 0);
+        int n = rand() % 6;
+        char name[NAME_LENGTH];
+        g_utf8_strncpy(name, names[n], NAME_LENGTH);
+
+        for (int a = 0; a < ACCESS_POINTS; a++)
+        {
+            if (rand() % 3 != 0 && a != ACCESS_POINTS - 1) continue;
+            // Well inside the 400s the pass looks back, so the clock ticking over cannot change the result
+            time_t latest = now - i * 300 / count - rand() % 30;
+            time_t earliest = latest - rand() % 600;
+            add_closest(state, i + 1, access_points[a], earliest, latest, (rand() % 100) / 10.0, category, 0,
+                1 + rand() % 5, name, name_types[n], address_type, false);
+        }
+    }
+}
+
+static bool blip(struct ClosestTo* a, struct ClosestTo* b)
+{
+    double delta = fabs(difftime(a->earliest, b->latest));
+    if (a->count == 1 && a->latest <= b->earliest && (delta < 2 || delta > 90)) return true;
+    if (b->count == 1 && b->latest <= a->earliest && (delta < 2 || delta > 90)) return true;
+    return false;
+}
+
+/*
+    The pass as it was: every A against every later B, the first B that could be A's earlier self
+    and is close enough by distance is claimed. Returns the number of pairs compared
+*/
+static long reference_pass(struct closest_snapshot* snapshot, time_t now, int64_t* supersededby, float* probability)
+{
+    struct ClosestHead* heads = snapshot->heads;
+    int count = snapshot->count;
+    long compared = 0;
+
+    for (int i = 0; i < count; i++)
+    {
+        supersededby[i] = 0;
+        probability[i] = 0.0;
+    }
+
+    for (int i = 0; i < count; i++)
+    {
+        struct ClosestHead* a = &heads[i];
+        if (difftime(now, closest_latest(a)->latest) > 400) continue;
+
+        for (int j = i + 1; j < count; j++)
+        {
+            struct ClosestHead* b = &heads[j];
+            if (supersededby[j] != 0) continue;
+            compared++;
+
+            bool different_address_types = a->addressType > 0 && b->addressType > 0 && a->addressType != b->addressType;
+            bool public = a->addressType == PUBLIC_ADDRESS_TYPE || b->addressType == PUBLIC_ADDRESS_TYPE;
+            bool different_names = (a->name_type == b->name_type ||
+                    (a->name_type == nt_alias || b->name_type == nt_alias) ||
+                    (a->name_type >= nt_known && b->name_type >= nt_known))
+                && g_strcmp0(a->name, b->name) != 0;
+            if (string_ends_with(a->name, " phone") && g_strcmp0(b->name, "iPhone") == 0) different_names = false;
+            if (string_ends_with(b->name, " phone") && g_strcmp0(a->name, "iPhone") == 0) different_names = false;
+            bool different_categories = a->category != b->category || a->category == CATEGORY_UNKNOWN;
+            if (different_address_types || public || different_names || different_categories) continue;
+
+            bool all_blips = true;
+            bool over = false;
+            uint32_t shared = a->ap_mask & b->ap_mask;
+            while (shared != 0)
+            {
+                int ap_id = __builtin_ctz(shared);
+                shared &= shared - 1;
+                struct ClosestTo* am = closest_for(a, ap_id);
+                struct ClosestTo* bm = closest_for(b, ap_id);
+                all_blips = all_blips && blip(am, bm);
+                over = over || am->earliest < bm->latest;
+            }
+            if (all_blips || over) continue;
+
+            double p = compare_features(&snapshot->features[i], &snapshot->features[j]);
+            if (p > 0.01)
+            {
+                supersededby[j] = a->mac64;
+                probability[j] = p;
+                break;
+            }
+            else if (probability[j] < p)
+            {
+                probability[j] = p;
+            }
+        }
+    }
+    return compared;
+}
+
+/*
+    Returns the number of heads claimed differently
+*/
+static int run(int head_count, int repeats, bool report)
+{
+    struct OverallState* state = g_malloc(sizeof(struct OverallState));
+    bench_state(state);
+    add_heads(state, head_count);
+
+    struct closest_snapshot* snapshot = &state->closest_snapshot;
+    closest_snapshot_take(snapshot, state);
+    closest_snapshot_fill_features(snapshot);
+    time_t now = time(NULL);
+
+    int64_t* supersededby = g_new(int64_t, head_count);
+    float* probability = g_new(float, head_count);
+    long compared = 0;
+    double start = now_seconds();
+    for (int r = 0; r < repeats; r++) compared = reference_pass(snapshot, now, supersededby, probability);
+    double reference_time = (now_seconds() - start) / repeats;
+
+    // Every head is still dirty on the copies so each pass finds all of the pairs again
+    long examined = state->supersession_examined;
+    start = now_seconds();
+    for (int r = 0; r < repeats; r++) pack_closest_columns(state, snapshot);
+    double pass_time = (now_seconds() - start) / repeats;
+    examined = (state->supersession_examined - examined) / repeats;
+
+    int wrong = 0;
+    int claimed = 0;
+    for (int i = 0; i < snapshot->count; i++)
+    {
+        struct ClosestHead* h = &snapshot->heads[i];
+        if (h->supersededby != supersededby[i] || h->superseded_probability != probability[i]) wrong++;
+        if (supersededby[i] != 0) claimed++;
+    }
+
+    if (report)
+    {
+        printf("%5i heads: every pair %8.2f ms (%8li pairs), bucketed %7.2f ms (%7li pairs), %.1fx, %i superseded\n",
+            snapshot->count, reference_time * 1e3, compared, pass_time * 1e3, examined,
+            reference_time / pass_time, claimed);
+    }
+    if (claimed == 0) wrong++;
+
+    g_free(probability);
+    g_free(supersededby);
+    return wrong;
+}
+
+/*
+    Returns the number of heads claimed differently from one thread
+*/
+static int run_threads(int head_count, int repeats, bool report)
+{
+    static const int threads[POOLS] = { 1, 2, 4 };
+
+    struct OverallState* state = g_malloc(sizeof(struct OverallState));
+    bench_state(state);
+    add_heads(state, head_count);
+
+    struct closest_snapshot* snapshot = &state->closest_snapshot;
+    closest_snapshot_take(snapshot, state);
+    closest_snapshot_fill_features(snapshot);
+
+    int64_t* supersededby = g_new(int64_t, head_count);
+    double* probability = g_new(double, head_count);
+    double times[POOLS];
+    int wrong = 0;
+    int claimed = 0;
+
+    for (int t = 0; t < POOLS; t++)
+    {
+        work_pool_free(&state->analysis_pool);
+        work_pool_init(&state->analysis_pool, threads[t]);
+
+        // Every head is still dirty on the copies so each pass finds all of the pairs again
+        double start = now_seconds();
+        for (int r = 0; r < repeats; r++) pack_closest_columns(state, snapshot);
+        times[t] = (now_seconds() - start) / repeats;
+
+        for (int i = 0; i < snapshot->count; i++)
+        {
+            struct ClosestHead* h = &snapshot->heads[i];
+            if (t == 0)
+            {
+                supersededby[i] = h->supersededby;
+                probability[i] = h->superseded_probability;
+                if (h->supersededby != 0) claimed++;
+            }
+            else if (h->supersededby != supersededby[i] || h->superseded_probability != probability[i])
+            {
+                wrong++;
+            }
+        }
+    }
+
+    if (report)
+    {
+        printf("%5i heads:", snapshot->count);
+        for (int t = 0; t < POOLS; t++)
+        {
+            printf(" %i thread%s %7.2f ms (%.1fx)", threads[t], threads[t] == 1 ? " " : "s", times[t] * 1e3, times[0] / times[t]);
+        }
+        printf(", %i superseded\n", claimed);
+    }
+    if (claimed == 0) wrong++;
+
+    work_pool_free(&state->analysis_pool);
+    g_free(probability);
+    g_free(supersededby);
+    return wrong;
+}
+
+int main(int argc, char** argv)
+{
+    bool check = false;
+    bool threads_only = false;
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--check") == 0) check = true;
+        if (strcmp(argv[i], "--threads") == 0) threads_only = true;
+    }
+    srand(7);
+
+    int sizes[] = { 500, 1000, 2000 };
+    int wrong = 0;
+    for (int i = 0; i < 3 && !threads_only; i++)
+    {
+        wrong += run(sizes[i], check ? 1 : 20, !check);
+    }
+
+    if (!check) printf("%li cores\n", sysconf(_SC_NPROCESSORS_ONLN));
+    for (int i = 0; i < 3; i++)
+    {
+        wrong += run_threads(sizes[i], check ? 1 : 20, !check);
+    }
+
+    if (wrong > 0)
+    {
+        printf("supersession: %i wrong results\n", wrong);
+        return 1;
+    }
+    if (check) printf("supersession: ok\n");
+    return 0;
+}
@@ -0,0 +1,208 @@
+/*
+    Concurrent ingest and analysis check for the closest snapshot
+
+    Starts analysis passes with start_counts_by_closest and, while each one runs on its own thread,
+    keeps adding observations and pruning the chain as the main loop does, until the analysis
+    queue hands the snapshot back and finish_counts_by_closest publishes it. Phones rotate their
+    mac every so often so there are supersession pairs to keep, claim and link, and there are more
+    of them than CLOSEST_N so heads are pruned while the analysis still has their copies.
+
+    Fails if the chain is inconsistent after a pass, if no observation arrived while a pass ran or
+    if the incremental supersession pass disagrees with pairing every head (SUPERSESSION_VERIFY).
+
+    make check runs it, make check-tsan runs it built with ThreadSanitizer
+*/
+
+#include "closest.h"
+#include "closestsnapshot.h"
+#include "accesspoints.h"
+#include "state.h"
+
+#include <glib.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define PASSES 12
+#define ACCESS_POINTS 4
+#define PHONES 3000             // more than CLOSEST_N heads
+#define ROTATE_SECONDS 30       // how often a phone changes mac
+#define BATCH 64
+#define BATCH_GAP_US 200        // between batches, so only some heads change during a pass
+
+static struct OverallState state;
+
+static gboolean no_drain(void* parameters)
+{
+    (void)parameters;
+    return FALSE;
+}
+
+/*
+    Just enough of initialize_state, without configuration files or /var/sniffer
+*/
+static void test_state(const char* directory)
+{
+    char recordings[256];
+    char beacons[256];
+    snprintf(recordings, sizeof(recordings), "%s/recordings", directory);
+    snprintf(beacons, sizeof(beacons), "%s/beacons", directory);
+    recording_store_init(&state.recording_store, recordings, beacons);
+
+    mac_map_init(&state.closest_index, 2 * CLOSEST_N);
+    node_pool_init(&state.head_pool, "Closest head", sizeof(struct ClosestHead), offsetof(struct ClosestHead, next));
+    for (int i = 0; i < CLOSEST_SIZE_CLASSES; i++)
+    {
+        node_pool_init(&state.closest_pools[i], "Closest", sizeof(struct ClosestTo) << i, 0);
+    }
+    node_pool_init(&state.room_pool, "Recent room", sizeof(struct RecentRoom), offsetof(struct RecentRoom, next));
+    closest_snapshot_init(&state.closest_snapshot);
+    identity_graph_init(&state.identities);
+
+    state.supersession_verify = 1;
+    state.identity_passes = 1;
+    state.knn_probes = 0;
+    state.udp_scale_factor = 1.0;
+    state.ingest_drain = no_drain;
+
+    work_pool_init(&state.analysis_pool, 2);
+    mpsc_queue_init(&state.analysis_queue, 1, sizeof(struct closest_snapshot*));
+}
+
+static struct AccessPoint* add_access_point(int i)
+{
+    char name[32];
+    snprintf(name, sizeof(name), "ap-%i", i);
+    bool created;
+    return get_or_create_access_point(&state, name, &created);
+}
+
+/*
+    One observation of a phone as the mesh or BlueZ reports it, the mac changes every ROTATE_SECONDS
+*/
+static void observe(struct AccessPoint** access_points, int ap_count, time_t t)
+{
+    int phone = rand() % PHONES;
+    int64_t mac = ((int64_t)phone << 16) | ((t / ROTATE_SECONDS) & 0xffff);
+    struct AccessPoint* ap = access_points[(phone + rand() % 2) % ap_count];
+    char name[NAME_LENGTH];
+    g_utf8_strncpy(name, "iPhone", NAME_LENGTH);
+    add_closest(&state, mac, ap, t, t, 1.0 + (phone % 7) + (rand() % 10) / 10.0, CATEGORY_PHONE, 0, 1,
+        name, nt_known, RANDOM_ADDRESS_TYPE, false);
+}
+
+/*
+    Every head is in the index and linked both ways, returns the number of problems
+*/
+static int check_chain()
+{
+    int problems = 0;
+    int count = 0;
+    struct ClosestHead* prev = NULL;
+    for (struct ClosestHead* h = state.closestHead; h != NULL; h = h->next)
+    {
+        count++;
+        if (h->prev != prev) problems++;
+        if (mac_map_get(&state.closest_index, h->mac64) != h) problems++;
+        if ((h->pairs == NULL) != (h->pair_count == 0)) problems++;
+        prev = h;
+    }
+    if (prev != state.closestTail) problems++;
+    if (count != state.closest_index.count) problems++;
+    return problems;
+}
+
+int main()
+{
+    srand(1);
+    char directory[] = "/tmp/closestsnapshotXXXXXX";
+    if (mkdtemp(directory) == NULL)
+    {
+        printf("closestsnapshot: could not make a directory for recordings\n");
+        return 1;
+    }
+    test_state(directory);
+
+    struct AccessPoint* access_points[ACCESS_POINTS + 1];
+    for (int i = 0; i < ACCESS_POINTS; i++) access_points[i] = add_access_point(i);
+    state.local = access_points[0];
+    int ap_count = ACCESS_POINTS;
+
+    int wrong = 0;
+    long during = 0;
+    time_t base = time(NULL) - PASSES * 10;
+
+    for (int pass = 0; pass < PASSES; pass++)
+    {
+        time_t t = base + pass * 10;
+
+        if (!start_counts_by_closest(&state))
+        {
+            printf("closestsnapshot: pass %i did not start\n", pass);
+            return 1;
+        }
+        if (start_counts_by_closest(&state))
+        {
+            printf("closestsnapshot: pass %i started twice\n", pass);
+            wrong++;
+        }
+
+        // An access point joins the mesh while a pass is running
+        if (pass == PASSES / 2) access_points[ap_count++] = add_access_point(ACCESS_POINTS);
+
+        // Ingest until the analysis thread hands the snapshot back
+        struct closest_snapshot* analysed;
+        int batches = 0;
+        for (;;)
+        {
+            // Time only moves forward, a rotated mac is never seen again
+            time_t seen = t + (batches / 30 < 9 ? batches / 30 : 9);
+            for (int i = 0; i < BATCH; i++) observe(access_points, ap_count, seen);
+            prune_closest(&state, time(NULL));
+            batches++;
+            if (mpsc_queue_pop(&state.analysis_queue, &analysed)) break;
+            usleep(BATCH_GAP_US);
+        }
+        during += batches;
+
+        finish_counts_by_closest(&state);
+        __atomic_store_n(&state.ingest_wake, 0, __ATOMIC_SEQ_CST);
+
+        int problems = check_chain();
+        if (problems > 0)
+        {
+            printf("closestsnapshot: pass %i left %i problems in the chain\n", pass, problems);
+            wrong++;
+        }
+    }
+
+    struct closest_snapshot* snapshot = &state.closest_snapshot;
+    printf("closestsnapshot: %i passes, %li batches of %i observations during them, %li results published, %li pruned and %li updated before publishing, %li links\n",
+        PASSES, during, BATCH, snapshot->published, snapshot->vanished, snapshot->changed, state.identities.linked);
+
+    if (state.supersession_mismatches > 0)
+    {
+        printf("closestsnapshot: %li heads claimed differently by a full pass\n", state.supersession_mismatches);
+        wrong++;
+    }
+    if (snapshot->published == 0 || state.closest_pruned == 0 || snapshot->changed == 0) wrong++;
+
+    // Only the recordings directories were made
+    char path[256];
+    snprintf(path, sizeof(path), "%s/recordings", directory);
+    rmdir(path);
+    snprintf(path, sizeof(path), "%s/beacons", directory);
+    rmdir(path);
+    rmdir(directory);
+
+    if (wrong > 0)
+    {
+        printf("closestsnapshot: %i wrong results\n", wrong);
+        return 1;
+    }
+    printf("closestsnapshot: ok\n");
+    return 0;
+}
@@ -0,0 +1,135 @@
+/*
+    Identity graph removal check
+
+    Links rotation chains and takes macs out of them, from the middle, the ends and the mac that
+    is the identity's id, one at a time and several before the next find. Fails if what is left
+    of a chain is not one identity, or if it no longer has the id it had before unless that id
+    was the mac removed.
+
+    make check runs it
+*/
+
+#include "identity.h"
+
+#include <glib.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define CHAIN 6
+
+static int wrong = 0;
+
+static void expect(bool ok, const char* what)
+{
+    if (ok) return;
+    printf("identity: %s\n", what);
+    wrong++;
+}
+
+/*
+    Link macs first..first+CHAIN-1 as a phone rotating its mac does, each one to the one before
+*/
+static void link_chain(struct identity_graph* graph, int64_t first)
+{
+    for (int i = 1; i < CHAIN; i++) identity_graph_link(graph, first + i - 1, first + i);
+}
+
+/*
+    Every mac of the chain that is still in it has the identity id
+*/
+static bool one_identity(struct identity_graph* graph, int64_t first, const bool* removed, int64_t id)
+{
+    for (int i = 0; i < CHAIN; i++)
+    {
+        if (removed[i]) continue;
+        if (identity_graph_find(graph, first + i) != id) return false;
+    }
+    return true;
+}
+
+/*
+    Take out the macs marked in remove, one find after each or all before the next find
+*/
+static void remove_from_chain(const bool* remove, bool together, const char* what)
+{
+    struct identity_graph graph;
+    identity_graph_init(&graph);
+    link_chain(&graph, 100);
+    link_chain(&graph, 200);
+    int64_t id = identity_graph_find(&graph, 100);
+    int64_t other = identity_graph_find(&graph, 200);
+
+    bool removed[CHAIN] = { false };
+    bool id_removed = false;
+    for (int i = 0; i < CHAIN; i++)
+    {
+        if (!remove[i]) continue;
+        identity_graph_remove(&graph, 100 + i);
+        removed[i] = true;
+        if (100 + i == id) id_removed = true;
+        if (!together) expect(identity_graph_find(&graph, 100 + i) == 100 + i, what);
+    }
+
+    int left = 0;
+    while (removed[left]) left++;
+    int64_t now = identity_graph_find(&graph, 100 + left);
+    expect(one_identity(&graph, 100, removed, now), what);
+    if (!id_removed) expect(now == id, what);
+    if (id_removed) expect(now != id, what);
+    expect(graph.identities == 2, what);
+
+    // The other chain is left alone
+    bool none[CHAIN] = { false };
+    expect(one_identity(&graph, 200, none, other), what);
+
+    // A removed mac is on its own until it's linked again
+    for (int i = 0; i < CHAIN; i++)
+    {
+        if (removed[i]) expect(identity_graph_find(&graph, 100 + i) == 100 + i, what);
+    }
+
+    identity_graph_free(&graph);
+}
+
+int main()
+{
+    bool middle[CHAIN] = { false, false, true, false, false, false };
+    bool ends[CHAIN] = { true, false, false, false, false, true };
+    bool several[CHAIN] = { false, true, false, true, true, false };
+
+    remove_from_chain(middle, false, "middle removal split the chain");
+    remove_from_chain(ends, false, "removing the ends split the chain");
+    remove_from_chain(several, false, "removing one after another split the chain");
+    remove_from_chain(several, true, "removing several before a find split the chain");
+
+    // Every mac in turn, so one of them is the id
+    for (int i = 0; i < CHAIN; i++)
+    {
+        bool one[CHAIN] = { false };
+        one[i] = true;
+        remove_from_chain(one, false, "removing one mac split the chain or kept a removed id");
+    }
+
+    // A mac linked again after it was removed joins the identity with its id
+    struct identity_graph graph;
+    identity_graph_init(&graph);
+    link_chain(&graph, 100);
+    int64_t id = identity_graph_find(&graph, 100);
+    int64_t middle_mac = id == 103 ? 102 : 103;
+    identity_graph_remove(&graph, middle_mac);
+    identity_graph_link(&graph, 100 + CHAIN - 1, middle_mac);
+    bool none[CHAIN] = { false };
+    expect(one_identity(&graph, 100, none, id), "relinking a removed mac changed the id");
+    expect(graph.link_count == CHAIN - 1, "links were left over from bridging");
+    identity_graph_free(&graph);
+
+    if (wrong > 0)
+    {
+        printf("identity: %i wrong results\n", wrong);
+        return 1;
+    }
+    printf("identity: ok\n");
+    return 0;
+}